@@ -0,0 +1,171 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Parse the output of virt-v2v, which may contain ANSI colour
+ * sequences and carriage returns (used by the progress bars).
+ *
+ * This is kept separate from the GUI so that it can be tested and
+ * benchmarked without Gtk.  The parser calls back with runs of plain
+ * text and their colour, and when the current line should be deleted.
+ * State is kept between calls, so a sequence may be split across
+ * messages.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "p2v.h"
+
+enum {
+  state_normal,
+  state_escape1,       /* seen ESC, expecting [ */
+  state_escape2,       /* seen ESC [, expecting 0 or 1 */
+  state_escape3,       /* seen ESC [ 0/1, expecting ; or m */
+  state_escape4,       /* seen ESC [ 0/1 ;, expecting 3 */
+  state_escape5,       /* seen ESC [ 0/1 ; 3, expecting 1/2/4/5 */
+  state_escape6,       /* seen ESC [ 0/1 ; 3 1/2/5/5, expecting m */
+  state_cr,            /* seen CR */
+};
+
+/**
+ * Initialize C<parser>.  C<text> is called with each run of normal
+ * characters and the colour (C<0>-C<15>, or C<-1> for the default
+ * colour).  C<delete_line> is called when the current (last) line
+ * should be deleted.
+ */
+void
+init_ansi_parser (struct ansi_parser *parser,
+                  void (*text) (void *opaque, const char *text, size_t len,
+                                int colour),
+                  void (*delete_line) (void *opaque),
+                  void *opaque)
+{
+  memset (parser, 0, sizeof *parser);
+  parser->state = state_normal;
+  parser->current_colour = -1;
+  parser->text = text;
+  parser->delete_line = delete_line;
+  parser->opaque = opaque;
+}
+
+/**
+ * Parse the string C<msg>.
+ */
+void
+ansi_parser_feed (struct ansi_parser *parser, const char *msg)
+{
+  const char *p, *run = NULL;
+
+#define flush_run()                                                     \
+  do {                                                                  \
+    if (run) {                                                          \
+      parser->text (parser->opaque, run, p - run,                       \
+                    parser->current_colour);                            \
+      run = NULL;                                                       \
+    }                                                                   \
+  } while (0)
+
+  for (p = msg; *p != '\0'; ++p) {
+    const char c = *p;
+
+    switch (parser->state) {
+    case state_normal:
+      if (c == '\r') {          /* Start of possible CRLF sequence. */
+        flush_run ();
+        parser->state = state_cr;
+      }
+      else if (c == '\x1b') {   /* Start of an escape sequence. */
+        flush_run ();
+        parser->state = state_escape1;
+        parser->colour = 0;
+      }
+      else if (run == NULL)     /* Treat everything else as a normal char. */
+        run = p;
+      break;
+
+    case state_escape1:
+      if (c == '[')
+        parser->state = state_escape2;
+      else
+        parser->state = state_normal;
+      break;
+
+    case state_escape2:
+      if (c == '0')
+        parser->state = state_escape3;
+      else if (c == '1') {
+        parser->state = state_escape3;
+        parser->colour += 8;
+      }
+      else
+        parser->state = state_normal;
+      break;
+
+    case state_escape3:
+      if (c == ';')
+        parser->state = state_escape4;
+      else if (c == 'm') {
+        parser->current_colour = -1; /* restore text colour */
+        parser->state = state_normal;
+      }
+      else
+        parser->state = state_normal;
+      break;
+
+    case state_escape4:
+      if (c == '3')
+        parser->state = state_escape5;
+      else
+        parser->state = state_normal;
+      break;
+
+    case state_escape5:
+      if (c >= '0' && c <= '7') {
+        parser->state = state_escape6;
+        parser->colour += c - '0';
+      }
+      else
+        parser->state = state_normal;
+      break;
+
+    case state_escape6:
+      if (c == 'm') {
+        assert (parser->colour >= 0 && parser->colour <= 15);
+        parser->current_colour = parser->colour; /* set colour */
+      }
+      parser->state = state_normal;
+      break;
+
+    case state_cr:
+      if (c == '\n')
+        /* Process CRLF as single a newline character. */
+        p--;
+      else                      /* Delete current (== last) line. */
+        parser->delete_line (parser->opaque);
+      parser->state = state_normal;
+      break;
+    } /* switch (state) */
+  } /* for */
+
+  flush_run ();
+#undef flush_run
+}
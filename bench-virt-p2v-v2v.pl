@@ -0,0 +1,205 @@
+#!/usr/bin/env perl
+# libguestfs virt-p2v benchmark
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# This is a virt-v2v substitute used by bench-virt-p2v.sh.
+#
+# Instead of converting the guest, it reads every disk listed in
+# physical.xml from the NBD server as fast as it can, one disk at a
+# time like virt-v2v, and throws the data away.  The timings are
+# appended to the file named by $BENCH_SINK_RESULTS.
+
+use strict;
+use warnings;
+no warnings "portable";
+
+use IO::Socket::INET;
+use Time::HiRes qw(time);
+
+# NBD protocol constants (see doc/proto.md in the NBD project).
+use constant {
+    NBD_MAGIC             => 0x4e42444d41474943, # "NBDMAGIC"
+    NBD_OPTS_MAGIC        => 0x49484156454F5054, # "IHAVEOPT"
+    NBD_REP_MAGIC         => 0x0003e889045565a9,
+    NBD_FLAG_FIXED_NEWSTYLE => 1,
+    NBD_FLAG_NO_ZEROES    => 2,
+    NBD_OPT_GO            => 7,
+    NBD_REP_ACK           => 1,
+    NBD_REP_INFO          => 3,
+    NBD_INFO_EXPORT       => 0,
+    NBD_REQUEST_MAGIC     => 0x25609513,
+    NBD_SIMPLE_REPLY_MAGIC => 0x67446698,
+    NBD_CMD_READ          => 0,
+    NBD_CMD_DISC          => 2,
+};
+
+# Size of each read request, and number of requests in flight.
+my $request_size = 2 * 1024 * 1024;
+my $in_flight = 4;
+
+# Answer the probes made by virt-p2v before the conversion.
+if (grep { $_ eq "--version" } @ARGV) {
+    print "virt-v2v 2.0.0 (virt-p2v benchmark)\n";
+    exit 0;
+}
+if (grep { $_ eq "--machine-readable" } @ARGV) {
+    print "virt-v2v\n";
+    print "libguestfs-rewrite\n";
+    print "colours-option\n";
+    print "input:libvirtxml\n";
+    print "output:local\n";
+    print "output:null\n";
+    exit 0;
+}
+
+my $results = $ENV{BENCH_SINK_RESULTS}
+    or die "$0: BENCH_SINK_RESULTS is not set\n";
+my $xml_file = $ARGV[$#ARGV];
+open my $xml_fh, "<", $xml_file or die "$0: $xml_file: $!\n";
+my $xml = do { local $/; <$xml_fh> };
+close $xml_fh;
+
+# Find the disks and the NBD ports.
+my @disks;
+while ($xml =~ m{<disk\b[^>]*device="disk"[^>]*>(.*?)</disk>}gs) {
+    my $disk = $1;
+    my ($host, $port) =
+        $disk =~ m{<source\s+protocol="nbd"\s*>\s*<host\s+name="([^"]+)"\s+port="(\d+)"};
+    my ($dev) = $disk =~ m{<target\s+dev="([^"]+)"};
+    push @disks, { host => $host, port => $port, dev => $dev }
+        if defined $port;
+}
+die "$0: no NBD disks found in $xml_file\n" unless @disks;
+
+sub read_exactly
+{
+    my ($sock, $len) = @_;
+    my $buf = "";
+    while (length ($buf) < $len) {
+        my $r = sysread ($sock, $buf, $len - length ($buf), length ($buf));
+        die "$0: read from NBD server: ", (defined $r ? "EOF" : $!), "\n"
+            unless $r;
+    }
+    return $buf;
+}
+
+sub write_all
+{
+    my ($sock, $buf) = @_;
+    while (length $buf) {
+        my $r = syswrite ($sock, $buf);
+        die "$0: write to NBD server: $!\n" unless defined $r;
+        substr ($buf, 0, $r) = "";
+    }
+}
+
+# Connect and negotiate with NBD_OPT_GO, returning the socket and
+# the size of the export.
+sub nbd_connect
+{
+    my ($host, $port) = @_;
+    my $sock = IO::Socket::INET->new (PeerAddr => $host,
+                                      PeerPort => $port,
+                                      Proto => "tcp")
+        or die "$0: connect to $host:$port: $!\n";
+
+    my ($magic, $opts_magic, $flags) =
+        unpack ("Q> Q> n", read_exactly ($sock, 18));
+    die "$0: $host:$port is not a newstyle NBD server\n"
+        unless $magic == NBD_MAGIC && $opts_magic == NBD_OPTS_MAGIC &&
+               ($flags & NBD_FLAG_FIXED_NEWSTYLE);
+    my $no_zeroes = $flags & NBD_FLAG_NO_ZEROES;
+    write_all ($sock, pack ("N", NBD_FLAG_FIXED_NEWSTYLE | $no_zeroes));
+
+    # NBD_OPT_GO with the default export name and no info requests.
+    write_all ($sock, pack ("Q> N N N n", NBD_OPTS_MAGIC, NBD_OPT_GO, 6, 0, 0));
+
+    my $size;
+    for (;;) {
+        my ($rep_magic, $opt, $type, $len) =
+            unpack ("Q> N N N", read_exactly ($sock, 20));
+        die "$0: bad NBD option reply\n" unless $rep_magic == NBD_REP_MAGIC;
+        my $data = $len ? read_exactly ($sock, $len) : "";
+        last if $type == NBD_REP_ACK;
+        die "$0: NBD_OPT_GO failed (reply type $type)\n"
+            if $type & 0x80000000;
+        if ($type == NBD_REP_INFO && $len >= 12) {
+            my ($info, $sz) = unpack ("n Q>", $data);
+            $size = $sz if $info == NBD_INFO_EXPORT;
+        }
+    }
+    die "$0: NBD server did not send the export size\n"
+        unless defined $size;
+
+    return ($sock, $size);
+}
+
+# Read the whole export with several requests in flight.
+sub nbd_read_all
+{
+    my ($sock, $size) = @_;
+    my ($offset, $outstanding, $handle, $bytes) = (0, 0, 0, 0);
+    my %lengths;
+
+    while ($offset < $size || $outstanding > 0) {
+        while ($outstanding < $in_flight && $offset < $size) {
+            my $len = $size - $offset;
+            $len = $request_size if $len > $request_size;
+            $handle++;
+            write_all ($sock, pack ("N n n Q> Q> N",
+                                    NBD_REQUEST_MAGIC, 0, NBD_CMD_READ,
+                                    $handle, $offset, $len));
+            $lengths{$handle} = $len;
+            $offset += $len;
+            $outstanding++;
+        }
+
+        my ($magic, $error, $h) = unpack ("N N Q>", read_exactly ($sock, 16));
+        die "$0: bad NBD reply\n" unless $magic == NBD_SIMPLE_REPLY_MAGIC;
+        die "$0: NBD read error $error\n" if $error;
+        my $len = delete $lengths{$h};
+        die "$0: unexpected NBD handle $h\n" unless defined $len;
+        read_exactly ($sock, $len);
+        $bytes += $len;
+        $outstanding--;
+    }
+
+    write_all ($sock, pack ("N n n Q> Q> N",
+                            NBD_REQUEST_MAGIC, 0, NBD_CMD_DISC, 0, 0, 0));
+    return $bytes;
+}
+
+open my $out, ">>", $results or die "$0: $results: $!\n";
+$out->autoflush (1);
+printf $out "start %.6f\n", time ();
+
+my $i = 0;
+foreach my $disk (@disks) {
+    $i++;
+    printf "[%6.1f] Copying disk %d/%d\n", time () - $^T, $i, scalar @disks;
+    my $start = time ();
+    my ($sock, $size) = nbd_connect ($disk->{host}, $disk->{port});
+    my $bytes = nbd_read_all ($sock, $size);
+    close $sock;
+    printf $out "disk %s %d %.6f\n", $disk->{dev}, $bytes, time () - $start;
+}
+
+my ($user, $system) = times ();
+printf $out "cpu %.3f\n", $user + $system;
+close $out;
+
+print "Finishing off\n";
+exit 0;
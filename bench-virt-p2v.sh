@@ -0,0 +1,160 @@
+#!/bin/bash -
+# libguestfs virt-p2v benchmark
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# End-to-end conversion benchmark.  Run this using 'make bench'.
+#
+# This runs a complete conversion in kernel mode using the same dummy
+# 'ssh' and 'scp' as test-virt-p2v-nbdkit.sh, but with large synthetic
+# disks, and with 'virt-v2v' replaced by bench-virt-p2v-v2v.pl which
+# just reads the disks from the NBD server as fast as possible.  The
+# results are written as JSON so that different builds can be
+# compared.  See p2v-hacking(1) for the settings.
+
+set -e
+
+$TEST_FUNCTIONS
+skip_unless nbdkit file --version
+skip_unless perl -MTime::HiRes -MIO::Socket::INET -e 1
+skip_unless /usr/bin/time --version
+
+# Settings.
+BENCH_DISKS="${BENCH_DISKS:-2}"
+BENCH_DISK_SIZE="${BENCH_DISK_SIZE:-4G}"
+BENCH_SPARSE="${BENCH_SPARSE:-50}"
+BENCH_CONTENT="${BENCH_CONTENT:-random}"
+BENCH_OUTPUT="${BENCH_OUTPUT:-bench-virt-p2v.json}"
+
+case "$BENCH_CONTENT" in
+    zero|random|compressible) ;;
+    *)
+        echo "$0: BENCH_CONTENT must be zero, random or compressible"
+        exit 1
+        ;;
+esac
+if [ "$BENCH_SPARSE" -lt 0 ] || [ "$BENCH_SPARSE" -gt 100 ]; then
+    echo "$0: BENCH_SPARSE must be a percentage"
+    exit 1
+fi
+
+d=bench-virt-p2v.d
+mkdir -p $d $d/bin
+rm -f $d/sink-results $d/time
+
+# The disks are generated in stripes of 64 MB.  In each stripe, the
+# first part contains data and the rest (BENCH_SPARSE percent) is a
+# hole.  Disks are kept between runs if the settings are the same,
+# since generating them can take a while.
+stripe=64
+data_mb=$(( stripe * (100 - BENCH_SPARSE) / 100 ))
+params="$BENCH_DISK_SIZE $BENCH_SPARSE $BENCH_CONTENT"
+
+if [ "$BENCH_CONTENT" = "compressible" ] && [ $data_mb -gt 0 ]; then
+    yes 'virt-p2v benchmark: the quick brown fox jumps over the lazy dog' |
+        head -c ${data_mb}M > $d/pattern
+fi
+
+make_disk ()
+{
+    local f="$1" size nr_stripes i
+
+    if [ -f "$f" ] && [ "$(cat "$f.params" 2>/dev/null)" = "$params" ]; then
+        return
+    fi
+
+    echo "$(basename $0): creating $f ($params)"
+    rm -f "$f" "$f.params"
+    truncate -s "$BENCH_DISK_SIZE" "$f"
+    size=$(stat -c %s "$f")
+    nr_stripes=$(( size / (stripe * 1024 * 1024) ))
+
+    if [ $data_mb -gt 0 ]; then
+        for (( i = 0; i < nr_stripes; ++i )); do
+            case "$BENCH_CONTENT" in
+                zero) src=/dev/zero ;;
+                random) src=/dev/urandom ;;
+                compressible) src=$d/pattern ;;
+            esac
+            dd if=$src of="$f" bs=1M count=$data_mb seek=$(( i * stripe )) \
+               iflag=fullblock conv=notrunc status=none
+        done
+    fi
+
+    echo "$params" > "$f.params"
+}
+
+disks=
+for (( i = 0; i < BENCH_DISKS; ++i )); do
+    f="$(pwd)/$d/disk$i.img"
+    make_disk "$f"
+    disks="${disks:+$disks,}$f"
+done
+
+# Use the same dummy 'ssh' and 'scp' as the tests, and the NBD sink
+# in place of virt-v2v.
+pushd $d/bin >/dev/null
+ln -sf "$abs_srcdir/test-virt-p2v-ssh.sh" ssh
+ln -sf "$abs_srcdir/test-virt-p2v-scp.sh" scp
+ln -sf "$abs_srcdir/bench-virt-p2v-v2v.pl" virt-v2v
+popd >/dev/null
+export PATH="$(pwd)/$d/bin:$PATH"
+export XDG_CACHE_HOME="$(pwd)/$d/cache"
+export BENCH_SINK_RESULTS="$(pwd)/$d/sink-results"
+
+cmdline="p2v.server=localhost p2v.name=bench p2v.disks=$disks p2v.o=null p2v.network=em1:wired,other p2v.post="
+
+start=$(date +%s.%N)
+/usr/bin/time -f '%e %U %S %M' -o $d/time \
+    virt-p2v --cmdline="$cmdline" > $d/virt-p2v.log 2>&1 || {
+    echo "$0: virt-p2v failed, see $d/virt-p2v.log"
+    exit 1
+}
+
+# Turn the results into JSON.
+{
+    echo "params $params $BENCH_DISKS"
+    echo "begin $start"
+    echo "version $(virt-p2v --version | awk '{print $2}')"
+    echo "time $(cat $d/time)"
+    cat $d/sink-results
+} | awk '
+    BEGIN           { n = 0; total = 0 }
+    $1 == "params"  { size = $2; sparse = $3; content = $4; nr = $5 }
+    $1 == "begin"   { begin = $2 }
+    $1 == "version" { version = $2 }
+    $1 == "time"    { elapsed = $2; cpu = $3 + $4; rss = $5 }
+    $1 == "start"   { start = $2 }
+    $1 == "cpu"     { sink_cpu = $2 }
+    $1 == "disk"    { name[n] = $2; bytes[n] = $3; secs[n] = $4; total += $3; n++ }
+    END {
+        p2v_cpu = cpu - sink_cpu
+        printf "{\n"
+        printf "  \"virt_p2v_version\": \"%s\",\n", version
+        printf "  \"settings\": { \"disks\": %d, \"disk_size\": \"%s\", \"sparse_percent\": %d, \"content\": \"%s\" },\n", nr, size, sparse, content
+        printf "  \"setup_latency_seconds\": %.3f,\n", start - begin
+        printf "  \"elapsed_seconds\": %.2f,\n", elapsed
+        printf "  \"disks\": [\n"
+        for (i = 0; i < n; ++i)
+            printf "    { \"name\": \"%s\", \"bytes\": %.0f, \"seconds\": %.3f, \"mb_per_second\": %.1f }%s\n", name[i], bytes[i], secs[i], (secs[i] > 0 ? bytes[i] / secs[i] / 1e6 : 0), (i < n-1 ? "," : "")
+        printf "  ],\n"
+        printf "  \"cpu_seconds\": { \"total\": %.2f, \"sink\": %.2f, \"virt_p2v\": %.2f },\n", cpu, sink_cpu, p2v_cpu
+        printf "  \"cpu_seconds_per_gb\": %.3f,\n", (total > 0 ? p2v_cpu / (total / 1e9) : 0)
+        printf "  \"peak_rss_kb\": %d\n", rss
+        printf "}\n"
+    }
+' > "$BENCH_OUTPUT"
+
+cat "$BENCH_OUTPUT"
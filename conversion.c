@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <unistd.h>
@@ -56,9 +57,9 @@
 
 static void cleanup_data_conns (struct data_conn *data_conns, size_t nr);
 static void generate_name (struct config *, const char *filename);
-static void generate_wrapper_script (struct config *, const char *remote_dir, const char *filename);
-static void generate_system_data (const char *dmesg_file, const char *lscpu_file, const char *lspci_file, const char *lsscsi_file, const char *lsusb_file);
+static void generate_wrapper_script (struct config *, struct data_conn *data_conns, const char *remote_dir, const char *filename);
 static void generate_p2v_version_file (const char *p2v_version_file);
+static void write_timeline_report (struct timeline *tl, struct config *, struct data_conn *data_conns, int ret, const char *filename);
 static void print_quoted (FILE *fp, const char *s);
 
 static char *conversion_error;
@@ -148,15 +149,203 @@ set_control_h (mexp_h *new_h)
   pthread_mutex_unlock (&cancel_requested_mutex);
 }
 
+/* After the wrapper script finishes, its exit status is printed on
+ * the control connection after this marker.  The marker is quoted in
+ * the command line so that the echo of the command does not match.
+ */
+#define STATUS_MARKER "###status### "
+
+/* virt-v2v prints a line like C<[  12.3] Copying disk 1/2 to ...> at
+ * the start of each of its steps.  These are turned into steps of the
+ * conversion timeline, so that the report shows how long inspection,
+ * the copy of each disk and so on took.
+ */
+struct v2v_steps {
+  struct timeline *tl;
+  size_t step;                  /* current step, if in_step */
+  int in_step;
+  char line[256];               /* current line of output */
+  size_t len;
+  int status;                   /* exit status of the wrapper, or -1 */
+  int at_prompt;                /* remote shell prompt after the status */
+};
+
+static void
+init_v2v_steps (struct v2v_steps *s, struct timeline *tl)
+{
+  memset (s, 0, sizeof *s);
+  s->tl = tl;
+  s->status = -1;
+}
+
+static void
+v2v_steps_end (struct v2v_steps *s)
+{
+  if (s->in_step)
+    timeline_end (s->tl, s->step);
+  s->in_step = 0;
+}
+
+static void
+v2v_steps_line (struct v2v_steps *s)
+{
+  char *p, *q;
+  double t;
+  int n = 0;
+
+  s->line[s->len] = '\0';
+
+  /* Remove colour sequences. */
+  for (p = q = s->line; *p; ++p) {
+    if (*p == '\x1b') {
+      while (p[1] && !isalpha ((unsigned char) p[1]))
+        p++;
+      if (p[1])
+        p++;
+    }
+    else
+      *q++ = *p;
+  }
+  *q = '\0';
+
+  /* See run_wrapper_script. */
+  p = strstr (s->line, STATUS_MARKER);
+  if (p && sscanf (p + strlen (STATUS_MARKER), "%d", &n) == 1) {
+    s->status = n;
+    return;
+  }
+
+  if (sscanf (s->line, "[%lf] %n", &t, &n) == 1 && n > 0 &&
+      s->line[n] != '\0') {
+    v2v_steps_end (s);
+    s->step = timeline_begin (s->tl, "virt-v2v: %s", &s->line[n]);
+    s->in_step = 1;
+  }
+}
+
+static void
+v2v_steps_feed (struct v2v_steps *s, const char *buf, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    if (buf[i] == '\n' || buf[i] == '\r') {
+      if (s->len > 0)
+        v2v_steps_line (s);
+      s->len = 0;
+    }
+    else if (s->len < sizeof s->line - 1)
+      s->line[s->len++] = buf[i];
+  }
+
+  /* The prompt of the remote shell is not followed by a newline. */
+  if (s->status >= 0 && s->len > 0) {
+    int n = 0;
+
+    s->line[s->len] = '\0';
+    if (sscanf (s->line, "###%*8[0-9a-z]### %n", &n) == 0 && n > 0)
+      s->at_prompt = 1;
+  }
+}
+
+/**
+ * Run the wrapper script over the control connection, and echo its
+ * output through the notify function until it has finished.
+ *
+ * The remote shell is left at its prompt afterwards, so that the
+ * wrapper script can be run again if virt-v2v failed.
+ *
+ * Returns the exit status of virt-v2v, or C<-1> if there was an
+ * error or the conversion was cancelled (and sets the conversion
+ * error).
+ */
+static int
+run_wrapper_script (const char *remote_dir, struct timeline *tl,
+                    void (*notify_ui) (int type, const char *data))
+{
+  struct v2v_steps v2v_steps;
+
+  init_v2v_steps (&v2v_steps, tl);
+  if (mexp_printf (control_h,
+                   /* To simplify things in the wrapper script, it
+                    * writes virt-v2v's exit status to
+                    * /remote_dir/status, and here we print that
+                    * after STATUS_MARKER.
+                    */
+                   "%s/virt-v2v-wrapper.sh; "
+                   "echo '###'status'###' $(< %s/status)\n",
+                   remote_dir, remote_dir) == -1) {
+    set_conversion_error ("mexp_printf: virt-v2v: %m");
+    return -1;
+  }
+
+  /* Read output from the virt-v2v process and echo it through the
+   * notify function, until the wrapper script has printed its status
+   * and the remote shell is waiting at its prompt again.
+   */
+  while (!is_cancel_requested () && !v2v_steps.at_prompt) {
+    char buf[257];
+    ssize_t r;
+    const int had_status = v2v_steps.status >= 0;
+    char *p;
+
+    r = read (mexp_get_fd (control_h), buf, sizeof buf - 1);
+    if (r == -1 && errno != EIO) {
+      set_conversion_error ("read: %m");
+      v2v_steps_end (&v2v_steps);
+      return -1;
+    }
+    if (r <= 0) {
+      /* See comment about EIO in miniexpect.c. */
+      set_conversion_error ("control connection closed by remote "
+                            "while virt-v2v was running");
+      v2v_steps_end (&v2v_steps);
+      return -1;
+    }
+    metrics_add_remote_output (r);
+    v2v_steps_feed (&v2v_steps, buf, r);
+    buf[r] = '\0';
+
+    /* Don't display the status or the prompt. */
+    if (had_status)
+      continue;
+    p = strstr (buf, STATUS_MARKER);
+    if (p)
+      *p = '\0';
+    if (notify_ui && buf[0] != '\0')
+      notify_ui (NOTIFY_REMOTE_MESSAGE, buf);
+  }
+
+  v2v_steps_end (&v2v_steps);
+
+  if (is_cancel_requested ()) {
+    set_conversion_error ("cancelled by user");
+    if (notify_ui)
+      notify_ui (NOTIFY_STATUS, _("Conversion cancelled by user."));
+    return -1;
+  }
+
+  return v2v_steps.status;
+}
+
+/**
+ * Do the conversion.
+ *
+ * If virt-v2v fails, C<retry_ui> (if not C<NULL>) is called.  It may
+ * change the output options in C<config>, and returns true to run
+ * virt-v2v again over the same NBD servers and data connections.
+ */
 #if defined(__GNUC__) && !defined(__clang__)
 #pragma GCC diagnostic ignored "-Wsuggest-attribute=noreturn"
 #endif
 int
 start_conversion (struct config *config,
-                  void (*notify_ui) (int type, const char *data))
+                  void (*notify_ui) (int type, const char *data),
+                  int (*retry_ui) (struct config *config))
 {
   int ret = -1;
-  int status;
+  int v2v_status = -1;
+  unsigned attempt;
   size_t i, len;
   const size_t nr_disks = guestfs_int_count_strings (config->disks);
   time_t now;
@@ -167,13 +356,17 @@ start_conversion (struct config *config,
   char name_file[]        = "/tmp/p2v.XXXXXX/name";
   char physical_xml_file[] = "/tmp/p2v.XXXXXX/physical.xml";
   char wrapper_script[]   = "/tmp/p2v.XXXXXX/virt-v2v-wrapper.sh";
-  char dmesg_file[]       = "/tmp/p2v.XXXXXX/dmesg";
-  char lscpu_file[]       = "/tmp/p2v.XXXXXX/lscpu";
-  char lspci_file[]       = "/tmp/p2v.XXXXXX/lspci";
-  char lsscsi_file[]      = "/tmp/p2v.XXXXXX/lsscsi";
-  char lsusb_file[]       = "/tmp/p2v.XXXXXX/lsusb";
   char p2v_version_file[] = "/tmp/p2v.XXXXXX/p2v-version";
+  char disk_benchmark_file[] = "/tmp/p2v.XXXXXX/disk-benchmark";
+  char timeline_file[]    = "/tmp/p2v.XXXXXX/conversion-timeline";
+  struct system_data *system_data = NULL;
+  int system_data_copied = 0;
+  int remote_dir_created = 0;
   int inhibit_fd = -1;
+  struct disk_tuning *tuning = NULL;
+  struct timeline *tl;
+  struct supervisor *supervisor = NULL;
+  size_t step;
 
 #if DEBUG_STDERR
   print_config (config, stderr);
@@ -183,6 +376,9 @@ start_conversion (struct config *config,
   set_control_h (NULL);
   set_running (1);
   set_cancel_requested (0);
+  tl = new_timeline ();
+  metrics_set_phase (PHASE_BENCHMARKING_DISKS);
+  metrics_set_disks (config->disks);
 
   inhibit_fd = inhibit_power_saving ();
 #ifdef DEBUG_STDERR
@@ -190,6 +386,57 @@ start_conversion (struct config *config,
     fprintf (stderr, "warning: virt-p2v cannot inhibit power saving during conversion.\n");
 #endif
 
+  /* Generate the local temporary directory. */
+  if (mkdtemp (tmpdir) == NULL) {
+    perror ("mkdtemp");
+    exit (EXIT_FAILURE);
+  }
+  memcpy (name_file, tmpdir, strlen (tmpdir));
+  memcpy (physical_xml_file, tmpdir, strlen (tmpdir));
+  memcpy (wrapper_script, tmpdir, strlen (tmpdir));
+  memcpy (p2v_version_file, tmpdir, strlen (tmpdir));
+  memcpy (disk_benchmark_file, tmpdir, strlen (tmpdir));
+  memcpy (timeline_file, tmpdir, strlen (tmpdir));
+
+  /* Start collecting the diagnostic data in the background.  This
+   * overlaps with setting up the NBD servers and data connections.
+   */
+  system_data = start_system_data (tmpdir);
+
+  /* Benchmark the disks if requested, before the NBD servers start
+   * reading from them.
+   */
+  if (config->benchmark.disks) {
+    for (i = 0; config->disks[i] != NULL && !is_cancel_requested (); ++i) {
+      CLEANUP_FREE char *result = NULL;
+
+      if (notify_ui) {
+        CLEANUP_FREE char *msg;
+        if (asprintf (&msg,
+                      _("Benchmarking disk %s ..."),
+                      config->disks[i]) == -1)
+          error (EXIT_FAILURE, errno, "asprintf");
+        notify_ui (NOTIFY_STATUS, msg);
+      }
+
+      step = timeline_begin (tl, "benchmark disk %s", config->disks[i]);
+      benchmark_disk (config->disks[i]);
+      timeline_end (tl, step);
+      result = get_disk_benchmark (config->disks[i]);
+      if (notify_ui && result) {
+        CLEANUP_FREE char *msg;
+        if (asprintf (&msg, "%s: %s", config->disks[i], result) == -1)
+          error (EXIT_FAILURE, errno, "asprintf");
+        notify_ui (NOTIFY_STATUS, msg);
+      }
+    }
+  }
+
+  /* Tune the source disks for reading them from start to end.  This
+   * comes after the benchmark, which measures the untuned disks.
+   */
+  tuning = tune_disks (config->disks, tl);
+
   data_conns = malloc (sizeof (struct data_conn) * nr_disks);
   if (data_conns == NULL)
     error (EXIT_FAILURE, errno, "malloc");
@@ -197,12 +444,51 @@ start_conversion (struct config *config,
   for (i = 0; config->disks[i] != NULL; ++i) {
     data_conns[i].h = NULL;
     data_conns[i].nbd_pid = 0;
+    data_conns[i].nbd_local_port = -1;
     data_conns[i].nbd_remote_port = -1;
+    data_conns[i].bytes_read = 0;
+    data_conns[i].stage_dir = NULL;
+    data_conns[i].nr_extra = 0;
+    data_conns[i].extra_h = NULL;
+    data_conns[i].extra_remote_port = NULL;
+  }
+
+  /* For staged transfers, list the chunks of the disks, and if
+   * needed compute their checksums, before the NBD servers start
+   * reading from them.
+   */
+  if (is_staged_transfer (config)) {
+    if (notify_ui && is_checksummed_transfer (config))
+      notify_ui (NOTIFY_STATUS, _("Computing checksums of the disks ..."));
+    else if (notify_ui)
+      notify_ui (NOTIFY_STATUS, _("Finding the empty chunks of the disks ..."));
+
+    metrics_set_phase (PHASE_CHECKSUMMING_DISKS);
+    step = timeline_begin (tl, "checksum disks");
+    if (write_all_disk_checksums (config, tmpdir,
+                                  is_cancel_requested) == -1) {
+      set_conversion_error ("could not compute the checksums of the disks: %m");
+      timeline_end (tl, step);
+      goto out;
+    }
+    timeline_end (tl, step);
+
+    for (i = 0; config->disks[i] != NULL; ++i) {
+      data_conns[i].stage_dir = get_disk_stage_dir (config, i);
+      if (data_conns[i].stage_dir == NULL) {
+        set_conversion_error ("disk %s has no serial number and this "
+                              "machine has no DMI UUID or machine ID, so it "
+                              "cannot be told apart from the staged disks of "
+                              "other machines: use transfer mode \"direct\"",
+                              config->disks[i]);
+        goto out;
+      }
+    }
   }
 
   /* Start the data connections and NBD server processes, one per disk. */
   for (i = 0; config->disks[i] != NULL; ++i) {
-    int nbd_local_port;
+    int nbd_local_port = -1;
     CLEANUP_FREE char *device = NULL;
 
     if (config->disks[i][0] == '/') {
@@ -229,11 +515,16 @@ start_conversion (struct config *config,
     }
 
     /* Start NBD server listening on the given port number. */
+    metrics_set_phase (PHASE_STARTING_NBD);
+    step = timeline_begin (tl, "start nbdkit for %s", config->disks[i]);
     data_conns[i].nbd_pid = start_nbd_server (&nbd_local_port, device);
+    timeline_end (tl, step);
     if (data_conns[i].nbd_pid == 0) {
       set_conversion_error ("NBD server error: %s", get_nbd_error ());
       goto out;
     }
+    data_conns[i].nbd_local_port = nbd_local_port;
+    metrics_set_data_conn (i, &data_conns[i]);
 
     if (notify_ui) {
       CLEANUP_FREE char *msg;
@@ -247,14 +538,62 @@ start_conversion (struct config *config,
     /* Open the SSH data connection, with reverse port forwarding
      * back to the NBD server.
      */
+    metrics_set_phase (PHASE_OPENING_DATA_CONNECTIONS);
+    step = timeline_begin (tl, "open data connection for %s",
+                           config->disks[i]);
     data_conns[i].h = open_data_connection (config, nbd_local_port,
                                             &data_conns[i].nbd_remote_port);
+    timeline_end (tl, step);
     if (data_conns[i].h == NULL) {
       const char *err = get_ssh_error ();
 
       set_conversion_error ("could not open data connection over SSH to the conversion server: %s", err);
       goto out;
     }
+    metrics_set_data_conn (i, &data_conns[i]);
+
+    /* Staged transfers copy each disk over several data connections
+     * in parallel, all forwarded to the same NBD server.
+     */
+    if (is_staged_transfer (config) && get_max_transfer_streams (config) > 1) {
+      const size_t nr_extra = get_max_transfer_streams (config) - 1;
+      const size_t nr_open =
+        MIN (get_transfer_streams (config) - 1, nr_extra);
+      size_t j;
+
+      data_conns[i].extra_h = calloc (nr_extra, sizeof (mexp_h *));
+      data_conns[i].extra_remote_port = calloc (nr_extra, sizeof (int));
+      if (data_conns[i].extra_h == NULL ||
+          data_conns[i].extra_remote_port == NULL)
+        error (EXIT_FAILURE, errno, "calloc");
+
+      data_conns[i].nr_extra = nr_extra;
+      step = timeline_begin (tl, "open %zu more data connections for %s",
+                             nr_open, config->disks[i]);
+      for (j = 0; j < nr_open; ++j) {
+        data_conns[i].extra_h[j] =
+          open_data_connection (config, nbd_local_port,
+                                &data_conns[i].extra_remote_port[j]);
+        if (data_conns[i].extra_h[j] == NULL)
+          break;
+      }
+      timeline_end (tl, step);
+      if (j < nr_open) {
+        set_conversion_error ("could not open data connection over SSH to the conversion server: %s", get_ssh_error ());
+        goto out;
+      }
+
+      /* The stream controller opens the other connections if it uses
+       * them (see supervisor.c).  Until then they have placeholder
+       * ports, above the real ones, which only name the port files
+       * that the copy workers will find their ports in.
+       */
+      for (; j < nr_extra; ++j)
+        data_conns[i].extra_remote_port[j] = 65536 + i * nr_extra + j;
+      metrics_set_data_conn (i, &data_conns[i]);
+    }
+
+    set_data_conn_affinity (config->disks, i, &data_conns[i]);
 
 #if DEBUG_STDERR
     fprintf (stderr,
@@ -286,129 +625,187 @@ start_conversion (struct config *config,
   if (notify_ui)
     notify_ui (NOTIFY_LOG_DIR, remote_dir);
 
-  /* Generate the local temporary directory. */
-  if (mkdtemp (tmpdir) == NULL) {
-    perror ("mkdtemp");
-    cleanup_data_conns (data_conns, nr_disks);
-    exit (EXIT_FAILURE);
-  }
-  memcpy (name_file, tmpdir, strlen (tmpdir));
-  memcpy (physical_xml_file, tmpdir, strlen (tmpdir));
-  memcpy (wrapper_script, tmpdir, strlen (tmpdir));
-  memcpy (dmesg_file, tmpdir, strlen (tmpdir));
-  memcpy (lscpu_file, tmpdir, strlen (tmpdir));
-  memcpy (lspci_file, tmpdir, strlen (tmpdir));
-  memcpy (lsscsi_file, tmpdir, strlen (tmpdir));
-  memcpy (lsusb_file, tmpdir, strlen (tmpdir));
-  memcpy (p2v_version_file, tmpdir, strlen (tmpdir));
-
   /* Generate the static files. */
+  metrics_set_phase (PHASE_GENERATING_METADATA);
+  step = timeline_begin (tl, "generate metadata");
   generate_name (config, name_file);
   generate_physical_xml (config, data_conns, physical_xml_file);
-  generate_wrapper_script (config, remote_dir, wrapper_script);
-  generate_system_data (dmesg_file,
-                        lscpu_file, lspci_file, lsscsi_file, lsusb_file);
+  generate_wrapper_script (config, data_conns, remote_dir, wrapper_script);
   generate_p2v_version_file (p2v_version_file);
+  timeline_end (tl, step);
 
   /* Open the control connection.  This also creates remote_dir. */
   if (notify_ui)
     notify_ui (NOTIFY_STATUS, _("Setting up the control connection ..."));
 
+  metrics_set_phase (PHASE_OPENING_CONTROL_CONNECTION);
+  step = timeline_begin (tl, "open control connection");
   set_control_h (start_remote_connection (config, remote_dir));
+  timeline_end (tl, step);
   if (control_h == NULL) {
     set_conversion_error ("could not open control connection over SSH to the conversion server: %s",
                           get_ssh_error ());
     goto out;
   }
+  remote_dir_created = 1;
+  metrics_set_control_pid (mexp_get_pid (control_h));
 
   /* Copy the static files to the remote dir. */
+  metrics_set_phase (PHASE_UPLOADING);
+  step = timeline_begin (tl, "upload files");
 
   /* These three files must not fail, so check for errors here. */
   if (scp_file (config, remote_dir,
                 name_file, physical_xml_file, wrapper_script, NULL) == -1) {
     set_conversion_error ("scp: %s: %s",
                           remote_dir, get_ssh_error ());
+    timeline_end (tl, step);
     goto out;
   }
 
-  /* It's not essential that these files are copied, so ignore errors. */
-  ignore_value (scp_file (config, remote_dir,
-                          dmesg_file, lscpu_file, lspci_file, lsscsi_file,
-                          lsusb_file, p2v_version_file, NULL));
-
-  /* Do the conversion.  This runs until virt-v2v exits. */
-  if (notify_ui)
-    notify_ui (NOTIFY_STATUS, _("Doing conversion ..."));
+  /* The lists of chunks are needed to stage the disks. */
+  for (i = 0; is_staged_transfer (config) && config->disks[i] != NULL; ++i) {
+    CLEANUP_FREE char *checksums_file = NULL;
 
-  if (mexp_printf (control_h,
-                   /* To simplify things in the wrapper script, it
-                    * writes virt-v2v's exit status to
-                    * /remote_dir/status, and here we read that and
-                    * exit the ssh shell with the same status.
-                    */
-                   "%s/virt-v2v-wrapper.sh; "
-                   "exit $(< %s/status)\n",
-                   remote_dir, remote_dir) == -1) {
-    set_conversion_error ("mexp_printf: virt-v2v: %m");
-    goto out;
+    if (asprintf (&checksums_file, "%s/checksums-%zu", tmpdir, i) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (scp_file (config, remote_dir, checksums_file, NULL) == -1) {
+      set_conversion_error ("scp: %s: %s",
+                            remote_dir, get_ssh_error ());
+      timeline_end (tl, step);
+      goto out;
+    }
   }
 
-  /* Read output from the virt-v2v process and echo it through the
-   * notify function, until virt-v2v closes the connection.
+  /* It's not essential that these files are copied, so ignore errors.
+   * If the system data is still being collected, don't wait for it
+   * here, it is copied after virt-v2v has finished instead.
    */
-  while (!is_cancel_requested ()) {
-    char buf[257];
-    ssize_t r;
+  if (system_data_is_ready (system_data)) {
+    const char *bundle = wait_system_data (system_data);
 
-    r = read (mexp_get_fd (control_h), buf, sizeof buf - 1);
-    if (r == -1) {
-      /* See comment about this in miniexpect.c. */
-      if (errno == EIO)
-        break;                  /* EOF */
-      set_conversion_error ("read: %m");
-      goto out;
-    }
-    if (r == 0)
-      break;                    /* EOF */
-    buf[r] = '\0';
-    if (notify_ui)
-      notify_ui (NOTIFY_REMOTE_MESSAGE, buf);
+    ignore_value (scp_file (config, remote_dir,
+                            p2v_version_file, bundle, NULL));
+    system_data_copied = 1;
   }
+  else
+    ignore_value (scp_file (config, remote_dir, p2v_version_file, NULL));
+
+  /* Disk benchmark results, either from above or from the GUI. */
+  if (write_disk_benchmarks (config->disks, disk_benchmark_file) == 0)
+    ignore_value (scp_file (config, remote_dir, disk_benchmark_file, NULL));
+  timeline_end (tl, step);
+
+  /* Do the conversion.  This runs until virt-v2v exits. */
+  if (notify_ui)
+    notify_ui (NOTIFY_STATUS,
+               config->transfer.mode == TRANSFER_MODE_PRECOPY ?
+               _("Pre-copying the disks ...") : _("Doing conversion ..."));
+
+  /* From now on, reconnect the data connections if they drop. */
+  supervisor = start_supervisor (config, data_conns, nr_disks,
+                                 remote_dir, tmpdir, notify_ui);
+
+  metrics_set_phase (PHASE_CONVERTING);
+  for (attempt = 0;; ++attempt) {
+    if (attempt == 0)
+      step = timeline_begin (tl, "virt-v2v");
+    else
+      step = timeline_begin (tl, "virt-v2v (retry %u)", attempt);
+    v2v_status = run_wrapper_script (remote_dir, tl, notify_ui);
+    timeline_end (tl, step);
+    if (v2v_status <= 0)
+      break;
+
+    /* virt-v2v failed.  The NBD servers and the data connections are
+     * still up, so if the caller wants to retry (perhaps with
+     * different output options) only the wrapper script has to be
+     * generated and uploaded again.
+     */
+    set_conversion_error ("virt-v2v exited with status %d", v2v_status);
+    if (retry_ui == NULL || !retry_ui (config) || is_cancel_requested ())
+      break;
 
-  if (is_cancel_requested ()) {
-    set_conversion_error ("cancelled by user");
     if (notify_ui)
-      notify_ui (NOTIFY_STATUS, _("Conversion cancelled by user."));
-    goto out;
+      notify_ui (NOTIFY_STATUS, _("Retrying the conversion ..."));
+    generate_wrapper_script (config, data_conns, remote_dir, wrapper_script);
+    if (scp_file (config, remote_dir, wrapper_script, NULL) == -1) {
+      set_conversion_error ("scp: %s: %s", remote_dir, get_ssh_error ());
+      v2v_status = -1;
+      break;
+    }
   }
+  if (v2v_status != 0)
+    goto out;
 
   if (notify_ui)
-    notify_ui (NOTIFY_STATUS, _("Control connection closed by remote."));
+    notify_ui (NOTIFY_STATUS,
+               config->transfer.mode == TRANSFER_MODE_PRECOPY ?
+               _("The disks were pre-copied.") : _("virt-v2v finished."));
 
   ret = 0;
  out:
+  metrics_set_phase (PHASE_TEARING_DOWN);
+  step = timeline_begin (tl, "teardown");
+  if (supervisor) {
+    const unsigned reconnections = stop_supervisor (supervisor);
+
+    if (reconnections > 0) {
+      CLEANUP_FREE char *msg = NULL;
+
+      if (asprintf (&msg, "data connections reconnected %u times",
+                    reconnections) == -1)
+        error (EXIT_FAILURE, errno, "asprintf");
+      timeline_mark (tl, msg);
+    }
+  }
   if (control_h) {
     mexp_h *h = control_h;
-    set_control_h (NULL);
-    status = mexp_close (h);
 
-    if (status == -1) {
+    /* If the wrapper script has finished, the remote shell is waiting
+     * at its prompt.  Staged disks which are only kept for retries
+     * are removed now, and then the shell exits.
+     */
+    if (v2v_status >= 0) {
+      if (mexp_printf (h, "%s/virt-v2v-wrapper.sh --cleanup; exit\n",
+                       remote_dir) != -1)
+        ignore_value (mexp_expect (h, NULL, NULL));
+    }
+
+    set_control_h (NULL);
+    if (close_session (h) == -1) {
       set_conversion_error ("mexp_close: %m");
       ret = -1;
     }
-    else if (ret == 0 &&
-             WIFEXITED (status) &&
-             WEXITSTATUS (status) != 0) {
-      set_conversion_error ("virt-v2v exited with status %d",
-                            WEXITSTATUS (status));
-      ret = -1;
+
+    /* The control connection was opened, so remote_dir exists. */
+    if (!system_data_copied && !is_cancel_requested ()) {
+      const char *bundle = wait_system_data (system_data);
+
+      if (bundle)
+        ignore_value (scp_file (config, remote_dir, bundle, NULL));
     }
   }
   cleanup_data_conns (data_conns, nr_disks);
+  restore_disk_tuning (tuning);
+  metrics_set_disks (NULL);
+  free_system_data (system_data);
+  timeline_end (tl, step);
+
+  /* Write how long each step took, even if the conversion failed.  If
+   * the control connection was never opened, the remote directory
+   * does not exist, so the report is only kept locally.
+   */
+  write_timeline_report (tl, config, data_conns, ret, timeline_file);
+  if (remote_dir_created && !is_cancel_requested ())
+    ignore_value (scp_file (config, remote_dir, timeline_file, NULL));
+  free_timeline (tl);
 
   if (inhibit_fd >= 0)
     close (inhibit_fd);
 
+  metrics_set_control_pid (0);
+  metrics_set_phase (ret == 0 ? PHASE_FINISHED : PHASE_FAILED);
   set_running (0);
 
   return ret;
@@ -429,7 +826,7 @@ cancel_conversion (void)
 static void
 cleanup_data_conns (struct data_conn *data_conns, size_t nr)
 {
-  size_t i;
+  size_t i, j;
 
   for (i = 0; i < nr; ++i) {
     if (data_conns[i].h != NULL) {
@@ -438,17 +835,71 @@ cleanup_data_conns (struct data_conn *data_conns, size_t nr)
        * pipe doesn't do anything.
        */
       kill (mexp_get_pid (data_conns[i].h), SIGHUP);
-      mexp_close (data_conns[i].h);
+      close_session (data_conns[i].h);
     }
+    for (j = 0; j < data_conns[i].nr_extra; ++j) {
+      /* NULL if the supervisor could not reconnect it. */
+      if (data_conns[i].extra_h[j] == NULL)
+        continue;
+      kill (mexp_get_pid (data_conns[i].extra_h[j]), SIGHUP);
+      close_session (data_conns[i].extra_h[j]);
+    }
+    free (data_conns[i].extra_h);
+    free (data_conns[i].extra_remote_port);
+    data_conns[i].extra_h = NULL;
+    data_conns[i].extra_remote_port = NULL;
+    data_conns[i].nr_extra = 0;
 
     if (data_conns[i].nbd_pid > 0) {
+      /* Record how much was read from the disk for the report. */
+      ignore_value (get_process_io_counter (data_conns[i].nbd_pid, "rchar",
+                                            &data_conns[i].bytes_read));
+
       /* Kill NBD process and clean up. */
       kill (data_conns[i].nbd_pid, SIGTERM);
       waitpid (data_conns[i].nbd_pid, NULL, 0);
     }
+
+    free (data_conns[i].stage_dir);
+    data_conns[i].stage_dir = NULL;
   }
 }
 
+/**
+ * Write the conversion timeline, the number of bytes read from each
+ * disk and the result of the conversion into C<filename>.
+ */
+static void
+write_timeline_report (struct timeline *tl, struct config *config,
+                       struct data_conn *data_conns, int ret,
+                       const char *filename)
+{
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  size_t i;
+
+  fp = fopen (filename, "w");
+  if (fp == NULL) {
+    perror (filename);
+    return;
+  }
+
+  timeline_print (tl, fp);
+
+  fprintf (fp, "\n%-20s %20s\n", "disk", "bytes read");
+  for (i = 0; data_conns != NULL && config->disks[i] != NULL; ++i)
+    fprintf (fp, "%-20s %20" PRIu64 "\n",
+             config->disks[i], data_conns[i].bytes_read);
+
+  fprintf (fp, "\nresult: %s\n",
+           ret == 0 ? "success" :
+           conversion_error ? conversion_error : "failed");
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: conversion timeline written to %s\n",
+           g_get_prgname (), filename);
+#endif
+}
+
 /**
  * Write the guest name into C<filename>.
  */
@@ -472,10 +923,11 @@ generate_name (struct config *config, const char *filename)
  * connection when we start the conversion.
  */
 static void
-generate_wrapper_script (struct config *config, const char *remote_dir,
-                         const char *filename)
+generate_wrapper_script (struct config *config, struct data_conn *data_conns,
+                         const char *remote_dir, const char *filename)
 {
   FILE *fp;
+  size_t i;
 
   fp = fopen (filename, "w");
   if (fp == NULL)
@@ -487,6 +939,30 @@ generate_wrapper_script (struct config *config, const char *remote_dir,
   fprintf (fp, "cd %s\n", remote_dir);
   fprintf (fp, "\n");
 
+  if (is_staged_transfer (config)) {
+    fprintf (fp, "stage_dirs=(");
+    for (i = 0; config->disks[i] != NULL; ++i) {
+      if (i > 0)
+        fprintf (fp, " ");
+      print_quoted (fp, data_conns[i].stage_dir);
+    }
+    fprintf (fp, ")\n");
+    fprintf (fp, "\n");
+  }
+
+  fprintf (fp,
+           "# virt-p2v runs this with --cleanup when it has finished.\n");
+  fprintf (fp, "if [ \"$1\" = \"--cleanup\" ]; then\n");
+  if (is_staged_transfer (config) && !is_resumable_transfer (config)) {
+    fprintf (fp,
+             "    # The staged disks were only kept in case virt-v2v\n"
+             "    # was retried.\n");
+    fprintf (fp, "    rm -rf \"${stage_dirs[@]}\"\n");
+  }
+  fprintf (fp, "    exit 0\n");
+  fprintf (fp, "fi\n");
+  fprintf (fp, "\n");
+
   /* The virt-v2v command, as a shell function called "v2v". */
   fprintf (fp, "v2v ()\n");
   fprintf (fp, "{\n");
@@ -527,8 +1003,6 @@ generate_wrapper_script (struct config *config, const char *remote_dir,
   }
 
   if (config->output.misc) { /* -oo */
-    size_t i;
-
     for (i = 0; config->output.misc[i]; ++i) {
       fprintf (fp, " -oo ");
       print_quoted (fp, config->output.misc[i]);
@@ -545,6 +1019,52 @@ generate_wrapper_script (struct config *config, const char *remote_dir,
   fprintf (fp, "}\n");
   fprintf (fp, "\n");
 
+  if (is_staged_transfer (config)) {
+    generate_stage_function (fp);
+
+    /* Stage each disk, as a shell function called "stage_all". */
+    fprintf (fp, "stage_all ()\n");
+    fprintf (fp, "{\n");
+    if (config->transfer.base_dir) {
+      fprintf (fp, "    load_base_index ");
+      print_quoted (fp, config->transfer.base_dir);
+      fprintf (fp, " %d\n", TRANSFER_CHUNK_SIZE);
+    }
+    /* The number of connections which the copy workers use, until
+     * the stream controller in virt-p2v changes it.
+     */
+    if (is_adaptive_transfer (config))
+      fprintf (fp, "    [ -f streams ] || echo %u > streams\n",
+               get_transfer_streams (config));
+    for (i = 0; config->disks[i] != NULL; ++i) {
+      size_t j;
+
+      fprintf (fp, "    stage ");
+      print_quoted (fp, config->disks[i]);
+      fprintf (fp, " ");
+      print_quoted (fp, data_conns[i].stage_dir);
+      fprintf (fp, " checksums-%zu %d", i, data_conns[i].nbd_remote_port);
+      for (j = 0; j < data_conns[i].nr_extra; ++j)
+        fprintf (fp, " %d", data_conns[i].extra_remote_port[j]);
+      fprintf (fp, " || return 1\n");
+    }
+    if (config->transfer.dedup &&
+        config->transfer.mode != TRANSFER_MODE_PRECOPY)
+      fprintf (fp, "    dedup_summary checksums-*\n");
+    if (config->transfer.verify &&
+        config->transfer.mode != TRANSFER_MODE_PRECOPY) {
+      for (i = 0; config->disks[i] != NULL; ++i) {
+        fprintf (fp, "    verify ");
+        print_quoted (fp, config->disks[i]);
+        fprintf (fp, " ");
+        print_quoted (fp, data_conns[i].stage_dir);
+        fprintf (fp, " checksums-%zu || return 1\n", i);
+      }
+    }
+    fprintf (fp, "}\n");
+    fprintf (fp, "\n");
+  }
+
   fprintf (fp,
            "# Write a pre-emptive error status, in case the virt-v2v\n"
            "# command doesn't get to run at all.  This will be\n"
@@ -553,7 +1073,14 @@ generate_wrapper_script (struct config *config, const char *remote_dir,
   fprintf (fp, "\n");
 
   fprintf (fp, "log=virt-v2v-conversion-log.txt\n");
-  fprintf (fp, "rm -f $log\n");
+  fprintf (fp,
+           "# If virt-v2v is being retried, keep the log of the\n"
+           "# previous run.\n");
+  fprintf (fp, "if [ -f $log ]; then\n");
+  fprintf (fp, "    n=1\n");
+  fprintf (fp, "    while [ -f $log.$n ]; do n=$((n + 1)); done\n");
+  fprintf (fp, "    mv $log $log.$n\n");
+  fprintf (fp, "fi\n");
   fprintf (fp, "\n");
 
   fprintf (fp,
@@ -571,7 +1098,42 @@ generate_wrapper_script (struct config *config, const char *remote_dir,
   fprintf (fp,
            "# Run virt-v2v.  Send stdout back to virt-p2v.  Send stdout\n"
            "# and stderr (debugging info) to the log file.\n");
-  fprintf (fp, "v2v 2>> $log | tee -a $log\n");
+  if (!is_staged_transfer (config))
+    fprintf (fp, "v2v 2>> $log | tee -a $log\n");
+  else if (config->transfer.mode == TRANSFER_MODE_PRECOPY) {
+    fprintf (fp,
+             "# The disks are only copied.  They are kept for the\n"
+             "# conversion, which copies the chunks that changed since.\n");
+    fprintf (fp, "stage_all 2>> $log | tee -a $log\n");
+    fprintf (fp, "echo ${PIPESTATUS[0]} > status\n");
+  }
+  else {
+    fprintf (fp,
+             "# The disks are copied to the staging directories first,\n"
+             "# then virt-v2v converts the copies.  If virt-v2v is\n"
+             "# retried, the disks which were staged before are used.\n");
+    fprintf (fp, "if [ ! -f staged ]; then\n");
+    if (!is_resumable_transfer (config))
+      fprintf (fp, "    rm -rf \"${stage_dirs[@]}\"\n");
+    fprintf (fp, "    stage_all 2>> $log | tee -a $log\n");
+    fprintf (fp, "    [ \"${PIPESTATUS[0]}\" -ne 0 ] || touch staged\n");
+    fprintf (fp, "fi\n");
+    fprintf (fp, "if [ -f staged ]; then\n");
+    fprintf (fp, "    v2v 2>> $log | tee -a $log\n");
+    fprintf (fp, "fi\n");
+    if (is_resumable_transfer (config))
+      fprintf (fp,
+               "# The staged disks are kept if the conversion fails, so\n"
+               "# that the next conversion of this machine only copies\n"
+               "# what has changed.\n");
+    else
+      fprintf (fp,
+               "# The staged disks are kept if the conversion fails, in\n"
+               "# case virt-v2v is retried.\n");
+    fprintf (fp, "if [ \"$(< status)\" -eq 0 ]; then\n");
+    fprintf (fp, "    rm -rf \"${stage_dirs[@]}\"\n");
+    fprintf (fp, "fi\n");
+  }
   fprintf (fp, "\n");
 
   fprintf (fp,
@@ -621,35 +1183,6 @@ print_quoted (FILE *fp, const char *s)
   fprintf (fp, "\"");
 }
 
-/**
- * Collect data about the system running virt-p2v such as the dmesg
- * output and lists of PCI devices.  This is useful for diagnosis when
- * things go wrong.
- *
- * If any command fails, this is non-fatal.
- */
-static void
-generate_system_data (const char *dmesg_file,
-                      const char *lscpu_file,
-                      const char *lspci_file,
-                      const char *lsscsi_file,
-                      const char *lsusb_file)
-{
-  CLEANUP_FREE char *cmd = NULL;
-
-  if (asprintf (&cmd,
-                "dmesg >%s 2>&1; "
-                "lscpu >%s 2>&1; "
-                "lspci -vvv >%s 2>&1; "
-                "lsscsi -v >%s 2>&1; "
-                "lsusb -v >%s 2>&1",
-                dmesg_file, lscpu_file, lspci_file, lsscsi_file, lsusb_file)
-      == -1)
-    error (EXIT_FAILURE, errno, "asprintf");
-
-  ignore_value (system (cmd));
-}
-
 /**
  * Generate a file containing the version of virt-p2v.
  *
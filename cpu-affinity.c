@@ -0,0 +1,271 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Partition the CPU cores between the user interface and the data
+ * connections.
+ *
+ * When the disks are copied, the ssh processes encrypting the data
+ * connections are usually the bottleneck, and left to themselves they
+ * move between cores and share them with nbdkit and with the GTK main
+ * loop.  Instead, the core of CPU 0 is kept for the GTK main thread
+ * (C<set_ui_affinity>), and each nbdkit and each ssh data connection
+ * is pinned to a core of its own (C<set_data_conn_affinity>), on the
+ * NUMA node of the controller of the disk (see C<get_disk_numa_node>)
+ * if that is known.  If there are more processes than cores on the
+ * node, cores are shared in turn.
+ *
+ * Only those processes are pinned.  The conversion thread, and the
+ * other processes which it starts (such as the control connection,
+ * scp and the commands which collect the system data), are left to
+ * the scheduler.  Since a thread inherits the affinity of the thread
+ * which creates it, the threads started by the GTK main thread are
+ * created with C<init_thread_affinity>.
+ *
+ * The cores are found with S<C<lscpu -p>>, which is also where
+ * C<get_cpu_topology> gets the number of sockets, cores and threads
+ * from.  Each core keeps all of its hardware threads.
+ *
+ * As with the disk tuning, this is only done in the virt-p2v ISO
+ * environment, and only when there are at least C<MIN_CORES> cores.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/types.h>
+
+#include <pthread.h>
+
+#include "p2v.h"
+
+/* Fewer cores than this are not worth partitioning. */
+#define MIN_CORES 3
+
+struct core {
+  int id;
+  int node;                     /* NUMA node, or 0 if not known. */
+  cpu_set_t cpus;               /* The hardware threads of the core. */
+};
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static struct core *cores;
+static size_t nr_cores;
+static size_t control_core;     /* The core of CPU 0. */
+static cpu_set_t all_cpus;      /* The hardware threads of all cores. */
+
+static void
+read_topology (void)
+{
+  CLEANUP_PCLOSE FILE *fp = NULL;
+  CLEANUP_FREE char *line = NULL;
+  size_t len = 0, i;
+  int cpu, id, node;
+
+  fp = popen ("lscpu -p=CPU,CORE,NODE", "re");
+  if (fp == NULL)
+    return;
+
+  /* Lines such as "2,1,0".  The node is empty if there is no NUMA. */
+  while (getline (&line, &len, fp) != -1) {
+    if (line[0] == '#')
+      continue;
+    node = 0;
+    if (sscanf (line, "%d,%d,%d", &cpu, &id, &node) < 2 ||
+        cpu < 0 || cpu >= CPU_SETSIZE)
+      continue;
+
+    for (i = 0; i < nr_cores; ++i)
+      if (cores[i].id == id)
+        break;
+    if (i == nr_cores) {
+      nr_cores++;
+      cores = realloc (cores, nr_cores * sizeof (struct core));
+      if (cores == NULL)
+        error (EXIT_FAILURE, errno, "realloc");
+      cores[i].id = id;
+      cores[i].node = node;
+      CPU_ZERO (&cores[i].cpus);
+    }
+    CPU_SET (cpu, &cores[i].cpus);
+    CPU_SET (cpu, &all_cpus);
+    if (cpu == 0)
+      control_core = i;
+  }
+}
+
+static bool
+is_partitioned (void)
+{
+  if (!is_iso_environment)
+    return false;
+  pthread_once (&topology_once, read_topology);
+  return nr_cores >= MIN_CORES;
+}
+
+/* Return the cores (except the control core) which are on C<node>,
+ * or all of them if there are none or the node is not known.
+ */
+static size_t *
+get_node_cores (int node, size_t *n)
+{
+  size_t *ret, i;
+
+  ret = calloc (nr_cores, sizeof (size_t));
+  if (ret == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+
+  *n = 0;
+  for (i = 0; i < nr_cores; ++i)
+    if (i != control_core && (node == -1 || cores[i].node == node))
+      ret[(*n)++] = i;
+  if (*n == 0 && node != -1) {
+    for (i = 0; i < nr_cores; ++i)
+      if (i != control_core)
+        ret[(*n)++] = i;
+  }
+  return ret;
+}
+
+/* Pin all the threads of process C<pid>.  Threads which it creates
+ * later inherit the affinity of the thread which creates them.
+ */
+static void
+set_process_affinity (pid_t pid, const cpu_set_t *cpus)
+{
+  CLEANUP_FREE char *path = NULL;
+  DIR *dir;
+  struct dirent *d;
+
+  if (asprintf (&path, "/proc/%d/task", (int) pid) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  dir = opendir (path);
+  if (dir == NULL) {
+    sched_setaffinity (pid, sizeof *cpus, cpus);
+    return;
+  }
+  while ((d = readdir (dir)) != NULL) {
+    if (d->d_name[0] != '.')
+      sched_setaffinity (atoi (d->d_name), sizeof *cpus, cpus);
+  }
+  closedir (dir);
+}
+
+/**
+ * Pin the GTK main thread (the caller) to the control core, away from
+ * the data connections.
+ */
+void
+set_ui_affinity (void)
+{
+  if (!is_partitioned ())
+    return;
+
+  pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t),
+                          &cores[control_core].cpus);
+}
+
+/**
+ * Let a thread which is created with C<attr> run on any core, instead
+ * of inheriting the affinity of the GTK main thread.
+ */
+void
+init_thread_affinity (pthread_attr_t *attr)
+{
+  if (!is_partitioned ())
+    return;
+
+  pthread_attr_setaffinity_np (attr, sizeof (cpu_set_t), &all_cpus);
+}
+
+/**
+ * Let the calling thread run on any core which is not the control
+ * core, on the NUMA node of C<disk> if it is known.  This is for
+ * threads which read C<disk>.
+ */
+void
+set_disk_thread_affinity (const char *disk)
+{
+  CLEANUP_FREE size_t *node_cores = NULL;
+  cpu_set_t cpus;
+  size_t n, i;
+
+  if (!is_partitioned ())
+    return;
+
+  node_cores = get_node_cores (get_disk_numa_node (disk), &n);
+  CPU_ZERO (&cpus);
+  for (i = 0; i < n; ++i)
+    CPU_OR (&cpus, &cpus, &cores[node_cores[i]].cpus);
+  pthread_setaffinity_np (pthread_self (), sizeof cpus, &cpus);
+}
+
+/**
+ * Pin the nbdkit and the ssh processes of the data connections of
+ * C<disks[i]> to cores of their own.  The cores are chosen in the
+ * same way every time, so this is also called again when an ssh
+ * process is restarted (see F<supervisor.c>).
+ */
+void
+set_data_conn_affinity (char * const *disks, size_t i,
+                        const struct data_conn *dc)
+{
+  CLEANUP_FREE size_t *node_cores = NULL;
+  const size_t per_disk = dc->nr_extra + 2;
+  size_t n, j, slot = 0;
+  int node;
+
+  if (!is_partitioned ())
+    return;
+
+  /* Disks on the same node take the cores in turn. */
+  node = get_disk_numa_node (disks[i]);
+  for (j = 0; j < i; ++j)
+    if (get_disk_numa_node (disks[j]) == node)
+      slot += per_disk;
+  node_cores = get_node_cores (node, &n);
+
+  for (j = 0; j < per_disk; ++j) {
+    const struct core *core = &cores[node_cores[(slot + j) % n]];
+    mexp_h *h = NULL;
+    pid_t pid;
+
+    if (j == 0)
+      pid = dc->nbd_pid;
+    else {
+      h = j == 1 ? dc->h : dc->extra_h[j-2];
+      if (h == NULL)
+        continue;
+      pid = mexp_get_pid (h);
+    }
+    if (pid <= 0)
+      continue;
+    set_process_affinity (pid, &core->cpus);
+#if DEBUG_STDERR
+    fprintf (stderr, "%s: %s %d for %s on core %d (NUMA node %d)\n",
+             g_get_prgname (), j == 0 ? "nbdkit" : "ssh", (int) pid,
+             disks[i], core->id, core->node);
+#endif
+  }
+}
@@ -33,6 +33,7 @@ ifelse(REDHAT,1,
   nbdkit-server
   nbdkit-file-plugin
   which
+  iproute
 
   dnl Generally useful tools to use within xterm
   vim-minimal
@@ -75,6 +76,7 @@ ifelse(DEBIAN,1,
   openssh-client
   nbdkit
   debianutils
+  iproute2
   vim-tiny
   open-iscsi
   xorg
@@ -96,6 +98,7 @@ ifelse(ARCHLINUX,1,
   openssh
   nbdkit
   which
+  iproute2
   vim-tiny
   open-iscsi
   xorg-xinit
@@ -119,6 +122,7 @@ ifelse(SUSE,1,
   nbdkit-server
   nbdkit-file-plugin
   openssh
+  iproute2
   dnl /usr/bin/which is in util-linux on SUSE
   vim
   open-iscsi
@@ -148,6 +152,7 @@ ifelse(OPENMANDRIVA,1,
   nbdkit-server
   nbdkit-file-plugin
   which
+  iproute2
 
   dnl Generally useful tools to use within xterm
   vim-enhanced
@@ -0,0 +1,396 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Measure the read performance of the source disks, and look for
+ * signs that a disk is failing (read errors, very high latency).
+ *
+ * The disks are read the same way that the NBD server reads them
+ * during the conversion: buffered C<pread(2)> calls on the device
+ * opened read-only.  The page cache is dropped for the device before
+ * each test so that the results reflect the disk and not memory.
+ *
+ * Results are kept per disk (by name, as in C<config-E<gt>disks>) so
+ * that the GUI can show them and the conversion can upload them to
+ * the conversion server.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <locale.h>
+#include <libintl.h>
+
+#include <pthread.h>
+
+#include "p2v.h"
+
+/* Amount of data read by the sequential test, and the size of each
+ * read (similar to the requests made by qemu-img convert).
+ */
+#define SEQUENTIAL_BYTES (64 * 1024 * 1024)
+#define SEQUENTIAL_CHUNK (256 * 1024)
+
+/* Number and size of reads in the random test. */
+#define RANDOM_READS 256
+#define RANDOM_CHUNK 4096
+
+/* Each test stops early after this many seconds, so that a very
+ * slow disk does not hold things up.
+ */
+#define TEST_SECONDS 10
+
+/* A disk is reported as slow if it is below these figures.  These
+ * are deliberately low: any working disk made in the last 15 years
+ * should manage them.
+ */
+#define SLOW_SEQUENTIAL_RATE (20 * 1000 * 1000) /* bytes/second */
+#define SLOW_RANDOM_P99 0.2                      /* seconds */
+
+/* Disks smaller than this are not given a verdict.  The tests read
+ * most of such a small device, often from the cache of the device or
+ * of a USB bridge, so the figures above do not mean anything.
+ */
+#define MIN_RATED_SIZE (UINT64_C(1024) * 1024 * 1024)
+
+struct disk_benchmark {
+  char *disk;
+  int err;                      /* errno if the disk could not be opened */
+  uint64_t size;
+  double seq_rate;              /* bytes/second */
+  double random_iops;
+  double random_avg;            /* seconds */
+  double random_p99;            /* seconds */
+  double random_max;            /* seconds */
+  unsigned read_errors;
+};
+
+static pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct disk_benchmark *results;
+static size_t nr_results;
+
+static double
+now_seconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+compare_doubles (const void *p1, const void *p2)
+{
+  const double d1 = *(const double *) p1;
+  const double d2 = *(const double *) p2;
+
+  return d1 < d2 ? -1 : d1 > d2 ? 1 : 0;
+}
+
+static void
+sequential_test (int fd, struct disk_benchmark *b, char *buf)
+{
+  const uint64_t bytes =
+    b->size < SEQUENTIAL_BYTES ? b->size : SEQUENTIAL_BYTES;
+  uint64_t offset = 0;
+  double start, elapsed;
+
+  posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  start = now_seconds ();
+  while (offset < bytes) {
+    ssize_t r = pread (fd, buf, SEQUENTIAL_CHUNK, offset);
+
+    if (r <= 0) {
+      if (r == -1 && errno == EINTR)
+        continue;
+      b->read_errors++;
+      /* Skip over the bad area. */
+      offset += SEQUENTIAL_CHUNK;
+    }
+    else
+      offset += r;
+    if (now_seconds () - start > TEST_SECONDS)
+      break;
+  }
+  elapsed = now_seconds () - start;
+
+  if (elapsed > 0)
+    b->seq_rate = offset / elapsed;
+}
+
+static void
+random_test (int fd, struct disk_benchmark *b, char *buf)
+{
+  const uint64_t blocks = b->size / RANDOM_CHUNK;
+  double latencies[RANDOM_READS];
+  double start, total = 0;
+  size_t i, n = 0;
+  unsigned seed = time (NULL);
+
+  if (blocks == 0)
+    return;
+
+  posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  start = now_seconds ();
+  for (i = 0; i < RANDOM_READS; ++i) {
+    const uint64_t block =
+      (((uint64_t) rand_r (&seed) << 31) ^ rand_r (&seed)) % blocks;
+    double t;
+    ssize_t r;
+
+    t = now_seconds ();
+    do
+      r = pread (fd, buf, RANDOM_CHUNK, block * RANDOM_CHUNK);
+    while (r == -1 && errno == EINTR);
+    t = now_seconds () - t;
+    if (r != RANDOM_CHUNK)
+      b->read_errors++;
+
+    latencies[n++] = t;
+    total += t;
+    if (now_seconds () - start > TEST_SECONDS)
+      break;
+  }
+
+  qsort (latencies, n, sizeof latencies[0], compare_doubles);
+  b->random_iops = total > 0 ? n / total : 0;
+  b->random_avg = total / n;
+  b->random_p99 = latencies[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1];
+  b->random_max = latencies[n-1];
+}
+
+static void
+store_result (struct disk_benchmark *b)
+{
+  size_t i;
+
+  pthread_mutex_lock (&results_lock);
+  for (i = 0; i < nr_results; ++i) {
+    if (STREQ (results[i].disk, b->disk)) {
+      free (results[i].disk);
+      results[i] = *b;
+      goto out;
+    }
+  }
+  results = realloc (results, (nr_results + 1) * sizeof *results);
+  if (results == NULL)
+    error (EXIT_FAILURE, errno, "realloc");
+  results[nr_results++] = *b;
+ out:
+  pthread_mutex_unlock (&results_lock);
+}
+
+/**
+ * Benchmark the disk C<disk> (a name like C<sda>, or a full path when
+ * using I<--test-disk>).  This takes up to about 20 seconds.
+ *
+ * The result is saved and can be retrieved with
+ * C<get_disk_benchmark>.  Returns C<-1> if the disk could not be
+ * opened at all, which is also recorded in the result.
+ */
+int
+benchmark_disk (const char *disk)
+{
+  CLEANUP_FREE char *device = NULL;
+  struct disk_benchmark b = { 0 };
+  char *buf;
+  off_t size;
+  int fd;
+
+  b.disk = strdup (disk);
+  if (b.disk == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+
+  if (disk[0] == '/')
+    device = strdup (disk);
+  else if (asprintf (&device, "/dev/%s", disk) == -1)
+    device = NULL;
+  if (device == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: benchmarking disk %s\n", g_get_prgname (), device);
+#endif
+
+  fd = open (device, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    b.err = errno;
+    store_result (&b);
+    return -1;
+  }
+  size = lseek (fd, 0, SEEK_END);
+  b.size = size > 0 ? size : 0;
+
+  buf = malloc (SEQUENTIAL_CHUNK);
+  if (buf == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  sequential_test (fd, &b, buf);
+  random_test (fd, &b, buf);
+  free (buf);
+
+  /* Don't leave the data we read in the page cache. */
+  posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+  close (fd);
+
+  store_result (&b);
+  return 0;
+}
+
+static int
+is_rated (const struct disk_benchmark *b)
+{
+  return b->size >= MIN_RATED_SIZE;
+}
+
+static int
+is_slow (const struct disk_benchmark *b)
+{
+  return b->seq_rate < SLOW_SEQUENTIAL_RATE || b->random_p99 > SLOW_RANDOM_P99;
+}
+
+static char *
+format_result (const struct disk_benchmark *b)
+{
+  char *ret;
+
+  if (b->err) {
+    if (asprintf (&ret, _("cannot open: %s"), strerror (b->err)) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    return ret;
+  }
+
+  if (asprintf (&ret,
+                _("read %.0f MB/s, %.0f IOPS (latency avg %.1f ms, "
+                  "p99 %.1f ms), %s"),
+                b->seq_rate / 1e6, b->random_iops,
+                b->random_avg * 1000, b->random_p99 * 1000,
+                b->read_errors > 0 ? _("read errors") :
+                !is_rated (b) ? _("too small to rate") :
+                is_slow (b) ? _("slow") : _("ok")) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  return ret;
+}
+
+/**
+ * Return a one line summary of the benchmark of C<disk>, or C<NULL>
+ * if it has not been benchmarked.  The caller must free the returned
+ * string.
+ */
+char *
+get_disk_benchmark (const char *disk)
+{
+  char *ret = NULL;
+  size_t i;
+
+  pthread_mutex_lock (&results_lock);
+  for (i = 0; i < nr_results; ++i) {
+    if (STREQ (results[i].disk, disk)) {
+      ret = format_result (&results[i]);
+      break;
+    }
+  }
+  pthread_mutex_unlock (&results_lock);
+
+  return ret;
+}
+
+/**
+ * Return the sequential read rate of C<disk> in bytes/second, or C<0>
+ * if it has not been benchmarked.
+ */
+double
+get_disk_read_rate (const char *disk)
+{
+  double ret = 0;
+  size_t i;
+
+  pthread_mutex_lock (&results_lock);
+  for (i = 0; i < nr_results; ++i) {
+    if (STREQ (results[i].disk, disk)) {
+      ret = results[i].seq_rate;
+      break;
+    }
+  }
+  pthread_mutex_unlock (&results_lock);
+
+  return ret;
+}
+
+/**
+ * Write the full benchmark results for the disks in C<disks> to
+ * C<filename>, for copying to the conversion server.
+ *
+ * Returns C<0> if the file was written, or C<-1> if none of the
+ * disks has been benchmarked (in which case no file is created).
+ */
+int
+write_disk_benchmarks (char **disks, const char *filename)
+{
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  size_t i, j;
+  int ret = -1;
+
+  if (disks == NULL)
+    return -1;
+
+  pthread_mutex_lock (&results_lock);
+  for (i = 0; disks[i] != NULL; ++i) {
+    for (j = 0; j < nr_results; ++j) {
+      const struct disk_benchmark *b = &results[j];
+
+      if (STRNEQ (b->disk, disks[i]))
+        continue;
+
+      if (fp == NULL) {
+        fp = fopen (filename, "w");
+        if (fp == NULL) {
+          perror (filename);
+          goto out;
+        }
+        fprintf (fp, "%-10s %12s %10s %8s %10s %10s %10s %7s  %s\n",
+                 "disk", "size", "seq_MB/s", "iops",
+                 "avg_ms", "p99_ms", "max_ms", "errors", "verdict");
+      }
+      if (b->err)
+        fprintf (fp, "%-10s cannot open: %s\n", b->disk, strerror (b->err));
+      else
+        fprintf (fp, "%-10s %12" PRIu64 " %10.1f %8.0f %10.2f %10.2f %10.2f %7u  %s\n",
+                 b->disk, b->size, b->seq_rate / 1e6, b->random_iops,
+                 b->random_avg * 1000, b->random_p99 * 1000,
+                 b->random_max * 1000, b->read_errors,
+                 b->read_errors > 0 ? "read-errors" :
+                 !is_rated (b) ? "not-rated" :
+                 is_slow (b) ? "slow" : "ok");
+      ret = 0;
+    }
+  }
+ out:
+  pthread_mutex_unlock (&results_lock);
+
+  return ret;
+}
@@ -0,0 +1,397 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Tune the block device queues of the source disks for the
+ * conversion, and put them back afterwards.
+ *
+ * The kernel defaults on the virt-p2v ISO (a small read-ahead, and
+ * whatever I/O scheduler the distribution chose) suit a desktop, not
+ * a single process reading a whole disk from start to end.  When the
+ * conversion starts, each queue under the source disks (see
+ * C<get_disk_sysfs_dirs>) is given a profile which depends on whether
+ * the device is rotational, and the original values are restored when
+ * the conversion finishes.
+ *
+ * This is only done in the virt-p2v ISO environment.  On a running
+ * machine (for example when pre-copying) the same disks are used by
+ * the operating system, which should keep its own settings.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+
+#include "p2v.h"
+
+/* The queue settings, in the order in which they are changed.  The
+ * scheduler comes first, since the limits of C<nr_requests> depend on
+ * it.  The numbers are minimums: a larger value is left alone, and
+ * C<max_sectors_kb> is also limited by C<max_hw_sectors_kb>.  C<NULL>
+ * means that the setting is left alone.
+ */
+static const struct {
+  const char *file;
+  const char *rotational;
+  const char *non_rotational;
+} profile[] = {
+  { "scheduler",      "mq-deadline", "none" },
+  { "nr_requests",    "256",         NULL },
+  { "read_ahead_kb",  "4096",        "1024" },
+  { "max_sectors_kb", "1024",        "1024" },
+};
+#define NR_SETTINGS (sizeof profile / sizeof profile[0])
+
+/* Amount of data read from each disk to measure the effect, if it
+ * was benchmarked.
+ */
+#define MEASURE_BYTES (32 * 1024 * 1024)
+#define MEASURE_CHUNK (256 * 1024)
+
+struct saved_setting {
+  char *path;
+  char *value;
+};
+
+struct disk_tuning {
+  size_t nr;
+  struct saved_setting *saved;
+};
+
+/* Read a sysfs file, without the trailing newline. */
+static char *
+read_setting (const char *path)
+{
+  gchar *contents;
+  char *ret;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return NULL;
+  ret = strndup (contents, strcspn (contents, "\n"));
+  g_free (contents);
+  if (ret == NULL)
+    error (EXIT_FAILURE, errno, "strndup");
+  return ret;
+}
+
+static int
+write_setting (const char *path, const char *value)
+{
+  int fd;
+  const size_t len = strlen (value);
+  ssize_t r;
+
+  fd = open (path, O_WRONLY|O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  r = write (fd, value, len);
+  if (close (fd) == -1 || r != (ssize_t) len)
+    return -1;
+  return 0;
+}
+
+/* The scheduler file lists the available schedulers, with the
+ * current one in brackets, eg. C<mq-deadline kyber [bfq] none>.
+ * Return the current one, and check that C<want> is available.
+ */
+static char *
+parse_scheduler (char *list, const char *want, bool *available)
+{
+  char *p, *saveptr, *current = NULL;
+
+  *available = false;
+  for (p = strtok_r (list, " ", &saveptr); p != NULL;
+       p = strtok_r (NULL, " ", &saveptr)) {
+    if (p[0] == '[') {
+      p++;
+      p[strcspn (p, "]")] = '\0';
+      current = p;
+    }
+    if (STREQ (p, want))
+      *available = true;
+  }
+  return current;
+}
+
+static void
+save_setting (struct disk_tuning *t, const char *path, const char *value)
+{
+  t->nr++;
+  t->saved = realloc (t->saved, t->nr * sizeof (struct saved_setting));
+  if (t->saved == NULL)
+    error (EXIT_FAILURE, errno, "realloc");
+  t->saved[t->nr-1].path = strdup (path);
+  t->saved[t->nr-1].value = strdup (value);
+  if (t->saved[t->nr-1].path == NULL || t->saved[t->nr-1].value == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+}
+
+/* Change one setting, saving its original value in C<t>.
+ * C<original> is the contents of the file before any of the settings
+ * of the queue were changed, since changing the scheduler resets
+ * C<nr_requests>.  A setting which was changed that way is saved too,
+ * even if it is not changed here or C<want> is C<NULL>.  Returns a
+ * description of the change, or C<NULL> if nothing was changed.
+ */
+static char *
+tune_setting (struct disk_tuning *t, const char *dir,
+              const char *file, const char *want, const char *original)
+{
+  CLEANUP_FREE char *path = NULL, *hw_path = NULL;
+  CLEANUP_FREE char *contents = NULL, *hw_max = NULL;
+  CLEANUP_FREE char *original_copy = NULL;
+  char value[32];
+  const char *current, *orig;
+  bool change = true;
+  char *ret;
+
+  if (original == NULL)
+    return NULL;
+  if (asprintf (&path, "%s/queue/%s", dir, file) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  contents = read_setting (path);
+  original_copy = strdup (original);
+  if (original_copy == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  if (contents == NULL)
+    return NULL;
+  current = contents;
+  orig = original_copy;
+
+  if (STREQ (file, "scheduler")) {
+    bool available;
+
+    orig = parse_scheduler (original_copy, want, &available);
+    current = parse_scheduler (contents, want, &available);
+    if (current == NULL || orig == NULL || !available || STREQ (current, want))
+      change = false;
+  }
+  else if (want == NULL)
+    change = false;
+  else {
+    unsigned long n = strtoul (want, NULL, 10);
+
+    if (STREQ (file, "max_sectors_kb")) {
+      if (asprintf (&hw_path, "%s/queue/max_hw_sectors_kb", dir) == -1)
+        error (EXIT_FAILURE, errno, "asprintf");
+      hw_max = read_setting (hw_path);
+      if (hw_max)
+        n = MIN (n, strtoul (hw_max, NULL, 10));
+    }
+    if (strtoul (current, NULL, 10) >= n)
+      change = false;
+    snprintf (value, sizeof value, "%lu", n);
+    want = value;
+  }
+
+  if (change && write_setting (path, want) == -1)
+    change = false;
+  if (!change) {
+    /* Changed by an earlier setting? */
+    if (current == NULL || orig == NULL || STREQ (current, orig))
+      return NULL;
+    want = current;
+  }
+
+  save_setting (t, path, orig);
+
+  if (asprintf (&ret, "%s %s -> %s", file, orig, want) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  return ret;
+}
+
+/* Measure the sequential read rate of the start of a disk, in
+ * bytes/second, with the page cache dropped.  Returns C<0> on error.
+ */
+static double
+measure_read_rate (const char *disk)
+{
+  CLEANUP_FREE char *device = NULL, *buf = NULL;
+  struct timespec start, end;
+  uint64_t total = 0;
+  double t;
+  ssize_t r;
+  int fd;
+
+  if (disk[0] == '/')
+    device = strdup (disk);
+  else if (asprintf (&device, "/dev/%s", disk) == -1)
+    device = NULL;
+  buf = malloc (MEASURE_CHUNK);
+  if (device == NULL || buf == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+
+  fd = open (device, O_RDONLY|O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  while (total < MEASURE_BYTES) {
+    r = read (fd, buf, MEASURE_CHUNK);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    total += r;
+  }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+  close (fd);
+
+  t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return t > 0 ? total / t : 0;
+}
+
+/**
+ * Tune the queues of the source disks.  The changes are written to
+ * stderr and to the timeline C<tl>.  If a disk was benchmarked (see
+ * F<disk-benchmark.c>), its sequential read rate is measured again
+ * after tuning it, and compared with the benchmark.  Otherwise the
+ * disks are not read here, since that would add a few seconds to
+ * every conversion.
+ *
+ * Returns the original settings, to be passed to
+ * C<restore_disk_tuning>, or C<NULL> if nothing was changed.
+ */
+struct disk_tuning *
+tune_disks (char * const *disks, struct timeline *tl)
+{
+  struct disk_tuning *t;
+  size_t i, j, k;
+
+  if (!is_iso_environment)
+    return NULL;
+
+  t = calloc (1, sizeof *t);
+  if (t == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+
+  for (i = 0; disks[i] != NULL; ++i) {
+    CLEANUP_FREE_STRING_LIST char **dirs = get_disk_sysfs_dirs (disks[i]);
+    CLEANUP_FREE_STRING_LIST char **changes = NULL;
+    CLEANUP_FREE char *msg = NULL, *list = NULL;
+    size_t nr_changes = 0;
+    double before, after;
+
+    for (j = 0; dirs[j] != NULL; ++j) {
+      CLEANUP_FREE char *path = NULL, *rotational = NULL;
+      const char *name = strrchr (dirs[j], '/') + 1;
+      char *originals[NR_SETTINGS];
+      bool rot;
+
+      if (asprintf (&path, "%s/queue/rotational", dirs[j]) == -1)
+        error (EXIT_FAILURE, errno, "asprintf");
+      rotational = read_setting (path);
+      rot = rotational && STREQ (rotational, "1");
+
+      /* Read all the original values before changing any. */
+      for (k = 0; k < NR_SETTINGS; ++k) {
+        CLEANUP_FREE char *setting_path = NULL;
+
+        if (asprintf (&setting_path, "%s/queue/%s",
+                      dirs[j], profile[k].file) == -1)
+          error (EXIT_FAILURE, errno, "asprintf");
+        originals[k] = read_setting (setting_path);
+      }
+
+      for (k = 0; k < NR_SETTINGS; ++k) {
+        const char *want =
+          rot ? profile[k].rotational : profile[k].non_rotational;
+        char *change;
+
+        /* Even if C<want> is NULL, since the setting may have been
+         * reset by changing the scheduler.
+         */
+        change = tune_setting (t, dirs[j], profile[k].file, want,
+                               originals[k]);
+        if (change == NULL)
+          continue;
+
+        nr_changes++;
+        changes = realloc (changes, (nr_changes + 1) * sizeof (char *));
+        if (changes == NULL)
+          error (EXIT_FAILURE, errno, "realloc");
+        if (asprintf (&changes[nr_changes-1], "%s %s", name, change) == -1)
+          error (EXIT_FAILURE, errno, "asprintf");
+        changes[nr_changes] = NULL;
+        free (change);
+      }
+
+      for (k = 0; k < NR_SETTINGS; ++k)
+        free (originals[k]);
+    }
+
+    if (nr_changes == 0)
+      continue;
+
+    before = get_disk_read_rate (disks[i]);
+    after = before > 0 ? measure_read_rate (disks[i]) : 0;
+    list = guestfs_int_join_strings (", ", changes);
+    if (list == NULL)
+      error (EXIT_FAILURE, errno, "malloc");
+    if (before > 0 && after > 0) {
+      if (asprintf (&msg, "tuned disk %s: %s; sequential reads "
+                    "%.1f -> %.1f MB/s",
+                    disks[i], list, before / 1e6, after / 1e6) == -1)
+        error (EXIT_FAILURE, errno, "asprintf");
+    }
+    else if (asprintf (&msg, "tuned disk %s: %s", disks[i], list) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+#if DEBUG_STDERR
+    fprintf (stderr, "%s: %s\n", g_get_prgname (), msg);
+#endif
+    timeline_mark (tl, msg);
+  }
+
+  if (t->nr == 0) {
+    free (t);
+    return NULL;
+  }
+  return t;
+}
+
+/**
+ * Put back the settings changed by C<tune_disks>, and free C<t>.  They
+ * are restored in the order in which they were changed, so that each
+ * scheduler is restored before the C<nr_requests> which depends on it.
+ */
+void
+restore_disk_tuning (struct disk_tuning *t)
+{
+  size_t i;
+
+  if (t == NULL)
+    return;
+
+  for (i = 0; i < t->nr; ++i) {
+    if (write_setting (t->saved[i].path, t->saved[i].value) == -1)
+      fprintf (stderr, "%s: could not restore %s to %s: %m\n",
+               g_get_prgname (), t->saved[i].path, t->saved[i].value);
+    free (t->saved[i].path);
+    free (t->saved[i].value);
+  }
+  free (t->saved);
+  free (t);
+}
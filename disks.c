@@ -17,6 +17,7 @@
 
 #include <config.h>
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <error.h>
@@ -27,6 +28,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #if MAJOR_IN_MKDEV
 #include <sys/mkdev.h>
@@ -74,7 +76,7 @@ partition_parent (dev_t part_dev)
  * drives (intentionally).
  */
 static int
-device_has_no_media (const char *dev)
+device_has_no_media (const char *sys_block, const char *dev)
 {
   int ret;
   gchar *sysfs_pathname;
@@ -88,7 +90,7 @@ device_has_no_media (const char *dev)
   if (!STRPREFIX (dev, "sd"))
     return ret;
 
-  sysfs_pathname = g_strdup_printf ("/sys/block/%s/removable", dev);
+  sysfs_pathname = g_strdup_printf ("%s/%s/removable", sys_block, dev);
 
   if (!g_file_get_contents (sysfs_pathname, &sysfs_contents, &sysfs_size, NULL))
     goto free_sysfs_pathname;
@@ -161,6 +163,17 @@ device_contains (const char *dev, dev_t root_device)
  */
 void
 find_all_disks (char ***disks, char ***removable)
+{
+  find_all_disks_in ("/sys/block", disks, removable);
+}
+
+/**
+ * The same as C<find_all_disks>, but enumerate the disks in
+ * C<sys_block> instead of F</sys/block>.  This is used by the
+ * microbenchmarks to run against a synthetic directory.
+ */
+void
+find_all_disks_in (const char *sys_block, char ***disks, char ***removable)
 {
   DIR *dir;
   struct dirent *d;
@@ -175,9 +188,9 @@ find_all_disks (char ***disks, char ***removable)
   /* The default list of disks is everything in /sys/block which
    * matches the common patterns for disk names.
    */
-  dir = opendir ("/sys/block");
+  dir = opendir (sys_block);
   if (!dir)
-    error (EXIT_FAILURE, errno, "opendir");
+    error (EXIT_FAILURE, errno, "opendir: %s", sys_block);
 
   for (;;) {
     errno = 0;
@@ -195,7 +208,7 @@ find_all_disks (char ***disks, char ***removable)
        * -- effectively, empty floppy drives. Note that SCSI CD-ROMs are named
        * C<sr*> and thus handled on the other branch.
        */
-      if (device_has_no_media (d->d_name))
+      if (device_has_no_media (sys_block, d->d_name))
         continue;
 
       /* Skip the device containing the root filesystem. */
@@ -228,11 +241,11 @@ find_all_disks (char ***disks, char ***removable)
 
   /* Check readdir didn't fail */
   if (errno != 0)
-    error (EXIT_FAILURE, errno, "readdir: %s", "/sys/block");
+    error (EXIT_FAILURE, errno, "readdir: %s", sys_block);
 
   /* Close the directory handle */
   if (closedir (dir) == -1)
-    error (EXIT_FAILURE, errno, "closedir: %s", "/sys/block");
+    error (EXIT_FAILURE, errno, "closedir: %s", sys_block);
 
   if (ret_disks)
     qsort (ret_disks, nr_disks, sizeof (char *), compare_strings);
@@ -242,3 +255,349 @@ find_all_disks (char ***disks, char ***removable)
   *disks = ret_disks;
   *removable = ret_removable;
 }
+
+/**
+ * Return the directory of a disk under F<I<sys>/devices>, where
+ * C<sys> is normally F</sys>.  C<disk> is a name from F</sys/block>
+ * (eg. C<sda> or C<cciss/c0d0>) or the path of a block device.
+ * Returns C<NULL> if it cannot be found.
+ */
+static char *
+get_sysfs_dir (const char *sys, const char *disk)
+{
+  CLEANUP_FREE char *path = NULL;
+  struct stat statbuf;
+  char *p;
+
+  if (disk[0] == '/') {
+    if (stat (disk, &statbuf) == -1 || !S_ISBLK (statbuf.st_mode))
+      return NULL;
+    if (asprintf (&path, "%s/dev/block/%ju:%ju", sys,
+                  (uintmax_t) major (statbuf.st_rdev),
+                  (uintmax_t) minor (statbuf.st_rdev)) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+  }
+  else {
+    if (asprintf (&path, "%s/class/block/%s", sys, disk) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    /* cciss device /dev/cciss/c0d0 will be /sys/block/cciss!c0d0 */
+    for (p = path + strlen (sys) + strlen ("/class/block/"); *p; ++p)
+      if (*p == '/')
+        *p = '!';
+  }
+
+  return realpath (path, NULL);
+}
+
+static void
+add_string (char ***list, size_t *n, const char *str)
+{
+  (*n)++;
+  *list = realloc (*list, sizeof (char *) * (*n + 1));
+  if (*list == NULL)
+    error (EXIT_FAILURE, errno, "realloc");
+  (*list)[*n-1] = strdup (str);
+  if ((*list)[*n-1] == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  (*list)[*n] = NULL;
+}
+
+/**
+ * Add the devices which hold the data of the device in the sysfs
+ * directory C<dir> to the list C<leaves>: the whole disk for a
+ * partition, and the underlying devices (F<slaves>) for device-mapper
+ * and MD devices, recursively.
+ */
+static void
+add_leaf_devices (const char *dir, char ***leaves, size_t *nr_leaves,
+                  int depth)
+{
+  CLEANUP_FREE char *path = NULL;
+  DIR *slaves;
+  struct dirent *d;
+  int has_slaves = 0;
+
+  if (depth > 8)                /* Should not happen, but avoid loops. */
+    return;
+
+  if (asprintf (&path, "%s/partition", dir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  if (access (path, F_OK) == 0) {
+    CLEANUP_FREE char *parent = strdup (dir);
+
+    if (parent == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    *strrchr (parent, '/') = '\0';
+    add_leaf_devices (parent, leaves, nr_leaves, depth + 1);
+    return;
+  }
+
+  free (path);
+  if (asprintf (&path, "%s/slaves", dir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  slaves = opendir (path);
+  if (slaves) {
+    while ((d = readdir (slaves)) != NULL) {
+      CLEANUP_FREE char *slave_path = NULL, *slave = NULL;
+
+      if (d->d_name[0] == '.')
+        continue;
+      if (asprintf (&slave_path, "%s/%s", path, d->d_name) == -1)
+        error (EXIT_FAILURE, errno, "asprintf");
+      slave = realpath (slave_path, NULL);
+      if (slave) {
+        has_slaves = 1;
+        add_leaf_devices (slave, leaves, nr_leaves, depth + 1);
+      }
+    }
+    closedir (slaves);
+  }
+
+  if (!has_slaves)
+    add_string (leaves, nr_leaves, dir);
+}
+
+/**
+ * Return the sysfs directories of the block devices which reads from
+ * C<disk> go through: the disk itself (or the whole disk, for a
+ * partition), followed by the devices under it for device-mapper and
+ * MD devices.  The list is empty if the disk cannot be found in
+ * F</sys>.  The caller must free the list.
+ */
+char **
+get_disk_sysfs_dirs (const char *disk)
+{
+  return get_disk_sysfs_dirs_in ("/sys", disk);
+}
+
+/**
+ * The same as C<get_disk_sysfs_dirs>, but look in C<sys> instead of
+ * F</sys>.  This is used by the tests to run against a synthetic
+ * directory.
+ */
+char **
+get_disk_sysfs_dirs_in (const char *sys, const char *disk)
+{
+  CLEANUP_FREE char *dir = get_sysfs_dir (sys, disk);
+  CLEANUP_FREE char *path = NULL;
+  CLEANUP_FREE_STRING_LIST char **leaves = NULL;
+  char **ret;
+  size_t nr = 0, nr_leaves = 0, i;
+
+  ret = calloc (1, sizeof (char *));
+  if (ret == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  if (dir == NULL)
+    return ret;
+
+  if (asprintf (&path, "%s/partition", dir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  if (access (path, F_OK) == 0)
+    *strrchr (dir, '/') = '\0';
+
+  add_string (&ret, &nr, dir);
+  add_leaf_devices (dir, &leaves, &nr_leaves, 0);
+  for (i = 0; i < nr_leaves; ++i) {
+    if (STRNEQ (leaves[i], dir))
+      add_string (&ret, &nr, leaves[i]);
+  }
+
+  return ret;
+}
+
+/**
+ * Return the NUMA node of the controller of C<disk>, or C<-1> if it
+ * is not known.  This is the F<numa_node> of the nearest device above
+ * a leaf device which has one (usually the PCI device of the
+ * controller).  It is C<-1> there too on machines with only one node.
+ */
+int
+get_disk_numa_node (const char *disk)
+{
+  return get_disk_numa_node_in ("/sys", disk);
+}
+
+/**
+ * The same as C<get_disk_numa_node>, but look in C<sys> instead of
+ * F</sys>.
+ */
+int
+get_disk_numa_node_in (const char *sys, const char *disk)
+{
+  CLEANUP_FREE_STRING_LIST char **dirs = get_disk_sysfs_dirs_in (sys, disk);
+  CLEANUP_FREE char *root = realpath (sys, NULL);
+  const size_t root_len = root ? strlen (root) : 0;
+  size_t i;
+
+  for (i = 0; dirs[i] != NULL; ++i) {
+    CLEANUP_FREE char *dir = strdup (dirs[i]);
+    char *p;
+
+    if (dir == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    /* Stop at the top of sysfs. */
+    while ((p = strrchr (dir, '/')) != NULL && p > dir + root_len) {
+      CLEANUP_FREE char *path = NULL;
+      gchar *contents;
+      int node;
+
+      *p = '\0';
+      if (asprintf (&path, "%s/numa_node", dir) == -1)
+        error (EXIT_FAILURE, errno, "asprintf");
+      if (g_file_get_contents (path, &contents, NULL, NULL)) {
+        node = atoi (contents);
+        g_free (contents);
+        if (node >= 0)
+          return node;
+        break;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Return what limits the reads from the leaf device in the sysfs
+ * directory C<dir>, and set C<*rotational> if it is a rotational disk.
+ *
+ * Rotational devices behind the same SCSI host (eg. the LUNs of a
+ * hardware RAID controller, or the disks on a SAS HBA) are likely to
+ * share spindles or bandwidth, so they return the directory of the
+ * host.  Otherwise the device is independent, and its own directory
+ * is returned.
+ */
+static char *
+get_device_key (const char *dir, bool *rotational)
+{
+  CLEANUP_FREE char *path = NULL;
+  gchar *contents;
+  char *ret, *p, *host = NULL;
+
+  *rotational = false;
+  if (asprintf (&path, "%s/queue/rotational", dir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  if (g_file_get_contents (path, &contents, NULL, NULL)) {
+    *rotational = contents[0] == '1';
+    g_free (contents);
+  }
+
+  ret = strdup (dir);
+  if (ret == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+
+  if (*rotational) {
+    /* eg. /sys/devices/pci0000:00/.../host0/target0:2:0/0:2:0:0/block/sda */
+    for (p = strstr (ret, "/host"); p != NULL; p = strstr (p + 1, "/host")) {
+      if (isdigit ((unsigned char) p[5]))
+        host = p;
+    }
+    if (host && (p = strchr (host + 1, '/')) != NULL)
+      *p = '\0';
+  }
+
+  return ret;
+}
+
+static size_t
+find_group (const size_t *parent, size_t i)
+{
+  while (parent[i] != i)
+    i = parent[i];
+  return i;
+}
+
+/**
+ * Divide the disks into groups which should not be read at the same
+ * time, because they are on the same physical device (eg. partitions
+ * or logical volumes of one disk) or on rotational disks behind the
+ * same controller.  Disks in different groups can be read in parallel.
+ *
+ * Sets C<groups[i]> to the group number of C<disks[i]> (numbered from
+ * C<0> in the order of the disks), and C<rotational[i]> if the disk is
+ * on a rotational device.  Disks which cannot be found in F</sys> are
+ * put in a group of their own.
+ *
+ * Returns the number of groups.
+ */
+size_t
+get_disk_groups (char * const *disks, size_t *groups, bool *rotational)
+{
+  return get_disk_groups_in ("/sys", disks, groups, rotational);
+}
+
+/**
+ * The same as C<get_disk_groups>, but look in C<sys> instead of
+ * F</sys>.
+ */
+size_t
+get_disk_groups_in (const char *sys, char * const *disks,
+                    size_t *groups, bool *rotational)
+{
+  const size_t nr_disks = guestfs_int_count_strings (disks);
+  CLEANUP_FREE size_t *parent = NULL, *number = NULL, *key_disk = NULL;
+  CLEANUP_FREE_STRING_LIST char **keys = NULL;
+  size_t nr_keys = 0, nr_groups = 0;
+  size_t i, j, k;
+
+  parent = calloc (nr_disks + 1, sizeof (size_t));
+  number = calloc (nr_disks + 1, sizeof (size_t));
+  keys = calloc (1, sizeof (char *));
+  if (parent == NULL || number == NULL || keys == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+
+  for (i = 0; i < nr_disks; ++i) {
+    CLEANUP_FREE char *dir = get_sysfs_dir (sys, disks[i]);
+    CLEANUP_FREE_STRING_LIST char **leaves = NULL;
+    size_t nr_leaves = 0;
+
+    parent[i] = i;
+    rotational[i] = false;
+    if (dir == NULL)
+      continue;
+
+    add_leaf_devices (dir, &leaves, &nr_leaves, 0);
+    for (j = 0; j < nr_leaves; ++j) {
+      bool rot;
+      char *key = get_device_key (leaves[j], &rot);
+
+      rotational[i] |= rot;
+
+      /* Join the group of any earlier disk with the same key. */
+      for (k = 0; k < nr_keys; ++k) {
+        if (STREQ (keys[k], key)) {
+          const size_t a = find_group (parent, i);
+          const size_t b = find_group (parent, key_disk[k]);
+
+          parent[MAX (a, b)] = MIN (a, b);
+        }
+      }
+
+      nr_keys++;
+      keys = realloc (keys, sizeof (char *) * (nr_keys + 1));
+      key_disk = realloc (key_disk, sizeof (size_t) * nr_keys);
+      if (keys == NULL || key_disk == NULL)
+        error (EXIT_FAILURE, errno, "realloc");
+      keys[nr_keys-1] = key;
+      keys[nr_keys] = NULL;
+      key_disk[nr_keys-1] = i;
+    }
+  }
+
+  /* Number the groups in the order of their first disk. */
+  for (i = 0; i < nr_disks; ++i) {
+    if (find_group (parent, i) == i)
+      number[i] = nr_groups++;
+  }
+  for (i = 0; i < nr_disks; ++i)
+    groups[i] = number[find_group (parent, i)];
+
+#if DEBUG_STDERR
+  for (i = 0; i < nr_disks; ++i)
+    fprintf (stderr, "%s: disk %s: group %zu%s\n",
+             g_get_prgname (), disks[i], groups[i],
+             rotational[i] ? " (rotational)" : "");
+#endif
+
+  return nr_groups;
+}
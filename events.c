@@ -0,0 +1,544 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Machine-readable event stream.
+ *
+ * When enabled (with S<C<virt-p2v --events=TARGET>> or
+ * S<C<p2v.events=TARGET>> on the kernel command line), every status
+ * change, remote log directory, remote message, progress update and
+ * error during a kernel mode conversion is also written to C<TARGET>
+ * as a single line of JSON (newline-delimited JSON).  This lets a
+ * fleet of conversions be monitored centrally without scraping the
+ * human-readable output from the console.
+ *
+ * Each event is formatted into a buffer and sent with a single
+ * L<write(2)> or L<send(2)>.  The target is written without blocking
+ * (it is put in non-blocking mode, and sockets are sent to with
+ * C<MSG_DONTWAIT>): if the receiver cannot keep up, events are
+ * dropped rather than holding up the conversion.  Dropped events can
+ * be detected from gaps in the C<seq> field, and the next event which
+ * is sent says how many were dropped.  If only part of an event could
+ * be sent, the rest is kept and sent before the next event, and new
+ * events are dropped until it has all gone.
+ *
+ * Messages are cut to C<MAX_MESSAGE> bytes, on a UTF-8 character
+ * boundary, so that one long line of output cannot hold up the
+ * stream.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+#include <pthread.h>
+
+#include "p2v.h"
+
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* All of these are protected by events_lock. */
+static int events_fd = -1;
+static int events_is_socket;
+static struct timespec events_origin;
+static unsigned long long events_seq;
+static double last_progress = -1;
+static unsigned long long events_dropped; /* Since the last event sent. */
+
+/* The event being formatted. */
+static char *buf;
+static size_t buf_len, buf_alloc;
+
+/* The rest of an event which was only partly sent. */
+static char *pending;
+static size_t pending_len;
+
+/* The longest message, in bytes, which is sent in an event. */
+#define MAX_MESSAGE 4096
+
+static int connect_tcp (const char *hostport);
+static int connect_unix (const char *path);
+
+/**
+ * Open the event stream.  C<target> is one of:
+ *
+ * =over 4
+ *
+ * =item C<fd:N>
+ *
+ * An already open file descriptor.
+ *
+ * =item C<tcp:HOST:PORT>
+ *
+ * A TCP connection to C<HOST> and C<PORT>.
+ *
+ * =item C<unix:PATH>
+ *
+ * A Unix domain (stream) socket.
+ *
+ * =item F</PATH>
+ *
+ * A file, which is appended to, or a device such as a serial port
+ * (eg. F</dev/ttyS1>).
+ *
+ * =back
+ *
+ * On error this returns C<-1> and sets C<errno>.  It is not an error
+ * to call this more than once, only the first call has any effect.
+ */
+int
+open_events (const char *target)
+{
+  int fd, flags;
+  struct stat statbuf;
+
+  if (events_enabled ())
+    return 0;
+
+  if (STRPREFIX (target, "fd:")) {
+    if (sscanf (target + 3, "%d", &fd) != 1 || fd < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    if (fcntl (fd, F_GETFD) == -1)
+      return -1;
+  }
+  else if (STRPREFIX (target, "tcp:"))
+    fd = connect_tcp (target + 4);
+  else if (STRPREFIX (target, "unix:"))
+    fd = connect_unix (target + 5);
+  else if (target[0] == '/')
+    fd = open (target,
+               O_WRONLY|O_CREAT|O_APPEND|O_NOCTTY|O_NONBLOCK|O_CLOEXEC,
+               0644);
+  else {
+    errno = EINVAL;
+    return -1;
+  }
+  if (fd == -1)
+    return -1;
+
+  /* Never block on a pipe, a terminal or a slow socket. */
+  flags = fcntl (fd, F_GETFL);
+  if (flags == -1 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    const int err = errno;
+
+    if (!STRPREFIX (target, "fd:"))
+      close (fd);
+    errno = err;
+    return -1;
+  }
+
+  pthread_mutex_lock (&events_lock);
+  events_fd = fd;
+  events_is_socket = fstat (fd, &statbuf) == 0 && S_ISSOCK (statbuf.st_mode);
+  clock_gettime (CLOCK_MONOTONIC, &events_origin);
+  pthread_mutex_unlock (&events_lock);
+
+  return 0;
+}
+
+/**
+ * Returns true if the event stream is open.
+ */
+int
+events_enabled (void)
+{
+  int r;
+
+  pthread_mutex_lock (&events_lock);
+  r = events_fd >= 0;
+  pthread_mutex_unlock (&events_lock);
+  return r;
+}
+
+static int
+connect_tcp (const char *hostport)
+{
+  CLEANUP_FREE char *host = NULL;
+  const char *port;
+  struct addrinfo hints, *ai, *a;
+  int fd = -1, err;
+
+  port = strrchr (hostport, ':');
+  if (port == NULL || port == hostport) {
+    errno = EINVAL;
+    return -1;
+  }
+  host = strndup (hostport, port - hostport);
+  if (host == NULL)
+    error (EXIT_FAILURE, errno, "strndup");
+  port++;
+
+  memset (&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  err = getaddrinfo (host, port, &hints, &ai);
+  if (err != 0) {
+    fprintf (stderr, "%s: getaddrinfo: %s: %s\n",
+             g_get_prgname (), hostport, gai_strerror (err));
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+
+  for (a = ai; a != NULL; a = a->ai_next) {
+    fd = socket (a->ai_family, a->ai_socktype|SOCK_CLOEXEC, a->ai_protocol);
+    if (fd == -1)
+      continue;
+    if (connect (fd, a->ai_addr, a->ai_addrlen) == 0)
+      break;
+    err = errno;
+    close (fd);
+    fd = -1;
+    errno = err;
+  }
+  freeaddrinfo (ai);
+
+  return fd;
+}
+
+static int
+connect_unix (const char *path)
+{
+  struct sockaddr_un addr;
+  int fd, err;
+
+  if (strlen (path) >= sizeof addr.sun_path) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  fd = socket (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  if (connect (fd, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    err = errno;
+    close (fd);
+    errno = err;
+    return -1;
+  }
+
+  return fd;
+}
+
+static void
+buf_add (const char *s, size_t n)
+{
+  if (buf_len + n + 1 > buf_alloc) {
+    buf_alloc = buf_alloc ? buf_alloc * 2 : 256;
+    while (buf_len + n + 1 > buf_alloc)
+      buf_alloc *= 2;
+    buf = realloc (buf, buf_alloc);
+    if (buf == NULL)
+      error (EXIT_FAILURE, errno, "realloc");
+  }
+  memcpy (&buf[buf_len], s, n);
+  buf_len += n;
+  buf[buf_len] = '\0';
+}
+
+static void __attribute__((format(printf,1,2)))
+buf_addf (const char *fs, ...)
+{
+  va_list args;
+  char tmp[128];
+  int r;
+
+  va_start (args, fs);
+  r = vsnprintf (tmp, sizeof tmp, fs, args);
+  va_end (args);
+  if (r < 0)
+    return;
+  if ((size_t) r >= sizeof tmp)
+    r = sizeof tmp - 1;
+  buf_add (tmp, r);
+}
+
+/* Add C<n> bytes of C<s> as a JSON string.  Control characters
+ * (including the ANSI colour sequences in remote messages) are
+ * escaped.
+ */
+static void
+buf_add_stringn (const char *s, size_t n)
+{
+  const char *run, *end = s + n;
+
+  buf_add ("\"", 1);
+  for (run = s; s < end; ++s) {
+    const unsigned char c = *s;
+
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    buf_add (run, s - run);
+    switch (c) {
+    case '"':  buf_add ("\\\"", 2); break;
+    case '\\': buf_add ("\\\\", 2); break;
+    case '\n': buf_add ("\\n", 2); break;
+    case '\r': buf_add ("\\r", 2); break;
+    case '\t': buf_add ("\\t", 2); break;
+    default:   buf_addf ("\\u%04x", c);
+    }
+    run = s + 1;
+  }
+  buf_add (run, s - run);
+  buf_add ("\"", 1);
+}
+
+static void
+buf_add_string (const char *s)
+{
+  buf_add_stringn (s, strlen (s));
+}
+
+/* Start an event.  Must be called with events_lock held. */
+static void
+begin_event (const char *event)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  buf_len = 0;
+  buf_addf ("{\"seq\":%llu,\"time\":%.6f,\"event\":",
+            events_seq++,
+            (now.tv_sec - events_origin.tv_sec) +
+            (now.tv_nsec - events_origin.tv_nsec) / 1e9);
+  buf_add_string (event);
+  if (events_dropped > 0)
+    buf_addf (",\"dropped\":%llu", events_dropped);
+}
+
+/* Send as much of C<p> as the receiver takes without blocking.
+ * Returns the number of bytes sent, or C<-1> on error.  Must be
+ * called with events_lock held.
+ */
+static ssize_t
+send_some (const char *p, size_t n)
+{
+  size_t sent = 0;
+  ssize_t r;
+
+  while (sent < n) {
+    if (events_is_socket)
+      r = send (events_fd, p + sent, n - sent, MSG_DONTWAIT|MSG_NOSIGNAL);
+    else
+      r = write (events_fd, p + sent, n - sent);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+    sent += r;
+  }
+  return sent;
+}
+
+/* Finish an event and send it, or drop it if the receiver is not
+ * keeping up.  Must be called with events_lock held.
+ */
+static void
+end_event (void)
+{
+  ssize_t r;
+
+  buf_add ("}\n", 2);
+
+  /* The rest of the last event goes first, or the stream would be
+   * left with half an event in it.
+   */
+  if (pending_len > 0) {
+    r = send_some (pending, pending_len);
+    if (r == -1)
+      goto error;
+    pending_len -= r;
+    memmove (pending, pending + r, pending_len);
+    if (pending_len > 0) {
+      events_dropped++;
+      return;
+    }
+  }
+
+  r = send_some (buf, buf_len);
+  if (r == -1)
+    goto error;
+  if (r == 0) {
+    events_dropped++;
+    return;
+  }
+  events_dropped = 0;
+  if ((size_t) r < buf_len) {
+    pending_len = buf_len - r;
+    pending = realloc (pending, pending_len);
+    if (pending == NULL)
+      error (EXIT_FAILURE, errno, "realloc");
+    memcpy (pending, buf + r, pending_len);
+  }
+  return;
+
+ error:
+  fprintf (stderr, "%s: warning: event stream: %m (events disabled)\n",
+           g_get_prgname ());
+  close (events_fd);
+  events_fd = -1;
+  pending_len = 0;
+}
+
+/**
+ * Send an event with a C<message> field.  C<message> may be C<NULL>.
+ */
+void
+emit_event (const char *event, const char *message)
+{
+  pthread_mutex_lock (&events_lock);
+  if (events_fd >= 0) {
+    begin_event (event);
+    if (message) {
+      size_t n = strlen (message);
+      const bool truncated = n > MAX_MESSAGE;
+
+      if (truncated) {
+        /* Don't cut a UTF-8 character in half. */
+        n = MAX_MESSAGE;
+        while (n > 0 && (message[n] & 0xc0) == 0x80)
+          n--;
+      }
+      buf_add (",\"message\":", 11);
+      buf_add_stringn (message, n);
+      if (truncated)
+        buf_add (",\"truncated\":true", 17);
+    }
+    end_event ();
+  }
+  pthread_mutex_unlock (&events_lock);
+}
+
+/**
+ * Send the C<start> event, which describes the conversion.
+ */
+void
+emit_start_event (const struct config *config)
+{
+  struct timespec now;
+  size_t i;
+
+  pthread_mutex_lock (&events_lock);
+  if (events_fd >= 0) {
+    clock_gettime (CLOCK_REALTIME, &now);
+    begin_event ("start");
+    buf_add (",\"version\":", 11);
+    buf_add_string (PACKAGE_VERSION_FULL);
+    buf_addf (",\"pid\":%d,\"wallclock\":%lld.%06ld",
+              (int) getpid (), (long long) now.tv_sec, now.tv_nsec / 1000);
+    if (config->guestname) {
+      buf_add (",\"name\":", 8);
+      buf_add_string (config->guestname);
+    }
+    if (config->remote.server) {
+      buf_add (",\"server\":", 10);
+      buf_add_string (config->remote.server);
+    }
+    buf_add (",\"disks\":[", 10);
+    for (i = 0; config->disks && config->disks[i] != NULL; ++i) {
+      if (i > 0)
+        buf_add (",", 1);
+      buf_add_string (config->disks[i]);
+    }
+    buf_add ("]", 1);
+    end_event ();
+  }
+  pthread_mutex_unlock (&events_lock);
+}
+
+/* Find the last virt-v2v progress bar in a remote message, which
+ * looks like C<(12.34/100%)>, and return the percentage, or -1 if
+ * there is none.
+ */
+static double
+find_progress (const char *msg)
+{
+  const char *p;
+  double percent = -1, d;
+  int n;
+
+  for (p = strchr (msg, '('); p != NULL; p = strchr (p + 1, '(')) {
+    n = 0;
+    if (sscanf (p, "(%lf/100%%)%n", &d, &n) == 1 && n > 0 &&
+        d >= 0 && d <= 100)
+      percent = d;
+  }
+  return percent;
+}
+
+/**
+ * Send the event corresponding to a C<notify_ui> callback (see
+ * C<start_conversion>).  Progress bars in the remote messages are
+ * also sent as C<progress> events.
+ */
+void
+emit_notify_event (int type, const char *data)
+{
+  double percent;
+
+  if (!events_enabled ())
+    return;
+
+  switch (type) {
+  case NOTIFY_LOG_DIR:
+    emit_event ("log_dir", data);
+    break;
+
+  case NOTIFY_REMOTE_MESSAGE:
+    emit_event ("remote", data);
+    percent = find_progress (data);
+    if (percent >= 0) {
+      pthread_mutex_lock (&events_lock);
+      if (events_fd >= 0 && percent != last_progress) {
+        last_progress = percent;
+        begin_event ("progress");
+        buf_addf (",\"percent\":%.2f", percent);
+        end_event ();
+      }
+      pthread_mutex_unlock (&events_lock);
+    }
+    break;
+
+  case NOTIFY_STATUS:
+    emit_event ("status", data);
+    break;
+
+  default:
+    emit_event ("unknown", data);
+  }
+}
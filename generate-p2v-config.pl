@@ -82,6 +82,11 @@ my @enums = (
     ["OUTPUT_ALLOCATION_SPARSE",       "sparse",       "sparse"],
     ["OUTPUT_ALLOCATION_PREALLOCATED", "preallocated", "preallocated"],
   )],
+  ["transfer_mode", (
+    ["TRANSFER_MODE_DIRECT", "direct", "virt-v2v reads the disks over NBD"],
+    ["TRANSFER_MODE_STAGED", "staged", "copy the disks first, then convert"],
+    ["TRANSFER_MODE_PRECOPY", "precopy", "only copy the disks, do not convert"],
+  )],
 );
 
 # Configuration fields.
@@ -150,6 +155,26 @@ my @fields = [
       ConfigStringList->new(name => 'misc'),
     ],
   ),
+  ConfigSection->new(
+    name => 'benchmark',
+    elements => [
+      ConfigBool->new(name => 'network'),
+      ConfigBool->new(name => 'disks'),
+    ],
+  ),
+  ConfigSection->new(
+    name => 'transfer',
+    elements => [
+      ConfigEnum->new(name => 'mode', enum => 'transfer_mode'),
+      ConfigInt->new(name => 'streams', value => 0),
+      ConfigBool->new(name => 'compress'),
+      ConfigBool->new(name => 'resume'),
+      ConfigString->new(name => 'stage_dir'),
+      ConfigString->new(name => 'base_dir'),
+      ConfigBool->new(name => 'dedup'),
+      ConfigBool->new(name => 'verify'),
+    ],
+  ),
 ];
 
 # Some /proc/cmdline p2v.* options were renamed when we introduced
@@ -390,6 +415,89 @@ element in the list will be turned into a separate S<I<-oo
 OPTION=VALUE>> option on the virt-v2v command line.  See
 L<virt-v2v(1)/OPTIONS>.",
   ),
+  "p2v.benchmark.network" => manual_entry->new(
+    shortopt => "", # ignored for booleans
+    description => "
+Measure the round trip time and the throughput of the connection to
+the conversion server before starting the conversion, and print the
+results together with an estimate of how long copying the disks will
+take.  See L</NETWORK BENCHMARK>.  Disabled by default.",
+  ),
+  "p2v.benchmark.disks" => manual_entry->new(
+    shortopt => "", # ignored for booleans
+    description => "
+Measure the read speed and latency of each disk before starting the
+conversion, and copy the results to the conversion server.  See
+L</DISK BENCHMARK>.  Disabled by default.",
+  ),
+  "p2v.transfer.mode" => manual_entry->new(
+    shortopt => "", # ignored for enums
+    description => "
+How the disks are transferred to the conversion server.  C<direct>
+(the default) means that virt-v2v reads the disks over the network
+while it converts the guest.  C<staged> means that the disks are first
+copied to the conversion server in parallel, and then virt-v2v converts
+the copies.  See L</TWO-PHASE CONVERSIONS>.  C<precopy> means that the
+disks are copied while the physical machine is still running, and not
+converted.  See L</PRE-COPYING A RUNNING MACHINE>.",
+  ),
+  "p2v.transfer.streams" => manual_entry->new(
+    shortopt => "N",
+    description => "
+The number of parallel network connections used to copy each disk
+when L</p2v.transfer.mode> is C<staged>.  The default (C<0>) lets
+virt-p2v change the number while the disks are copied, starting from
+a number based on the L</NETWORK BENCHMARK> if it was run, or C<4>
+otherwise.  See L</TWO-PHASE CONVERSIONS>.",
+  ),
+  "p2v.transfer.compress" => manual_entry->new(
+    shortopt => "", # ignored for booleans
+    description => "
+Compress the disk data sent over the network (using ssh compression).
+This is useful on slow networks, and when the disks have a lot of
+free space.  Disabled by default.",
+  ),
+  "p2v.transfer.resume" => manual_entry->new(
+    shortopt => "", # ignored for booleans
+    description => "
+Keep the staged copies of the disks (see L</p2v.transfer.mode>) if
+the conversion fails or is interrupted, so that running virt-p2v
+again only copies the parts of the disks which are not on the
+conversion server already.  This implies C<p2v.transfer.mode=staged>.
+See L</RESUMABLE CONVERSIONS>.  Disabled by default.",
+  ),
+  "p2v.transfer.stage_dir" => manual_entry->new(
+    shortopt => "DIR",
+    description => "
+The directory on the conversion server where the disks are staged when
+L</p2v.transfer.mode> is C<staged>.
+
+If not specified, the default is F</var/tmp/virt-p2v-stage>.",
+  ),
+  "p2v.transfer.base_dir" => manual_entry->new(
+    shortopt => "DIR",
+    description => "
+A directory on the conversion server containing base images (raw disk
+images that the physical machines were installed from).  Chunks of the
+disks which are the same as a chunk of a base image are copied from
+the base image on the conversion server instead of over the network.
+This implies staged transfers.  See L</BASE IMAGES>.",
+  ),
+  "p2v.transfer.dedup" => manual_entry->new(
+    shortopt => "", # ignored for booleans
+    description => "
+Compare the chunks of all the disks before they are copied, and only
+send each different chunk once.  This implies staged transfers.  See
+L</DEDUPLICATION>.  Disabled by default.",
+  ),
+  "p2v.transfer.verify" => manual_entry->new(
+    shortopt => "", # ignored for booleans
+    description => "
+After the disks are copied, read the copies on the conversion server
+again and compare them with the checksums of the physical disks, before
+virt-v2v converts them.  This implies staged transfers.  See
+L</VERIFYING THE COPIED DISKS>.  Disabled by default.",
+  ),
 );
 
 # Clean up the program name.
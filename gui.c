@@ -108,6 +108,7 @@ static void set_info_label (void);
 static GtkWidget *conn_dlg,
   *server_entry, *port_entry,
   *username_entry, *password_entry, *identity_entry, *sudo_button,
+  *benchmark_button,
   *spinner_hbox,
   *spinner,
   *spinner_message, *next_button;
@@ -117,8 +118,21 @@ static GtkWidget *conv_dlg,
   *guestname_entry, *vcpu_topo, *vcpus_entry, *memory_entry,
   *vcpus_warning, *memory_warning, *target_warning_label,
   *o_combo, *oc_entry, *os_entry, *of_entry, *oa_combo, *oo_entry,
-  *info_label,
-  *disks_list, *removable_list, *interfaces_list;
+  *transfer_combo, *streams_entry, *compress_button, *resume_button,
+  *dedup_button, *verify_button, *info_label,
+  *disks_list, *removable_list, *interfaces_list,
+  *benchmark_disks_button;
+
+/* True if the conversion dialog is being shown to change the output
+ * options of a failed conversion (main thread only).
+ */
+static int retrying;
+
+/* Parts of the conversion dialog which cannot be changed when
+ * retrying a failed conversion.
+ */
+static GtkWidget *target_frame, *transfer_frame, *devices_vbox,
+  *back_button, *refresh_disks_button;
 static int vcpus_entry_when_last_sensitive;
 
 /* The running dialog which is displayed when virt-v2v is running. */
@@ -147,6 +161,8 @@ gui_conversion (struct config *config,
   /* Start by displaying the connection dialog. */
   show_connection_dialog ();
 
+  startup_ready ();
+
   gtk_main ();
 }
 
@@ -220,7 +236,7 @@ create_connection_dialog (struct config *config)
   gtk_label_set_line_wrap (GTK_LABEL (intro), TRUE);
   set_padding (intro, 10, 10);
 
-  table_new (table, 5, 2);
+  table_new (table, 6, 2);
   row = 0;
   server_label = gtk_label_new_with_mnemonic (_("Conversion _server:"));
   table_attach (table, server_label,
@@ -292,6 +308,14 @@ create_connection_dialog (struct config *config)
   table_attach (table, sudo_button,
                 1, 2, row, GTK_FILL, GTK_FILL, 4, 4);
 
+  row++;
+  benchmark_button =
+    gtk_check_button_new_with_mnemonic (_("_Measure the network speed"));
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (benchmark_button),
+                                config->benchmark.network);
+  table_attach (table, benchmark_button,
+                1, 2, row, GTK_FILL, GTK_FILL, 4, 4);
+
   hbox_new (test_hbox, FALSE, 0);
   test = gtk_button_new_with_mnemonic (_("_Test connection"));
   gtk_box_pack_start (GTK_BOX (test_hbox), test, TRUE, FALSE, 0);
@@ -483,6 +507,7 @@ test_connection_clicked (GtkWidget *w, gpointer data)
   config->auth.identity.file_needs_update = 1;
 
   config->auth.sudo = tgl_btn_is_act (sudo_button);
+  config->benchmark.network = tgl_btn_is_act (benchmark_button);
 
   if (errors)
     return;
@@ -495,6 +520,7 @@ test_connection_clicked (GtkWidget *w, gpointer data)
   /* No errors so far, so test the connection in a background thread. */
   pthread_attr_init (&attr);
   pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  init_thread_affinity (&attr);
   err = pthread_create (&tid, &attr, test_connection_thread, copy);
   if (err != 0)
     error (EXIT_FAILURE, err, "pthread_create");
@@ -512,20 +538,29 @@ static void *
 test_connection_thread (void *data)
 {
   struct config *copy = data;
+  char *benchmark = NULL;
   int r;
 
   g_idle_add (start_spinner, NULL);
 
   wait_network_online (copy);
   r = test_connection (copy);
+  if (r == 0 && copy->benchmark.network)
+    benchmark = format_network_benchmark (copy);
   free_config (copy);
 
   g_idle_add (stop_spinner, NULL);
 
-  if (r == -1)
-    g_idle_add (test_connection_error, NULL);
+  if (r == -1) {
+    /* The error is only visible to this thread. */
+    char *err = strdup (get_ssh_error () ? : "");
+
+    if (err == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    g_idle_add (test_connection_error, err);
+  }
   else
-    g_idle_add (test_connection_ok, NULL);
+    g_idle_add (test_connection_ok, benchmark);
 
   /* Thread is detached anyway, so no one is waiting for the status. */
   return NULL;
@@ -561,11 +596,13 @@ stop_spinner (gpointer user_data)
  * Idle task called from C<test_connection_thread> (but run on the
  * main thread) when there is an error.  Display the error message and
  * disable the C<Next> button so the user is forced to correct it.
+ *
+ * C<user_data> is a copy of the error message.  It is freed here.
  */
 static gboolean
 test_connection_error (gpointer user_data)
 {
-  const char *err = get_ssh_error ();
+  CLEANUP_FREE char *err = user_data;
 
   gtk_label_set_text (GTK_LABEL (spinner_message), err);
   /* Disable the Next button. */
@@ -577,14 +614,27 @@ test_connection_error (gpointer user_data)
 /**
  * Idle task called from C<test_connection_thread> (but run on the
  * main thread) when the connection test was successful.
+ *
+ * C<user_data> is the formatted result of the network benchmark, or
+ * C<NULL> if it was not run.  It is freed here.
  */
 static gboolean
 test_connection_ok (gpointer user_data)
 {
-  gtk_label_set_text
-    (GTK_LABEL (spinner_message),
-     _("Connected to the conversion server.\n"
-       "Press the \"Next\" button to configure the conversion process."));
+  CLEANUP_FREE char *benchmark = user_data;
+  const char *msg =
+    _("Connected to the conversion server.\n"
+      "Press the \"Next\" button to configure the conversion process.");
+
+  if (benchmark) {
+    CLEANUP_FREE char *text = NULL;
+
+    if (asprintf (&text, "%s\n\n%s", msg, benchmark) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    gtk_label_set_text (GTK_LABEL (spinner_message), text);
+  }
+  else
+    gtk_label_set_text (GTK_LABEL (spinner_message), msg);
 
   /* Enable the Next button. */
   gtk_widget_set_sensitive (next_button, TRUE);
@@ -690,12 +740,18 @@ static void set_removable_from_ui (struct config *);
 static void set_interfaces_from_ui (struct config *);
 static void conversion_back_clicked (GtkWidget *w, gpointer data);
 static void refresh_disks_clicked (GtkWidget *w, gpointer data);
+static void benchmark_disks_clicked (GtkWidget *w, gpointer data);
 static void start_conversion_clicked (GtkWidget *w, gpointer data);
 static void vcpu_topo_toggled (GtkWidget *w, gpointer data);
 static void vcpus_or_memory_check_callback (GtkWidget *w, gpointer data);
 static void notify_ui_callback (int type, const char *data);
+static void transfer_mode_changed (GtkWidget *w, gpointer data);
 static int get_vcpus_from_conv_dlg (void);
 static uint64_t get_memory_from_conv_dlg (void);
+static gboolean close_conversion_dialog (GtkWidget *w,
+                                         GdkEvent *event,
+                                         gpointer data);
+static void abandon_retry_conversion (void);
 
 enum {
   DISKS_COL_CONVERT = 0,
@@ -729,18 +785,21 @@ create_conversion_dialog (struct config *config,
                           const char * const *disks,
                           const char * const *removable)
 {
-  GtkWidget *back, *refresh_disks, *start_button;
-  GtkWidget *hbox, *left_vbox, *right_vbox;
-  GtkWidget *target_frame, *target_vbox, *target_tbl;
+  GtkWidget *start_button;
+  GtkWidget *hbox, *left_vbox;
+  GtkWidget *target_vbox, *target_tbl;
   GtkWidget *guestname_label, *vcpus_label, *memory_label;
   GtkWidget *output_frame, *output_vbox, *output_tbl;
   GtkWidget *o_label, *oa_label, *oc_label, *of_label, *os_label, *oo_label;
+  GtkWidget *transfer_vbox, *transfer_tbl;
+  GtkWidget *transfer_label, *streams_label;
   GtkWidget *info_frame;
   GtkWidget *disks_frame, *disks_sw;
   GtkWidget *removable_frame, *removable_sw;
   GtkWidget *interfaces_frame, *interfaces_sw;
   char vcpus_str[64];
   char memory_str[64];
+  char streams_str[64];
   int row;
 
   conv_dlg = gtk_dialog_new ();
@@ -754,7 +813,7 @@ create_conversion_dialog (struct config *config,
   /* The main dialog area. */
   hbox_new (hbox, TRUE, 1);
   vbox_new (left_vbox, FALSE, 1);
-  vbox_new (right_vbox, TRUE, 1);
+  vbox_new (devices_vbox, TRUE, 1);
 
   /* The left column: target properties and output options. */
   target_frame = gtk_frame_new (_("Target properties"));
@@ -955,6 +1014,111 @@ create_conversion_dialog (struct config *config,
   gtk_box_pack_start (GTK_BOX (output_vbox), output_tbl, TRUE, TRUE, 0);
   gtk_container_add (GTK_CONTAINER (output_frame), output_vbox);
 
+  transfer_frame = gtk_frame_new (_("Disk transfer"));
+  gtk_container_set_border_width (GTK_CONTAINER (transfer_frame), 4);
+
+  vbox_new (transfer_vbox, FALSE, 1);
+
+  table_new (transfer_tbl, 4, 2);
+  row = 0;
+  transfer_label = gtk_label_new_with_mnemonic (_("Transf_er mode:"));
+  table_attach (transfer_tbl, transfer_label,
+                0, 1, row, GTK_FILL, GTK_FILL, 1, 1);
+  set_alignment (transfer_label, 1., 0.5);
+  transfer_combo = gtk_combo_box_text_new ();
+  gtk_label_set_mnemonic_widget (GTK_LABEL (transfer_label), transfer_combo);
+  gtk_widget_set_tooltip_markup (transfer_combo,
+                                 _("<b>direct</b> means virt-v2v reads the "
+                                   "disks over the network while it converts "
+                                   "the guest.  "
+                                   "<b>staged</b> means the disks are first "
+                                   "copied to the conversion server using "
+                                   "several connections in parallel, and then "
+                                   "virt-v2v converts the copies.  "
+                                   "<b>precopy</b> (not available when booted "
+                                   "from the virt-p2v ISO) copies the disks "
+                                   "while this machine is running, without "
+                                   "converting it."));
+  gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (transfer_combo),
+                                  "direct");
+  gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (transfer_combo),
+                                  "staged");
+  if (!is_iso_environment)
+    gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (transfer_combo),
+                                    "precopy");
+  if (config->transfer.mode == TRANSFER_MODE_PRECOPY && !is_iso_environment)
+    gtk_combo_box_set_active (GTK_COMBO_BOX (transfer_combo), 2);
+  else
+    gtk_combo_box_set_active (GTK_COMBO_BOX (transfer_combo),
+                              is_staged_transfer (config) ? 1 : 0);
+  table_attach (transfer_tbl, transfer_combo,
+                1, 2, row, GTK_FILL, GTK_FILL, 1, 1);
+
+  row++;
+  streams_label = gtk_label_new_with_mnemonic (_("Paralle_l streams:"));
+  table_attach (transfer_tbl, streams_label,
+                0, 1, row, GTK_FILL, GTK_FILL, 1, 1);
+  set_alignment (streams_label, 1., 0.5);
+  streams_entry = gtk_entry_new ();
+  gtk_label_set_mnemonic_widget (GTK_LABEL (streams_label), streams_entry);
+  gtk_widget_set_tooltip_markup (streams_entry,
+                                 _("For <b>staged</b> only, the number of "
+                                   "connections used to copy each disk.  "
+                                   "<b>0</b> means adjust the number while "
+                                   "copying, starting from the result of "
+                                   "the network benchmark, if it was run."));
+  snprintf (streams_str, sizeof streams_str, "%d", config->transfer.streams);
+  gtk_entry_set_text (GTK_ENTRY (streams_entry), streams_str);
+  table_attach (transfer_tbl, streams_entry,
+                1, 2, row, GTK_FILL, GTK_FILL, 1, 1);
+
+  row++;
+  compress_button =
+    gtk_check_button_new_with_mnemonic (_("Compress data over the net_work"));
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (compress_button),
+                                config->transfer.compress);
+  table_attach (transfer_tbl, compress_button,
+                1, 2, row, GTK_FILL, GTK_FILL, 1, 1);
+
+  row++;
+  resume_button =
+    gtk_check_button_new_with_mnemonic (_("Keep staged disks to res_ume "
+                                          "a failed conversion"));
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (resume_button),
+                                config->transfer.resume);
+  table_attach (transfer_tbl, resume_button,
+                1, 2, row, GTK_FILL, GTK_FILL, 1, 1);
+
+  row++;
+  dedup_button =
+    gtk_check_button_new_with_mnemonic (_("Send identical chunks "
+                                          "only _once"));
+  gtk_widget_set_tooltip_markup (dedup_button,
+                                 _("For <b>staged</b> only, read all of the "
+                                   "disks first to find the data which "
+                                   "appears more than once, for example "
+                                   "on mirrored disks."));
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (dedup_button),
+                                config->transfer.dedup);
+  table_attach (transfer_tbl, dedup_button,
+                1, 2, row, GTK_FILL, GTK_FILL, 1, 1);
+
+  row++;
+  verify_button =
+    gtk_check_button_new_with_mnemonic (_("_Verify the copied disks"));
+  gtk_widget_set_tooltip_markup (verify_button,
+                                 _("For <b>staged</b> only, compare the "
+                                   "copies of the disks on the conversion "
+                                   "server with the physical disks before "
+                                   "converting them."));
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (verify_button),
+                                config->transfer.verify);
+  table_attach (transfer_tbl, verify_button,
+                1, 2, row, GTK_FILL, GTK_FILL, 1, 1);
+
+  gtk_box_pack_start (GTK_BOX (transfer_vbox), transfer_tbl, TRUE, TRUE, 0);
+  gtk_container_add (GTK_CONTAINER (transfer_frame), transfer_vbox);
+
   info_frame = gtk_frame_new (_("Information"));
   gtk_container_set_border_width (GTK_CONTAINER (info_frame), 4);
   info_label = gtk_label_new (NULL);
@@ -1005,14 +1169,15 @@ create_conversion_dialog (struct config *config,
   /* Pack the top level dialog. */
   gtk_box_pack_start (GTK_BOX (left_vbox), target_frame, TRUE, TRUE, 0);
   gtk_box_pack_start (GTK_BOX (left_vbox), output_frame, TRUE, TRUE, 0);
+  gtk_box_pack_start (GTK_BOX (left_vbox), transfer_frame, TRUE, TRUE, 0);
   gtk_box_pack_start (GTK_BOX (left_vbox), info_frame, TRUE, TRUE, 0);
 
-  gtk_box_pack_start (GTK_BOX (right_vbox), disks_frame, TRUE, TRUE, 0);
-  gtk_box_pack_start (GTK_BOX (right_vbox), removable_frame, TRUE, TRUE, 0);
-  gtk_box_pack_start (GTK_BOX (right_vbox), interfaces_frame, TRUE, TRUE, 0);
+  gtk_box_pack_start (GTK_BOX (devices_vbox), disks_frame, TRUE, TRUE, 0);
+  gtk_box_pack_start (GTK_BOX (devices_vbox), removable_frame, TRUE, TRUE, 0);
+  gtk_box_pack_start (GTK_BOX (devices_vbox), interfaces_frame, TRUE, TRUE, 0);
 
   gtk_box_pack_start (GTK_BOX (hbox), left_vbox, TRUE, TRUE, 0);
-  gtk_box_pack_start (GTK_BOX (hbox), right_vbox, TRUE, TRUE, 0);
+  gtk_box_pack_start (GTK_BOX (hbox), devices_vbox, TRUE, TRUE, 0);
   gtk_box_pack_start
     (GTK_BOX (gtk_dialog_get_content_area (GTK_DIALOG (conv_dlg))),
      hbox, TRUE, TRUE, 0);
@@ -1021,10 +1186,14 @@ create_conversion_dialog (struct config *config,
   gtk_dialog_add_buttons (GTK_DIALOG (conv_dlg),
                           _("_Back"), 1,
                           _("_Refresh disks (will reset selection)"), 2,
+                          _("Benchmark _disks"), 4,
                           _("Start _conversion"), 3,
                           NULL);
-  back = gtk_dialog_get_widget_for_response (GTK_DIALOG (conv_dlg), 1);
-  refresh_disks = gtk_dialog_get_widget_for_response (GTK_DIALOG (conv_dlg), 2);
+  back_button = gtk_dialog_get_widget_for_response (GTK_DIALOG (conv_dlg), 1);
+  refresh_disks_button =
+    gtk_dialog_get_widget_for_response (GTK_DIALOG (conv_dlg), 2);
+  benchmark_disks_button =
+    gtk_dialog_get_widget_for_response (GTK_DIALOG (conv_dlg), 4);
   start_button = gtk_dialog_get_widget_for_response (GTK_DIALOG (conv_dlg), 3);
 
   /* Disable disk refreshing in case --test-disk was passed. */
@@ -1032,15 +1201,19 @@ create_conversion_dialog (struct config *config,
       disks[0] != NULL &&
       disks[0][0] == '/' &&
       disks[1] == NULL)
-    gtk_widget_set_sensitive (refresh_disks, FALSE);
+    gtk_widget_set_sensitive (refresh_disks_button, FALSE);
 
   /* Signals. */
+  g_signal_connect_swapped (G_OBJECT (conv_dlg), "delete_event",
+                            G_CALLBACK (close_conversion_dialog), NULL);
   g_signal_connect_swapped (G_OBJECT (conv_dlg), "destroy",
                             G_CALLBACK (gtk_main_quit), NULL);
-  g_signal_connect (G_OBJECT (back), "clicked",
+  g_signal_connect (G_OBJECT (back_button), "clicked",
                     G_CALLBACK (conversion_back_clicked), NULL);
-  g_signal_connect (G_OBJECT (refresh_disks), "clicked",
+  g_signal_connect (G_OBJECT (refresh_disks_button), "clicked",
                     G_CALLBACK (refresh_disks_clicked), NULL);
+  g_signal_connect (G_OBJECT (benchmark_disks_button), "clicked",
+                    G_CALLBACK (benchmark_disks_clicked), NULL);
   g_signal_connect (G_OBJECT (start_button), "clicked",
                     G_CALLBACK (start_conversion_clicked), config);
   g_signal_connect (G_OBJECT (vcpu_topo), "toggled",
@@ -1049,6 +1222,25 @@ create_conversion_dialog (struct config *config,
                     G_CALLBACK (vcpus_or_memory_check_callback), NULL);
   g_signal_connect (G_OBJECT (memory_entry), "changed",
                     G_CALLBACK (vcpus_or_memory_check_callback), NULL);
+  g_signal_connect (G_OBJECT (transfer_combo), "changed",
+                    G_CALLBACK (transfer_mode_changed), NULL);
+  transfer_mode_changed (transfer_combo, NULL);
+}
+
+/**
+ * This is called if the user tries to close the conversion dialog.
+ * If it was shown again to change the output options of a failed
+ * conversion, the conversion thread is told not to retry, and the
+ * running dialog is shown again.  Otherwise the dialog is deleted.
+ */
+static gboolean
+close_conversion_dialog (GtkWidget *w, GdkEvent *event, gpointer data)
+{
+  if (retrying) {
+    abandon_retry_conversion ();
+    return TRUE;
+  }
+  return FALSE;
 }
 
 /**
@@ -1151,6 +1343,50 @@ repopulate_output_combo (struct config *config)
   }
 }
 
+/**
+ * Return the markup describing C<disk> in the C<Fixed hard disks>
+ * treeview.  This includes the result of the disk benchmark if it
+ * has been run, or a note if it is C<running>.
+ */
+static char *
+disk_description (const char *disk, int running)
+{
+  uint64_t size;
+  CLEANUP_FREE char *size_gb = NULL;
+  CLEANUP_FREE char *model = NULL;
+  CLEANUP_FREE char *serial = NULL;
+  CLEANUP_FREE char *benchmark = NULL;
+  char *device_descr;
+
+  if (disk[0] != '/') { /* not using --test-disk */
+    size = get_blockdev_size (disk);
+    if (asprintf (&size_gb, "%" PRIu64 "G", size) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    model = get_blockdev_model (disk);
+    serial = get_blockdev_serial (disk);
+  }
+
+  if (running)
+    benchmark = strdup (_("Benchmarking ..."));
+  else
+    benchmark = get_disk_benchmark (disk);
+
+  if (asprintf (&device_descr,
+                "<b>%s</b>\n"
+                "<small>"
+                "%s %s\n"
+                "%s%s"
+                "%s%s"
+                "</small>",
+                disk,
+                size_gb ? size_gb : "", model ? model : "",
+                serial ? "s/n " : "", serial ? serial : "",
+                benchmark ? "\n" : "", benchmark ? benchmark : "") == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+
+  return device_descr;
+}
+
 /**
  * Populate the C<Fixed hard disks> treeview.
  */
@@ -1163,32 +1399,9 @@ populate_disks_store (GtkListStore *disks_store, const char * const *disks)
     return;
 
   for (i = 0; disks[i] != NULL; ++i) {
-    uint64_t size;
-    CLEANUP_FREE char *size_gb = NULL;
-    CLEANUP_FREE char *model = NULL;
-    CLEANUP_FREE char *serial = NULL;
-    CLEANUP_FREE char *device_descr = NULL;
+    CLEANUP_FREE char *device_descr = disk_description (disks[i], 0);
     GtkTreeIter iter;
 
-    if (disks[i][0] != '/') { /* not using --test-disk */
-      size = get_blockdev_size (disks[i]);
-      if (asprintf (&size_gb, "%" PRIu64 "G", size) == -1)
-        error (EXIT_FAILURE, errno, "asprintf");
-      model = get_blockdev_model (disks[i]);
-      serial = get_blockdev_serial (disks[i]);
-    }
-
-    if (asprintf (&device_descr,
-                  "<b>%s</b>\n"
-                  "<small>"
-                  "%s %s\n"
-                  "%s%s"
-                  "</small>",
-                  disks[i],
-                  size_gb ? size_gb : "", model ? model : "",
-                  serial ? "s/n " : "", serial ? serial : "") == -1)
-      error (EXIT_FAILURE, errno, "asprintf");
-
     gtk_list_store_append (disks_store, &iter);
     gtk_list_store_set (disks_store, &iter,
                         DISKS_COL_CONVERT, TRUE,
@@ -1659,6 +1872,14 @@ set_network_map_from_ui (struct config *config)
 static void
 conversion_back_clicked (GtkWidget *w, gpointer data)
 {
+  /* When changing the output options of a failed conversion, this
+   * goes back to the running dialog instead.
+   */
+  if (retrying) {
+    abandon_retry_conversion ();
+    return;
+  }
+
   /* Switch to the connection dialog. */
   show_connection_dialog ();
 
@@ -1692,6 +1913,123 @@ refresh_disks_clicked (GtkWidget *w, gpointer data)
   guestfs_int_free_string_list (disks);
 }
 
+struct disk_benchmark_update {
+  char *disk;
+  int running;
+};
+
+/**
+ * Idle task called from C<benchmark_disks_thread> (but run on the
+ * main thread) to update the description of a disk.
+ */
+static gboolean
+update_disk_description (gpointer user_data)
+{
+  struct disk_benchmark_update *update = user_data;
+  GtkTreeModel *model;
+  GtkTreeIter iter;
+  gboolean avail;
+
+  model = gtk_tree_view_get_model (GTK_TREE_VIEW (disks_list));
+  avail = gtk_tree_model_get_iter_first (model, &iter);
+  while (avail) {
+    gchar *hw_name;
+
+    gtk_tree_model_get (model, &iter, DISKS_COL_HW_NAME, &hw_name, -1);
+    if (hw_name && STREQ (hw_name, update->disk)) {
+      CLEANUP_FREE char *device_descr =
+        disk_description (update->disk, update->running);
+
+      gtk_list_store_set (GTK_LIST_STORE (model), &iter,
+                          DISKS_COL_DEVICE, device_descr, -1);
+    }
+    g_free (hw_name);
+    avail = gtk_tree_model_iter_next (model, &iter);
+  }
+
+  free (update->disk);
+  free (update);
+  return FALSE;
+}
+
+static void
+queue_disk_description_update (const char *disk, int running)
+{
+  struct disk_benchmark_update *update;
+
+  update = malloc (sizeof *update);
+  if (update == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  update->disk = strdup (disk);
+  if (update->disk == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  update->running = running;
+  g_idle_add (update_disk_description, update);
+}
+
+/**
+ * Idle task called from C<benchmark_disks_thread> (but run on the
+ * main thread) when all the disks have been benchmarked.
+ */
+static gboolean
+benchmark_disks_done (gpointer user_data)
+{
+  gtk_widget_set_sensitive (benchmark_disks_button, TRUE);
+  return FALSE;
+}
+
+/**
+ * Benchmark the disks in C<data> one at a time (in a detached
+ * background thread), updating the disk list as each finishes.
+ */
+static void *
+benchmark_disks_thread (void *data)
+{
+  char **disks = data;
+  size_t i;
+
+  for (i = 0; disks[i] != NULL; ++i) {
+    queue_disk_description_update (disks[i], 1);
+    benchmark_disk (disks[i]);
+    queue_disk_description_update (disks[i], 0);
+  }
+  guestfs_int_free_string_list (disks);
+
+  g_idle_add (benchmark_disks_done, NULL);
+  return NULL;
+}
+
+/**
+ * Callback from the C<Benchmark disks> button.  Only the disks which
+ * are selected for conversion are benchmarked.  The results are
+ * shown in the disk list, and copied to the conversion server when
+ * the conversion starts.
+ */
+static void
+benchmark_disks_clicked (GtkWidget *w, gpointer data)
+{
+  char **disks = NULL;
+  pthread_attr_t attr;
+  pthread_t tid;
+  int err;
+
+  set_from_ui_generic (&disks, GTK_TREE_VIEW (disks_list));
+  if (disks == NULL || disks[0] == NULL) {
+    guestfs_int_free_string_list (disks);
+    return;
+  }
+
+  gtk_widget_set_sensitive (benchmark_disks_button, FALSE);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  init_thread_affinity (&attr);
+  err = pthread_create (&tid, &attr, benchmark_disks_thread, disks);
+  if (err != 0)
+    error (EXIT_FAILURE, err, "pthread_create");
+  pthread_attr_destroy (&attr);
+}
+
 static char *concat_warning (char *warning, const char *fs, ...)
   __attribute__((format (printf,2,3)));
 
@@ -1799,6 +2137,35 @@ vcpus_or_memory_check_callback (GtkWidget *w, gpointer data)
     gtk_label_set_text (GTK_LABEL (target_warning_label), "");
 }
 
+/**
+ * The number of streams, resuming, deduplication and verification
+ * only apply to staged transfers.
+ */
+static void
+transfer_mode_changed (GtkWidget *w, gpointer data)
+{
+  const gint active = gtk_combo_box_get_active (GTK_COMBO_BOX (transfer_combo));
+
+  gtk_widget_set_sensitive (streams_entry, active >= 1);
+  /* Pre-copies are always kept for the conversion. */
+  gtk_widget_set_sensitive (resume_button, active == 1);
+  gtk_widget_set_sensitive (dedup_button, active == 1);
+  gtk_widget_set_sensitive (verify_button, active == 1);
+}
+
+static int
+get_transfer_streams_from_conv_dlg (void)
+{
+  const char *str;
+  int i;
+
+  str = gtk_entry_get_text (GTK_ENTRY (streams_entry));
+  if (sscanf (str, "%d", &i) == 1 && i >= 0)
+    return i;
+  else
+    return 0;
+}
+
 static int
 get_vcpus_from_conv_dlg (void)
 {
@@ -1834,6 +2201,9 @@ static gboolean add_v2v_output (gpointer msg);
 static void *start_conversion_thread (void *data);
 static gboolean conversion_error (gpointer user_data);
 static gboolean conversion_finished (gpointer user_data);
+static int retry_conversion_callback (struct config *copy);
+static gboolean ask_retry_conversion (gpointer user_data);
+static void answer_retry_conversion (int answer, struct config *config);
 static void cancel_conversion_dialog (GtkWidget *w, gpointer data);
 static void activate_action (GSimpleAction *action,
                              GVariant *parameter,
@@ -1844,6 +2214,14 @@ static gboolean close_running_dialog (GtkWidget *w,
                                       GdkEvent *event,
                                       gpointer data);
 
+/* When virt-v2v fails, the conversion thread waits here while the
+ * user decides whether to retry it.
+ */
+static pthread_mutex_t retry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t retry_cond = PTHREAD_COND_INITIALIZER;
+static int retry_answer;        /* -1 until the user has answered */
+static struct config *retry_config; /* the new output options */
+
 static const GActionEntry shutdown_actions[] = {
   { .name = "shutdown", .activate = activate_action },
   { .name = "reboot", .activate = activate_action },
@@ -2018,11 +2396,37 @@ set_status (gpointer user_data)
   return FALSE;
 }
 
+static void
+v2v_output_text (void *bufv, const char *text, size_t len, int colour)
+{
+  GtkTextBuffer *buf = bufv;
+  GtkTextIter iter;
+
+  gtk_text_buffer_get_end_iter (buf, &iter);
+  gtk_text_buffer_insert_with_tags (buf, &iter, text, len,
+                                    colour >= 0 ? v2v_output_tags[colour] : NULL,
+                                    NULL);
+}
+
+static void
+v2v_output_delete_line (void *bufv)
+{
+  GtkTextBuffer *buf = bufv;
+  GtkTextIter iter, iter2;
+
+  gtk_text_buffer_get_end_iter (buf, &iter);
+  iter2 = iter;
+  gtk_text_iter_set_line_offset (&iter, 0);
+  /* Delete from iter..iter2 */
+  gtk_text_buffer_delete (buf, &iter, &iter2);
+}
+
 /**
  * Append output from the virt-v2v process to the buffer, and scroll
  * to ensure it is visible.
  *
- * This function is able to parse ANSI colour sequences and more.
+ * This function is able to parse ANSI colour sequences and more
+ * (see F<ansi-parser.c>).
  *
  * If this isn't called from the main thread, then you must only
  * call it via an idle task (C<g_idle_add>).
@@ -2034,107 +2438,17 @@ static gboolean
 add_v2v_output (gpointer user_data)
 {
   CLEANUP_FREE const char *msg = user_data;
-  const char *p;
-  static enum {
-    state_normal,
-    state_escape1,       /* seen ESC, expecting [ */
-    state_escape2,       /* seen ESC [, expecting 0 or 1 */
-    state_escape3,       /* seen ESC [ 0/1, expecting ; or m */
-    state_escape4,       /* seen ESC [ 0/1 ;, expecting 3 */
-    state_escape5,       /* seen ESC [ 0/1 ; 3, expecting 1/2/4/5 */
-    state_escape6,       /* seen ESC [ 0/1 ; 3 1/2/5/5, expecting m */
-    state_cr,            /* seen CR */
-  } state = state_normal;
-  static int colour = 0;
-  static GtkTextTag *tag = NULL;
+  static struct ansi_parser parser;
+  static bool parser_initialized = false;
   GtkTextBuffer *buf = gtk_text_view_get_buffer (GTK_TEXT_VIEW (v2v_output));
-  GtkTextIter iter, iter2;
-
-  for (p = msg; *p != '\0'; ++p) {
-    char c = *p;
-
-    switch (state) {
-    case state_normal:
-      if (c == '\r')            /* Start of possible CRLF sequence. */
-        state = state_cr;
-      else if (c == '\x1b') {   /* Start of an escape sequence. */
-        state = state_escape1;
-        colour = 0;
-      }
-      else {             /* Treat everything else as a normal char. */
-        gtk_text_buffer_get_end_iter (buf, &iter);
-        gtk_text_buffer_insert_with_tags (buf, &iter, &c, 1, tag, NULL);
-      }
-      break;
-
-    case state_escape1:
-      if (c == '[')
-        state = state_escape2;
-      else
-        state = state_normal;
-      break;
+  GtkTextIter iter;
 
-    case state_escape2:
-      if (c == '0')
-        state = state_escape3;
-      else if (c == '1') {
-        state = state_escape3;
-        colour += 8;
-      }
-      else
-        state = state_normal;
-      break;
-
-    case state_escape3:
-      if (c == ';')
-        state = state_escape4;
-      else if (c == 'm') {
-        tag = NULL;             /* restore text colour */
-        state = state_normal;
-      }
-      else
-        state = state_normal;
-      break;
-
-    case state_escape4:
-      if (c == '3')
-        state = state_escape5;
-      else
-        state = state_normal;
-      break;
-
-    case state_escape5:
-      if (c >= '0' && c <= '7') {
-        state = state_escape6;
-        colour += c - '0';
-      }
-      else
-        state = state_normal;
-      break;
-
-    case state_escape6:
-      if (c == 'm') {
-        assert (colour >= 0 && colour <= 15);
-        tag = v2v_output_tags[colour]; /* set colour tag */
-      }
-      state = state_normal;
-      break;
+  if (!parser_initialized) {
+    init_ansi_parser (&parser, v2v_output_text, v2v_output_delete_line, buf);
+    parser_initialized = true;
+  }
 
-    case state_cr:
-      if (c == '\n')
-        /* Process CRLF as single a newline character. */
-        p--;
-      else {                    /* Delete current (== last) line. */
-        gtk_text_buffer_get_end_iter (buf, &iter);
-        iter2 = iter;
-        gtk_text_iter_set_line_offset (&iter, 0);
-        /* Delete from iter..iter2 */
-        gtk_text_buffer_delete (buf, &iter, &iter2);
-      }
-      state = state_normal;
-      break;
-    } /* switch (state) */
-  } /* for */
+  ansi_parser_feed (&parser, msg);
 
   /* Scroll to the end of the buffer. */
   gtk_text_buffer_get_end_iter (buf, &iter);
@@ -2245,9 +2559,36 @@ start_conversion_clicked (GtkWidget *w, gpointer data)
   if (config->output.misc == NULL)
     error (EXIT_FAILURE, errno, "strdup");
 
+  /* Disk transfer. */
+  switch (gtk_combo_box_get_active (GTK_COMBO_BOX (transfer_combo))) {
+  case 1: config->transfer.mode = TRANSFER_MODE_STAGED; break;
+  case 2: config->transfer.mode = TRANSFER_MODE_PRECOPY; break;
+  default: config->transfer.mode = TRANSFER_MODE_DIRECT;
+  }
+  config->transfer.streams = get_transfer_streams_from_conv_dlg ();
+  config->transfer.compress = tgl_btn_is_act (compress_button);
+  config->transfer.resume =
+    config->transfer.mode == TRANSFER_MODE_STAGED &&
+    tgl_btn_is_act (resume_button);
+  config->transfer.dedup =
+    config->transfer.mode == TRANSFER_MODE_STAGED &&
+    tgl_btn_is_act (dedup_button);
+  config->transfer.verify =
+    config->transfer.mode == TRANSFER_MODE_STAGED &&
+    tgl_btn_is_act (verify_button);
+
   /* Display the UI for conversion. */
   show_running_dialog ();
 
+  /* If this is a retry, the conversion thread is already running and
+   * it only needs the new output options.
+   */
+  if (retrying) {
+    retrying = 0;
+    answer_retry_conversion (1, copy_config (config));
+    return;
+  }
+
   /* Do the conversion, in a background thread. */
 
   /* Give the conversion (background) thread its own copy of the
@@ -2255,8 +2596,14 @@ start_conversion_clicked (GtkWidget *w, gpointer data)
    */
   copy = copy_config (config);
 
+  /* Keep the user interface on a core of its own, away from the data
+   * connections.
+   */
+  set_ui_affinity ();
+
   pthread_attr_init (&attr);
   pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  init_thread_affinity (&attr);
   err = pthread_create (&tid, &attr, start_conversion_thread, copy);
   if (err != 0)
     error (EXIT_FAILURE, err, "pthread_create");
@@ -2270,15 +2617,16 @@ static void *
 start_conversion_thread (void *data)
 {
   struct config *copy = data;
+  const int precopy = copy->transfer.mode == TRANSFER_MODE_PRECOPY;
   int r;
 
-  r = start_conversion (copy, notify_ui_callback);
+  r = start_conversion (copy, notify_ui_callback, retry_conversion_callback);
   free_config (copy);
 
   if (r == -1)
     g_idle_add (conversion_error, NULL);
   else
-    g_idle_add (conversion_finished, NULL);
+    g_idle_add (conversion_finished, GINT_TO_POINTER (precopy));
 
   /* Thread is detached anyway, so no one is waiting for the status. */
   return NULL;
@@ -2316,17 +2664,31 @@ conversion_error (gpointer user_data)
 /**
  * Idle task called from C<start_conversion_thread> (but run on the
  * main thread) when the conversion completed without errors.
+ * C<user_data> is true if the disks were only pre-copied.
  */
 static gboolean
 conversion_finished (gpointer user_data)
 {
+  const int precopy = GPOINTER_TO_INT (user_data);
   GtkWidget *dlg;
 
-  dlg = gtk_message_dialog_new (GTK_WINDOW (run_dlg),
-                                GTK_DIALOG_DESTROY_WITH_PARENT,
-                                GTK_MESSAGE_INFO,
-                                GTK_BUTTONS_OK,
-                                _("The conversion was successful."));
+  if (precopy)
+    dlg = gtk_message_dialog_new (GTK_WINDOW (run_dlg),
+                                  GTK_DIALOG_DESTROY_WITH_PARENT,
+                                  GTK_MESSAGE_INFO,
+                                  GTK_BUTTONS_OK,
+                                  _("The disks were pre-copied.  To finish "
+                                    "the conversion, boot this machine from "
+                                    "the virt-p2v ISO and select \"Keep "
+                                    "staged disks to resume a failed "
+                                    "conversion\", so that only the data "
+                                    "which changed is copied."));
+  else
+    dlg = gtk_message_dialog_new (GTK_WINDOW (run_dlg),
+                                  GTK_DIALOG_DESTROY_WITH_PARENT,
+                                  GTK_MESSAGE_INFO,
+                                  GTK_BUTTONS_OK,
+                                  _("The conversion was successful."));
   gtk_window_set_title (GTK_WINDOW (dlg), _("Conversion was successful"));
   gtk_dialog_run (GTK_DIALOG (dlg));
   gtk_widget_destroy (dlg);
@@ -2341,6 +2703,118 @@ conversion_finished (gpointer user_data)
   return FALSE;
 }
 
+/**
+ * This is called from F<conversion.c>:C<start_conversion> (in the
+ * conversion thread) when virt-v2v failed.  It asks the user whether
+ * to retry, and waits for the answer.
+ */
+static int
+retry_conversion_callback (struct config *copy)
+{
+  int r;
+
+  pthread_mutex_lock (&retry_lock);
+  retry_answer = -1;
+  pthread_mutex_unlock (&retry_lock);
+
+  g_idle_add (ask_retry_conversion, NULL);
+
+  pthread_mutex_lock (&retry_lock);
+  while (retry_answer == -1)
+    pthread_cond_wait (&retry_cond, &retry_lock);
+  r = retry_answer;
+  if (retry_config) {
+    /* Only the output options can be changed, since the disks are
+     * already being served to the conversion server.
+     */
+    struct output_config output = copy->output;
+
+    copy->output = retry_config->output;
+    retry_config->output = output;
+    free_config (retry_config);
+    retry_config = NULL;
+  }
+  pthread_mutex_unlock (&retry_lock);
+
+  return r;
+}
+
+/**
+ * Idle task called from C<retry_conversion_callback> (but run on the
+ * main thread).  If the user wants to retry the conversion, the
+ * conversion dialog is shown again so the output options can be
+ * changed.  The other settings cannot be changed.
+ */
+static gboolean
+ask_retry_conversion (gpointer user_data)
+{
+  const char *err = get_conversion_error ();
+  GtkWidget *dlg;
+  gint response;
+
+  dlg = gtk_message_dialog_new (GTK_WINDOW (run_dlg),
+                                GTK_DIALOG_DESTROY_WITH_PARENT,
+                                GTK_MESSAGE_QUESTION,
+                                GTK_BUTTONS_YES_NO,
+                                _("Conversion failed: %s\n\n"
+                                  "The disks of this machine are still "
+                                  "connected to the conversion server.  "
+                                  "Do you want to change the virt-v2v "
+                                  "output options and try again?"), err);
+  gtk_window_set_title (GTK_WINDOW (dlg), _("Conversion failed"));
+  response = gtk_dialog_run (GTK_DIALOG (dlg));
+  gtk_widget_destroy (dlg);
+
+  if (response != GTK_RESPONSE_YES) {
+    answer_retry_conversion (0, NULL);
+    return FALSE;
+  }
+
+  retrying = 1;
+  gtk_widget_set_sensitive (target_frame, FALSE);
+  gtk_widget_set_sensitive (transfer_frame, FALSE);
+  gtk_widget_set_sensitive (devices_vbox, FALSE);
+  gtk_widget_set_sensitive (back_button, FALSE);
+  gtk_widget_set_sensitive (refresh_disks_button, FALSE);
+  gtk_widget_set_sensitive (benchmark_disks_button, FALSE);
+  show_conversion_dialog ();
+
+  return FALSE;
+}
+
+/**
+ * If the conversion dialog was shown again by C<ask_retry_conversion>,
+ * tell the conversion thread not to retry, and show the running
+ * dialog again.  This must be called (on the main thread) from every
+ * path which leaves the conversion dialog without starting the retry,
+ * or else the conversion thread waits forever.
+ */
+static void
+abandon_retry_conversion (void)
+{
+  if (!retrying)
+    return;
+
+  retrying = 0;
+  answer_retry_conversion (0, NULL);
+  show_running_dialog ();
+}
+
+/**
+ * Pass the answer from C<ask_retry_conversion> to the conversion
+ * thread.  C<config> (if not C<NULL>) contains the new output
+ * options, and is freed by the conversion thread.
+ */
+static void
+answer_retry_conversion (int answer, struct config *config)
+{
+  pthread_mutex_lock (&retry_lock);
+  retry_answer = answer;
+  retry_config = config;
+  pthread_cond_signal (&retry_cond);
+  pthread_mutex_unlock (&retry_lock);
+}
+
 /**
  * This is called from F<conversion.c>:C<start_conversion>
  * when there is a status change or a log message.
@@ -2385,6 +2859,7 @@ close_running_dialog (GtkWidget *w, GdkEvent *event, gpointer data)
    */
   if (conversion_is_running ()) {
     cancel_conversion ();
+    abandon_retry_conversion ();
     return TRUE;
   }
   else
@@ -2414,9 +2889,11 @@ cancel_conversion_dialog (GtkWidget *w, gpointer data)
                                   "To convert this machine you will need to "
                                   "re-run the conversion from the beginning."));
   gtk_window_set_title (GTK_WINDOW (dlg), _("Cancel the conversion"));
-  if (gtk_dialog_run (GTK_DIALOG (dlg)) == GTK_RESPONSE_YES)
+  if (gtk_dialog_run (GTK_DIALOG (dlg)) == GTK_RESPONSE_YES) {
     /* This makes start_conversion return an error (eventually). */
     cancel_conversion ();
+    abandon_retry_conversion ();
+  }
 
   gtk_widget_destroy (dlg);
 }
@@ -23,6 +23,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
@@ -37,45 +38,93 @@
 #include "p2v.h"
 
 static void notify_ui_callback (int type, const char *data);
+static int retry_callback (struct config *config);
 static void run_command (const char *stage, const char *command);
 
+/* The p2v.retry command, and how many times virt-v2v was retried. */
+static const char *retry_command;
+static unsigned retries;
+
+/* Give up after this many retries, even if p2v.retry succeeds. */
+#define MAX_RETRIES 10
+
 /* Perform conversion using the kernel method. */
 void
 kernel_conversion (struct config *config, char **cmdline, int cmdline_source)
 {
   const char *p;
+  const int skip_test_connection =
+    get_cmdline_key (cmdline, "p2v.skip_test_connection") != NULL;
 
   /* Pre-conversion command. */
   p = get_cmdline_key (cmdline, "p2v.pre");
   if (p)
     run_command ("p2v.pre", p);
 
-  /* Connect to and interrogate virt-v2v on the conversion server. */
-  p = get_cmdline_key (cmdline, "p2v.skip_test_connection");
-  if (!p) {
+  if (!skip_test_connection)
     wait_network_online (config);
+
+  /* The event stream and the metrics endpoint may need the network,
+   * so they are started after the pre-conversion command and the
+   * network are ready.  virt-p2v --events and --metrics override
+   * these.
+   */
+  p = get_cmdline_key (cmdline, "p2v.events");
+  if (p && open_events (p) == -1)
+    fprintf (stderr, "%s: warning: p2v.events=%s: %m (events disabled)\n",
+             g_get_prgname (), p);
+  p = get_cmdline_key (cmdline, "p2v.metrics");
+  if (p && start_metrics_server (p) == -1)
+    fprintf (stderr, "%s: warning: p2v.metrics=%s: %m (metrics disabled)\n",
+             g_get_prgname (), p);
+  emit_start_event (config);
+
+  /* Connect to and interrogate virt-v2v on the conversion server. */
+  if (!skip_test_connection) {
+    size_t step;
+
+    step = timeline_begin (startup_timeline, "test connection");
     if (test_connection (config) == -1) {
       const char *err = get_ssh_error ();
 
+      emit_event ("error", err);
       error (EXIT_FAILURE, 0,
              "error opening control connection to %s:%d: %s",
              config->remote.server, config->remote.port, err);
     }
+    timeline_end (startup_timeline, step);
+
+    if (config->benchmark.network) {
+      CLEANUP_FREE char *benchmark = format_network_benchmark (config);
+      char *line, *saveptr;
+
+      if (benchmark) {
+        for (line = strtok_r (benchmark, "\n", &saveptr); line != NULL;
+             line = strtok_r (NULL, "\n", &saveptr))
+          notify_ui_callback (NOTIFY_STATUS, line);
+      }
+    }
   }
 
+  startup_ready ();
+
   /* Some disks must have been specified for conversion. */
-  if (config->disks == NULL || guestfs_int_count_strings (config->disks) == 0)
+  if (config->disks == NULL || guestfs_int_count_strings (config->disks) == 0) {
+    emit_event ("error", "no non-removable disks were discovered on this machine");
     error (EXIT_FAILURE, 0,
            "no non-removable disks were discovered on this machine.\n"
            "virt-p2v looked in /sys/block and in p2v.disks on the kernel command line.\n"
            "This is a fatal error and virt-p2v cannot continue.");
+  }
 
   /* Perform the conversion in text mode. */
-  if (start_conversion (config, notify_ui_callback) == -1) {
+  retry_command = get_cmdline_key (cmdline, "p2v.retry");
+  if (start_conversion (config, notify_ui_callback, retry_callback) == -1) {
     const char *err = get_conversion_error ();
 
     fprintf (stderr, "%s: error during conversion: %s\n",
              g_get_prgname (), err);
+    emit_event ("error", err);
 
     p = get_cmdline_key (cmdline, "p2v.fail");
     if (p)
@@ -84,8 +133,14 @@ kernel_conversion (struct config *config, char **cmdline, int cmdline_source)
     exit (EXIT_FAILURE);
   }
 
+  emit_event ("finished", NULL);
+
   ansi_green (stdout);
-  printf ("Conversion finished successfully.");
+  if (config->transfer.mode == TRANSFER_MODE_PRECOPY)
+    printf ("Pre-copy finished successfully.  Boot the virt-p2v ISO and "
+            "convert with p2v.transfer.resume to finish the conversion.");
+  else
+    printf ("Conversion finished successfully.");
   ansi_restore (stdout);
   putchar ('\n');
 
@@ -101,6 +156,8 @@ kernel_conversion (struct config *config, char **cmdline, int cmdline_source)
 static void
 notify_ui_callback (int type, const char *data)
 {
+  emit_notify_event (type, data);
+
   switch (type) {
   case NOTIFY_LOG_DIR:
     ansi_magenta (stdout);
@@ -133,6 +190,117 @@ notify_ui_callback (int type, const char *data)
   fflush (stdout);
 }
 
+/**
+ * Return true if C<key> is one of the output options
+ * (C<p2v.output.*>, or one of their short aliases such as C<p2v.os>).
+ */
+static bool
+is_output_key (const char *key)
+{
+  static const char *const aliases[] =
+    { "p2v.o", "p2v.oa", "p2v.oc", "p2v.of", "p2v.os", "p2v.oo", NULL };
+  size_t i;
+
+  if (STRPREFIX (key, "p2v.output."))
+    return true;
+  for (i = 0; aliases[i] != NULL; ++i) {
+    if (STREQ (key, aliases[i]))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * This is called from F<conversion.c>:C<start_conversion> when
+ * virt-v2v failed.  If there is a C<p2v.retry> command, it is run.
+ * If it succeeds, virt-v2v is run again, with any output options
+ * (C<p2v.output.*> keys) which the command printed on stdout.
+ */
+static int
+retry_callback (struct config *config)
+{
+  const char *err = get_conversion_error ();
+  FILE *pp;
+  CLEANUP_FREE char *keys = NULL;
+  size_t keys_len = 0;
+  CLEANUP_FREE char *line = NULL;
+  size_t len = 0;
+  ssize_t n;
+  int r;
+
+  if (retry_command == NULL || STREQ (retry_command, ""))
+    return 0;
+  if (retries >= MAX_RETRIES) {
+    fprintf (stderr, "%s: giving up after %u retries\n",
+             g_get_prgname (), retries);
+    return 0;
+  }
+
+  fprintf (stderr, "%s: %s\n", g_get_prgname (), err);
+  emit_event ("retry", err);
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s\n", retry_command);
+  fflush (stderr);
+#endif
+
+  pp = popen (retry_command, "r");
+  if (pp == NULL)
+    error (EXIT_FAILURE, errno, "popen: %s", retry_command);
+  while ((n = getline (&line, &len, pp)) != -1) {
+    if (n > 0 && line[n-1] == '\n')
+      line[n-1] = ' ';          /* keys are separated by spaces */
+    keys = realloc (keys, keys_len + n + 1);
+    if (keys == NULL)
+      error (EXIT_FAILURE, errno, "realloc");
+    memcpy (&keys[keys_len], line, n);
+    keys_len += n;
+    keys[keys_len] = '\0';
+  }
+  r = pclose (pp);
+  if (r == -1)
+    error (EXIT_FAILURE, errno, "pclose: %s", retry_command);
+  if (!WIFEXITED (r) || WEXITSTATUS (r) != 0)
+    return 0;
+
+  /* Only the output options can be changed, since the disks are
+   * already being served to the conversion server.  Any other keys
+   * are ignored, with a warning.
+   */
+  if (keys) {
+    CLEANUP_FREE_STRING_LIST char **cmdline = parse_cmdline_string (keys);
+    CLEANUP_FREE char **output_keys = NULL;
+    struct config *copy;
+    struct output_config output;
+    size_t i, j = 0;
+
+    output_keys = calloc (guestfs_int_count_strings (cmdline) + 1,
+                          sizeof (char *));
+    if (output_keys == NULL)
+      error (EXIT_FAILURE, errno, "calloc");
+    for (i = 0; cmdline[i] != NULL; i += 2) {
+      if (is_output_key (cmdline[i])) {
+        output_keys[j++] = cmdline[i];
+        output_keys[j++] = cmdline[i+1];
+      }
+      else
+        fprintf (stderr, "%s: p2v.retry: ignoring %s, only the output "
+                 "options (p2v.output.*) can be changed\n",
+                 g_get_prgname (), cmdline[i]);
+    }
+
+    copy = copy_config (config);
+    update_config_from_kernel_cmdline (copy, output_keys);
+    output = config->output;
+    config->output = copy->output;
+    copy->output = output;
+    free_config (copy);
+  }
+
+  retries++;
+  return 1;
+}
+
 static void
 run_command (const char *stage, const char *command)
 {
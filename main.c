@@ -29,6 +29,9 @@
 #include <locale.h>
 #include <libintl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
 
 /* errors in <gtk.h> */
 #pragma GCC diagnostic push
@@ -46,8 +49,15 @@ char **all_interfaces;
 int is_iso_environment = 0;
 int feature_colours_option = 0;
 int force_colour = 0;
+const char *record_sessions_dir = NULL;
+
+/* Inventory of disks and network interfaces, see start_inventory. */
+static struct background_command *udevadm_settle;
+static pthread_t inventory_thread;
+static char **inventory_disks, **inventory_removable;
 
-static void udevadm_settle (void);
+static void start_inventory (const char *test_disk);
+static void wait_inventory (char ***disks, char ***removable);
 static void set_config_defaults (struct config *config,
                                  const char * const *disks,
                                  const char * const *removable);
@@ -62,9 +72,13 @@ static const struct option long_options[] = {
   { "colors", 0, 0, 0 },
   { "colour", 0, 0, 0 },
   { "colours", 0, 0, 0 },
+  { "events", 1, 0, 0 },
   { "iso", 0, 0, 0 },
   { "long-options", 0, 0, 0 },
+  { "metrics", 1, 0, 0 },
+  { "record-sessions", 1, 0, 0 },
   { "short-options", 0, 0, 0 },
+  { "startup-timeline", 0, 0, 0 },
   { "test-disk", 1, 0, 0 },
   { "verbose", 0, 0, 'v' },
   { "version", 0, 0, 'V' },
@@ -86,7 +100,12 @@ usage (int status)
               "  --help                 Display brief help\n"
               " --cmdline=CMDLINE       Used to debug command line parsing\n"
               " --colors|--colours      Use ANSI colour sequences even if not tty\n"
+              " --events=TARGET         Write JSON events to fd:N, tcp:HOST:PORT,\n"
+              "                         unix:PATH or a file\n"
               " --iso                   Running in the ISO environment\n"
+              " --metrics=[HOST:]PORT   Export metrics over HTTP\n"
+              " --record-sessions=DIR   Record ssh and scp sessions in DIR\n"
+              " --startup-timeline      Print how long each startup step took\n"
               " --test-disk=DISK.IMG    For testing, use disk as /dev/sda\n"
               "  -v|--verbose           Verbose messages\n"
               "  -V|--version           Display version and exit\n"
@@ -129,9 +148,23 @@ main (int argc, char *argv[])
   int option_index;
   char **cmdline = NULL;
   int cmdline_source = 0;
-  struct config *config = new_config ();
+  struct config *config;
   const char *test_disk = NULL;
   char **disks, **removable;
+  size_t step;
+
+  /* virt-p2v runs itself as the relay process of recorded ssh and scp
+   * sessions (see ssh.c).
+   */
+  if (argc > 3 && STREQ (argv[1], "--relay-session"))
+    relay_session (&argv[2]);
+
+  /* Record how long each of the startup steps takes.  Printed when
+   * using --startup-timeline.
+   */
+  startup_timeline = new_timeline ();
+
+  config = new_config ();
 
   setlocale (LC_ALL, "");
   bindtextdomain (PACKAGE, LOCALEBASEDIR);
@@ -140,14 +173,21 @@ main (int argc, char *argv[])
   /* We may use random(3) in this program. */
   srandom (time (NULL) + getpid ());
 
-  /* There is some raciness between slow devices being discovered by
+  /* The following startup steps are independent of each other, so
+   * they are started in the background here and waited for later.
+   *
+   * There is some raciness between slow devices being discovered by
    * the kernel and udev and virt-p2v running.  This is a partial
    * workaround, but a real fix involves handling hotplug events
    * (possible in GUI mode, not easy in kernel mode).
    */
-  udevadm_settle ();
+  udevadm_settle = start_background_command ("udevadm settle",
+                                             "udevadm settle");
+  probe_nbd_server ();
 
+  step = timeline_begin (startup_timeline, "gtk init");
   gui_possible = gtk_init_check (&argc, &argv);
+  timeline_end (startup_timeline, step);
 
   for (;;) {
     c = getopt_long (argc, argv, options, long_options, &option_index);
@@ -171,9 +211,25 @@ main (int argc, char *argv[])
                STREQ (long_options[option_index].name, "colours")) {
         force_colour = 1;
       }
+      else if (STREQ (long_options[option_index].name, "events")) {
+        if (open_events (optarg) == -1)
+          error (EXIT_FAILURE, errno, "--events=%s", optarg);
+      }
       else if (STREQ (long_options[option_index].name, "iso")) {
         is_iso_environment = 1;
       }
+      else if (STREQ (long_options[option_index].name, "metrics")) {
+        if (start_metrics_server (optarg) == -1)
+          error (EXIT_FAILURE, errno, "--metrics=%s", optarg);
+      }
+      else if (STREQ (long_options[option_index].name, "record-sessions")) {
+        if (mkdir (optarg, 0755) == -1 && errno != EEXIST)
+          error (EXIT_FAILURE, errno, "mkdir: %s", optarg);
+        record_sessions_dir = optarg;
+      }
+      else if (STREQ (long_options[option_index].name, "startup-timeline")) {
+        print_startup_timeline = 1;
+      }
       else if (STREQ (long_options[option_index].name, "test-disk")) {
         if (test_disk != NULL)
           error (EXIT_FAILURE, 0,
@@ -213,26 +269,11 @@ main (int argc, char *argv[])
     usage (EXIT_FAILURE);
   }
 
-  test_nbd_server ();
-
-  /* Find all block devices in the system. */
-  if (test_disk) {
-    /* For testing and debugging purposes, you can use
-     * --test-disk=/path/to/disk.img
-     */
-    disks = malloc (2 * sizeof (char *));
-    if (disks == NULL)
-      error (EXIT_FAILURE, errno, "malloc");
-    disks[0] = strdup (test_disk);
-    if (disks[0] == NULL)
-      error (EXIT_FAILURE, errno, "strdup");
-    disks[1] = NULL;
-
-    removable = NULL;
-  } else
-    find_all_disks (&disks, &removable);
-
-  set_config_defaults (config, (const char **)disks, (const char **)removable);
+  /* Find all block devices and network interfaces in the system.
+   * This has to wait for udev to settle, but the nbdkit probes carry
+   * on in the background.
+   */
+  start_inventory (test_disk);
 
   /* Parse /proc/cmdline (if it exists) or use the --cmdline parameter
    * to initialize the configuration.  This allows defaults to be pass
@@ -245,9 +286,34 @@ main (int argc, char *argv[])
       cmdline_source = CMDLINE_SOURCE_PROC_CMDLINE;
   }
 
+  /* In kernel mode we will need the network, and possibly the ssh
+   * identity, so start on those now.  We cannot do this if there is
+   * a p2v.pre command since that might set up the network.
+   */
+  if (cmdline &&
+      (get_cmdline_key (cmdline, "p2v.server") ||
+       get_cmdline_key (cmdline, "p2v.remote.server")) &&
+      !get_cmdline_key (cmdline, "p2v.pre") &&
+      !get_cmdline_key (cmdline, "p2v.dump_config_and_exit")) {
+    const char *url;
+
+    start_network_online ();
+    url = get_cmdline_key (cmdline, "p2v.auth.identity.url");
+    if (url == NULL)
+      url = get_cmdline_key (cmdline, "p2v.identity");
+    if (url != NULL && STRNEQ (url, ""))
+      prefetch_ssh_identity (url);
+  }
+
+  wait_inventory (&disks, &removable);
+
+  set_config_defaults (config, (const char **)disks, (const char **)removable);
+
   if (cmdline)
     update_config_from_kernel_cmdline (config, cmdline);
 
+  test_nbd_server ();
+
   /* If p2v.server exists, then we use the non-interactive kernel
    * conversion.  Otherwise we run the GUI.
    */
@@ -265,14 +331,67 @@ main (int argc, char *argv[])
   guestfs_int_free_string_list (removable);
   guestfs_int_free_string_list (disks);
   free_config (config);
+  free_timeline (startup_timeline);
 
   exit (EXIT_SUCCESS);
 }
 
+static void *
+inventory_thread_start (void *test_disk_v)
+{
+  const char *test_disk = test_disk_v;
+  size_t step;
+
+  ignore_value (wait_background_command (udevadm_settle));
+  udevadm_settle = NULL;
+
+  step = timeline_begin (startup_timeline, "disk inventory");
+  if (test_disk) {
+    /* For testing and debugging purposes, you can use
+     * --test-disk=/path/to/disk.img
+     */
+    inventory_disks = malloc (2 * sizeof (char *));
+    if (inventory_disks == NULL)
+      error (EXIT_FAILURE, errno, "malloc");
+    inventory_disks[0] = strdup (test_disk);
+    if (inventory_disks[0] == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+    inventory_disks[1] = NULL;
+
+    inventory_removable = NULL;
+  } else
+    find_all_disks (&inventory_disks, &inventory_removable);
+  timeline_end (startup_timeline, step);
+
+  step = timeline_begin (startup_timeline, "network interface inventory");
+  find_all_interfaces ();
+  timeline_end (startup_timeline, step);
+
+  return NULL;
+}
+
+/**
+ * Find all disks and network interfaces in a background thread,
+ * after C<udevadm settle> has finished.  Call C<wait_inventory> to
+ * get the list of disks.
+ */
+static void
+start_inventory (const char *test_disk)
+{
+  int err;
+
+  err = pthread_create (&inventory_thread, NULL,
+                        inventory_thread_start, (void *) test_disk);
+  if (err != 0)
+    error (EXIT_FAILURE, err, "pthread_create");
+}
+
 static void
-udevadm_settle (void)
+wait_inventory (char ***disks, char ***removable)
 {
-  ignore_value (system ("udevadm settle"));
+  pthread_join (inventory_thread, NULL);
+  *disks = inventory_disks;
+  *removable = inventory_removable;
 }
 
 static void
@@ -355,8 +474,7 @@ set_config_defaults (struct config *config,
   if (removable)
     config->removable = guestfs_int_copy_string_list ((char **)removable);
 
-  /* Find all network interfaces in the system. */
-  find_all_interfaces ();
+  /* Network interfaces were found by start_inventory. */
   if (all_interfaces)
     config->interfaces = guestfs_int_copy_string_list (all_interfaces);
 
@@ -0,0 +1,592 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Optional HTTP endpoint which exports the state of the conversion
+ * in the Prometheus text format.
+ *
+ * It is off by default, and is enabled with S<C<virt-p2v
+ * --metrics=ADDR:PORT>> or S<C<p2v.metrics=ADDR:PORT>> on the kernel
+ * command line.  A single background thread accepts connections and
+ * answers every request with the current metrics.
+ *
+ * The conversion thread only does atomic stores and increments (see
+ * C<metrics_set_phase> etc), so the cost when nobody is scraping is
+ * close to nothing.  Everything else (bytes read by each nbdkit, CPU
+ * and memory used by virt-p2v and its children, page cache pressure)
+ * is read from F</proc> when a scrape arrives.
+ *
+ * Staged transfers copy each disk over several ssh data connections
+ * (see F<supervisor.c>).  Their series have a C<stream> label, where
+ * stream C<0> is the connection which nbdkit was started with.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+
+#include <pthread.h>
+
+#include "p2v.h"
+
+/* Names of the phases, indexed by enum conversion_phase. */
+static const char *const phase_names[] = {
+  [PHASE_IDLE] = "idle",
+  [PHASE_BENCHMARKING_DISKS] = "benchmarking_disks",
+  [PHASE_CHECKSUMMING_DISKS] = "checksumming_disks",
+  [PHASE_STARTING_NBD] = "starting_nbd",
+  [PHASE_OPENING_DATA_CONNECTIONS] = "opening_data_connections",
+  [PHASE_GENERATING_METADATA] = "generating_metadata",
+  [PHASE_OPENING_CONTROL_CONNECTION] = "opening_control_connection",
+  [PHASE_UPLOADING] = "uploading",
+  [PHASE_CONVERTING] = "converting",
+  [PHASE_TEARING_DOWN] = "tearing_down",
+  [PHASE_FINISHED] = "finished",
+  [PHASE_FAILED] = "failed",
+};
+
+/* Counters and gauges written by the conversion thread.  These are
+ * only accessed using atomic builtins.
+ */
+static int phase = PHASE_IDLE;
+static int64_t conversion_start;  /* monotonic, in microseconds, 0 = none */
+static uint64_t conversions_total;
+static uint64_t remote_output_bytes;
+static pid_t control_pid;
+
+/* The disks of the current conversion, protected by disks_lock.
+ * These only change a few times during each conversion, so a lock is
+ * fine here.
+ */
+static pthread_mutex_t disks_lock = PTHREAD_MUTEX_INITIALIZER;
+struct metrics_disk {
+  char *name;
+  pid_t nbd_pid;
+  size_t nr_streams;
+  pid_t *ssh_pids;              /* ssh of each data connection, 0 = none */
+};
+static struct metrics_disk *disks;
+static size_t nr_disks;
+
+static int listen_fd = -1;
+static pthread_t metrics_thread;
+
+static void *metrics_thread_start (void *);
+
+static int64_t
+now_usec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Start the metrics endpoint, listening on C<addr>, which is
+ * C<HOST:PORT> or just C<PORT> (meaning C<localhost:PORT>).  An
+ * IPv6 address must be written in square brackets
+ * (eg. C<[::]:9469>).
+ *
+ * On error this returns C<-1> and sets C<errno>.  It is not an error
+ * to call this more than once, only the first call has any effect.
+ */
+int
+start_metrics_server (const char *addr)
+{
+  CLEANUP_FREE char *host = NULL;
+  const char *port;
+  struct addrinfo hints, *ai, *a;
+  int fd = -1, err, on = 1;
+
+  if (listen_fd >= 0)
+    return 0;
+
+  port = strrchr (addr, ':');
+  if (port == NULL) {
+    host = strdup ("localhost");
+    port = addr;
+  }
+  else {
+    if (addr[0] == '[' && port > addr && port[-1] == ']')
+      host = strndup (addr + 1, port - addr - 2);
+    else
+      host = strndup (addr, port - addr);
+    port++;
+  }
+  if (host == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+
+  memset (&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  err = getaddrinfo (STREQ (host, "") ? NULL : host, port, &hints, &ai);
+  if (err != 0) {
+    fprintf (stderr, "%s: getaddrinfo: %s: %s\n",
+             g_get_prgname (), addr, gai_strerror (err));
+    errno = EADDRNOTAVAIL;
+    return -1;
+  }
+
+  for (a = ai; a != NULL; a = a->ai_next) {
+    fd = socket (a->ai_family, a->ai_socktype|SOCK_CLOEXEC, a->ai_protocol);
+    if (fd == -1)
+      continue;
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    if (bind (fd, a->ai_addr, a->ai_addrlen) == 0 && listen (fd, 8) == 0)
+      break;
+    err = errno;
+    close (fd);
+    fd = -1;
+    errno = err;
+  }
+  freeaddrinfo (ai);
+  if (fd == -1)
+    return -1;
+
+  listen_fd = fd;
+  err = pthread_create (&metrics_thread, NULL, metrics_thread_start, NULL);
+  if (err != 0)
+    error (EXIT_FAILURE, err, "pthread_create");
+  pthread_detach (metrics_thread);
+
+  return 0;
+}
+
+/**
+ * Set the current phase of the conversion.  Entering
+ * C<PHASE_BENCHMARKING_DISKS> starts a new conversion.
+ */
+void
+metrics_set_phase (enum conversion_phase new_phase)
+{
+  if (new_phase == PHASE_BENCHMARKING_DISKS) {
+    __atomic_store_n (&conversion_start, now_usec (), __ATOMIC_RELAXED);
+    __atomic_add_fetch (&conversions_total, 1, __ATOMIC_RELAXED);
+    __atomic_store_n (&remote_output_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n (&control_pid, 0, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n (&phase, new_phase, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set the disks which are being converted.  This forgets the
+ * processes of any previous conversion.
+ */
+void
+metrics_set_disks (char * const *names)
+{
+  size_t i, n;
+
+  n = names ? guestfs_int_count_strings ((char **) names) : 0;
+
+  pthread_mutex_lock (&disks_lock);
+  for (i = 0; i < nr_disks; ++i) {
+    free (disks[i].name);
+    free (disks[i].ssh_pids);
+  }
+  free (disks);
+  disks = calloc (n, sizeof *disks);
+  if (n > 0 && disks == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  for (i = 0; i < n; ++i) {
+    disks[i].name = strdup (names[i]);
+    if (disks[i].name == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+  }
+  nr_disks = n;
+  pthread_mutex_unlock (&disks_lock);
+}
+
+/**
+ * Record the nbdkit and ssh processes serving disk C<i>, from its
+ * data connection C<dc>.  This must be called again whenever any of
+ * them starts or stops, including the extra data connections of
+ * staged transfers.
+ */
+void
+metrics_set_data_conn (size_t i, const struct data_conn *dc)
+{
+  const size_t n = 1 + dc->nr_extra;
+  size_t j;
+
+  pthread_mutex_lock (&disks_lock);
+  if (i < nr_disks) {
+    if (disks[i].nr_streams != n) {
+      free (disks[i].ssh_pids);
+      disks[i].ssh_pids = calloc (n, sizeof (pid_t));
+      if (disks[i].ssh_pids == NULL)
+        error (EXIT_FAILURE, errno, "calloc");
+      disks[i].nr_streams = n;
+    }
+    disks[i].nbd_pid = dc->nbd_pid;
+    for (j = 0; j < n; ++j) {
+      mexp_h *h = j == 0 ? dc->h : dc->extra_h[j-1];
+      disks[i].ssh_pids[j] = h ? mexp_get_pid (h) : 0;
+    }
+  }
+  pthread_mutex_unlock (&disks_lock);
+}
+
+/**
+ * Record the ssh process for the control connection (C<0> if none).
+ */
+void
+metrics_set_control_pid (pid_t pid)
+{
+  __atomic_store_n (&control_pid, pid, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count C<n> bytes of output received from virt-v2v.
+ */
+void
+metrics_add_remote_output (size_t n)
+{
+  __atomic_add_fetch (&remote_output_bytes, n, __ATOMIC_RELAXED);
+}
+
+struct proc_stat {
+  char state;
+  double cpu_seconds;
+  uint64_t rss_bytes;
+};
+
+/* Print C<s> as the value of a label, escaping it as the text format
+ * requires.
+ */
+static void
+print_label_value (FILE *fp, const char *s)
+{
+  fputc ('"', fp);
+  for (; *s; ++s) {
+    switch (*s) {
+    case '\\': fputs ("\\\\", fp); break;
+    case '"':  fputs ("\\\"", fp); break;
+    case '\n': fputs ("\\n", fp); break;
+    default: fputc (*s, fp);
+    }
+  }
+  fputc ('"', fp);
+}
+
+/* Print the labels of the series of disk C<i>, and of data connection
+ * C<stream> unless it is C<-1>.
+ */
+static void
+print_disk_labels (FILE *fp, size_t i, int stream)
+{
+  fputs ("{disk=", fp);
+  print_label_value (fp, disks[i].name);
+  if (stream >= 0)
+    fprintf (fp, ",stream=\"%d\"", stream);
+  fputs ("} ", fp);
+}
+
+/* Read F</proc/PID/stat>.  C<pid> may be C<0> for this process. */
+static int
+read_proc_stat (pid_t pid, struct proc_stat *st)
+{
+  char path[64], line[1024];
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  const char *p;
+  unsigned long utime, stime;
+  long rss;
+
+  if (pid > 0)
+    snprintf (path, sizeof path, "/proc/%d/stat", (int) pid);
+  else
+    strcpy (path, "/proc/self/stat");
+  fp = fopen (path, "r");
+  if (fp == NULL || fgets (line, sizeof line, fp) == NULL)
+    return -1;
+
+  /* The command name may contain spaces and brackets, so start
+   * after the last ')'.
+   */
+  p = strrchr (line, ')');
+  if (p == NULL ||
+      sscanf (p + 1,
+              " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu"
+              " %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+              &st->state, &utime, &stime, &rss) != 4)
+    return -1;
+
+  st->cpu_seconds = (double) (utime + stime) / sysconf (_SC_CLK_TCK);
+  st->rss_bytes = (uint64_t) rss * sysconf (_SC_PAGESIZE);
+  return 0;
+}
+
+static void
+print_process (FILE *fp, const char *metric,
+               const char *process, const char *disk, int stream, pid_t pid)
+{
+  struct proc_stat st;
+
+  if (read_proc_stat (pid, &st) == -1)
+    return;
+  fprintf (fp, "%s{process=\"%s\",disk=", metric, process);
+  print_label_value (fp, disk);
+  if (stream >= 0)
+    fprintf (fp, ",stream=\"%d\"", stream);
+  fputs ("} ", fp);
+  if (STREQ (metric, "virt_p2v_process_cpu_seconds_total"))
+    fprintf (fp, "%.2f\n", st.cpu_seconds);
+  else
+    fprintf (fp, "%" PRIu64 "\n", st.rss_bytes);
+}
+
+/* Print C<metric> for virt-p2v and each of its children.  Must be
+ * called with disks_lock held.
+ */
+static void
+print_processes (FILE *fp, const char *metric, pid_t ctl_pid)
+{
+  size_t i, j;
+
+  print_process (fp, metric, "virt-p2v", "", -1, 0);
+  if (ctl_pid > 0)
+    print_process (fp, metric, "ssh", "", -1, ctl_pid);
+  for (i = 0; i < nr_disks; ++i) {
+    const pid_t nbd_pid = disks[i].nbd_pid;
+    if (nbd_pid > 0)
+      print_process (fp, metric, "nbdkit", disks[i].name, -1, nbd_pid);
+    for (j = 0; j < disks[i].nr_streams; ++j) {
+      const pid_t ssh_pid = disks[i].ssh_pids[j];
+      if (ssh_pid > 0)
+        print_process (fp, metric, "ssh", disks[i].name, j, ssh_pid);
+    }
+  }
+}
+
+/* Is the process running (and not a zombie)? */
+static int
+process_is_up (pid_t pid)
+{
+  struct proc_stat st;
+
+  return pid > 0 && read_proc_stat (pid, &st) == 0 && st.state != 'Z';
+}
+
+static void
+print_memory (FILE *fp)
+{
+  CLEANUP_FCLOSE FILE *meminfo = NULL;
+  CLEANUP_FCLOSE FILE *pressure = NULL;
+  char name[32], kind[8];
+  uint64_t kb;
+  double avg10;
+
+  meminfo = fopen ("/proc/meminfo", "r");
+  if (meminfo) {
+    fprintf (fp, "# HELP virt_p2v_memory_bytes Memory usage from /proc/meminfo.\n");
+    fprintf (fp, "# TYPE virt_p2v_memory_bytes gauge\n");
+    while (fscanf (meminfo, "%31[^:]: %" SCNu64 " kB ", name, &kb) == 2) {
+      if (STREQ (name, "MemTotal") || STREQ (name, "MemAvailable") ||
+          STREQ (name, "Cached") || STREQ (name, "Dirty") ||
+          STREQ (name, "Writeback"))
+        fprintf (fp, "virt_p2v_memory_bytes{type=\"%s\"} %" PRIu64 "\n",
+                 name, kb * 1024);
+    }
+  }
+
+  /* Pressure stall information, if the kernel has it. */
+  pressure = fopen ("/proc/pressure/memory", "r");
+  if (pressure) {
+    fprintf (fp, "# HELP virt_p2v_memory_pressure_avg10 Percentage of time stalled on memory in the last 10 seconds.\n");
+    fprintf (fp, "# TYPE virt_p2v_memory_pressure_avg10 gauge\n");
+    while (fscanf (pressure, "%7s avg10=%lf %*[^\n] ", kind, &avg10) == 2)
+      fprintf (fp, "virt_p2v_memory_pressure_avg10{kind=\"%s\"} %.2f\n",
+               kind, avg10);
+  }
+}
+
+static void
+print_metrics (FILE *fp)
+{
+  const int current_phase = __atomic_load_n (&phase, __ATOMIC_RELAXED);
+  const int64_t start = __atomic_load_n (&conversion_start, __ATOMIC_RELAXED);
+  const pid_t ctl_pid = __atomic_load_n (&control_pid, __ATOMIC_RELAXED);
+  size_t i, j;
+  uint64_t v;
+
+  fprintf (fp, "# HELP virt_p2v_phase Current phase of the conversion.\n");
+  fprintf (fp, "# TYPE virt_p2v_phase gauge\n");
+  for (i = 0; i < sizeof phase_names / sizeof phase_names[0]; ++i)
+    fprintf (fp, "virt_p2v_phase{phase=\"%s\"} %d\n",
+             phase_names[i], (int) i == current_phase);
+
+  fprintf (fp, "# HELP virt_p2v_conversions_total Conversions started.\n");
+  fprintf (fp, "# TYPE virt_p2v_conversions_total counter\n");
+  fprintf (fp, "virt_p2v_conversions_total %" PRIu64 "\n",
+           __atomic_load_n (&conversions_total, __ATOMIC_RELAXED));
+
+  if (start > 0) {
+    fprintf (fp, "# HELP virt_p2v_conversion_seconds Time since the current or last conversion started.\n");
+    fprintf (fp, "# TYPE virt_p2v_conversion_seconds gauge\n");
+    fprintf (fp, "virt_p2v_conversion_seconds %.3f\n",
+             (now_usec () - start) / 1e6);
+  }
+
+  fprintf (fp, "# HELP virt_p2v_remote_output_bytes_total Output received from virt-v2v.\n");
+  fprintf (fp, "# TYPE virt_p2v_remote_output_bytes_total counter\n");
+  fprintf (fp, "virt_p2v_remote_output_bytes_total %" PRIu64 "\n",
+           __atomic_load_n (&remote_output_bytes, __ATOMIC_RELAXED));
+
+  fprintf (fp, "# HELP virt_p2v_control_connection_up Whether the ssh control connection is running.\n");
+  fprintf (fp, "# TYPE virt_p2v_control_connection_up gauge\n");
+  fprintf (fp, "virt_p2v_control_connection_up %d\n", process_is_up (ctl_pid));
+
+  pthread_mutex_lock (&disks_lock);
+
+  fprintf (fp, "# HELP virt_p2v_disk_read_bytes_total Bytes read from the disk by nbdkit.\n");
+  fprintf (fp, "# TYPE virt_p2v_disk_read_bytes_total counter\n");
+  for (i = 0; i < nr_disks; ++i) {
+    const pid_t pid = disks[i].nbd_pid;
+    if (pid > 0 && get_process_io_counter (pid, "rchar", &v) == 0) {
+      fputs ("virt_p2v_disk_read_bytes_total", fp);
+      print_disk_labels (fp, i, -1);
+      fprintf (fp, "%" PRIu64 "\n", v);
+    }
+  }
+
+  fprintf (fp, "# HELP virt_p2v_tunnel_sent_bytes_total Bytes written to the network by each ssh data connection.\n");
+  fprintf (fp, "# TYPE virt_p2v_tunnel_sent_bytes_total counter\n");
+  for (i = 0; i < nr_disks; ++i) {
+    for (j = 0; j < disks[i].nr_streams; ++j) {
+      const pid_t pid = disks[i].ssh_pids[j];
+      if (pid > 0 && get_process_io_counter (pid, "wchar", &v) == 0) {
+        fputs ("virt_p2v_tunnel_sent_bytes_total", fp);
+        print_disk_labels (fp, i, j);
+        fprintf (fp, "%" PRIu64 "\n", v);
+      }
+    }
+  }
+
+  /* The first data connection of each disk is always reported.  The
+   * extra ones are only reported once they have been opened.
+   */
+  fprintf (fp, "# HELP virt_p2v_tunnel_up Whether each ssh data connection is running.\n");
+  fprintf (fp, "# TYPE virt_p2v_tunnel_up gauge\n");
+  for (i = 0; i < nr_disks; ++i) {
+    for (j = 0; j < MAX (disks[i].nr_streams, 1); ++j) {
+      const pid_t pid = j < disks[i].nr_streams ? disks[i].ssh_pids[j] : 0;
+      if (j > 0 && pid == 0)
+        continue;
+      fputs ("virt_p2v_tunnel_up", fp);
+      print_disk_labels (fp, i, j);
+      fprintf (fp, "%d\n", process_is_up (pid));
+    }
+  }
+
+  fprintf (fp, "# HELP virt_p2v_process_cpu_seconds_total CPU time used by virt-p2v and its children.\n");
+  fprintf (fp, "# TYPE virt_p2v_process_cpu_seconds_total counter\n");
+  print_processes (fp, "virt_p2v_process_cpu_seconds_total", ctl_pid);
+  fprintf (fp, "# HELP virt_p2v_process_resident_memory_bytes Resident memory of virt-p2v and its children.\n");
+  fprintf (fp, "# TYPE virt_p2v_process_resident_memory_bytes gauge\n");
+  print_processes (fp, "virt_p2v_process_resident_memory_bytes", ctl_pid);
+
+  pthread_mutex_unlock (&disks_lock);
+
+  print_memory (fp);
+}
+
+/* Answer one HTTP request.  Whatever the request is, the reply is
+ * the metrics.
+ */
+static void
+handle_request (int fd)
+{
+  char req[4096];
+  size_t n = 0;
+  ssize_t r;
+  const struct timeval timeout = { .tv_sec = 5 };
+  CLEANUP_FREE char *body = NULL;
+  size_t body_len = 0;
+  FILE *fp;
+  char header[256];
+  int header_len;
+
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+  /* Read the request headers. */
+  while (n < sizeof req - 1) {
+    r = recv (fd, req + n, sizeof req - 1 - n, 0);
+    if (r <= 0)
+      return;
+    n += r;
+    req[n] = '\0';
+    if (strstr (req, "\r\n\r\n") || strstr (req, "\n\n"))
+      break;
+  }
+
+  fp = open_memstream (&body, &body_len);
+  if (fp == NULL)
+    return;
+  print_metrics (fp);
+  if (fclose (fp) == EOF)
+    return;
+
+  header_len = snprintf (header, sizeof header,
+                         "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\n"
+                         "Connection: close\r\n"
+                         "\r\n",
+                         body_len);
+  if (send (fd, header, header_len, MSG_NOSIGNAL) != header_len)
+    return;
+  if (STRPREFIX (req, "HEAD "))
+    return;
+  send (fd, body, body_len, MSG_NOSIGNAL);
+}
+
+static void *
+metrics_thread_start (void *arg)
+{
+  int fd;
+
+  for (;;) {
+    fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror ("metrics: accept");
+      sleep (1);
+      continue;
+    }
+    handle_request (fd);
+    close (fd);
+  }
+
+  return NULL;
+}
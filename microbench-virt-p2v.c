@@ -0,0 +1,631 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Microbenchmarks for helper functions which are on hot paths in
+ * virt-p2v.  Run this using S<C<make microbench>>.
+ *
+ * Each benchmark is run for an increasing number of iterations until
+ * it takes at least C<--seconds>, and the time and number of heap
+ * allocations per operation are printed.
+ *
+ * This is not part of virt-p2v and is not installed.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "p2v.h"
+
+/* Referenced by print_config in config.c.  In virt-p2v it is in ssh.c
+ * which is not linked into this program.
+ */
+char *v2v_version = NULL;
+
+/* Count heap allocations by replacing the malloc family and calling
+ * the glibc implementations.  See "Replacing malloc" in the glibc
+ * manual.
+ */
+extern void *__libc_malloc (size_t);
+extern void *__libc_calloc (size_t, size_t);
+extern void *__libc_realloc (void *, size_t);
+extern void __libc_free (void *);
+
+static size_t nr_allocations;
+
+void *
+malloc (size_t size)
+{
+  __atomic_add_fetch (&nr_allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  __atomic_add_fetch (&nr_allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  __atomic_add_fetch (&nr_allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc (ptr, size);
+}
+
+void
+free (void *ptr)
+{
+  __libc_free (ptr);
+}
+
+static size_t
+get_allocations (void)
+{
+  return __atomic_load_n (&nr_allocations, __ATOMIC_RELAXED);
+}
+
+static double
+now_seconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*----------------------------------------------------------------------*/
+/* mexp_expect */
+
+/* Roughly what virt-p2v sees from the conversion server when it runs
+ * a command: the echoed command, some output and a prompt.
+ */
+#define EXPECT_OUTPUT_LINES 64
+
+static mexp_h expect_h;
+static int expect_wfd = -1;
+static char *expect_data;
+static size_t expect_len;
+static mexp_regexp *expect_regexps;
+static pcre2_code *expect_prompt_re, *expect_other_re;
+static pcre2_match_data *expect_match_data;
+
+static pcre2_code *
+compile_re (const char *pattern)
+{
+  int errcode;
+  PCRE2_SIZE offset;
+  pcre2_code *re;
+
+  re = pcre2_compile ((PCRE2_SPTR) pattern, PCRE2_ZERO_TERMINATED, 0,
+                      &errcode, &offset, NULL);
+  if (re == NULL)
+    error (EXIT_FAILURE, 0, "pcre2_compile: %s: error %d", pattern, errcode);
+  return re;
+}
+
+static void
+expect_setup (void)
+{
+  FILE *fp;
+  int sv[2];
+  size_t i;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) == -1)
+    error (EXIT_FAILURE, errno, "socketpair");
+  expect_wfd = sv[1];
+
+  memset (&expect_h, 0, sizeof expect_h);
+  expect_h.fd = sv[0];
+  expect_h.pid = 0;
+  expect_h.next_match = -1;
+  expect_h.read_size = 1024;  /* the same as mexp_spawnvf */
+  mexp_set_timeout (&expect_h, 60);
+
+  fp = open_memstream (&expect_data, &expect_len);
+  if (fp == NULL)
+    error (EXIT_FAILURE, errno, "open_memstream");
+  fprintf (fp, "virt-v2v --machine-readable\r\n");
+  for (i = 0; i < EXPECT_OUTPUT_LINES; ++i)
+    fprintf (fp, "output:driver-%zu\r\n", i);
+  fprintf (fp, "###abcdefghijklmnop### ");
+  fclose (fp);
+
+  expect_prompt_re = compile_re ("###abcdefghijklmnop### ");
+  expect_other_re = compile_re ("Permission denied|Connection refused");
+  expect_match_data = pcre2_match_data_create (4, NULL);
+  expect_regexps = calloc (3, sizeof (mexp_regexp));
+  if (expect_regexps == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  expect_regexps[0] = (mexp_regexp) { 100, expect_prompt_re, 0 };
+  expect_regexps[1] = (mexp_regexp) { 101, expect_other_re, 0 };
+  expect_regexps[2] = (mexp_regexp) { 0 };
+}
+
+static void
+expect_debug_setup (void)
+{
+  FILE *fp;
+
+  expect_setup ();
+  fp = fopen ("/dev/null", "w");
+  if (fp == NULL)
+    error (EXIT_FAILURE, errno, "/dev/null");
+  mexp_set_debug_file (&expect_h, fp);
+}
+
+static void
+expect_run (void)
+{
+  size_t n = 0;
+
+  /* The output fits in the socket buffer, so it can be written
+   * before calling mexp_expect.
+   */
+  while (n < expect_len) {
+    const ssize_t r = write (expect_wfd, expect_data + n, expect_len - n);
+    if (r == -1)
+      error (EXIT_FAILURE, errno, "write");
+    n += r;
+  }
+
+  if (mexp_expect (&expect_h, expect_regexps, expect_match_data) != 100)
+    error (EXIT_FAILURE, 0, "mexp_expect did not match the prompt");
+}
+
+static void
+expect_teardown (void)
+{
+  if (expect_h.debug_fp)
+    fclose (expect_h.debug_fp);
+  close (expect_h.fd);
+  close (expect_wfd);
+  free (expect_h.buffer);
+  free (expect_data);
+  free (expect_regexps);
+  pcre2_match_data_free (expect_match_data);
+  pcre2_code_free (expect_prompt_re);
+  pcre2_code_free (expect_other_re);
+}
+
+/*----------------------------------------------------------------------*/
+/* parse_cmdline_string */
+
+static const char cmdline[] =
+  "BOOT_IMAGE=/vmlinuz-6.1.0 root=live:CDLABEL=virt-p2v ro rd.live.image "
+  "quiet rhgb console=tty0 console=ttyS0,115200n8 "
+  "p2v.server=conversion.example.com p2v.port=22 p2v.username=root "
+  "p2v.password=\"correct horse battery staple\" p2v.identity=https://"
+  "example.com/id_rsa p2v.name=physical-machine-01 p2v.vcpus=16 "
+  "p2v.memory=32G p2v.disks=sda,sdb,sdc,nvme0n1 p2v.removable=sr0 "
+  "p2v.interfaces=eth0,eth1 p2v.network=eth0:default,eth1:backup "
+  "p2v.o=libvirt p2v.oa=sparse p2v.oc=qemu:///system p2v.of=qcow2 "
+  "p2v.os=default p2v.post=poweroff p2v.benchmark.network";
+
+static void
+cmdline_run (void)
+{
+  char **argv = parse_cmdline_string (cmdline);
+
+  guestfs_int_free_string_list (argv);
+}
+
+/*----------------------------------------------------------------------*/
+/* ansi_parser_feed */
+
+static char **ansi_messages;
+static size_t ansi_index, ansi_bytes;
+
+static void
+ansi_text (void *opaque, const char *text, size_t len, int colour)
+{
+  ansi_bytes += len;
+}
+
+static void
+ansi_delete_line (void *opaque)
+{
+}
+
+static struct ansi_parser ansi_parser;
+
+static void
+ansi_setup (void)
+{
+  const size_t n = 256;
+  size_t i;
+
+  init_ansi_parser (&ansi_parser, ansi_text, ansi_delete_line, NULL);
+
+  /* Each message is one line of virt-v2v output, as sent by
+   * notify_ui_callback.  Mix colourized messages with progress bar
+   * updates.
+   */
+  ansi_messages = calloc (n + 1, sizeof (char *));
+  if (ansi_messages == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  for (i = 0; i < n; ++i) {
+    int r;
+
+    if (i % 4 == 0)
+      r = asprintf (&ansi_messages[i],
+                    "\x1b[1;34m[ %6.1f] Inspecting the source\x1b[0m\n",
+                    i * 0.5);
+    else
+      r = asprintf (&ansi_messages[i],
+                    "\r (%zu.00/100%%)"
+                    "                                                 ",
+                    i % 100);
+    if (r == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+  }
+  ansi_index = 0;
+}
+
+static void
+ansi_run (void)
+{
+  ansi_parser_feed (&ansi_parser, ansi_messages[ansi_index]);
+  ansi_index++;
+  if (ansi_messages[ansi_index] == NULL)
+    ansi_index = 0;
+}
+
+static void
+ansi_teardown (void)
+{
+  guestfs_int_free_string_list (ansi_messages);
+}
+
+/*----------------------------------------------------------------------*/
+/* generate_physical_xml */
+
+#define PHYSICAL_XML_DISKS 256
+#define PHYSICAL_XML_INTERFACES 128
+
+static struct config *xml_config;
+static struct data_conn *xml_data_conns;
+
+static char **
+make_list (const char *prefix, size_t n, int drive_names)
+{
+  char **ret;
+  size_t i;
+
+  ret = calloc (n + 1, sizeof (char *));
+  if (ret == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  for (i = 0; i < n; ++i) {
+    char name[64];
+
+    if (drive_names) {
+      strcpy (name, prefix);
+      guestfs_int_drive_name (i, &name[strlen (prefix)]);
+    }
+    else
+      snprintf (name, sizeof name, "%s%zu", prefix, i);
+    ret[i] = strdup (name);
+    if (ret[i] == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+  }
+  return ret;
+}
+
+static void
+xml_setup (void)
+{
+  size_t i;
+
+  xml_config = new_config ();
+  xml_config->guestname = strdup ("physical-machine-01");
+  xml_config->memory = UINT64_C (32) * 1024 * 1024 * 1024;
+  xml_config->vcpu.phys_topo = false;
+  xml_config->vcpu.cores = 16;
+  xml_config->cpu.vendor = strdup ("Intel");
+  xml_config->cpu.model = strdup ("Skylake-Server");
+  xml_config->cpu.acpi = xml_config->cpu.apic = xml_config->cpu.pae = true;
+  xml_config->disks = make_list ("sd", PHYSICAL_XML_DISKS, 1);
+  xml_config->removable = make_list ("sr", 2, 0);
+  xml_config->interfaces = make_list ("eth", PHYSICAL_XML_INTERFACES, 0);
+  xml_config->network_map = make_list ("eth", PHYSICAL_XML_INTERFACES, 0);
+  for (i = 0; xml_config->network_map[i] != NULL; ++i) {
+    char *p;
+
+    if (asprintf (&p, "%s:network%zu", xml_config->network_map[i], i) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    free (xml_config->network_map[i]);
+    xml_config->network_map[i] = p;
+  }
+
+  xml_data_conns = calloc (PHYSICAL_XML_DISKS, sizeof (struct data_conn));
+  if (xml_data_conns == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  for (i = 0; i < PHYSICAL_XML_DISKS; ++i)
+    xml_data_conns[i].nbd_remote_port = 50000 + i;
+}
+
+static void
+xml_run (void)
+{
+  generate_physical_xml (xml_config, xml_data_conns, "/dev/null");
+}
+
+static void
+xml_teardown (void)
+{
+  free_config (xml_config);
+  free (xml_data_conns);
+}
+
+/*----------------------------------------------------------------------*/
+/* find_all_disks */
+
+#define SYS_BLOCK_DISKS 512
+
+static char *sys_block;
+static char **sys_block_entries;
+
+static void
+write_file (const char *dir, const char *name, const char *content)
+{
+  CLEANUP_FREE char *path = NULL;
+  FILE *fp;
+
+  if (asprintf (&path, "%s/%s", dir, name) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  fp = fopen (path, "w");
+  if (fp == NULL)
+    error (EXIT_FAILURE, errno, "fopen: %s", path);
+  fputs (content, fp);
+  if (fclose (fp) == EOF)
+    error (EXIT_FAILURE, errno, "fclose: %s", path);
+}
+
+/* Create a synthetic F</sys/block> with lots of disks, and some
+ * other devices which should be ignored or treated as removable.
+ */
+static void
+disks_setup (void)
+{
+  const char *tmpdir = getenv ("TMPDIR") ? : "/tmp";
+  size_t i, n = 0;
+
+  if (asprintf (&sys_block, "%s/p2v-microbench.XXXXXX", tmpdir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  if (mkdtemp (sys_block) == NULL)
+    error (EXIT_FAILURE, errno, "mkdtemp: %s", sys_block);
+
+  sys_block_entries = calloc (SYS_BLOCK_DISKS + 64 + 1, sizeof (char *));
+  if (sys_block_entries == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  for (i = 0; i < SYS_BLOCK_DISKS + 64; ++i) {
+    char name[64];
+    CLEANUP_FREE char *path = NULL;
+
+    if (i < SYS_BLOCK_DISKS) {
+      strcpy (name, "sd");
+      guestfs_int_drive_name (i, &name[2]);
+    }
+    else if (i < SYS_BLOCK_DISKS + 4)
+      snprintf (name, sizeof name, "sr%zu", i - SYS_BLOCK_DISKS);
+    else if (i < SYS_BLOCK_DISKS + 32)
+      snprintf (name, sizeof name, "loop%zu", i - SYS_BLOCK_DISKS);
+    else
+      snprintf (name, sizeof name, "dm-%zu", i - SYS_BLOCK_DISKS);
+
+    if (asprintf (&path, "%s/%s", sys_block, name) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    if (mkdir (path, 0755) == -1)
+      error (EXIT_FAILURE, errno, "mkdir: %s", path);
+    write_file (path, "removable", "0\n");
+    sys_block_entries[n++] = strdup (name);
+  }
+}
+
+static void
+disks_run (void)
+{
+  char **disks, **removable;
+
+  find_all_disks_in (sys_block, &disks, &removable);
+  guestfs_int_free_string_list (disks);
+  guestfs_int_free_string_list (removable);
+}
+
+static void
+disks_teardown (void)
+{
+  size_t i;
+
+  for (i = 0; sys_block_entries[i] != NULL; ++i) {
+    CLEANUP_FREE char *path = NULL, *file = NULL;
+
+    if (asprintf (&path, "%s/%s", sys_block, sys_block_entries[i]) == -1 ||
+        asprintf (&file, "%s/removable", path) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    unlink (file);
+    rmdir (path);
+  }
+  rmdir (sys_block);
+  free (sys_block);
+  guestfs_int_free_string_list (sys_block_entries);
+}
+
+/*----------------------------------------------------------------------*/
+
+struct benchmark {
+  const char *name;
+  void (*setup) (void);
+  void (*run) (void);
+  void (*teardown) (void);
+};
+
+static const struct benchmark benchmarks[] = {
+  { "mexp_expect", expect_setup, expect_run, expect_teardown },
+  { "mexp_expect/debug", expect_debug_setup, expect_run, expect_teardown },
+  { "parse_cmdline_string", NULL, cmdline_run, NULL },
+  { "ansi_parser_feed", ansi_setup, ansi_run, ansi_teardown },
+  { "generate_physical_xml/256-disks", xml_setup, xml_run, xml_teardown },
+  { "find_all_disks/512-disks", disks_setup, disks_run, disks_teardown },
+};
+
+static void
+run_benchmark (const struct benchmark *b, double min_seconds)
+{
+  uint64_t iterations = 1, i;
+  double start, elapsed;
+  size_t allocations;
+
+  if (b->setup)
+    b->setup ();
+
+  /* Warm up. */
+  b->run ();
+
+  for (;;) {
+    allocations = get_allocations ();
+    start = now_seconds ();
+    for (i = 0; i < iterations; ++i)
+      b->run ();
+    elapsed = now_seconds () - start;
+    allocations = get_allocations () - allocations;
+
+    if (elapsed >= min_seconds || iterations >= UINT64_C (1) << 40)
+      break;
+    /* Aim slightly past min_seconds on the next attempt. */
+    if (elapsed > 0 && min_seconds / elapsed < 100)
+      iterations = iterations * (min_seconds / elapsed) * 1.2 + 1;
+    else
+      iterations *= 100;
+  }
+
+  printf ("%-36s %12" PRIu64 " %14.1f ns/op %10.1f allocs/op\n",
+          b->name, iterations, elapsed * 1e9 / iterations,
+          (double) allocations / iterations);
+  fflush (stdout);
+
+  if (b->teardown)
+    b->teardown ();
+}
+
+static void __attribute__((noreturn))
+usage (int status)
+{
+  if (status != EXIT_SUCCESS)
+    fprintf (stderr, "Try ‘%s --help’ for more information.\n",
+             g_get_prgname ());
+  else {
+    size_t i;
+
+    printf ("%s: microbenchmarks for virt-p2v\n"
+            "Usage:\n"
+            "  %s [--options] [NAME ...]\n"
+            "Options:\n"
+            "  --help                 Display brief help\n"
+            "  --list                 List the benchmarks\n"
+            "  --seconds=N            Run each benchmark for at least N "
+            "seconds (default: 1)\n"
+            "If NAME is given, only benchmarks containing NAME are run.\n"
+            "Benchmarks:\n",
+            g_get_prgname (), g_get_prgname ());
+    for (i = 0; i < sizeof benchmarks / sizeof benchmarks[0]; ++i)
+      printf ("  %s\n", benchmarks[i].name);
+  }
+  exit (status);
+}
+
+enum { HELP_OPTION = CHAR_MAX + 1 };
+
+static const char options[] = "";
+static const struct option long_options[] = {
+  { "help", 0, 0, HELP_OPTION },
+  { "list", 0, 0, 0 },
+  { "seconds", 1, 0, 0 },
+  { 0, 0, 0, 0 }
+};
+
+int
+main (int argc, char *argv[])
+{
+  int c, option_index;
+  double min_seconds = 1;
+  size_t i;
+  int j;
+
+  g_set_prgname ("microbench-virt-p2v");
+
+  for (;;) {
+    c = getopt_long (argc, argv, options, long_options, &option_index);
+    if (c == -1) break;
+
+    switch (c) {
+    case 0:                     /* options which are long only */
+      if (STREQ (long_options[option_index].name, "list")) {
+        for (i = 0; i < sizeof benchmarks / sizeof benchmarks[0]; ++i)
+          printf ("%s\n", benchmarks[i].name);
+        exit (EXIT_SUCCESS);
+      }
+      else if (STREQ (long_options[option_index].name, "seconds")) {
+        if (sscanf (optarg, "%lf", &min_seconds) != 1 || min_seconds <= 0)
+          error (EXIT_FAILURE, 0,
+                 "--seconds: could not parse ‘%s’", optarg);
+      }
+      else
+        error (EXIT_FAILURE, 0,
+               "unknown long option: %s (%d)",
+               long_options[option_index].name, option_index);
+      break;
+
+    case HELP_OPTION:
+      usage (EXIT_SUCCESS);
+
+    default:
+      usage (EXIT_FAILURE);
+    }
+  }
+
+  for (i = 0; i < sizeof benchmarks / sizeof benchmarks[0]; ++i) {
+    const struct benchmark *b = &benchmarks[i];
+
+    if (optind < argc) {
+      for (j = optind; j < argc; ++j)
+        if (strstr (b->name, argv[j]) != NULL)
+          break;
+      if (j == argc)
+        continue;
+    }
+
+    run_benchmark (b, min_seconds);
+  }
+
+  exit (EXIT_SUCCESS);
+}
@@ -47,6 +47,11 @@ static int nbd_local_port;
 /* Whether nbdkit recognizes "--exit-with-parent". */
 static bool nbd_exit_with_parent;
 
+/* Whether the nbdkit file plugin has the "cache" and "fadvise"
+ * parameters.
+ */
+static bool nbd_cache_none;
+
 static pid_t start_nbdkit (const char *device, int *fds, size_t nr_fds);
 static int open_listening_socket (int **fds, size_t *nr_fds);
 static int bind_tcpip_socket (const char *port, int **fds, size_t *nr_fds);
@@ -81,6 +86,45 @@ get_nbd_error (void)
   return nbd_error;
 }
 
+/* Probes started by C<probe_nbd_server>. */
+static struct background_command *nbd_probe_file, *nbd_probe_exit_with_parent;
+static struct background_command *nbd_probe_cache_none;
+
+/**
+ * Start checking for nbdkit in the background.  The checks are
+ * independent so they run in parallel.  C<test_nbd_server> waits for
+ * the results.
+ */
+void
+probe_nbd_server (void)
+{
+  if (nbd_probe_file != NULL)
+    return;
+
+#if DEBUG_STDERR
+  fprintf (stderr, "checking for nbdkit ...\n");
+#endif
+
+  nbd_probe_file =
+    start_background_command ("nbdkit probe (file plugin)",
+                              "nbdkit file --version"
+#ifndef DEBUG_STDERR
+                              " >/dev/null 2>&1"
+#endif
+                              );
+  nbd_probe_exit_with_parent =
+    start_background_command ("nbdkit probe (--exit-with-parent)",
+                              "nbdkit --exit-with-parent --version"
+#ifndef DEBUG_STDERR
+                              " >/dev/null 2>&1"
+#endif
+                              );
+  nbd_probe_cache_none =
+    start_background_command ("nbdkit probe (file cache=none)",
+                              "nbdkit file --dump-plugin | "
+                              "grep -q '^file_cache_none=yes'");
+}
+
 /**
  * Check for nbdkit.
  */
@@ -102,31 +146,28 @@ test_nbd_server (void)
     /* When testing on the local machine, choose a random port. */
     nbd_local_port = 50000 + (random () % 10000);
 
-#if DEBUG_STDERR
-  fprintf (stderr, "checking for nbdkit ...\n");
-#endif
+  probe_nbd_server ();
 
-  r = system ("nbdkit file --version"
-#ifndef DEBUG_STDERR
-              " >/dev/null 2>&1"
-#endif
-              );
+  r = wait_background_command (nbd_probe_file);
+  nbd_probe_file = NULL;
   if (r != 0) {
     fprintf (stderr, _("%s: nbdkit was not found, cannot continue.\n"),
              g_get_prgname ());
     exit (EXIT_FAILURE);
   }
 
-  r = system ("nbdkit --exit-with-parent --version"
-#ifndef DEBUG_STDERR
-              " >/dev/null 2>&1"
-#endif
-              );
+  r = wait_background_command (nbd_probe_exit_with_parent);
+  nbd_probe_exit_with_parent = NULL;
   nbd_exit_with_parent = (r == 0);
 
+  r = wait_background_command (nbd_probe_cache_none);
+  nbd_probe_cache_none = NULL;
+  nbd_cache_none = (r == 0);
+
 #if DEBUG_STDERR
-  fprintf (stderr, "found nbdkit (%s exit with parent)\n",
-           nbd_exit_with_parent ? "can" : "cannot");
+  fprintf (stderr, "found nbdkit (%s exit with parent, %s bypass the page cache)\n",
+           nbd_exit_with_parent ? "can" : "cannot",
+           nbd_cache_none ? "can" : "cannot");
 #endif
 }
 
@@ -228,13 +269,28 @@ start_nbdkit (const char *device, int *fds, size_t nr_fds)
                                          * thread does */
                  "-f";                  /* don't fork */
 
-    execlp ("nbdkit",
-            "nbdkit",
-            "-r",             /* readonly (vital!) */
-            nofork_opt,
-            "file",           /* file plugin */
-            file_str,         /* a device like file=/dev/sda */
-            NULL);
+    /* The whole disk is read once, so there is no point caching it,
+     * and on a machine with little RAM the page cache would push out
+     * everything else.
+     */
+    if (nbd_cache_none)
+      execlp ("nbdkit",
+              "nbdkit",
+              "-r",           /* readonly (vital!) */
+              nofork_opt,
+              "file",         /* file plugin */
+              file_str,       /* a device like file=/dev/sda */
+              "cache=none",
+              "fadvise=sequential",
+              NULL);
+    else
+      execlp ("nbdkit",
+              "nbdkit",
+              "-r",           /* readonly (vital!) */
+              nofork_opt,
+              "file",         /* file plugin */
+              file_str,       /* a device like file=/dev/sda */
+              NULL);
     perror ("nbdkit");
     _exit (EXIT_FAILURE);
   }
@@ -0,0 +1,343 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Helpers for the optional network benchmark which is run at the end
+ * of C<test_connection> (see F<ssh.c>).
+ *
+ * The benchmark uses the same transport as the data connections: an
+ * ssh reverse port forward back to a local port.  Instead of nbdkit,
+ * the local port is served by a "TCP source" thread which streams
+ * incompressible data for a fixed time, and the conversion server
+ * reads and counts it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <error.h>
+#include <locale.h>
+#include <libintl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <pthread.h>
+
+#include "ignore-value.h"
+
+#include "p2v.h"
+
+/* Results of the last benchmark (read from the remote). */
+struct network_benchmark network_benchmark;
+
+/* How long to wait for the conversion server to connect (seconds). */
+#define TCP_SOURCE_ACCEPT_TIMEOUT 30
+
+#define TCP_SOURCE_BUFFER_SIZE (256 * 1024)
+
+struct tcp_source {
+  pthread_t thread;
+  int listen_fd;
+  int cancel_fd[2];             /* Pipe used to stop waiting in accept. */
+  int port;
+  double seconds;               /* How long to stream data for. */
+  struct timespec start;        /* When the connection was accepted. */
+  int started;
+  uint64_t bytes_sent;
+};
+
+static double
+timespec_diff (const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static void *
+tcp_source_thread (void *tsv)
+{
+  struct tcp_source *ts = tsv;
+  struct pollfd pfds[2] = {
+    { .fd = ts->listen_fd, .events = POLLIN },
+    { .fd = ts->cancel_fd[0], .events = POLLIN },
+  };
+  struct timespec now;
+  char *buf;
+  size_t i;
+  int fd;
+
+  if (poll (pfds, 2, TCP_SOURCE_ACCEPT_TIMEOUT * 1000) <= 0 ||
+      !(pfds[0].revents & POLLIN))
+    return NULL;
+  fd = accept (ts->listen_fd, NULL, NULL);
+  if (fd == -1)
+    return NULL;
+
+  /* Random data so that compression in ssh (if enabled) does not
+   * distort the results.
+   */
+  buf = malloc (TCP_SOURCE_BUFFER_SIZE);
+  if (buf == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  for (i = 0; i < TCP_SOURCE_BUFFER_SIZE; ++i)
+    buf[i] = random ();
+
+  clock_gettime (CLOCK_MONOTONIC, &ts->start);
+  ts->started = 1;
+
+  do {
+    ssize_t r = send (fd, buf, TCP_SOURCE_BUFFER_SIZE, MSG_NOSIGNAL);
+    if (r <= 0)
+      break;
+    ts->bytes_sent += r;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+  } while (timespec_diff (&ts->start, &now) < ts->seconds);
+
+  close (fd);
+  free (buf);
+  return NULL;
+}
+
+/**
+ * Start a TCP source listening on an ephemeral port on the loopback
+ * interface.  When the first client connects it is sent random data
+ * for C<seconds> seconds, and then the connection is closed.
+ *
+ * Returns C<NULL> on error.
+ */
+struct tcp_source *
+start_tcp_source (double seconds)
+{
+  struct tcp_source *ts;
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof addr;
+  int err;
+
+  ts = calloc (1, sizeof *ts);
+  if (ts == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  ts->seconds = seconds;
+
+  if (pipe2 (ts->cancel_fd, O_CLOEXEC) == -1) {
+    perror ("pipe2");
+    free (ts);
+    return NULL;
+  }
+  ts->listen_fd = socket (AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (ts->listen_fd == -1) {
+    perror ("socket");
+    goto error;
+  }
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind (ts->listen_fd, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+      listen (ts->listen_fd, 1) == -1 ||
+      getsockname (ts->listen_fd, (struct sockaddr *) &addr, &addrlen) == -1) {
+    perror ("tcp source");
+    close (ts->listen_fd);
+    goto error;
+  }
+  ts->port = ntohs (addr.sin_port);
+
+  err = pthread_create (&ts->thread, NULL, tcp_source_thread, ts);
+  if (err != 0)
+    error (EXIT_FAILURE, err, "pthread_create");
+
+  return ts;
+
+ error:
+  close (ts->cancel_fd[0]);
+  close (ts->cancel_fd[1]);
+  free (ts);
+  return NULL;
+}
+
+int
+get_tcp_source_port (const struct tcp_source *ts)
+{
+  return ts->port;
+}
+
+/**
+ * Wait for the TCP source to finish, and free it.  If nothing has
+ * connected to the source yet, it is stopped immediately.
+ *
+ * If C<start> is not
+ * C<NULL>, it is set to the time the connection was accepted (or left
+ * unchanged if the source was never connected to, or if it is later
+ * than the time already there).
+ *
+ * Returns the number of bytes sent.
+ */
+uint64_t
+stop_tcp_source (struct tcp_source *ts, struct timespec *start)
+{
+  uint64_t bytes;
+
+  ignore_value (write (ts->cancel_fd[1], "", 1));
+  pthread_join (ts->thread, NULL);
+  close (ts->listen_fd);
+  close (ts->cancel_fd[0]);
+  close (ts->cancel_fd[1]);
+  bytes = ts->bytes_sent;
+  if (start && ts->started &&
+      (start->tv_sec == 0 || timespec_diff (&ts->start, start) > 0))
+    *start = ts->start;
+  free (ts);
+  return bytes;
+}
+
+/**
+ * Return the CPU time (user + system) used so far by process C<pid>,
+ * in seconds, or C<-1> if it cannot be read.
+ */
+double
+get_process_cpu_seconds (pid_t pid)
+{
+  CLEANUP_FREE char *path = NULL, *line = NULL;
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  size_t len = 0;
+  const char *p;
+  unsigned long utime, stime;
+  const long ticks = sysconf (_SC_CLK_TCK);
+
+  if (asprintf (&path, "/proc/%d/stat", (int) pid) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  fp = fopen (path, "r");
+  if (fp == NULL || getline (&line, &len, fp) == -1 || ticks <= 0)
+    return -1;
+
+  /* The command name (field 2) may contain spaces, so skip past it. */
+  p = strrchr (line, ')');
+  if (p == NULL ||
+      sscanf (p + 1,
+              " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+              &utime, &stime) != 2)
+    return -1;
+
+  return (double) (utime + stime) / ticks;
+}
+
+/**
+ * Return the size in bytes of C<disk> (an entry from
+ * C<config-E<gt>disks>), or C<0> if it cannot be determined.
+ */
+static uint64_t
+get_disk_bytes (const char *disk)
+{
+  CLEANUP_FREE char *device = NULL;
+  off_t size;
+  int fd;
+
+  if (disk[0] == '/')
+    device = strdup (disk);
+  else if (asprintf (&device, "/dev/%s", disk) == -1)
+    device = NULL;
+  if (device == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+
+  fd = open (device, O_RDONLY|O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  size = lseek (fd, 0, SEEK_END);
+  close (fd);
+
+  return size > 0 ? (uint64_t) size : 0;
+}
+
+static void
+format_duration (char *buf, size_t len, double seconds)
+{
+  const unsigned long s = seconds + 0.5;
+
+  if (s >= 3600)
+    snprintf (buf, len, "%luh %02lum", s / 3600, (s / 60) % 60);
+  else if (s >= 60)
+    snprintf (buf, len, "%lum %02lus", s / 60, s % 60);
+  else
+    snprintf (buf, len, "%lus", s);
+}
+
+/**
+ * Format the results of the network benchmark as human readable
+ * text, including a projection of how long it would take to copy the
+ * disks in C<config-E<gt>disks>.
+ *
+ * Returns C<NULL> if the benchmark was not run.  The caller must free
+ * the returned string.
+ */
+char *
+format_network_benchmark (const struct config *config)
+{
+  const struct network_benchmark *nb = &network_benchmark;
+  char *ret = NULL;
+  size_t len = 0;
+  FILE *fp;
+  uint64_t total = 0;
+  size_t i;
+
+  if (!nb->valid)
+    return NULL;
+
+  fp = open_memstream (&ret, &len);
+  if (fp == NULL)
+    error (EXIT_FAILURE, errno, "open_memstream");
+
+  fprintf (fp, _("Round trip time: %.1f ms (min), %.1f ms (avg)\n"),
+           nb->rtt_min * 1000, nb->rtt_avg * 1000);
+  fprintf (fp, _("Throughput: %.1f MB/s (1 stream), %.1f MB/s (%u streams)\n"),
+           nb->single_stream / 1e6, nb->multi_stream / 1e6, nb->nr_streams);
+  if (nb->ssh_cipher > 0)
+    fprintf (fp, _("ssh encryption: %.1f MB/s per core\n"),
+             nb->ssh_cipher / 1e6);
+
+  if (config->disks) {
+    for (i = 0; config->disks[i] != NULL; ++i)
+      total += get_disk_bytes (config->disks[i]);
+  }
+  /* virt-v2v copies the disks one at a time, so use the single
+   * stream throughput for the projection.
+   */
+  if (total > 0 && nb->single_stream > 0) {
+    char duration[64];
+
+    format_duration (duration, sizeof duration,
+                     total / nb->single_stream);
+    fprintf (fp, _("Projected time to copy %.1f GB of disks: %s\n"),
+             total / 1e9, duration);
+  }
+
+  fclose (fp);
+
+  /* Remove the final newline. */
+  if (len > 0 && ret[len-1] == '\n')
+    ret[len-1] = '\0';
+
+  return ret;
+}
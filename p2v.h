@@ -22,6 +22,8 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 
 /* Send various debug information to stderr.  Harmless and useful, so
  * can be left enabled in production builds.
@@ -57,6 +59,21 @@ extern int feature_colours_option;
 /* virt-p2v --colours option (used by ansi_* macros). */
 extern int force_colour;
 
+/* virt-p2v --record-sessions option (NULL if not used). */
+extern const char *record_sessions_dir;
+
+/* timeline.c */
+struct timeline;
+extern struct timeline *startup_timeline;
+extern int print_startup_timeline;
+extern struct timeline *new_timeline (void);
+extern void free_timeline (struct timeline *);
+extern size_t timeline_begin (struct timeline *, const char *fs, ...) __attribute__((format(printf,2,3)));
+extern void timeline_end (struct timeline *, size_t step);
+extern void timeline_mark (struct timeline *, const char *name);
+extern void timeline_print (struct timeline *, FILE *fp);
+extern void startup_ready (void);
+
 /* cpuid.c */
 struct cpu_topo {
   unsigned sockets;
@@ -66,8 +83,22 @@ struct cpu_topo {
 extern void get_cpu_topology (struct cpu_topo *topo);
 extern void get_cpu_config (struct cpu_config *);
 
+/* cpu-affinity.c */
+struct data_conn;
+extern void set_ui_affinity (void);
+extern void init_thread_affinity (pthread_attr_t *attr);
+extern void set_disk_thread_affinity (const char *disk);
+extern void set_data_conn_affinity (char * const *disks, size_t i, const struct data_conn *dc);
+
 /* disks.c */
 extern void find_all_disks (char ***disks, char ***removable);
+extern void find_all_disks_in (const char *sys_block, char ***disks, char ***removable);
+extern size_t get_disk_groups (char * const *disks, size_t *groups, bool *rotational);
+extern size_t get_disk_groups_in (const char *sys, char * const *disks, size_t *groups, bool *rotational);
+extern char **get_disk_sysfs_dirs (const char *disk);
+extern char **get_disk_sysfs_dirs_in (const char *sys, const char *disk);
+extern int get_disk_numa_node (const char *disk);
+extern int get_disk_numa_node_in (const char *sys, const char *disk);
 
 /* rtc.c */
 extern void get_rtc_config (struct rtc_config *);
@@ -86,6 +117,47 @@ extern void update_config_from_kernel_cmdline (struct config *config, char **cmd
 /* kernel.c */
 extern void kernel_conversion (struct config *, char **cmdline, int cmdline_source);
 
+/* events.c */
+extern int open_events (const char *target);
+extern int events_enabled (void);
+extern void emit_event (const char *event, const char *message);
+extern void emit_start_event (const struct config *);
+extern void emit_notify_event (int type, const char *data);
+
+/* metrics.c */
+enum conversion_phase {
+  PHASE_IDLE,
+  PHASE_BENCHMARKING_DISKS,
+  PHASE_CHECKSUMMING_DISKS,
+  PHASE_STARTING_NBD,
+  PHASE_OPENING_DATA_CONNECTIONS,
+  PHASE_GENERATING_METADATA,
+  PHASE_OPENING_CONTROL_CONNECTION,
+  PHASE_UPLOADING,
+  PHASE_CONVERTING,
+  PHASE_TEARING_DOWN,
+  PHASE_FINISHED,
+  PHASE_FAILED,
+};
+extern int start_metrics_server (const char *addr);
+extern void metrics_set_phase (enum conversion_phase);
+extern void metrics_set_disks (char * const *names);
+extern void metrics_set_data_conn (size_t i, const struct data_conn *dc);
+extern void metrics_set_control_pid (pid_t pid);
+extern void metrics_add_remote_output (size_t n);
+
+/* ansi-parser.c */
+struct ansi_parser {
+  int state;
+  int colour;               /* colour being parsed */
+  int current_colour;       /* 0-15, or -1 for the default colour */
+  void (*text) (void *opaque, const char *text, size_t len, int colour);
+  void (*delete_line) (void *opaque);
+  void *opaque;
+};
+extern void init_ansi_parser (struct ansi_parser *, void (*text) (void *opaque, const char *text, size_t len, int colour), void (*delete_line) (void *opaque), void *opaque);
+extern void ansi_parser_feed (struct ansi_parser *, const char *msg);
+
 /* gui.c */
 extern void gui_conversion (struct config *config,
                             const char * const *disks,
@@ -95,10 +167,16 @@ extern void gui_conversion (struct config *config,
 struct data_conn {          /* Data per NBD connection / physical disk. */
   mexp_h *h;                /* miniexpect handle to ssh */
   pid_t nbd_pid;            /* NBD server PID */
+  int nbd_local_port;       /* local port of the NBD server */
   int nbd_remote_port;      /* remote NBD port on conversion server */
+  uint64_t bytes_read;      /* bytes read by the NBD server (at the end) */
+  char *stage_dir;          /* remote staging directory, if staged */
+  size_t nr_extra;          /* extra data connections for staging */
+  mexp_h **extra_h;         /* NULL until the connection is opened */
+  int *extra_remote_port;
 };
 
-extern int start_conversion (struct config *, void (*notify_ui) (int type, const char *data));
+extern int start_conversion (struct config *, void (*notify_ui) (int type, const char *data), int (*retry_ui) (struct config *));
 #define NOTIFY_LOG_DIR        1  /* location of remote log directory */
 #define NOTIFY_REMOTE_MESSAGE 2  /* log message from remote virt-v2v */
 #define NOTIFY_STATUS         3  /* stage in conversion process */
@@ -106,6 +184,61 @@ extern const char *get_conversion_error (void);
 extern void cancel_conversion (void);
 extern int conversion_is_running (void);
 
+/* system-data.c */
+struct system_data;
+extern struct system_data *start_system_data (const char *tmpdir);
+extern int system_data_is_ready (struct system_data *);
+extern const char *wait_system_data (struct system_data *);
+extern void free_system_data (struct system_data *);
+
+/* network-benchmark.c */
+struct network_benchmark {
+  bool valid;                   /* Set if the benchmark was run. */
+  double rtt_min, rtt_avg;      /* Round trip time (seconds). */
+  double single_stream;         /* Throughput (bytes/second). */
+  double multi_stream;
+  unsigned nr_streams;          /* Number of streams in multi_stream. */
+  double ssh_cipher;            /* Local ssh throughput per CPU second. */
+};
+extern struct network_benchmark network_benchmark;
+struct tcp_source;
+extern struct tcp_source *start_tcp_source (double seconds);
+extern int get_tcp_source_port (const struct tcp_source *);
+extern uint64_t stop_tcp_source (struct tcp_source *, struct timespec *start);
+extern double get_process_cpu_seconds (pid_t pid);
+extern char *format_network_benchmark (const struct config *);
+
+/* disk-benchmark.c */
+extern int benchmark_disk (const char *disk);
+extern char *get_disk_benchmark (const char *disk);
+extern double get_disk_read_rate (const char *disk);
+extern int write_disk_benchmarks (char **disks, const char *filename);
+
+/* disk-tuning.c */
+struct disk_tuning;
+extern struct disk_tuning *tune_disks (char * const *disks, struct timeline *tl);
+extern void restore_disk_tuning (struct disk_tuning *);
+
+/* transfer.c */
+#define TRANSFER_CHUNK_SIZE (64 * 1024 * 1024)
+extern bool is_staged_transfer (const struct config *);
+extern bool is_resumable_transfer (const struct config *);
+extern bool is_checksummed_transfer (const struct config *);
+extern char *get_disk_stage_dir (struct config *, size_t i);
+extern int write_all_disk_checksums (struct config *, const char *dir, int (*cancelled) (void));
+extern unsigned get_transfer_streams (const struct config *);
+extern bool is_adaptive_transfer (const struct config *);
+extern unsigned get_max_transfer_streams (const struct config *);
+extern void generate_stage_function (FILE *fp);
+
+/* stage-script.c */
+extern const char stage_script[];
+
+/* supervisor.c */
+struct supervisor;
+extern struct supervisor *start_supervisor (struct config *, struct data_conn *, size_t nr_disks, const char *remote_dir, const char *tmpdir, void (*notify_ui) (int type, const char *data));
+extern unsigned stop_supervisor (struct supervisor *);
+
 /* physical-xml.c */
 extern void generate_physical_xml (struct config *, struct data_conn *, const char *filename);
 
@@ -115,11 +248,16 @@ extern int inhibit_power_saving (void);
 /* ssh.c */
 extern int test_connection (struct config *);
 extern mexp_h *open_data_connection (struct config *, int local_port, int *remote_port);
+extern mexp_h *reopen_data_connection (struct config *, int local_port, int remote_port);
 extern mexp_h *start_remote_connection (struct config *, const char *remote_dir);
+extern int close_session (mexp_h *h);
+extern void relay_session (char **argv) __attribute__((noreturn));
 extern const char *get_ssh_error (void);
 extern int scp_file (struct config *config, const char *target, const char *local, ...) __attribute__((sentinel));
+extern void prefetch_ssh_identity (const char *url);
 
 /* nbd.c */
+extern void probe_nbd_server (void);
 extern void test_nbd_server (void);
 extern pid_t start_nbd_server (int *port, const char *device);
 const char *get_nbd_error (void);
@@ -128,8 +266,15 @@ const char *get_nbd_error (void);
 extern uint64_t get_blockdev_size (const char *dev);
 extern char *get_blockdev_model (const char *dev);
 extern char *get_blockdev_serial (const char *dev);
+extern int get_process_io_counter (pid_t pid, const char *field, uint64_t *ret);
+extern double get_memory_pressure (void);
 extern char *get_if_addr (const char *if_name);
 extern char *get_if_vendor (const char *if_name, int truncate);
+extern char *get_machine_id (void);
+struct background_command;
+extern struct background_command *start_background_command (const char *description, const char *command);
+extern int wait_background_command (struct background_command *);
+extern void start_network_online (void);
 extern void wait_network_online (const struct config *);
 extern int compare_strings (const void *vp1, const void *vp2);
 
@@ -187,18 +187,29 @@ generate_physical_xml (struct config *config, struct data_conn *data_conns,
         }
 
         start_element ("disk") {
-          attribute ("type", "network");
+          /* A staged disk (see transfer.c) is converted from the copy
+           * on the conversion server instead of over the data
+           * connection.
+           */
+          attribute ("type",
+                     data_conns[i].stage_dir ? "file" : "network");
           attribute ("device", "disk");
           start_element ("driver") {
             attribute ("name", "qemu");
             attribute ("type", "raw");
           } end_element ();
           start_element ("source") {
-            attribute ("protocol", "nbd");
-            start_element ("host") {
-              attribute ("name", "localhost");
-              attribute_format ("port", "%d", data_conns[i].nbd_remote_port);
-            } end_element ();
+            if (data_conns[i].stage_dir)
+              attribute_format ("file", "%s/disk.raw",
+                                data_conns[i].stage_dir);
+            else {
+              attribute ("protocol", "nbd");
+              start_element ("host") {
+                attribute ("name", "localhost");
+                attribute_format ("port", "%d",
+                                  data_conns[i].nbd_remote_port);
+              } end_element ();
+            }
           } end_element ();
           start_element ("target") {
             attribute ("dev", target_dev);
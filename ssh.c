@@ -44,15 +44,21 @@
 #include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
 #include <errno.h>
 #include <error.h>
 #include <locale.h>
 #include <assert.h>
 #include <libintl.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
 
+#include <pthread.h>
+
 #include "ignore-value.h"
 
 #include "miniexpect.h"
@@ -60,6 +66,11 @@
 
 #define SSH_TIMEOUT 60          /* seconds */
 
+/* How long a reopened data connection must stay up before we assume
+ * that the remote port was forwarded (see reopen_data_connection).
+ */
+#define REOPEN_WAIT 5           /* seconds */
+
 char *v2v_version = NULL;
 char **input_drivers = NULL;
 char **output_drivers = NULL;
@@ -71,7 +82,11 @@ free_globals (void)
   pcre2_substring_free ((PCRE2_UCHAR *)v2v_version);
 }
 
-static char *ssh_error;
+/* The last error, per thread, since the supervisor thread opens data
+ * connections and copies files while the conversion thread is using
+ * ssh too.  A thread can only read back its own errors.
+ */
+static __thread char *ssh_error;
 
 static void set_ssh_error (const char *fs, ...)
   __attribute__((format(printf,1,2)));
@@ -130,6 +145,7 @@ static pcre2_code *feature_colours_option_re;
 static pcre2_code *feature_input_re;
 static pcre2_code *feature_output_re;
 static pcre2_code *portfwd_re;
+static pcre2_code *benchmark_bytes_re;
 
 static void
 compile_regexps (void)
@@ -174,6 +190,7 @@ compile_regexps (void)
   COMPILE (feature_input_re, "input:((?:[-\\w])+)");
   COMPILE (feature_output_re, "output:((?:[-\\w])+)");
   COMPILE (portfwd_re, "Allocated port ((?:\\d)+) for remote forward");
+  COMPILE (benchmark_bytes_re, "p2v-bytes=((?:\\d)+)");
 }
 
 static void
@@ -189,6 +206,7 @@ free_regexps (void)
   pcre2_code_free (feature_input_re);
   pcre2_code_free (feature_output_re);
   pcre2_code_free (portfwd_re);
+  pcre2_code_free (benchmark_bytes_re);
 }
 
 /**
@@ -258,6 +276,68 @@ curl_download (const char *url, const char *local_file)
   return 0;
 }
 
+/* State of the identity download started by C<prefetch_ssh_identity>. */
+static pthread_t prefetch_thread;
+static int prefetch_started;
+static char *prefetch_url;
+static char *prefetch_file;     /* NULL if the download failed. */
+
+static void *
+prefetch_ssh_identity_thread (void *arg)
+{
+  size_t step;
+  int fd;
+
+  /* The URL is usually on the network. */
+  wait_network_online (NULL);
+
+  step = timeline_begin (startup_timeline, "identity download");
+  prefetch_file = strdup ("/tmp/id.XXXXXX");
+  if (prefetch_file == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  fd = mkstemp (prefetch_file);
+  if (fd == -1)
+    error (EXIT_FAILURE, errno, "mkstemp");
+  close (fd);
+
+  if (curl_download (prefetch_url, prefetch_file) == -1) {
+    unlink (prefetch_file);
+    free (prefetch_file);
+    prefetch_file = NULL;
+  }
+  timeline_end (startup_timeline, step);
+
+  return NULL;
+}
+
+/**
+ * Start downloading the ssh identity from C<url> in the background,
+ * once the network is online.  This is used in kernel mode so that
+ * the download overlaps with the rest of startup.
+ *
+ * C<cache_ssh_identity> waits for the download to finish and uses the
+ * result if the configured URL is still the same.  No other function
+ * in this file may be called until then.
+ */
+void
+prefetch_ssh_identity (const char *url)
+{
+  int err;
+
+  if (prefetch_started)
+    return;
+
+  prefetch_url = strdup (url);
+  if (prefetch_url == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+
+  err = pthread_create (&prefetch_thread, NULL,
+                        prefetch_ssh_identity_thread, NULL);
+  if (err != 0)
+    error (EXIT_FAILURE, err, "pthread_create");
+  prefetch_started = 1;
+}
+
 /**
  * Re-cache the C<config-E<gt>identity.url> if needed.
  */
@@ -266,6 +346,35 @@ cache_ssh_identity (struct config *config)
 {
   int fd;
 
+  /* Collect the result of any download started at startup. */
+  if (prefetch_started) {
+    pthread_join (prefetch_thread, NULL);
+    prefetch_started = 0;
+
+    if (config->auth.identity.url &&
+        config->auth.identity.file_needs_update &&
+        STREQ (config->auth.identity.url, prefetch_url)) {
+      if (prefetch_file == NULL) {
+        /* The thread already set the error. */
+        free (prefetch_url);
+        prefetch_url = NULL;
+        return -1;
+      }
+      free (config->auth.identity.file);
+      config->auth.identity.file = prefetch_file;
+      config->auth.identity.file_needs_update = 0;
+      prefetch_file = NULL;
+    }
+    free (prefetch_url);
+    prefetch_url = NULL;
+    /* Not used: do not leave a copy of the private key behind. */
+    if (prefetch_file) {
+      unlink (prefetch_file);
+      free (prefetch_file);
+      prefetch_file = NULL;
+    }
+  }
+
   /* If it doesn't need downloading, return. */
   if (config->auth.identity.url == NULL ||
       !config->auth.identity.file_needs_update)
@@ -289,9 +398,369 @@ cache_ssh_identity (struct config *config)
     return -1;
   }
 
+  /* Don't download it again for every ssh connection. */
+  config->auth.identity.file_needs_update = 0;
+
+  return 0;
+}
+
+/**
+ * Session recording (I<--record-sessions>, see L<p2v-hacking(1)>).
+ *
+ * miniexpect is bundled unmodified from upstream and has no hooks
+ * for this, so recorded sessions go through a relay process instead.
+ * C<spawn_session> runs S<C<virt-p2v --relay-session FILE PROGRAM
+ * ARGS...>> in place of ssh or scp.  The relay (C<relay_session>)
+ * runs the real program on a pty of its own, and copies data between
+ * the two ptys, writing each chunk to the record file with a
+ * timestamp as it passes through.  Signals sent to the relay with
+ * L<kill(2)> are passed on to the program, and the relay exits with
+ * the program's status, so the miniexpect handle can be used as if
+ * it was the program's own.
+ *
+ * C<send_password> sends a NUL byte, the length of the password in
+ * decimal and another NUL byte before the password.  The relay
+ * removes these, and leaves that many bytes out of the record.
+ * virt-p2v never sends NUL bytes to ssh or scp otherwise.
+ *
+ * Each line of the record file is one event:
+ *
+ *   R <time> "<data>"     data read from the subprocess
+ *   E <time>              end of file reading from the subprocess
+ *   W <time> "<data>"     data written to the subprocess
+ *   P <time> <len>        password written (not recorded)
+ *   C <time>              virt-p2v closed the session
+ *   X <time> <status>     subprocess exited (waitpid status)
+ *
+ * where <time> is seconds since recording started, and <data> is
+ * escaped like a C string, using only \\ \" \n \r \t and \xHH.
+ */
+
+/* State of the relay process. */
+static FILE *record_fp;         /* NULL if the file could not be opened. */
+static struct timespec record_start;
+static pid_t relay_pid;         /* The program being recorded. */
+
+static void
+record_event (char type, const char *buf, ssize_t len)
+{
+  struct timespec now;
+  double t;
+  ssize_t i;
+
+  if (record_fp == NULL)
+    return;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  t = (now.tv_sec - record_start.tv_sec) +
+    (now.tv_nsec - record_start.tv_nsec) / 1e9;
+  fprintf (record_fp, "%c %.6f", type, t);
+
+  if (buf) {
+    fputs (" \"", record_fp);
+    for (i = 0; i < len; ++i) {
+      const unsigned char c = buf[i];
+
+      switch (c) {
+      case '\\': fputs ("\\\\", record_fp); break;
+      case '"': fputs ("\\\"", record_fp); break;
+      case '\n': fputs ("\\n", record_fp); break;
+      case '\r': fputs ("\\r", record_fp); break;
+      case '\t': fputs ("\\t", record_fp); break;
+      default:
+        if (c >= 32 && c < 127)
+          fputc (c, record_fp);
+        else
+          fprintf (record_fp, "\\x%02x", c);
+      }
+    }
+    fputc ('"', record_fp);
+  }
+  else if (type == 'P' || type == 'X')
+    fprintf (record_fp, " %zd", len);
+
+  fputc ('\n', record_fp);
+  fflush (record_fp);
+}
+
+static int
+write_all (int fd, const char *buf, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (fd, buf, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
   return 0;
 }
 
+/* Pass on signals sent with kill(2).  The SIGHUP which the kernel
+ * sends when virt-p2v closes the handle is ignored here, since the
+ * relay sees the end of file and hangs up the program itself.
+ */
+static void
+forward_signal (int sig, siginfo_t *info, void *context)
+{
+  if (relay_pid > 0 &&
+      (info->si_code == SI_USER || info->si_code == SI_QUEUE))
+    kill (relay_pid, sig);
+}
+
+/**
+ * The relay process of a recorded session (see above).  virt-p2v
+ * runs itself as S<C<virt-p2v --relay-session FILE PROGRAM
+ * ARGS...>>, and C<argv> starts at C<FILE>.  This does not return.
+ */
+void
+relay_session (char **argv)
+{
+  const char *filename = argv[0];
+  char **prog_argv = &argv[1];
+  const int sigs[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM };
+  struct sigaction sa;
+  struct termios termios;
+  bool have_termios;
+  char slave[1024];
+  int pty_fd;
+  struct pollfd fds[2];
+  char buf[BUFSIZ];
+  ssize_t r;
+  size_t i, n, password_len = 0, marker = 0;
+  bool in_marker = false;
+  int status;
+
+  /* The file was created by spawn_session, which reports any errors,
+   * since anything printed here would be seen as output of the
+   * program.
+   */
+  record_fp = fopen (filename, "ae");
+  clock_gettime (CLOCK_MONOTONIC, &record_start);
+
+  /* Give the program a pty with the settings which miniexpect chose
+   * for ours, and make ours raw, so that everything passes through
+   * it unchanged.
+   */
+  have_termios = tcgetattr (0, &termios) == 0;
+  pty_fd = posix_openpt (O_RDWR|O_NOCTTY);
+  if (pty_fd == -1 || grantpt (pty_fd) == -1 || unlockpt (pty_fd) == -1 ||
+      ptsname_r (pty_fd, slave, sizeof slave) != 0)
+    error (EXIT_FAILURE, errno, "posix_openpt");
+  if (fcntl (pty_fd, F_SETFD, FD_CLOEXEC) == -1)
+    error (EXIT_FAILURE, errno, "fcntl");
+  if (have_termios) {
+    struct termios raw = termios;
+
+    cfmakeraw (&raw);
+    tcsetattr (0, TCSANOW, &raw);
+  }
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_sigaction = forward_signal;
+  sa.sa_flags = SA_SIGINFO|SA_RESTART;
+  sigemptyset (&sa.sa_mask);
+  for (i = 0; i < sizeof sigs / sizeof sigs[0]; ++i)
+    sigaction (sigs[i], &sa, NULL);
+
+  relay_pid = fork ();
+  if (relay_pid == -1)
+    error (EXIT_FAILURE, errno, "fork");
+  if (relay_pid == 0) {         /* Child. */
+    int fd;
+
+    /* Like mexp_spawnvf, open the slave after setsid so that it
+     * becomes the controlling tty.
+     */
+    setsid ();
+    fd = open (slave, O_RDWR);
+    if (fd == -1) {
+      perror (slave);
+      _exit (EXIT_FAILURE);
+    }
+    if (have_termios)
+      tcsetattr (fd, TCSANOW, &termios);
+    dup2 (fd, 0);
+    dup2 (fd, 1);
+    dup2 (fd, 2);
+    if (fd > 2)
+      close (fd);
+    execvp (prog_argv[0], prog_argv);
+    perror (prog_argv[0]);
+    _exit (EXIT_FAILURE);
+  }
+
+  for (;;) {
+    fds[0].fd = 0;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = pty_fd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    if (poll (fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (fds[1].revents != 0) {
+      r = read (pty_fd, buf, sizeof buf);
+      if (r > 0) {
+        record_event ('R', buf, r);
+        ignore_value (write_all (1, buf, r));
+      }
+      /* On Linux, read returns EIO once the program has closed the
+       * pty (see miniexpect.c).
+       */
+      else if (r == 0 || (errno != EINTR && errno != EAGAIN)) {
+        record_event ('E', NULL, 0);
+        break;
+      }
+    }
+
+    if (fds[0].revents != 0) {
+      r = read (0, buf, sizeof buf);
+      if (r == -1 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      if (r <= 0) {
+        record_event ('C', NULL, 0);
+        break;
+      }
+
+      for (i = 0; i < (size_t) r; i += n) {
+        const char *p = buf + i;
+        const char *nul;
+        size_t pw;
+
+        /* The password length sent by send_password. */
+        if (in_marker) {
+          if (*p == '\0') {
+            password_len += marker;
+            in_marker = false;
+          }
+          else
+            marker = marker * 10 + (*p - '0');
+          n = 1;
+          continue;
+        }
+        if (*p == '\0') {
+          in_marker = true;
+          marker = 0;
+          n = 1;
+          continue;
+        }
+
+        nul = memchr (p, '\0', r - i);
+        n = nul ? (size_t) (nul - p) : r - i;
+        pw = MIN (password_len, n);
+        password_len -= pw;
+        if (pw > 0)
+          record_event ('P', NULL, pw);
+        if (n > pw)
+          record_event ('W', p + pw, n - pw);
+        ignore_value (write_all (pty_fd, p, n));
+      }
+    }
+  }
+
+  /* Closing the pty hangs up the program, if it is still running. */
+  close (pty_fd);
+  while (waitpid (relay_pid, &status, 0) == -1) {
+    if (errno != EINTR)
+      error (EXIT_FAILURE, errno, "waitpid");
+  }
+  record_event ('X', NULL, status);
+
+  if (WIFSIGNALED (status)) {
+    signal (WTERMSIG (status), SIG_DFL);
+    raise (WTERMSIG (status));
+  }
+  _exit (WIFEXITED (status) ? WEXITSTATUS (status) : EXIT_FAILURE);
+}
+
+/**
+ * Start C<program> (ssh or scp) using miniexpect.  If
+ * I<--record-sessions> was used, it runs through the relay process
+ * (see above), which records the session to a new file in that
+ * directory.  The files are numbered in the order that the sessions
+ * start and named after the program, eg. F<003-ssh>.  Failure to
+ * create the file is not an error.
+ */
+static mexp_h *
+spawn_session (unsigned flags, const char *program, const char **argv)
+{
+  static pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER;
+  static unsigned counter = 0;
+  CLEANUP_FREE char *filename = NULL;
+  CLEANUP_FREE const char **relay_argv = NULL;
+  FILE *fp;
+  unsigned n;
+  size_t i, nr_args;
+
+  if (record_sessions_dir == NULL)
+    return mexp_spawnvf (flags, program, (char **) argv);
+
+  pthread_mutex_lock (&counter_lock);
+  n = ++counter;
+  pthread_mutex_unlock (&counter_lock);
+
+  if (asprintf (&filename, "%s/%03u-%s",
+                record_sessions_dir, n, program) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+
+  fp = fopen (filename, "we");
+  if (fp == NULL)
+    perror (filename);
+  else {
+    fprintf (fp, "# virt-p2v session record\n");
+    fputc ('#', fp);
+    for (i = 0; argv[i] != NULL; ++i)
+      fprintf (fp, " %s", argv[i]);
+    fputc ('\n', fp);
+    fclose (fp);
+  }
+
+  nr_args = guestfs_int_count_strings ((char **) argv);
+  relay_argv = malloc ((nr_args + 4) * sizeof (char *));
+  if (relay_argv == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  relay_argv[0] = "virt-p2v";
+  relay_argv[1] = "--relay-session";
+  relay_argv[2] = filename;
+  memcpy (&relay_argv[3], argv, (nr_args + 1) * sizeof (char *));
+
+  return mexp_spawnvf (flags, "/proc/self/exe", (char **) relay_argv);
+}
+
+/**
+ * Send the password to the subprocess.  This is the same as
+ * C<mexp_printf_password>, but it also keeps the password out of the
+ * session record.
+ */
+static int
+send_password (mexp_h *h, const char *password)
+{
+  if (record_sessions_dir != NULL &&
+      mexp_printf (h, "%c%zu%c", '\0', strlen (password), '\0') == -1)
+    return -1;
+  return mexp_printf_password (h, "%s", password);
+}
+
+/**
+ * Close a handle returned by C<start_ssh> or C<scp_file>, or any of
+ * the functions which call them.  This is the same as C<mexp_close>.
+ */
+int
+close_session (mexp_h *h)
+{
+  return mexp_close (h);
+}
+
 /* GCC complains about the argv array in the next function which it
  * thinks might grow to an unbounded size.  Since we control
  * extra_args, this is not in fact a problem.
@@ -373,7 +842,7 @@ start_ssh (unsigned spawn_flags, struct config *config,
 #endif
 
   /* Create the miniexpect handle. */
-  h = mexp_spawnvf (spawn_flags, "ssh", (char **) argv);
+  h = spawn_session (spawn_flags, "ssh", argv);
   if (h == NULL) {
     set_ssh_internal_error ("ssh: mexp_spawnvf: %m");
     return NULL;
@@ -404,10 +873,10 @@ start_ssh (unsigned spawn_flags, struct config *config,
                            { 0 }
                          }, match_data)) {
     case 100:                   /* Got password prompt. */
-      if (mexp_printf_password (h, "%s", config->auth.password) == -1 ||
+      if (send_password (h, config->auth.password) == -1 ||
           mexp_printf (h, "\n") == -1) {
         set_ssh_mexp_error ("mexp_printf");
-        mexp_close (h);
+        close_session (h);
         return NULL;
       }
       break;
@@ -428,22 +897,22 @@ start_ssh (unsigned spawn_flags, struct config *config,
         set_ssh_error ("%s", (char *) ssh_message);
       else
         set_ssh_error ("ssh closed the connection without printing an error.");
-      mexp_close (h);
+      close_session (h);
       return NULL;
 
     case MEXP_TIMEOUT:
       set_ssh_unexpected_timeout ("password prompt");
-      mexp_close (h);
+      close_session (h);
       return NULL;
 
     case MEXP_ERROR:
       set_ssh_mexp_error ("mexp_expect");
-      mexp_close (h);
+      close_session (h);
       return NULL;
 
     case MEXP_PCRE_ERROR:
       set_ssh_pcre_error ();
-      mexp_close (h);
+      close_session (h);
       return NULL;
     }
   }
@@ -471,7 +940,7 @@ start_ssh (unsigned spawn_flags, struct config *config,
    */
   if (mexp_printf (h, "exec bash --noediting --noprofile --norc\n") == -1) {
     set_ssh_mexp_error ("mexp_printf");
-    mexp_close (h);
+    close_session (h);
     return NULL;
   }
 
@@ -486,7 +955,7 @@ start_ssh (unsigned spawn_flags, struct config *config,
 
     if (guestfs_int_random_string (magic, 8) == -1) {
       set_ssh_internal_error ("random_string: %m");
-      mexp_close (h);
+      close_session (h);
       return NULL;
     }
 
@@ -495,7 +964,7 @@ start_ssh (unsigned spawn_flags, struct config *config,
      */
     if (mexp_printf (h, "export LANG=C PS1='###''%s''### '\n", magic) == -1) {
       set_ssh_mexp_error ("mexp_printf");
-      mexp_close (h);
+      close_session (h);
       return NULL;
     }
 
@@ -509,7 +978,7 @@ start_ssh (unsigned spawn_flags, struct config *config,
                          }, match_data)) {
     case 100:                    /* Got password prompt unexpectedly. */
       set_ssh_error ("Login failed.  Probably the username and/or password is wrong.");
-      mexp_close (h);
+      close_session (h);
       return NULL;
 
     case 101:
@@ -527,7 +996,7 @@ start_ssh (unsigned spawn_flags, struct config *config,
 
     case MEXP_EOF:
       set_ssh_unexpected_eof ("the command prompt");
-      mexp_close (h);
+      close_session (h);
       return NULL;
 
     case MEXP_TIMEOUT:
@@ -538,18 +1007,18 @@ start_ssh (unsigned spawn_flags, struct config *config,
 
     case MEXP_ERROR:
       set_ssh_mexp_error ("mexp_expect");
-      mexp_close (h);
+      close_session (h);
       return NULL;
 
     case MEXP_PCRE_ERROR:
       set_ssh_pcre_error ();
-      mexp_close (h);
+      close_session (h);
       return NULL;
     }
   }
 
   set_ssh_error ("Failed to synchronize with remote shell after 60 seconds.");
-  mexp_close (h);
+  close_session (h);
   return NULL;
 
  got_prompt:
@@ -644,7 +1113,7 @@ scp_file (struct config *config, const char *target, const char *local, ...)
 #endif
 
   /* Create the miniexpect handle. */
-  h = mexp_spawnv ("scp", (char **) argv);
+  h = spawn_session (0, "scp", argv);
   if (h == NULL) {
     set_ssh_internal_error ("scp: mexp_spawnv: %m");
     return -1;
@@ -675,10 +1144,10 @@ scp_file (struct config *config, const char *target, const char *local, ...)
                            { 0 }
                          }, match_data)) {
     case 100:                   /* Got password prompt. */
-      if (mexp_printf_password (h, "%s", config->auth.password) == -1 ||
+      if (send_password (h, config->auth.password) == -1 ||
           mexp_printf (h, "\n") == -1) {
         set_ssh_mexp_error ("mexp_printf");
-        mexp_close (h);
+        close_session (h);
         return -1;
       }
       break;
@@ -699,22 +1168,22 @@ scp_file (struct config *config, const char *target, const char *local, ...)
         set_ssh_error ("%s", (char *) ssh_message);
       else
         set_ssh_error ("scp closed the connection without printing an error.");
-      mexp_close (h);
+      close_session (h);
       return -1;
 
     case MEXP_TIMEOUT:
       set_ssh_unexpected_timeout ("password prompt");
-      mexp_close (h);
+      close_session (h);
       return -1;
 
     case MEXP_ERROR:
       set_ssh_mexp_error ("mexp_expect");
-      mexp_close (h);
+      close_session (h);
       return -1;
 
     case MEXP_PCRE_ERROR:
       set_ssh_pcre_error ();
-      mexp_close (h);
+      close_session (h);
       return -1;
     }
   }
@@ -726,21 +1195,21 @@ scp_file (struct config *config, const char *target, const char *local, ...)
 
   case MEXP_TIMEOUT:
     set_ssh_unexpected_timeout ("copying (scp) file");
-    mexp_close (h);
+    close_session (h);
     return -1;
 
   case MEXP_ERROR:
     set_ssh_mexp_error ("mexp_expect");
-    mexp_close (h);
+    close_session (h);
     return -1;
 
   case MEXP_PCRE_ERROR:
     set_ssh_pcre_error ();
-    mexp_close (h);
+    close_session (h);
     return -1;
   }
 
-  if (mexp_close (h) == -1) {
+  if (close_session (h) == -1) {
     set_ssh_internal_error ("scp: mexp_close: %m");
     return -1;
   }
@@ -751,6 +1220,58 @@ scp_file (struct config *config, const char *target, const char *local, ...)
 static void add_input_driver (const char *name);
 static void add_output_driver (const char *name);
 static int compatible_version (const char *v2v_version_p);
+static int benchmark_network (struct config *config, mexp_h *h);
+
+/**
+ * Return the shell command which prints the output of
+ * S<C<virt-v2v --version>> followed by the output of
+ * S<C<virt-v2v --machine-readable>>, using the cache in the remote
+ * user's home directory if possible.
+ *
+ * The cache file is per server, port and user implicitly since it
+ * lives in the home directory of the user we log in as.  Whether sudo
+ * is used is part of the file name, as that may run a different
+ * virt-v2v.  The first line of the cache file records the inode,
+ * size and ctime of the virt-v2v binary, looked up in the same
+ * environment (with or without sudo) that the probe runs in.  Package
+ * managers preserve the build mtime of the files they install, but
+ * installing or upgrading virt-v2v always changes these, so it
+ * invalidates the cache.  Failed probes (eg. sudo needing a password)
+ * are never cached.
+ *
+ * NB: The command is echoed back by the remote shell, so it must not
+ * contain any text that the regular expressions in
+ * C<test_connection> would match.
+ */
+static char *
+remote_capabilities_command (struct config *config)
+{
+  char *cmd;
+  const char *sudo = config->auth.sudo ? "sudo -n " : "";
+
+  if (asprintf (&cmd,
+                "d=\"${XDG_CACHE_HOME:-$HOME/.cache}/virt-p2v\"; "
+                "c=\"$d/v2v-capabilities%s\"; "
+                "v=\"$(%ssh -c 'command -v virt-v2v')\"; "
+                "k=\"$([ -n \"$v\" ] && stat -L -c '%%i %%s %%Z' \"$v\" 2>/dev/null)\"; "
+                "if [ -n \"$k\" ] && [ -s \"$c\" ] && "
+                "[ \"$(head -n 1 \"$c\")\" = \"$k\" ]; then "
+                "tail -n +2 \"$c\"; "
+                "else "
+                "t=\"$(mktemp)\"; "
+                "{ %svirt-v2v --version && %svirt-v2v --machine-readable; } "
+                ">\"$t\" 2>&1 && [ -n \"$k\" ] && "
+                "mkdir -p \"$d\" 2>/dev/null && "
+                "{ echo \"$k\"; cat \"$t\"; } >\"$c.$$\" 2>/dev/null && "
+                "mv -f \"$c.$$\" \"$c\" 2>/dev/null; "
+                "cat \"$t\"; rm -f \"$t\" \"$c.$$\"; "
+                "fi",
+                config->auth.sudo ? "-sudo" : "",
+                sudo, sudo, sudo) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+
+  return cmd;
+}
 
 #if defined(__GNUC__) && !defined(__clang__)
 #pragma GCC diagnostic ignored "-Wsuggest-attribute=noreturn" /* WTF? */
@@ -764,34 +1285,54 @@ test_connection (struct config *config)
   CLEANUP_PCRE2_MATCH_DATA pcre2_match_data *match_data =
     pcre2_match_data_create (4, NULL);
   PCRE2_SIZE verlen;
+  CLEANUP_FREE char *cache_command = NULL;
 
   h = start_ssh (0, config, NULL, 1);
   if (h == NULL)
     return -1;
 
-  /* Clear any previous version information since we may be connecting
-   * to a different server.
+  /* Clear any previous version and driver information since we may
+   * be connecting to a different server.
    */
   pcre2_substring_free ((PCRE2_UCHAR *)v2v_version);
   v2v_version = NULL;
+  guestfs_int_free_string_list (input_drivers);
+  guestfs_int_free_string_list (output_drivers);
+  input_drivers = output_drivers = NULL;
 
-  /* Send 'virt-v2v --version' command and hope we get back a version string.
-   * Note old virt-v2v did not understand -V option.
+  /* Send 'virt-v2v --version' and 'virt-v2v --machine-readable'
+   * commands and hope we get back a version string and the list of
+   * features.  Note old virt-v2v did not understand -V option.
+   *
+   * Running virt-v2v twice on every connection adds up, so the output
+   * of these commands is cached in the remote user's home directory.
+   * The cache is only used if the virt-v2v binary has not changed
+   * since it was written.
    */
-  if (mexp_printf (h,
-                   "%svirt-v2v --version\n",
-                   config->auth.sudo ? "sudo -n " : "") == -1) {
+  cache_command = remote_capabilities_command (config);
+  if (mexp_printf (h, "%s\n", cache_command) == -1) {
     set_ssh_mexp_error ("mexp_printf");
-    mexp_close (h);
+    close_session (h);
     return -1;
   }
 
+  /* The order of the regular expressions below must match the order
+   * of the lines in the output, because mexp_expect skips over any
+   * text before the first expression that matches.
+   */
   for (;;) {
+    PCRE2_UCHAR *driver;
+    PCRE2_SIZE drvrlen;
+
     switch (mexp_expect (h,
                          (mexp_regexp[]) {
                            { 100, .re = version_re },
                            { 101, .re = sudo_password_re },
-                           { 102, .re = prompt_re },
+                           { 102, .re = feature_libguestfs_rewrite_re },
+                           { 103, .re = feature_colours_option_re },
+                           { 104, .re = feature_input_re },
+                           { 105, .re = feature_output_re },
+                           { 106, .re = prompt_re },
                            { 0 }
                          }, match_data)) {
     case 100:                   /* Got version string. */
@@ -807,82 +1348,14 @@ test_connection (struct config *config)
     case 101:
       set_ssh_error ("sudo for user \"%s\" requires a password.  Edit /etc/sudoers on the conversion server to ensure the \"NOPASSWD:\" option is set for this user.",
                      config->auth.username);
-      mexp_close (h);
+      close_session (h);
       return -1;
 
-    case 102:             /* Got the prompt. */
-      goto end_of_version;
-
-    case MEXP_EOF:
-      set_ssh_unexpected_eof ("\"virt-v2v --version\" output");
-      mexp_close (h);
-      return -1;
-
-    case MEXP_TIMEOUT:
-      set_ssh_unexpected_timeout ("\"virt-v2v --version\" output");
-      mexp_close (h);
-      return -1;
-
-    case MEXP_ERROR:
-      set_ssh_mexp_error ("mexp_expect");
-      mexp_close (h);
-      return -1;
-
-    case MEXP_PCRE_ERROR:
-      set_ssh_pcre_error ();
-      mexp_close (h);
-      return -1;
-    }
-  }
- end_of_version:
-
-  /* Got the prompt but no version number. */
-  if (v2v_version == NULL) {
-    set_ssh_error ("virt-v2v is not installed on the conversion server, "
-                   "or it might be a too old version.");
-    mexp_close (h);
-    return -1;
-  }
-
-  /* Check the version of virt-v2v is compatible with virt-p2v. */
-  if (!compatible_version (v2v_version)) {
-    mexp_close (h);
-    return -1;
-  }
-
-  /* Clear any previous driver information since we may be connecting
-   * to a different server.
-   */
-  guestfs_int_free_string_list (input_drivers);
-  guestfs_int_free_string_list (output_drivers);
-  input_drivers = output_drivers = NULL;
-
-  /* Get virt-v2v features.  See: v2v/cmdline.ml */
-  if (mexp_printf (h, "%svirt-v2v --machine-readable\n",
-                   config->auth.sudo ? "sudo -n " : "") == -1) {
-    set_ssh_mexp_error ("mexp_printf");
-    mexp_close (h);
-    return -1;
-  }
-
-  for (;;) {
-    PCRE2_UCHAR *driver;
-    PCRE2_SIZE drvrlen;
-
-    switch (mexp_expect (h,
-                         (mexp_regexp[]) {
-                           { 100, .re = feature_libguestfs_rewrite_re },
-                           { 101, .re = feature_colours_option_re },
-                           { 102, .re = feature_input_re },
-                           { 103, .re = feature_output_re },
-                           { 104, .re = prompt_re },
-                           { 0 }
-                         }, match_data)) {
-    case 100:                   /* libguestfs-rewrite. */
+    case 102:                   /* libguestfs-rewrite. */
       feature_libguestfs_rewrite = 1;
       break;
 
-    case 101:                   /* virt-v2v supports --colours option */
+    case 103:                   /* virt-v2v supports --colours option */
 #if DEBUG_STDERR
   fprintf (stderr, "%s: remote virt-v2v supports --colours option\n",
            g_get_prgname ());
@@ -890,56 +1363,79 @@ test_connection (struct config *config)
       feature_colours_option = 1;
       break;
 
-    case 102:
+    case 104:
       /* input:<driver-name> corresponds to an -i option in virt-v2v. */
       pcre2_substring_get_bynumber (match_data, 1, &driver, &drvrlen);
       add_input_driver ((char *) driver);
       pcre2_substring_free (driver);
       break;
 
-    case 103:
+    case 105:
       /* output:<driver-name> corresponds to an -o option in virt-v2v. */
       pcre2_substring_get_bynumber (match_data, 1, &driver, &drvrlen);
       add_output_driver ((char *) driver);
       pcre2_substring_free (driver);
       break;
 
-    case 104:                   /* Got prompt, so end of output. */
+    case 106:                   /* Got prompt, so end of output. */
       goto end_of_machine_readable;
 
     case MEXP_EOF:
       set_ssh_unexpected_eof ("\"virt-v2v --machine-readable\" output");
-      mexp_close (h);
+      close_session (h);
       return -1;
 
     case MEXP_TIMEOUT:
       set_ssh_unexpected_timeout ("\"virt-v2v --machine-readable\" output");
-      mexp_close (h);
+      close_session (h);
       return -1;
 
     case MEXP_ERROR:
       set_ssh_mexp_error ("mexp_expect");
-      mexp_close (h);
+      close_session (h);
       return -1;
 
     case MEXP_PCRE_ERROR:
       set_ssh_pcre_error ();
-      mexp_close (h);
+      close_session (h);
       return -1;
     }
   }
  end_of_machine_readable:
 
+  /* Got the prompt but no version number. */
+  if (v2v_version == NULL) {
+    set_ssh_error ("virt-v2v is not installed on the conversion server, "
+                   "or it might be a too old version.");
+    close_session (h);
+    return -1;
+  }
+
+  /* Check the version of virt-v2v is compatible with virt-p2v. */
+  if (!compatible_version (v2v_version)) {
+    close_session (h);
+    return -1;
+  }
+
   if (!feature_libguestfs_rewrite) {
     set_ssh_error ("Invalid output of \"virt-v2v --machine-readable\" command.");
-    mexp_close (h);
+    close_session (h);
     return -1;
   }
 
+  /* Optionally measure the network.  The results are only
+   * informational, so a failure here does not fail the test.
+   */
+  network_benchmark.valid = false;
+  if (config->benchmark.network &&
+      benchmark_network (config, h) == -1)
+    fprintf (stderr, "%s: network benchmark failed: %s\n",
+             g_get_prgname (), get_ssh_error ());
+
   /* Test finished, shut down ssh. */
   if (mexp_printf (h, "exit\n") == -1) {
     set_ssh_mexp_error ("mexp_printf");
-    mexp_close (h);
+    close_session (h);
     return -1;
   }
 
@@ -949,21 +1445,21 @@ test_connection (struct config *config)
 
   case MEXP_TIMEOUT:
     set_ssh_unexpected_timeout ("end of ssh session");
-    mexp_close (h);
+    close_session (h);
     return -1;
 
   case MEXP_ERROR:
     set_ssh_mexp_error ("mexp_expect");
-    mexp_close (h);
+    close_session (h);
     return -1;
 
   case MEXP_PCRE_ERROR:
     set_ssh_pcre_error ();
-    mexp_close (h);
+    close_session (h);
     return -1;
   }
 
-  status = mexp_close (h);
+  status = close_session (h);
   if (status == -1) {
     set_ssh_internal_error ("mexp_close: %m");
     return -1;
@@ -1065,6 +1561,7 @@ open_data_connection (struct config *config, int local_port, int *remote_port)
   const char *extra_args[] = {
     "-R", remote_arg,
     "-N",
+    NULL,                       /* -C, see below */
     NULL
   };
   PCRE2_UCHAR *port_str;
@@ -1073,6 +1570,8 @@ open_data_connection (struct config *config, int local_port, int *remote_port)
     pcre2_match_data_create (4, NULL);
 
   snprintf (remote_arg, sizeof remote_arg, "0:localhost:%d", local_port);
+  if (config->transfer.compress)
+    extra_args[3] = "-C";     /* Compress the disk data. */
 
   h = start_ssh (0, config, (char **) extra_args, 0);
   if (h == NULL)
@@ -1087,14 +1586,14 @@ open_data_connection (struct config *config, int local_port, int *remote_port)
     pcre2_substring_get_bynumber (match_data, 1, &port_str, &portlen);
     if (port_str == NULL) {
       set_ssh_internal_error ("strndup: %m");
-      mexp_close (h);
+      close_session (h);
       return NULL;
     }
     if (sscanf ((char *) port_str, "%d", remote_port) != 1) {
       set_ssh_internal_error ("cannot extract the port number from '%s'",
                               port_str);
       pcre2_substring_free (port_str);
-      mexp_close (h);
+      close_session (h);
       return NULL;
     }
     pcre2_substring_free (port_str);
@@ -1102,22 +1601,80 @@ open_data_connection (struct config *config, int local_port, int *remote_port)
 
   case MEXP_EOF:
     set_ssh_unexpected_eof ("\"ssh -R\" output");
-    mexp_close (h);
+    close_session (h);
     return NULL;
 
   case MEXP_TIMEOUT:
     set_ssh_unexpected_timeout ("\"ssh -R\" output");
-    mexp_close (h);
+    close_session (h);
+    return NULL;
+
+  case MEXP_ERROR:
+    set_ssh_mexp_error ("mexp_expect");
+    close_session (h);
+    return NULL;
+
+  case MEXP_PCRE_ERROR:
+    set_ssh_pcre_error ();
+    close_session (h);
+    return NULL;
+  }
+
+  return h;
+}
+
+/**
+ * Open a data connection again after the previous one was lost,
+ * forwarding the same C<remote_port> on the conversion server to
+ * C<local_port>, so that virt-v2v can reconnect to the same port.
+ *
+ * ssh does not print anything when it forwards a fixed port, but with
+ * C<ExitOnForwardFailure> it exits straight away if the port could
+ * not be forwarded, for example because sshd on the conversion server
+ * has not noticed that the previous connection was lost yet.
+ */
+mexp_h *
+reopen_data_connection (struct config *config, int local_port,
+                        int remote_port)
+{
+  mexp_h *h;
+  char remote_arg[32];
+  const char *extra_args[] = {
+    "-o", "ExitOnForwardFailure=yes",
+    "-R", remote_arg,
+    "-N",
+    NULL,                       /* -C, see below */
+    NULL
+  };
+
+  snprintf (remote_arg, sizeof remote_arg, "%d:localhost:%d",
+            remote_port, local_port);
+  if (config->transfer.compress)
+    extra_args[5] = "-C";     /* Compress the disk data. */
+
+  h = start_ssh (0, config, (char **) extra_args, 0);
+  if (h == NULL)
+    return NULL;
+
+  mexp_set_timeout (h, REOPEN_WAIT);
+  switch (mexp_expect (h, NULL, NULL)) {
+  case MEXP_TIMEOUT:            /* Still running, so the port is forwarded. */
+    break;
+
+  case MEXP_EOF:
+    set_ssh_error ("could not forward port %d on the conversion server",
+                   remote_port);
+    close_session (h);
     return NULL;
 
   case MEXP_ERROR:
     set_ssh_mexp_error ("mexp_expect");
-    mexp_close (h);
+    close_session (h);
     return NULL;
 
   case MEXP_PCRE_ERROR:
     set_ssh_pcre_error ();
-    mexp_close (h);
+    close_session (h);
     return NULL;
   }
 
@@ -1159,6 +1716,241 @@ wait_for_prompt (mexp_h *h)
   return 0;
 }
 
+/* Number of round trips used to measure the latency. */
+#define BENCHMARK_ROUND_TRIPS 5
+
+/* How long each throughput test runs for (seconds). */
+#define BENCHMARK_SECONDS 5
+
+/* Number of parallel streams in the multi-stream throughput test. */
+#define BENCHMARK_STREAMS 4
+
+static double
+benchmark_elapsed (const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Measure the round trip time through the ssh session C<h> by sending
+ * empty command lines and timing how long it takes for the prompt to
+ * come back.
+ */
+static int
+benchmark_rtt (mexp_h *h, struct network_benchmark *nb)
+{
+  struct timespec start, end;
+  double rtt, total = 0;
+  size_t i;
+
+  nb->rtt_min = 0;
+  for (i = 0; i < BENCHMARK_ROUND_TRIPS; ++i) {
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    if (mexp_printf (h, "\n") == -1) {
+      set_ssh_mexp_error ("mexp_printf");
+      return -1;
+    }
+    if (wait_for_prompt (h) == -1)
+      return -1;
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    rtt = benchmark_elapsed (&start, &end);
+    total += rtt;
+    if (i == 0 || rtt < nb->rtt_min)
+      nb->rtt_min = rtt;
+  }
+  nb->rtt_avg = total / BENCHMARK_ROUND_TRIPS;
+
+  return 0;
+}
+
+/**
+ * Measure the throughput of C<nr_streams> parallel data connections.
+ *
+ * Each stream is set up exactly like the data connections used for
+ * the conversion (see C<open_data_connection>), except that the local
+ * end is a TCP source (see F<network-benchmark.c>) instead of an NBD
+ * server.  The remote shell C<h> reads from all of the forwarded
+ * ports at once and prints the total number of bytes received.
+ *
+ * On success, C<*rate> is set to the total throughput in bytes per
+ * second, and C<*cipher_rate> to the number of bytes that the local
+ * ssh processes handled per second of CPU time they used (or C<0> if
+ * that could not be measured).
+ */
+static int
+benchmark_throughput (struct config *config, mexp_h *h,
+                      unsigned nr_streams, double rtt,
+                      double *rate, double *cipher_rate)
+{
+  struct tcp_source *sources[BENCHMARK_STREAMS] = { NULL };
+  mexp_h *conns[BENCHMARK_STREAMS] = { NULL };
+  double cpu_start[BENCHMARK_STREAMS];
+  double cpu = 0;
+  struct timespec start = { 0 }, end;
+  char ports[BENCHMARK_STREAMS * 8] = "";
+  PCRE2_UCHAR *bytes_str;
+  PCRE2_SIZE byteslen;
+  uint64_t bytes = 0;
+  CLEANUP_PCRE2_MATCH_DATA pcre2_match_data *match_data =
+    pcre2_match_data_create (4, NULL);
+  unsigned i;
+  int ret = -1;
+
+  for (i = 0; i < nr_streams; ++i) {
+    int remote_port;
+    size_t len = strlen (ports);
+
+    sources[i] = start_tcp_source (BENCHMARK_SECONDS);
+    if (sources[i] == NULL) {
+      set_ssh_internal_error ("could not start the benchmark data source");
+      goto out;
+    }
+    conns[i] = open_data_connection (config, get_tcp_source_port (sources[i]),
+                                     &remote_port);
+    if (conns[i] == NULL)
+      goto out;
+    cpu_start[i] = get_process_cpu_seconds (mexp_get_pid (conns[i]));
+    snprintf (&ports[len], sizeof ports - len, "%s%d",
+              len > 0 ? " " : "", remote_port);
+  }
+
+  /* Read from every port in parallel on the conversion server.  The
+   * sources close the connection after BENCHMARK_SECONDS, and the
+   * timeout is only there in case something goes wrong.
+   *
+   * NB: The command is echoed back, so the string printed at the end
+   * is split in two in order that the echo does not match.
+   */
+  if (mexp_printf (h,
+                   "{ for p in %s; do "
+                   "(timeout %d bash -c \"cat </dev/tcp/localhost/$p\" | wc -c) & "
+                   "done; wait; } | "
+                   "awk '{ s += $1 } END { print \"p2v\" \"-bytes=\" s }'\n",
+                   ports, BENCHMARK_SECONDS * 6) == -1) {
+    set_ssh_mexp_error ("mexp_printf");
+    goto out;
+  }
+
+  switch (mexp_expect (h,
+                       (mexp_regexp[]) {
+                         { 100, .re = benchmark_bytes_re },
+                         { 0 }
+                       }, match_data)) {
+  case 100:
+    pcre2_substring_get_bynumber (match_data, 1, &bytes_str, &byteslen);
+    if (bytes_str == NULL) {
+      set_ssh_internal_error ("strndup: %m");
+      goto out;
+    }
+    if (sscanf ((char *) bytes_str, "%" SCNu64, &bytes) != 1) {
+      set_ssh_internal_error ("cannot parse the benchmark output '%s'",
+                              bytes_str);
+      pcre2_substring_free (bytes_str);
+      goto out;
+    }
+    pcre2_substring_free (bytes_str);
+    break;
+
+  case MEXP_EOF:
+    set_ssh_unexpected_eof ("network benchmark output");
+    goto out;
+
+  case MEXP_TIMEOUT:
+    set_ssh_unexpected_timeout ("network benchmark output");
+    goto out;
+
+  case MEXP_ERROR:
+    set_ssh_mexp_error ("mexp_expect");
+    goto out;
+
+  case MEXP_PCRE_ERROR:
+    set_ssh_pcre_error ();
+    goto out;
+  }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  for (i = 0; i < nr_streams; ++i) {
+    const double c = get_process_cpu_seconds (mexp_get_pid (conns[i]));
+
+    if (c >= 0 && cpu_start[i] >= 0)
+      cpu += c - cpu_start[i];
+  }
+
+  if (wait_for_prompt (h) == -1)
+    goto out;
+
+  ret = 0;
+
+ out:
+  for (i = 0; i < nr_streams; ++i) {
+    if (conns[i] != NULL) {
+      /* See cleanup_data_conns in conversion.c. */
+      kill (mexp_get_pid (conns[i]), SIGHUP);
+      close_session (conns[i]);
+    }
+  }
+  for (i = 0; i < nr_streams; ++i) {
+    if (sources[i] != NULL)
+      stop_tcp_source (sources[i], &start);
+  }
+
+  if (ret == 0) {
+    /* Time from the first stream starting until the byte count was
+     * printed, less the time taken for that message to reach us.
+     */
+    double elapsed = benchmark_elapsed (&start, &end) - rtt / 2;
+
+    if (start.tv_sec == 0 || bytes == 0 || elapsed <= 0) {
+      set_ssh_error ("no data was received by the conversion server");
+      return -1;
+    }
+    *rate = bytes / elapsed;
+    *cipher_rate = cpu > 0 ? bytes / cpu : 0;
+  }
+
+  return ret;
+}
+
+/**
+ * Run the network benchmark over the ssh session C<h> which was
+ * opened by C<test_connection>.  The results are stored in the
+ * global C<network_benchmark>.
+ */
+static int
+benchmark_network (struct config *config, mexp_h *h)
+{
+  struct network_benchmark nb = { .nr_streams = BENCHMARK_STREAMS };
+  double cipher_rate;
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: measuring the network\n", g_get_prgname ());
+#endif
+
+  if (benchmark_rtt (h, &nb) == -1)
+    return -1;
+  if (benchmark_throughput (config, h, 1, nb.rtt_min,
+                            &nb.single_stream, &nb.ssh_cipher) == -1)
+    return -1;
+  if (benchmark_throughput (config, h, nb.nr_streams, nb.rtt_min,
+                            &nb.multi_stream, &cipher_rate) == -1)
+    return -1;
+
+  nb.valid = true;
+  network_benchmark = nb;
+
+#if DEBUG_STDERR
+  fprintf (stderr,
+           "%s: network: rtt %.3f/%.3f ms, "
+           "1 stream %.1f MB/s, %u streams %.1f MB/s, ssh %.1f MB/s/core\n",
+           g_get_prgname (), nb.rtt_min * 1000, nb.rtt_avg * 1000,
+           nb.single_stream / 1e6, nb.nr_streams, nb.multi_stream / 1e6,
+           nb.ssh_cipher / 1e6);
+#endif
+
+  return 0;
+}
+
 mexp_h *
 start_remote_connection (struct config *config, const char *remote_dir)
 {
@@ -1196,6 +1988,6 @@ start_remote_connection (struct config *config, const char *remote_dir)
   return h;
 
  error:
-  mexp_close (h);
+  close_session (h);
   return NULL;
 }
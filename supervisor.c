@@ -0,0 +1,725 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Supervise the data connections while virt-v2v is running.
+ *
+ * Each data connection is an S<C<ssh -R ... -N>> process which
+ * forwards a port on the conversion server back to the NBD server.
+ * If the network goes away for longer than the ssh keepalive timeout
+ * (or the connection is reset by a NAT gateway), ssh exits, and
+ * without this the whole conversion fails.
+ *
+ * A background thread checks the ssh processes once a second.  When
+ * one has exited it is started again, forwarding the same remote port
+ * so that anything on the conversion server which reconnects to that
+ * port finds the NBD server again.  sshd on the conversion server may
+ * not release the old port until it notices that the old connection
+ * has gone, so this is retried for up to C<RECONNECT_TIMEOUT>
+ * seconds.  The attempts are spread out (see C<struct reconnect>)
+ * and made from the same once a second loop, so while one connection
+ * is down the others are still checked and the stream controller
+ * still runs.
+ *
+ * For staged transfers (see F<transfer.c>), if the same port cannot
+ * be forwarded after a few tries, a new port is forwarded instead and
+ * a file called F<port-I<OLD>> containing the new port number is
+ * copied to the remote directory.  The copy workers in the wrapper
+ * script look for this file before copying each chunk, and they retry
+ * chunks which could not be copied, so a dropped connection only
+ * delays the transfer.
+ *
+ * Note that the NBD connection which was open through the dropped
+ * data connection is lost.  In direct mode, virt-v2v only recovers
+ * from that if its NBD client reconnects.
+ *
+ * The same thread runs the stream controller when the number of data
+ * connections is adaptive (see C<is_adaptive_transfer>).  Only the
+ * connections of the starting number of streams are opened up front,
+ * and the controller opens the others when it first uses them.
+ * Every C<CONTROL_INTERVAL> seconds the controller looks at the throughput of the NBD servers,
+ * the CPU used by the NBD servers and ssh, and the round trip time of
+ * the TCP connections of the ssh processes in use (from L<ss(8)>, if
+ * it is installed).  Like TCP congestion control, it adds one stream
+ * at a time while that makes the disks copy faster, and halves the
+ * number of streams when the CPUs are saturated or the round trip
+ * time rises, which means that the streams are only filling queues
+ * in the network.  The number of streams in use is sent to the copy
+ * workers in a file called F<streams>, together with the reason,
+ * which the workers print to the conversion log.  Each stream reads
+ * one chunk at a time, so this is also the read queue depth on the
+ * source disks.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <libintl.h>
+
+#include <pthread.h>
+
+#include "miniexpect.h"
+#include "p2v.h"
+
+/* How long to keep trying to reconnect a data connection. */
+#define RECONNECT_TIMEOUT 600   /* seconds */
+
+/* How many times to try forwarding the same remote port, before
+ * forwarding a new port (for staged transfers only).
+ */
+#define SAME_PORT_TRIES 3
+
+/* How often the stream controller runs. */
+#define CONTROL_INTERVAL 10     /* seconds */
+
+/* If the NBD servers and ssh use more than this share of all the
+ * CPUs, more streams cannot help.
+ */
+#define CPU_SATURATION 0.9
+
+/* A round trip time this many times the smallest one seen means that
+ * the network is queueing.
+ */
+#define RTT_CONGESTION 2.0
+
+/* After adding a stream did not help, wait this many intervals before
+ * trying again.
+ */
+#define HOLD_INTERVALS 6
+
+/* A data connection which was lost and is being reconnected.  Only
+ * one attempt is made each time it is due.
+ */
+struct reconnect {
+  bool lost;
+  unsigned tries;
+  time_t deadline;              /* Give up after this time. */
+  time_t next_try;              /* Time of the next attempt. */
+  int delay;                    /* Seconds until the attempt after that. */
+};
+
+struct supervisor {
+  pthread_t thread;
+  struct config *config;
+  struct data_conn *data_conns;
+  size_t nr_disks;
+  char *remote_dir;
+  char *tmpdir;
+  void (*notify_ui) (int type, const char *data);
+
+  /* The remote port of each connection when the conversion started.
+   * This is the name of the port file if the port changes.
+   */
+  int **orig_ports;
+
+  /* The reconnection state of each connection, indexed like
+   * C<orig_ports>.
+   */
+  struct reconnect **reconnects;
+
+  /* Stream controller state.  C<max_streams> is C<0> if the number
+   * of streams is not adaptive.
+   */
+  unsigned max_streams;
+  unsigned streams;             /* Streams in use. */
+  int last_change;              /* +1, -1 or 0 at the last interval. */
+  unsigned hold;
+  bool have_sample;
+  struct timespec sample_time;
+  uint64_t *bytes;              /* Bytes read by each NBD server. */
+  double cpu;                   /* CPU seconds of NBD servers and ssh. */
+  double rate;                  /* Throughput at the last interval. */
+  double rtt_min;
+
+  pthread_mutex_t lock;         /* Protects the fields below. */
+  pthread_cond_t cond;
+  int stop;
+  unsigned reconnections;
+};
+
+static void *supervise (void *svp);
+
+/**
+ * Start supervising the data connections in C<data_conns>.  The
+ * caller must not touch the data connections until
+ * C<stop_supervisor> is called.
+ */
+struct supervisor *
+start_supervisor (struct config *config,
+                  struct data_conn *data_conns, size_t nr_disks,
+                  const char *remote_dir, const char *tmpdir,
+                  void (*notify_ui) (int type, const char *data))
+{
+  struct supervisor *sv;
+  size_t i, j;
+  int err;
+
+  sv = calloc (1, sizeof *sv);
+  if (sv == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  sv->config = config;
+  sv->data_conns = data_conns;
+  sv->nr_disks = nr_disks;
+  sv->remote_dir = strdup (remote_dir);
+  sv->tmpdir = strdup (tmpdir);
+  sv->orig_ports = calloc (nr_disks, sizeof (int *));
+  sv->reconnects = calloc (nr_disks, sizeof (struct reconnect *));
+  if (sv->remote_dir == NULL || sv->tmpdir == NULL ||
+      sv->orig_ports == NULL || sv->reconnects == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  sv->notify_ui = notify_ui;
+
+  for (i = 0; i < nr_disks; ++i) {
+    sv->orig_ports[i] = calloc (data_conns[i].nr_extra + 1, sizeof (int));
+    sv->reconnects[i] = calloc (data_conns[i].nr_extra + 1,
+                                sizeof (struct reconnect));
+    if (sv->orig_ports[i] == NULL || sv->reconnects[i] == NULL)
+      error (EXIT_FAILURE, errno, "calloc");
+    sv->orig_ports[i][0] = data_conns[i].nbd_remote_port;
+    for (j = 0; j < data_conns[i].nr_extra; ++j)
+      sv->orig_ports[i][j+1] = data_conns[i].extra_remote_port[j];
+  }
+
+  if (is_adaptive_transfer (config) && nr_disks > 0 &&
+      data_conns[0].nr_extra > 0) {
+    sv->max_streams = data_conns[0].nr_extra + 1;
+    sv->streams = MIN (get_transfer_streams (config), sv->max_streams);
+    sv->bytes = calloc (nr_disks, sizeof (uint64_t));
+    if (sv->bytes == NULL)
+      error (EXIT_FAILURE, errno, "calloc");
+  }
+
+  pthread_mutex_init (&sv->lock, NULL);
+  pthread_cond_init (&sv->cond, NULL);
+
+  err = pthread_create (&sv->thread, NULL, supervise, sv);
+  if (err != 0)
+    error (EXIT_FAILURE, err, "pthread_create");
+
+  return sv;
+}
+
+/**
+ * Stop supervising the data connections and free C<sv>.  Returns the
+ * number of times that a data connection was reconnected.
+ */
+unsigned
+stop_supervisor (struct supervisor *sv)
+{
+  unsigned ret;
+  size_t i;
+
+  pthread_mutex_lock (&sv->lock);
+  sv->stop = 1;
+  pthread_cond_signal (&sv->cond);
+  pthread_mutex_unlock (&sv->lock);
+
+  pthread_join (sv->thread, NULL);
+  ret = sv->reconnections;
+
+  pthread_mutex_destroy (&sv->lock);
+  pthread_cond_destroy (&sv->cond);
+  for (i = 0; i < sv->nr_disks; ++i) {
+    free (sv->orig_ports[i]);
+    free (sv->reconnects[i]);
+  }
+  free (sv->orig_ports);
+  free (sv->reconnects);
+  free (sv->bytes);
+  free (sv->remote_dir);
+  free (sv->tmpdir);
+  free (sv);
+
+  return ret;
+}
+
+/**
+ * Sleep for C<seconds>, or until C<stop_supervisor> is called.
+ * Returns true if the supervisor should stop.
+ */
+static int
+wait_or_stop (struct supervisor *sv, int seconds)
+{
+  struct timespec ts;
+  int stop;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  ts.tv_sec += seconds;
+
+  pthread_mutex_lock (&sv->lock);
+  while (!sv->stop &&
+         pthread_cond_timedwait (&sv->cond, &sv->lock, &ts) != ETIMEDOUT)
+    ;
+  stop = sv->stop;
+  pthread_mutex_unlock (&sv->lock);
+
+  return stop;
+}
+
+/**
+ * Has the ssh process behind C<h> exited?  ssh -N does not print
+ * anything normally, so anything which is read here (such as a
+ * warning) is thrown away.
+ */
+static int
+is_dead (mexp_h *h)
+{
+  struct pollfd pfd = { .fd = mexp_get_fd (h), .events = POLLIN };
+  char buf[256];
+  ssize_t r;
+
+  while (poll (&pfd, 1, 0) == 1) {
+    r = read (mexp_get_fd (h), buf, sizeof buf);
+    if (r == 0 || (r == -1 && errno == EIO))
+      return 1;
+    if (r == -1)
+      return 0;
+  }
+
+  return 0;
+}
+
+static void
+notify_status (struct supervisor *sv, const char *fs, ...)
+  __attribute__((format(printf,2,3)));
+
+static void
+notify_status (struct supervisor *sv, const char *fs, ...)
+{
+  va_list args;
+  CLEANUP_FREE char *msg = NULL;
+  int len;
+
+  va_start (args, fs);
+  len = vasprintf (&msg, fs, args);
+  va_end (args);
+  if (len < 0)
+    error (EXIT_FAILURE, errno, "vasprintf");
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: %s\n", g_get_prgname (), msg);
+#endif
+  if (sv->notify_ui)
+    sv->notify_ui (NOTIFY_STATUS, msg);
+}
+
+/**
+ * Tell the copy workers on the conversion server that the data
+ * connection which was on C<orig_port> is now on C<new_port>.
+ */
+static int
+send_port_file (struct supervisor *sv, int orig_port, int new_port)
+{
+  CLEANUP_FREE char *filename = NULL;
+  FILE *fp;
+
+  if (asprintf (&filename, "%s/port-%d", sv->tmpdir, orig_port) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  fp = fopen (filename, "w");
+  if (fp == NULL) {
+    perror (filename);
+    return -1;
+  }
+  fprintf (fp, "%d\n", new_port);
+  fclose (fp);
+
+  return scp_file (sv->config, sv->remote_dir, filename, NULL);
+}
+
+/**
+ * Connection C<j> (C<0> is C<data_conns[i].h>, the rest are the extra
+ * connections) of disk C<i> was lost.  The first attempt to reconnect
+ * it is made straight away.
+ */
+static void
+lost_connection (struct supervisor *sv, size_t i, size_t j)
+{
+  struct reconnect *rc = &sv->reconnects[i][j];
+  const time_t now = time (NULL);
+
+  notify_status (sv, _("Data connection for %s was lost, reconnecting ..."),
+                 sv->config->disks[i]);
+
+  rc->lost = true;
+  rc->tries = 0;
+  rc->deadline = now + RECONNECT_TIMEOUT;
+  rc->next_try = now;
+  rc->delay = 1;
+}
+
+/**
+ * Try once to reconnect connection C<j> of disk C<i>.  Returns the new
+ * handle, or C<NULL> if it could not be reconnected this time.  The
+ * next attempt is scheduled in C<sv-E<gt>reconnects>, until
+ * C<RECONNECT_TIMEOUT> seconds after the connection was lost.
+ */
+static mexp_h *
+try_reconnect (struct supervisor *sv, size_t i, size_t j)
+{
+  struct data_conn *dc = &sv->data_conns[i];
+  struct reconnect *rc = &sv->reconnects[i][j];
+  int *remote_port = j == 0 ? &dc->nbd_remote_port
+                            : &dc->extra_remote_port[j-1];
+  mexp_h *h;
+
+  rc->tries++;
+  if (dc->stage_dir == NULL || rc->tries <= SAME_PORT_TRIES)
+    h = reopen_data_connection (sv->config, dc->nbd_local_port,
+                                *remote_port);
+  else {
+    int new_port;
+
+    h = open_data_connection (sv->config, dc->nbd_local_port, &new_port);
+    if (h != NULL &&
+        send_port_file (sv, sv->orig_ports[i][j], new_port) == -1) {
+      kill (mexp_get_pid (h), SIGHUP);
+      close_session (h);
+      h = NULL;
+    }
+    if (h != NULL)
+      *remote_port = new_port;
+  }
+  if (h != NULL) {
+    rc->lost = false;
+    notify_status (sv, _("Data connection for %s reconnected."),
+                   sv->config->disks[i]);
+    return h;
+  }
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: reconnecting data connection for %s: %s\n",
+           g_get_prgname (), sv->config->disks[i], get_ssh_error ());
+#endif
+  if (time (NULL) >= rc->deadline) {
+    rc->lost = false;
+    notify_status (sv, _("Could not reconnect the data connection for %s: %s"),
+                   sv->config->disks[i], get_ssh_error ());
+    return NULL;
+  }
+  rc->next_try = time (NULL) + rc->delay;
+  rc->delay = MIN (rc->delay * 2, 30);
+  return NULL;
+}
+
+/**
+ * Return the average round trip time in seconds of the ssh processes
+ * in C<pids>, or C<-1> if it is not known.  An ssh process also has
+ * local connections to the NBD server, so the round trip time of
+ * each process is the largest of its sockets.
+ */
+static double
+get_streams_rtt (const pid_t *pids, size_t nr_pids)
+{
+  CLEANUP_PCLOSE FILE *fp = NULL;
+  CLEANUP_FREE char *line = NULL;
+  CLEANUP_FREE double *rtts = NULL;
+  size_t len = 0, k, n = 0;
+  ssize_t cur = -1;
+  double rtt, total = 0;
+
+  if (nr_pids == 0)
+    return -1;
+  rtts = calloc (nr_pids, sizeof (double));
+  if (rtts == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+
+  /* Each socket is on one line, and its TCP information (which is
+   * indented) on the next.
+   */
+  fp = popen ("ss -tinpH state established 2>/dev/null", "re");
+  if (fp == NULL)
+    return -1;
+  while (getline (&line, &len, fp) != -1) {
+    const char *p;
+
+    if (!g_ascii_isspace (line[0])) {
+      cur = -1;
+      for (k = 0; k < nr_pids; ++k) {
+        char pid_str[32];
+
+        snprintf (pid_str, sizeof pid_str, "pid=%d,", (int) pids[k]);
+        if (strstr (line, pid_str) != NULL) {
+          cur = k;
+          break;
+        }
+      }
+    }
+    else if (cur >= 0 && (p = strstr (line, " rtt:")) != NULL &&
+             sscanf (p, " rtt:%lf", &rtt) == 1)
+      rtts[cur] = MAX (rtts[cur], rtt / 1000);
+  }
+
+  for (k = 0; k < nr_pids; ++k) {
+    if (rtts[k] > 0) {
+      total += rtts[k];
+      n++;
+    }
+  }
+  return n > 0 ? total / n : -1;
+}
+
+/**
+ * Tell the copy workers on the conversion server how many streams to
+ * use, and why.
+ */
+static int
+send_streams_file (struct supervisor *sv, unsigned streams, const char *why)
+{
+  CLEANUP_FREE char *filename = NULL;
+  FILE *fp;
+
+  if (asprintf (&filename, "%s/streams", sv->tmpdir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  fp = fopen (filename, "w");
+  if (fp == NULL) {
+    perror (filename);
+    return -1;
+  }
+  fprintf (fp, "%u\n%s\n", streams, why);
+  fclose (fp);
+
+  return scp_file (sv->config, sv->remote_dir, filename, NULL);
+}
+
+/**
+ * Open the data connections that the copy workers need for C<streams>
+ * streams, if they have not been opened yet.  Like after a
+ * reconnection on a new port, the workers find the port of a new
+ * connection in the port file named after its placeholder port (see
+ * F<conversion.c>).  Returns C<-1> if a connection could not be
+ * opened.
+ */
+static int
+open_streams (struct supervisor *sv, unsigned streams)
+{
+  size_t i, j;
+
+  for (i = 0; i < sv->nr_disks; ++i) {
+    struct data_conn *dc = &sv->data_conns[i];
+
+    for (j = 1; j < streams && j <= dc->nr_extra; ++j) {
+      mexp_h *h;
+      int port;
+
+      /* A lost connection is reconnected by the loop in supervise. */
+      if (dc->extra_h[j-1] != NULL || sv->reconnects[i][j].lost)
+        continue;
+
+      h = open_data_connection (sv->config, dc->nbd_local_port, &port);
+      if (h != NULL &&
+          send_port_file (sv, sv->orig_ports[i][j], port) == -1) {
+        kill (mexp_get_pid (h), SIGHUP);
+        close_session (h);
+        h = NULL;
+      }
+      if (h == NULL) {
+#if DEBUG_STDERR
+        fprintf (stderr, "%s: could not open another data connection for %s: %s\n",
+                 g_get_prgname (), sv->config->disks[i], get_ssh_error ());
+#endif
+        return -1;
+      }
+      dc->extra_h[j-1] = h;
+      dc->extra_remote_port[j-1] = port;
+      metrics_set_data_conn (i, dc);
+      set_data_conn_affinity (sv->config->disks, i, dc);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Run the stream controller once (see the top of this file).
+ */
+static void
+control_streams (struct supervisor *sv)
+{
+  const long ncpus = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+  CLEANUP_FREE pid_t *pids = NULL;
+  CLEANUP_FREE char *why = NULL;
+  struct timespec now;
+  uint64_t bytes = 0, n;
+  size_t nr_pids = 0, i, j;
+  double cpu = 0, c, dt, rate, load, rtt;
+  unsigned streams = sv->streams;
+  const char *reason = NULL;
+  const bool first = !sv->have_sample;
+
+  pids = calloc (sv->nr_disks * sv->max_streams, sizeof (pid_t));
+  if (pids == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  for (i = 0; i < sv->nr_disks; ++i) {
+    struct data_conn *dc = &sv->data_conns[i];
+    bool busy = false;
+
+    if (get_process_io_counter (dc->nbd_pid, "rchar", &n) == 0) {
+      busy = n > sv->bytes[i];
+      if (busy)
+        bytes += n - sv->bytes[i];
+      sv->bytes[i] = n;
+    }
+    c = get_process_cpu_seconds (dc->nbd_pid);
+    if (c > 0)
+      cpu += c;
+
+    for (j = 0; j <= dc->nr_extra; ++j) {
+      mexp_h *h = j == 0 ? dc->h : dc->extra_h[j-1];
+
+      if (h == NULL)
+        continue;
+      c = get_process_cpu_seconds (mexp_get_pid (h));
+      if (c > 0)
+        cpu += c;
+      /* Only the streams in use on the disks being copied. */
+      if (busy && j < sv->streams)
+        pids[nr_pids++] = mexp_get_pid (h);
+    }
+  }
+
+  dt = (now.tv_sec - sv->sample_time.tv_sec) +
+    (now.tv_nsec - sv->sample_time.tv_nsec) / 1e9;
+  load = MAX (0, cpu - sv->cpu) / dt / ncpus;
+  rate = bytes / dt;
+  sv->have_sample = true;
+  sv->sample_time = now;
+  sv->cpu = cpu;
+  if (first || rate == 0) {
+    /* Not copying at the moment (for example, virt-v2v is running). */
+    sv->rate = 0;
+    sv->last_change = 0;
+    return;
+  }
+
+  rtt = get_streams_rtt (pids, nr_pids);
+  if (rtt > 0 && (sv->rtt_min == 0 || rtt < sv->rtt_min))
+    sv->rtt_min = rtt;
+
+  if (load > CPU_SATURATION) {
+    streams = MAX (1, streams / 2);
+    reason = "CPUs saturated";
+  }
+  else if (rtt > 0 && rtt > sv->rtt_min * RTT_CONGESTION &&
+           rtt - sv->rtt_min > 0.001) {
+    streams = MAX (1, streams / 2);
+    reason = "round trip time rising";
+  }
+  else if (sv->last_change > 0 && rate < sv->rate * 1.05) {
+    streams--;
+    sv->hold = HOLD_INTERVALS;
+    reason = "the last stream did not help";
+  }
+  else if (sv->hold > 0)
+    sv->hold--;
+  else if (streams < sv->max_streams) {
+    streams++;
+    reason = "probing for more throughput";
+  }
+
+  sv->last_change =
+    streams > sv->streams ? 1 : streams < sv->streams ? -1 : 0;
+  sv->rate = rate;
+  if (streams == sv->streams)
+    return;
+  if (streams > sv->streams && open_streams (sv, streams) == -1) {
+    sv->last_change = 0;
+    return;
+  }
+
+  if (rtt > 0) {
+    if (asprintf (&why, "stream controller: %u -> %u streams (%s): "
+                  "%.1f MB/s, CPU %.0f%%, RTT %.1f ms",
+                  sv->streams, streams, reason, rate / 1e6, load * 100,
+                  rtt * 1000) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+  }
+  else if (asprintf (&why, "stream controller: %u -> %u streams (%s): "
+                     "%.1f MB/s, CPU %.0f%%",
+                     sv->streams, streams, reason, rate / 1e6,
+                     load * 100) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: %s\n", g_get_prgname (), why);
+#endif
+  if (send_streams_file (sv, streams, why) == -1) {
+#if DEBUG_STDERR
+    fprintf (stderr, "%s: could not send the streams file: %s\n",
+             g_get_prgname (), get_ssh_error ());
+#endif
+    sv->last_change = 0;
+    return;
+  }
+  sv->streams = streams;
+}
+
+static void *
+supervise (void *svp)
+{
+  struct supervisor *sv = svp;
+  size_t i, j;
+  unsigned ticks = 0;
+
+  while (!wait_or_stop (sv, 1)) {
+    if (sv->max_streams > 1 && ++ticks % CONTROL_INTERVAL == 0)
+      control_streams (sv);
+
+    for (i = 0; i < sv->nr_disks; ++i) {
+      struct data_conn *dc = &sv->data_conns[i];
+
+      for (j = 0; j <= dc->nr_extra; ++j) {
+        mexp_h **hp = j == 0 ? &dc->h : &dc->extra_h[j-1];
+
+        struct reconnect *rc = &sv->reconnects[i][j];
+
+        if (*hp != NULL) {
+          if (!is_dead (*hp))
+            continue;
+          close_session (*hp);
+          *hp = NULL;
+          metrics_set_data_conn (i, dc);
+          lost_connection (sv, i, j);
+        }
+        if (!rc->lost || time (NULL) < rc->next_try)
+          continue;
+
+        *hp = try_reconnect (sv, i, j);
+        if (*hp == NULL)
+          continue;
+
+        pthread_mutex_lock (&sv->lock);
+        sv->reconnections++;
+        pthread_mutex_unlock (&sv->lock);
+        metrics_set_data_conn (i, dc);
+        set_data_conn_affinity (sv->config->disks, i, dc);
+      }
+    }
+  }
+
+  return NULL;
+}
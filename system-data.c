@@ -0,0 +1,344 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Collect data about the system running virt-p2v such as the dmesg
+ * output and lists of PCI devices.  This is useful for diagnosis when
+ * things go wrong.
+ *
+ * Some of these commands (especially S<C<lspci -vvv>> and
+ * S<C<lsusb -v>>) can take many seconds on large servers, so they are
+ * all run in parallel, in a background thread, each with a timeout.
+ * The output is then bundled into a single compressed tarball
+ * (F<system-data.tar.gz>) which is copied to the conversion server.
+ *
+ * Nothing here is fatal: if any command fails or times out, the
+ * bundle simply contains whatever the command managed to print.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <pthread.h>
+
+#include "ignore-value.h"
+
+#include "p2v.h"
+
+/* Maximum time that any single command is allowed to run. */
+#define SYSTEM_DATA_TIMEOUT 30
+
+/* How often to poll for commands finishing (in milliseconds). */
+#define SYSTEM_DATA_POLL_MS 50
+
+struct system_data_command {
+  const char *name;             /* Name of the output file. */
+  const char *argv[3];          /* Command to run. */
+};
+
+static const struct system_data_command commands[] = {
+  { "dmesg",  { "dmesg", NULL } },
+  { "lscpu",  { "lscpu", NULL } },
+  { "lspci",  { "lspci", "-vvv", NULL } },
+  { "lsscsi", { "lsscsi", "-v", NULL } },
+  { "lsusb",  { "lsusb", "-v", NULL } },
+};
+#define NR_COMMANDS (sizeof commands / sizeof commands[0])
+
+struct system_data {
+  pthread_t thread;
+  char *tmpdir;                 /* Local temporary directory. */
+  char *bundle;                 /* Full path of the bundle. */
+
+  pthread_mutex_t lock;         /* Protects the fields below. */
+  pthread_cond_t cond;
+  int done;                     /* Set when the bundle is complete. */
+  int ok;                       /* Set if the bundle was created. */
+  int cancelled;                /* Kill outstanding commands. */
+};
+
+static void *collect_system_data (void *sdv);
+static pid_t spawn_command (const char *const *argv, const char *output_file);
+static void run_until_done (struct system_data *sd, pid_t *pids, char **files, size_t n);
+
+/**
+ * Start collecting system data in the background.
+ *
+ * The commands write into F<tmpdir/system-data/> and the bundle is
+ * written to F<tmpdir/system-data.tar.gz>.  This returns immediately.
+ * Use C<system_data_is_ready> or C<wait_system_data> to find out when
+ * the bundle is available, and C<free_system_data> to clean up.
+ */
+struct system_data *
+start_system_data (const char *tmpdir)
+{
+  struct system_data *sd;
+  int err;
+
+  sd = calloc (1, sizeof *sd);
+  if (sd == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  sd->tmpdir = strdup (tmpdir);
+  if (sd->tmpdir == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  if (asprintf (&sd->bundle, "%s/system-data.tar.gz", tmpdir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  pthread_mutex_init (&sd->lock, NULL);
+  pthread_cond_init (&sd->cond, NULL);
+
+  err = pthread_create (&sd->thread, NULL, collect_system_data, sd);
+  if (err != 0)
+    error (EXIT_FAILURE, err, "pthread_create");
+
+  return sd;
+}
+
+/**
+ * Return true if the background collection has finished.  This never
+ * blocks.
+ */
+int
+system_data_is_ready (struct system_data *sd)
+{
+  int r;
+
+  pthread_mutex_lock (&sd->lock);
+  r = sd->done;
+  pthread_mutex_unlock (&sd->lock);
+  return r;
+}
+
+/**
+ * Wait for the background collection to finish.  Because every
+ * command has a timeout this cannot block for very long.
+ *
+ * Returns the path of the bundle, or C<NULL> if it could not be
+ * created.
+ */
+const char *
+wait_system_data (struct system_data *sd)
+{
+  int ok;
+
+  pthread_mutex_lock (&sd->lock);
+  while (!sd->done)
+    pthread_cond_wait (&sd->cond, &sd->lock);
+  ok = sd->ok;
+  pthread_mutex_unlock (&sd->lock);
+
+  return ok ? sd->bundle : NULL;
+}
+
+/**
+ * Kill any commands which are still running, wait for the background
+ * thread and free the handle.
+ */
+void
+free_system_data (struct system_data *sd)
+{
+  if (sd == NULL)
+    return;
+
+  pthread_mutex_lock (&sd->lock);
+  sd->cancelled = 1;
+  pthread_mutex_unlock (&sd->lock);
+
+  pthread_join (sd->thread, NULL);
+  pthread_mutex_destroy (&sd->lock);
+  pthread_cond_destroy (&sd->cond);
+  free (sd->tmpdir);
+  free (sd->bundle);
+  free (sd);
+}
+
+static int
+is_cancelled (struct system_data *sd)
+{
+  int r;
+
+  pthread_mutex_lock (&sd->lock);
+  r = sd->cancelled;
+  pthread_mutex_unlock (&sd->lock);
+  return r;
+}
+
+static void *
+collect_system_data (void *sdv)
+{
+  struct system_data *sd = sdv;
+  CLEANUP_FREE char *dir = NULL;
+  char *files[NR_COMMANDS];
+  pid_t pids[NR_COMMANDS];
+  const char *tar_argv[] = {
+    "tar", "-C", sd->tmpdir, "-czf", sd->bundle, "system-data", NULL
+  };
+  pid_t pid;
+  int status, ok = 0;
+  size_t i;
+
+  if (asprintf (&dir, "%s/system-data", sd->tmpdir) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  if (mkdir (dir, 0755) == -1) {
+    perror (dir);
+    goto out;
+  }
+
+  /* Start all of the commands in parallel. */
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (asprintf (&files[i], "%s/%s", dir, commands[i].name) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    pids[i] = spawn_command (commands[i].argv, files[i]);
+  }
+
+  run_until_done (sd, pids, files, NR_COMMANDS);
+
+  for (i = 0; i < NR_COMMANDS; ++i)
+    free (files[i]);
+
+  /* Bundle the results. */
+  pid = spawn_command (tar_argv, "/dev/null");
+  if (pid > 0 &&
+      waitpid (pid, &status, 0) == pid &&
+      WIFEXITED (status) && WEXITSTATUS (status) == 0)
+    ok = 1;
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: system data %s\n",
+           g_get_prgname (), ok ? sd->bundle : "could not be bundled");
+#endif
+
+ out:
+  pthread_mutex_lock (&sd->lock);
+  sd->ok = ok;
+  sd->done = 1;
+  pthread_cond_broadcast (&sd->cond);
+  pthread_mutex_unlock (&sd->lock);
+
+  return NULL;
+}
+
+/**
+ * Fork and exec C<argv>, sending stdout and stderr to C<output_file>.
+ *
+ * Returns the PID, or C<0> if the command could not be started.
+ */
+static pid_t
+spawn_command (const char *const *argv, const char *output_file)
+{
+  pid_t pid;
+  int fd;
+
+  fd = open (output_file, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (fd == -1) {
+    perror (output_file);
+    return 0;
+  }
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    close (fd);
+    return 0;
+  }
+
+  if (pid == 0) {               /* Child. */
+    int nullfd = open ("/dev/null", O_RDONLY);
+
+    if (nullfd >= 0)
+      dup2 (nullfd, 0);
+    dup2 (fd, 1);
+    dup2 (fd, 2);
+    execvp (argv[0], (char **) argv);
+    /* The parent has other threads, so only async-signal-safe
+     * functions may be used here.
+     */
+    ignore_value (write (2, argv[0], strlen (argv[0])));
+    ignore_value (write (2, ": command could not be run\n", 27));
+    _exit (EXIT_FAILURE);
+  }
+
+  close (fd);
+  return pid;
+}
+
+/**
+ * Wait until all the commands have exited, killing any which exceed
+ * C<SYSTEM_DATA_TIMEOUT> (or all of them if the collection is
+ * cancelled).  A note is appended to the output of commands that were
+ * killed so it is clear the output is truncated.
+ */
+static void
+run_until_done (struct system_data *sd, pid_t *pids, char **files, size_t n)
+{
+  struct timespec start, now;
+  size_t i, running;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  for (;;) {
+    int timed_out, cancelled;
+
+    running = 0;
+    for (i = 0; i < n; ++i) {
+      if (pids[i] > 0) {
+        pid_t r = waitpid (pids[i], NULL, WNOHANG);
+        if (r == pids[i] || (r == -1 && errno == ECHILD))
+          pids[i] = 0;
+        else
+          running++;
+      }
+    }
+    if (running == 0)
+      return;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    timed_out = now.tv_sec - start.tv_sec >= SYSTEM_DATA_TIMEOUT;
+    cancelled = is_cancelled (sd);
+    if (timed_out || cancelled)
+      break;
+
+    usleep (SYSTEM_DATA_POLL_MS * 1000);
+  }
+
+  for (i = 0; i < n; ++i) {
+    if (pids[i] > 0) {
+      FILE *fp;
+
+      kill (pids[i], SIGKILL);
+      waitpid (pids[i], NULL, 0);
+
+      fp = fopen (files[i], "a");
+      if (fp) {
+        fprintf (fp, "\n*** %s did not finish and was killed ***\n",
+                 commands[i].argv[0]);
+        fclose (fp);
+      }
+    }
+  }
+}
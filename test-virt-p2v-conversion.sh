@@ -0,0 +1,80 @@
+# libguestfs virt-p2v test script
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Common setup of the tests which convert fedora.img in non-GUI mode
+# using the same dummy 'ssh' and 'scp' as test-virt-p2v-nbdkit.sh.
+# Source it after $TEST_FUNCTIONS:
+#
+#   source "$abs_srcdir/test-virt-p2v-conversion.sh"
+#   conversion_test_skips
+#   conversion_test_setup test-virt-p2v-foo.d
+#   $VG virt-p2v --cmdline="$cmdline p2v.disks=$f p2v.os=$(pwd)/$d ..."
+#   ...
+#   conversion_test_cleanup
+
+# The test fixture.
+f="$abs_builddir/fedora.img"
+
+# The kernel command line options which are the same for every
+# conversion.  Each test adds p2v.disks, p2v.os and its own options.
+cmdline="p2v.server=localhost p2v.name=fedora p2v.o=local p2v.network=em1:wired,other p2v.post="
+
+# Skip the test if it, or the things every conversion needs, are not
+# available.
+conversion_test_skips ()
+{
+    skip_if_skipped
+    skip_if_backend uml
+    skip_unless nbdkit file --version
+    skip_unless test -f fedora.img
+}
+
+# Create dummy 'ssh' and 'scp' binaries in directory $1.
+fake_ssh ()
+{
+    pushd "$1" >/dev/null
+    ln -sf "$abs_srcdir/test-virt-p2v-ssh.sh" ssh
+    ln -sf "$abs_srcdir/test-virt-p2v-scp.sh" scp
+    popd >/dev/null
+}
+
+# Create the test directory $1 (saved in $d) with the dummy 'ssh' and
+# 'scp' first in the $PATH.  Note that the PATH already contains the
+# local virt-p2v & virt-v2v binaries under test (because of the ./run
+# script).
+conversion_test_setup ()
+{
+    d="$1"
+    rm -rf $d
+    mkdir $d
+
+    fake_ssh $d
+    export PATH=$d:$PATH
+
+    # Keep the virt-v2v capability cache out of the real home directory.
+    export XDG_CACHE_HOME="$(pwd)/$d/cache"
+
+    # Don't let the settings of the dummy 'ssh' from the environment
+    # (see test-virt-p2v-ssh.sh) change what the test does.
+    unset P2V_WAN P2V_WAN_EPOCH P2V_SSH_DROP
+}
+
+# Remove the test directory.  It is kept if the test fails, to help
+# with debugging.
+conversion_test_cleanup ()
+{
+    rm -r $d
+}
@@ -0,0 +1,60 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test deduplication (p2v.transfer.dedup) with a disk which has
+# repeated chunks, and that the staged disks are the same as the
+# source disks.
+
+set -e
+
+$TEST_FUNCTIONS
+source "$abs_srcdir/test-virt-p2v-conversion.sh"
+conversion_test_skips
+skip_unless qemu-img --version
+
+conversion_test_setup test-virt-p2v-dedup.d
+
+# A data disk of 4 chunks (64 MB each, see TRANSFER_CHUNK_SIZE in
+# p2v.h): chunks 0 and 2 are the same, chunk 1 is empty, and chunk 3
+# is different from all the others.
+data="$(pwd)/$d/data.img"
+head -c 64M /dev/urandom > $d/chunk
+truncate -s 256M $data
+dd if=$d/chunk of=$data bs=64M seek=0 conv=notrunc status=none
+dd if=$d/chunk of=$data bs=64M seek=2 conv=notrunc status=none
+head -c 64M /dev/urandom |
+    dd of=$data bs=64M seek=3 conv=notrunc iflag=fullblock status=none
+rm $d/chunk
+
+# The conversion fails because the output directory does not exist,
+# and the staged disks are kept (p2v.transfer.resume).
+cmdline="$cmdline p2v.disks=$f,$data p2v.os=$(pwd)/$d/missing p2v.transfer.resume p2v.transfer.dedup p2v.transfer.streams=2 p2v.transfer.stage_dir=$(pwd)/$d/stage"
+
+if $VG virt-p2v --cmdline="$cmdline" > $d/out; then
+    echo "$0: the conversion was expected to fail"
+    exit 1
+fi
+cat $d/out
+
+# Only chunk 2 of the data disk is a duplicate.
+grep -q 'data.img: 4 of 4 chunks copied (0 from base images, 1 duplicates)' $d/out
+grep -q '^1 of [0-9]* chunks were duplicates' $d/out
+
+cmp $f $d/stage/*-fedora.img-*/disk.raw
+cmp $data $d/stage/*-data.img-*/disk.raw
+
+conversion_test_cleanup
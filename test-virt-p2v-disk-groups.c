@@ -0,0 +1,236 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Test C<get_disk_groups>, C<get_disk_sysfs_dirs> and
+ * C<get_disk_numa_node> against a synthetic sysfs tree with
+ * partitions, device-mapper and MD devices, and rotational and
+ * non-rotational disks behind the same SCSI host.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ignore-value.h"
+
+#include "p2v.h"
+
+static char sys[] = "/tmp/p2vsysXXXXXX";
+static int failures;
+
+#define PCI "devices/pci0000:00"
+#define HOST0 PCI "/0000:00:01.0/host0"
+#define HOST1 PCI "/0000:00:03.0/host1"
+#define NVME PCI "/0000:00:02.0/nvme/nvme0"
+
+/* Create C<sys>/C<path> containing C<content>, and its directory. */
+static void
+write_file (const char *path, const char *content)
+{
+  CLEANUP_FREE char *cmd = NULL;
+  CLEANUP_FREE char *file = NULL;
+  FILE *fp;
+
+  if (asprintf (&file, "%s/%s", sys, path) == -1 ||
+      asprintf (&cmd, "mkdir -p \"$(dirname '%s')\"", file) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  if (system (cmd) != 0)
+    error (EXIT_FAILURE, 0, "%s: failed", cmd);
+  fp = fopen (file, "w");
+  if (fp == NULL)
+    error (EXIT_FAILURE, errno, "fopen: %s", file);
+  fputs (content, fp);
+  fclose (fp);
+}
+
+/* Create the symlink C<sys>/C<path> pointing to C<target>, which is
+ * relative to C<sys>.
+ */
+static void
+make_link (const char *path, const char *target)
+{
+  CLEANUP_FREE char *cmd = NULL;
+
+  if (asprintf (&cmd,
+                "cd '%s' && mkdir -p \"$(dirname '%s')\" && "
+                "ln -s \"$(realpath -m --relative-to=\"$(dirname '%s')\" '%s')\" '%s'",
+                sys, path, path, target, path) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  if (system (cmd) != 0)
+    error (EXIT_FAILURE, 0, "%s: failed", cmd);
+}
+
+/* Add a block device in the sysfs directory C<dir>. */
+static void
+add_block_device (const char *name, const char *dir, int rotational)
+{
+  CLEANUP_FREE char *path = NULL;
+  CLEANUP_FREE char *link = NULL;
+
+  if (asprintf (&path, "%s/queue/rotational", dir) == -1 ||
+      asprintf (&link, "class/block/%s", name) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  write_file (path, rotational ? "1\n" : "0\n");
+  make_link (link, dir);
+}
+
+static void
+make_sysfs (void)
+{
+  if (mkdtemp (sys) == NULL)
+    error (EXIT_FAILURE, errno, "mkdtemp");
+
+  /* Two rotational disks behind host0, and a partition of one. */
+  write_file (PCI "/0000:00:01.0/numa_node", "1\n");
+  add_block_device ("sda", HOST0 "/target0:0:0/0:0:0:0/block/sda", 1);
+  add_block_device ("sdb", HOST0 "/target0:0:1/0:0:1:0/block/sdb", 1);
+  write_file (HOST0 "/target0:0:0/0:0:0:0/block/sda/sda1/partition", "1\n");
+  make_link ("class/block/sda1",
+             HOST0 "/target0:0:0/0:0:0:0/block/sda/sda1");
+
+  /* Two SSDs behind host1, and an MD RAID of both. */
+  write_file (PCI "/0000:00:03.0/numa_node", "-1\n");
+  add_block_device ("sdc", HOST1 "/target1:0:0/1:0:0:0/block/sdc", 0);
+  add_block_device ("sdd", HOST1 "/target1:0:1/1:0:1:0/block/sdd", 0);
+  add_block_device ("md0", "devices/virtual/block/md0", 0);
+  make_link ("devices/virtual/block/md0/slaves/sdc",
+             HOST1 "/target1:0:0/1:0:0:0/block/sdc");
+  make_link ("devices/virtual/block/md0/slaves/sdd",
+             HOST1 "/target1:0:1/1:0:1:0/block/sdd");
+
+  /* An NVMe disk, and a logical volume on a partition of it. */
+  write_file (PCI "/0000:00:02.0/numa_node", "0\n");
+  add_block_device ("nvme0n1", NVME "/nvme0n1", 0);
+  write_file (NVME "/nvme0n1/nvme0n1p2/partition", "2\n");
+  add_block_device ("dm-0", "devices/virtual/block/dm-0", 0);
+  make_link ("devices/virtual/block/dm-0/slaves/nvme0n1p2",
+             NVME "/nvme0n1/nvme0n1p2");
+}
+
+static void
+remove_sysfs (void)
+{
+  CLEANUP_FREE char *cmd = NULL;
+
+  if (asprintf (&cmd, "rm -rf '%s'", sys) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+  ignore_value (system (cmd));
+}
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf (stderr, "%s:%d: check failed: %s\n",                     \
+               __FILE__, __LINE__, #cond);                              \
+      failures++;                                                       \
+    }                                                                   \
+  } while (0)
+
+static void
+test_groups (void)
+{
+  char *disks[] = { "sda", "sdb", "sda1", "sdc", "sdd", "md0",
+                    "nvme0n1", "dm-0", "missing", NULL };
+  size_t groups[9];
+  bool rotational[9];
+  size_t nr_groups;
+
+  nr_groups = get_disk_groups_in (sys, disks, groups, rotational);
+
+  /* sda, sdb and sda1 share host0 and its spindles. */
+  CHECK (groups[0] == 0 && groups[1] == 0 && groups[2] == 0);
+  CHECK (rotational[0] && rotational[1] && rotational[2]);
+  /* The SSDs are independent, but md0 is on both of them. */
+  CHECK (groups[3] == 1 && groups[4] == 1 && groups[5] == 1);
+  CHECK (!rotational[3] && !rotational[4] && !rotational[5]);
+  /* dm-0 is on the NVMe disk. */
+  CHECK (groups[6] == 2 && groups[7] == 2);
+  CHECK (!rotational[6] && !rotational[7]);
+  /* A disk which is not in sysfs is on its own. */
+  CHECK (groups[8] == 3 && !rotational[8]);
+  CHECK (nr_groups == 4);
+
+  /* Without md0, the SSDs behind host1 can be read in parallel. */
+  disks[0] = "sdc";
+  disks[1] = "sdd";
+  disks[2] = NULL;
+  nr_groups = get_disk_groups_in (sys, disks, groups, rotational);
+  CHECK (nr_groups == 2 && groups[0] == 0 && groups[1] == 1);
+}
+
+static bool
+ends_with (const char *str, const char *suffix)
+{
+  const size_t len = strlen (str), slen = strlen (suffix);
+
+  return len >= slen && STREQ (str + len - slen, suffix);
+}
+
+static void
+test_sysfs_dirs (void)
+{
+  CLEANUP_FREE_STRING_LIST char **sda1 = get_disk_sysfs_dirs_in (sys, "sda1");
+  CLEANUP_FREE_STRING_LIST char **md0 = get_disk_sysfs_dirs_in (sys, "md0");
+  CLEANUP_FREE_STRING_LIST char **dm0 = get_disk_sysfs_dirs_in (sys, "dm-0");
+  CLEANUP_FREE_STRING_LIST char **missing =
+    get_disk_sysfs_dirs_in (sys, "missing");
+
+  /* The whole disk for a partition. */
+  CHECK (sda1[0] != NULL && ends_with (sda1[0], "/block/sda"));
+  CHECK (sda1[0] == NULL || sda1[1] == NULL);
+  /* The device itself, then the devices under it. */
+  CHECK (guestfs_int_count_strings (md0) == 3);
+  CHECK (md0[0] && ends_with (md0[0], "/md0"));
+  CHECK (guestfs_int_count_strings (dm0) == 2);
+  CHECK (dm0[1] && ends_with (dm0[1], "/nvme0/nvme0n1"));
+  CHECK (missing[0] == NULL);
+}
+
+static void
+test_numa_node (void)
+{
+  CHECK (get_disk_numa_node_in (sys, "sda") == 1);
+  CHECK (get_disk_numa_node_in (sys, "sda1") == 1);
+  CHECK (get_disk_numa_node_in (sys, "dm-0") == 0);
+  CHECK (get_disk_numa_node_in (sys, "md0") == -1);
+  CHECK (get_disk_numa_node_in (sys, "missing") == -1);
+}
+
+int
+main (int argc, char *argv[])
+{
+  make_sysfs ();
+  test_groups ();
+  test_sysfs_dirs ();
+  test_numa_node ();
+  remove_sysfs ();
+
+  if (failures > 0) {
+    fprintf (stderr, "%s: %d check(s) failed\n", argv[0], failures);
+    exit (EXIT_FAILURE);
+  }
+  exit (EXIT_SUCCESS);
+}
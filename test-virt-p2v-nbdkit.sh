@@ -41,11 +41,14 @@ ln -sf "$abs_srcdir/test-virt-p2v-scp.sh" scp
 popd
 export PATH=$d:$PATH
 
+# Keep the virt-v2v capability cache out of the real home directory.
+export XDG_CACHE_HOME="$(pwd)/$d/cache"
+
 # Note that the PATH already contains the local virt-p2v & virt-v2v
 # binaries under test (because of the ./run script).
 
 # The Linux kernel command line.
-cmdline="p2v.server=localhost p2v.name=fedora p2v.disks=$f1,$f2 p2v.o=local p2v.os=$(pwd)/$d p2v.network=em1:wired,other p2v.post="
+cmdline="p2v.server=localhost p2v.name=fedora p2v.disks=$f1,$f2 p2v.o=local p2v.os=$(pwd)/$d p2v.network=em1:wired,other p2v.post= p2v.events=$(pwd)/$d/events"
 
 $VG virt-p2v --cmdline="$cmdline"
 
@@ -54,4 +57,9 @@ test -f $d/fedora.xml
 test -f $d/fedora-sda
 test -f $d/fedora-sdb
 
+# Test the event stream.
+grep -q '"event":"start"' $d/events
+grep -q '"event":"log_dir"' $d/events
+grep -q '"event":"finished"' $d/events
+
 rm -r $d
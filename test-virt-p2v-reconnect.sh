@@ -0,0 +1,45 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test that a data connection which drops while the disks are being
+# staged is reconnected, and that the conversion still succeeds.
+
+set -e
+
+$TEST_FUNCTIONS
+source "$abs_srcdir/test-virt-p2v-conversion.sh"
+conversion_test_skips
+skip_unless qemu-img --version
+
+conversion_test_setup test-virt-p2v-reconnect.d
+
+# Drop one of the data connections as soon as the copy workers start
+# (see test-virt-p2v-ssh.sh).
+export P2V_SSH_DROP="$(pwd)/$d/stage/*/next:$(pwd)/$d/dropped"
+
+cmdline="$cmdline p2v.disks=$f p2v.os=$(pwd)/$d p2v.transfer.mode=staged p2v.transfer.streams=2 p2v.transfer.stage_dir=$(pwd)/$d/stage"
+
+$VG virt-p2v --cmdline="$cmdline" > $d/out
+cat $d/out
+test -d $d/dropped
+grep -q 'Data connection for .* was lost' $d/out
+grep -q 'Data connection for .* reconnected' $d/out
+grep -q ': [0-9]* of [0-9]* chunks copied' $d/out
+test -f $d/fedora.xml
+test -f $d/fedora-sda
+
+conversion_test_cleanup
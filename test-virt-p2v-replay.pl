@@ -0,0 +1,188 @@
+#!/usr/bin/env perl
+# libguestfs virt-p2v test script
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# This is an ssh and scp substitute which replays the sessions
+# recorded by 'virt-p2v --record-sessions=DIR'.  It is used by
+# test-virt-p2v-replay.sh, and can be used to profile virt-p2v
+# without a conversion server (see "RECORDING AND REPLAYING SESSIONS"
+# in p2v-hacking(1)).
+#
+# Symlink this script as 'ssh' and 'scp' somewhere on the $PATH, and
+# set these environment variables:
+#
+#   P2V_REPLAY_DIR     The directory containing the recorded sessions.
+#   P2V_REPLAY_SPEED   1 (the default) replays at the recorded speed,
+#                      N replays N times faster, and 0 replays without
+#                      any delays.
+#
+# Each time it is run, it replays the first session for the same
+# program (ssh or scp) which has not been replayed yet.  The output
+# from the remote is written at the recorded times, relative to the
+# last input or output.  Before continuing past the point where
+# virt-p2v sent something, it waits for virt-p2v to send it again.
+# Words which are different in what virt-p2v sends this time (such
+# as the random prompt string and the remote directory name) are
+# replaced in the output which follows.
+
+use strict;
+use warnings;
+
+use Fcntl;
+use File::Basename;
+use Time::HiRes qw(sleep);
+
+my $program = basename ($0);
+my $dir = $ENV{P2V_REPLAY_DIR}
+    or die "$0: P2V_REPLAY_DIR is not set\n";
+my $speed = $ENV{P2V_REPLAY_SPEED} // 1;
+
+# Find the next session to replay.  Creating the ".replayed" file
+# claims the session, even if several copies of this script are
+# started at the same time.
+opendir (my $dh, $dir) or die "$0: $dir: $!\n";
+my @sessions = sort grep { /^\d+-\Q$program\E$/ } readdir ($dh);
+closedir $dh;
+my $session;
+foreach (@sessions) {
+    if (sysopen (my $fh, "$dir/$_.replayed", O_WRONLY|O_CREAT|O_EXCL)) {
+        close $fh;
+        $session = $_;
+        last;
+    }
+}
+die "$0: no more $program sessions to replay in $dir\n"
+    unless defined $session;
+
+my %unescape = ( "n" => "\n", "r" => "\r", "t" => "\t",
+                 "\\" => "\\", "\"" => "\"" );
+
+# Read the events.  See the session recording comment in ssh.c.
+my @events;
+open (my $fh, "<", "$dir/$session") or die "$0: $dir/$session: $!\n";
+while (<$fh>) {
+    chomp;
+    next if /^#/;
+    my ($type, $time, $arg) = /^([A-Z]) (\S+)(?: (.*))?$/
+        or die "$0: $dir/$session: cannot parse: $_\n";
+    my $event = { type => $type, time => $time };
+    if (defined $arg && $arg =~ /^"(.*)"$/) {
+        my $data = $1;
+        $data =~ s/\\(?:x([0-9a-f]{2})|(.))/defined $1 ? chr hex $1 : $unescape{$2}/ge;
+        $event->{data} = $data;
+    }
+    elsif (defined $arg) {
+        $event->{value} = $arg;
+    }
+    push @events, $event;
+}
+close $fh;
+
+my ($status) = map { $_->{value} } grep { $_->{type} eq "X" } @events;
+$status //= 0;
+
+binmode STDIN;
+binmode STDOUT;
+$| = 1;
+
+# Exit the same way as the recorded program did.
+sub finish
+{
+    if ($status & 127) {
+        kill $status & 127, $$;
+        sleep 1;
+    }
+    exit ($status >> 8);
+}
+
+# Read what virt-p2v sends, up to the end of the line if the recorded
+# input ended with a newline, else the same number of bytes.
+my $input = "";
+sub read_input
+{
+    my ($data, $len) = @_;
+
+    for (;;) {
+        if ($data =~ /\n$/) {
+            my $i = index ($input, "\n");
+            return substr ($input, 0, $i + 1, "") if $i >= 0;
+        }
+        elsif (length ($input) >= $len) {
+            return substr ($input, 0, $len, "");
+        }
+        my $r = sysread (STDIN, $input, 4096, length ($input));
+        finish () unless $r;
+    }
+}
+
+my %subst;
+my $subst_re;
+sub learn_substitutions
+{
+    my ($recorded, $actual) = @_;
+    my @a = $recorded =~ /(\w+)/g;
+    my @b = $actual =~ /(\w+)/g;
+
+    return unless @a == @b;
+    for (my $i = 0; $i < @a; ++$i) {
+        $subst{$a[$i]} = $b[$i] if $a[$i] ne $b[$i];
+    }
+    if (%subst) {
+        my $re = join "|", map { quotemeta } sort { length $b <=> length $a }
+                                             keys %subst;
+        $subst_re = qr/\b($re)\b/;
+    }
+}
+
+my $last = 0;
+sub wait_until
+{
+    my $time = shift;
+    sleep (($time - $last) / $speed) if $speed > 0 && $time > $last;
+    $last = $time;
+}
+
+foreach my $event (@events) {
+    my $type = $event->{type};
+
+    if ($type eq "R") {
+        wait_until ($event->{time});
+        my $data = $event->{data};
+        $data =~ s/$subst_re/$subst{$1}/g if defined $subst_re;
+        print $data;
+    }
+    elsif ($type eq "W") {
+        my $got = read_input ($event->{data}, length ($event->{data}));
+        learn_substitutions ($event->{data}, $got);
+        $last = $event->{time};
+    }
+    elsif ($type eq "P") {
+        read_input ("\n", $event->{value});
+        $last = $event->{time};
+    }
+    elsif ($type eq "E") {
+        # The recorded program exited by itself.
+        wait_until ($event->{time});
+        finish ();
+    }
+    elsif ($type eq "C") {
+        # virt-p2v closed the session, so wait for it to do so again.
+        1 while sysread (STDIN, $input, 4096);
+        finish ();
+    }
+}
+
+finish ();
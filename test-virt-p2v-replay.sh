@@ -0,0 +1,62 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test recording the ssh and scp sessions of a conversion with
+# --record-sessions, and replaying them with test-virt-p2v-replay.pl.
+
+set -e
+
+$TEST_FUNCTIONS
+source "$abs_srcdir/test-virt-p2v-conversion.sh"
+conversion_test_skips
+skip_unless perl -MTime::HiRes -e 1
+skip_unless test -f blank-part.img
+
+f2="$abs_builddir/blank-part.img"
+
+conversion_test_setup test-virt-p2v-replay.d
+mkdir $d/replay
+
+cmdline="$cmdline p2v.disks=$f,$f2 p2v.os=$(pwd)/$d"
+
+# Record a conversion using the dummy 'ssh' and 'scp'.
+$VG virt-p2v --record-sessions="$d/sessions" --cmdline="$cmdline"
+
+test -f $d/fedora.xml
+test -f $d/sessions/001-ssh
+
+# Replay it as fast as possible.  virt-v2v does not run this time,
+# so the output files should not be created.
+rm $d/fedora.xml $d/fedora-sd*
+
+pushd $d/replay
+ln -sf "$abs_srcdir/test-virt-p2v-replay.pl" ssh
+ln -sf "$abs_srcdir/test-virt-p2v-replay.pl" scp
+popd
+
+PATH="$d/replay:$PATH" XDG_CACHE_HOME="$(pwd)/$d/cache2" \
+    P2V_REPLAY_DIR="$(pwd)/$d/sessions" P2V_REPLAY_SPEED=0 \
+    $VG virt-p2v --cmdline="$cmdline"
+
+test ! -f $d/fedora.xml
+
+# Every recorded session should have been replayed.
+for s in $d/sessions/[0-9]*-ssh $d/sessions/[0-9]*-scp; do
+    test -f "$s.replayed"
+done
+
+conversion_test_cleanup
@@ -0,0 +1,70 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test pre-copies, staged and resumable conversions, and verifying
+# the staged disks (p2v.transfer.*).
+
+set -e
+
+$TEST_FUNCTIONS
+source "$abs_srcdir/test-virt-p2v-conversion.sh"
+conversion_test_skips
+skip_unless qemu-img --version
+
+conversion_test_setup test-virt-p2v-resume.d
+
+cmdline="$cmdline p2v.disks=$f p2v.transfer.resume p2v.transfer.streams=2 p2v.transfer.compress p2v.transfer.verify p2v.transfer.stage_dir=$(pwd)/$d/stage"
+
+# Pre-copy the disk.  It is staged, but not converted.
+$VG virt-p2v --cmdline="$cmdline p2v.transfer.mode=precopy p2v.os=$(pwd)/$d" > $d/out0
+cat $d/out0
+grep -q 'over 2 connection(s)' $d/out0
+test -f $d/stage/*/disk.raw
+test -s $d/stage/*/manifest
+test ! -f $d/fedora.xml
+cmp $f $d/stage/*/disk.raw
+
+# Corrupt the first chunk of the staged disk.  Verifying it fails, and
+# the chunk is removed from the manifest.
+printf 'XX' |
+    dd of="$(echo $d/stage/*/disk.raw)" bs=1 seek=5 conv=notrunc status=none
+
+# The first conversion fails because the staged disk is corrupted,
+# so virt-v2v does not run.  The disk has not changed since the
+# pre-copy, so nothing should be copied.
+if $VG virt-p2v --cmdline="$cmdline p2v.os=$(pwd)/$d" > $d/out1; then
+    echo "$0: the first conversion was expected to fail"
+    exit 1
+fi
+cat $d/out1
+grep -q ': 0 of [0-9]* chunks copied' $d/out1
+grep -q ': verification FAILED: 1 chunk(s) are different from the source: 0' $d/out1
+test -f $d/stage/*/disk.raw
+test ! -f $d/fedora.xml
+
+# The second conversion should only copy the corrupted chunk again.
+$VG virt-p2v --cmdline="$cmdline p2v.os=$(pwd)/$d" > $d/out2
+cat $d/out2
+grep -q ': 1 of [0-9]* chunks copied' $d/out2
+grep -q ': verified, all [0-9]* chunks are the same as the source' $d/out2
+test -f $d/fedora.xml
+test -f $d/fedora-sda
+
+# The staging directory is removed after a successful conversion.
+test ! -f $d/stage/*/disk.raw
+
+conversion_test_cleanup
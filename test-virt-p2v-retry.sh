@@ -0,0 +1,50 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test that a failed virt-v2v run is retried with the output options
+# printed by the p2v.retry command, without copying the disks again.
+
+set -e
+
+$TEST_FUNCTIONS
+source "$abs_srcdir/test-virt-p2v-conversion.sh"
+conversion_test_skips
+skip_unless qemu-img --version
+
+conversion_test_setup test-virt-p2v-retry.d
+
+# The first run of virt-v2v fails because the output directory does
+# not exist.  The retry command creates another one and selects it.
+cat > $d/retry <<EOS
+#!/bin/sh
+mkdir "$(pwd)/$d/output"
+echo p2v.output.storage="$(pwd)/$d/output"
+EOS
+chmod +x $d/retry
+
+cmdline="$cmdline p2v.disks=$f p2v.os=$(pwd)/$d/missing p2v.transfer.mode=staged p2v.transfer.stage_dir=$(pwd)/$d/stage p2v.retry=$(pwd)/$d/retry"
+
+$VG virt-p2v --cmdline="$cmdline" > $d/out
+cat $d/out
+grep -q 'Retrying the conversion' $d/out
+test -f $d/output/fedora.xml
+test -f $d/output/fedora-sda
+
+# The disks were only staged once.
+test "$(grep -c ': [0-9]* of [0-9]* chunks copied' $d/out)" -eq 1
+
+conversion_test_cleanup
@@ -17,7 +17,7 @@
 # This is an ssh substitute used by test-virt-p2v-nbdkit.sh.
 
 TEMP=`getopt \
-        -o 'l:No:p:R:' \
+        -o 'Cl:No:p:R:' \
         -- "$@"`
 if [ $? != 0 ]; then
     echo "$0: problem parsing the command line arguments"
@@ -28,10 +28,17 @@ eval set -- "$TEMP"
 while true ; do
     case "$1" in
         # Regular arguments that we can just ignore.
-        -N)
+        -C|-N)
             shift
             ;;
-        -l|-o|-p)
+        -l|-p)
+            shift 2
+            ;;
+        -o)
+            case "$2" in
+                ServerAliveInterval=*) alive_interval="${2#*=}" ;;
+                ServerAliveCountMax=*) alive_count_max="${2#*=}" ;;
+            esac
             shift 2
             ;;
 
@@ -41,6 +48,17 @@ while true ; do
         -R)
             arg="$2"
             port="$(echo $arg | awk -F: '{print $3}')"
+            # If $P2V_WAN is set, send the connection through the WAN
+            # link emulator (see test-virt-p2v-wan.sh) instead.
+            if [ -n "$P2V_WAN" ]; then
+                port_file="$(mktemp)"
+                rm -f "$port_file"
+                "$(dirname "$(readlink -f "$0")")/test-virt-p2v-wan.pl" \
+                    "$P2V_WAN" $port "$port_file" $$ </dev/null &
+                while [ ! -s "$port_file" ]; do sleep 0.1; done
+                port="$(cat "$port_file")"
+                rm -f "$port_file"
+            fi
             echo "Allocated port" $port "for remote forward"
             shift 2
             ;;
@@ -56,5 +74,45 @@ while true ; do
     esac
 done
 
+# If the emulated link has an outage which is longer than the ssh
+# keepalive timeout, disconnect like the real ssh would.  The outage
+# starts at the time in $P2V_WAN_EPOCH (see test-virt-p2v-wan.pl).
+if [[ "$P2V_WAN" =~ outage=([^,+]+)\+([^,]+) ]]; then
+    disconnect_after="$(
+        awk -v at="${BASH_REMATCH[1]}" -v len="${BASH_REMATCH[2]}" \
+            -v epoch="${P2V_WAN_EPOCH:-$(date +%s.%N)}" -v now="$(date +%s.%N)" \
+            -v interval="${alive_interval:-0}" -v count="${alive_count_max:-3}" '
+            function secs(s) { return s ~ /ms$/ ? s / 1000 : s + 0 }
+            BEGIN {
+                t = epoch + secs(at) + interval * count - now
+                if (interval > 0 && secs(len) > interval * count && t > 0)
+                    print t
+            }')"
+    if [ -n "$disconnect_after" ]; then
+        (
+            sleep $disconnect_after
+            echo "Timeout, server localhost not responding."
+            kill -HUP $$
+        ) &
+    fi
+fi
+
+# If $P2V_SSH_DROP is set to "FILE:DIR", the first data connection
+# drops as soon as FILE exists, like when a NAT gateway resets it (see
+# test-virt-p2v-reconnect.sh).  FILE may be a glob.  DIR is created to
+# remember that a connection was dropped.
+if [ -n "$port" ] && [[ "$P2V_SSH_DROP" =~ ^(.*):([^:]+)$ ]] &&
+       mkdir "${BASH_REMATCH[2]}" 2>/dev/null; then
+    file="${BASH_REMATCH[1]}"
+    (
+        until compgen -G "$file" >/dev/null; do
+            kill -0 $$ 2>/dev/null || exit 0
+            sleep 0.1
+        done
+        echo "Connection reset by peer"
+        kill -HUP $$
+    ) &
+fi
+
 # Now run the interactive shell.
 exec bash --norc
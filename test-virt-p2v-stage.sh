@@ -0,0 +1,143 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test the shell functions of staged transfers (virt-p2v-stage.sh)
+# directly, with small chunks and a qemu-img substitute which reads
+# the "disk" served on each port from a file.
+
+set -e
+
+$TEST_FUNCTIONS
+skip_if_skipped
+skip_unless flock --version
+skip_unless sha256sum --version
+
+script="$abs_srcdir/virt-p2v-stage.sh"
+
+if shellcheck --version >/dev/null 2>&1; then
+    shellcheck -s bash "$script"
+fi
+
+d=test-virt-p2v-stage.d
+rm -rf $d
+mkdir $d
+cd $d
+
+# qemu-img convert -O raw json:{...,"port":PORT} OUT copies the disk
+# in the file src-PORT.  If the directory "short" exists, the first
+# copy is short.
+mkdir bin
+cat > bin/qemu-img <<'EOF'
+#!/bin/bash -
+[[ "$4" =~ \"offset\":([0-9]+),\"size\":([0-9]+),.*\"port\":([0-9]+) ]] ||
+    exit 1
+off=${BASH_REMATCH[1]} len=${BASH_REMATCH[2]} port=${BASH_REMATCH[3]}
+[ -f src-$port ] || exit 1
+if rmdir short 2>/dev/null; then len=$((len / 2)); fi
+dd if=src-$port of="$5" bs=4096 skip=$off count=$len \
+   iflag=skip_bytes,count_bytes status=none
+EOF
+chmod +x bin/qemu-img
+export PATH="$(pwd)/bin:$PATH"
+
+chunk=4096
+
+# Write the checksums file of a disk, as virt-p2v does.  Arguments
+# after the disk are "I DISK J" for the duplicate chunks.
+checksums ()
+{
+    local disk="$1" size i sum
+    shift
+    size=$(stat -c %s $disk)
+    echo "# chunks of $disk"
+    echo "size $size"
+    echo "chunk $chunk"
+    for ((i = 0; i * chunk < size; i++)); do
+        sum=$(dd if=$disk bs=$chunk skip=$i count=1 status=none | sha256sum)
+        sum=${sum%% *}
+        if [ -z "$(dd if=$disk bs=$chunk skip=$i count=1 status=none |
+                   tr -d '\0' | head -c 1)" ]; then
+            sum=zero
+        fi
+        echo "$i $sum $(for dup in "$@"; do
+                            [ "${dup%% *}" != "$i" ] || echo "${dup#* }"
+                        done)"
+    done
+}
+
+# Disk 0 has 4 chunks, of which chunk 1 is empty and chunk 3 is
+# short.  Chunk 0 of disk 1 is the same as chunk 0 of disk 0.
+head -c $chunk /dev/urandom > src-1001
+head -c $chunk /dev/zero >> src-1001
+head -c $((chunk + 100)) /dev/urandom >> src-1001
+head -c $chunk src-1001 > src-1002
+head -c $((chunk * 2)) /dev/urandom >> src-1002
+checksums src-1001 > checksums-0
+checksums src-1002 "0 0 0" > checksums-1
+
+export STAGE_RETRY_DELAY=0
+source "$script"
+stage_dirs=("$(pwd)/stage/0" "$(pwd)/stage/1")
+
+stage disk0 stage/0 checksums-0 1001 1001 > out
+stage disk1 stage/1 checksums-1 1002 > out1
+cat out out1
+grep -q '^disk0: 4 of 4 chunks copied (0 from base images, 0 duplicates)' out
+grep -q '^disk1: 3 of 3 chunks copied (0 from base images, 1 duplicates)' out1
+cmp src-1001 stage/0/disk.raw
+cmp src-1002 stage/1/disk.raw
+test "$(dedup_summary checksums-*)" = \
+     "1 of 6 chunks were duplicates (deduplication ratio 1.20)"
+
+# Nothing is copied again.
+stage disk0 stage/0 checksums-0 1001 > out
+grep -q '^disk0: 0 of 4 chunks copied .* 4 already on the conversion server' out
+verify disk0 stage/0 checksums-0
+
+# A corrupted chunk is found, and only that chunk is copied again.
+printf 'XX' |
+    dd of=stage/1/disk.raw bs=1 seek=$((chunk * 2 + 5)) conv=notrunc status=none
+if verify disk1 stage/1 checksums-1 > out; then
+    echo "$0: verify was expected to fail"
+    exit 1
+fi
+cat out
+grep -q '^disk1: verification FAILED: 1 chunk(s) are different from the source: 2$' out
+stage disk1 stage/1 checksums-1 1002 > out
+grep -q '^disk1: 1 of 3 chunks copied' out
+verify disk1 stage/1 checksums-1
+cmp src-1002 stage/1/disk.raw
+
+# A data connection which was reconnected on a new port, and a short
+# copy which is retried.
+echo 1001 > port-2001
+mkdir short
+stage disk0 stage/2 checksums-0 2001 > out 2> err
+cat out err
+grep -q '^disk0: chunk [0-9]: retrying' err
+cmp src-1001 stage/2/disk.raw
+
+# A data connection which is never reconnected.
+if STAGE_RETRIES=2 stage disk0 stage/3 checksums-0 3001 > out 2> err; then
+    echo "$0: stage was expected to fail"
+    exit 1
+fi
+cat out err
+grep -q '^disk0: chunk [0-9]: giving up after 2 tries' err
+
+cd ..
+rm -r $d
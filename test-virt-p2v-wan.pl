@@ -0,0 +1,238 @@
+#!/usr/bin/env perl
+# libguestfs virt-p2v test script
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# WAN link emulator used by test-virt-p2v-ssh.sh when $P2V_WAN is set
+# (see test-virt-p2v-wan.sh).
+#
+# Usage: test-virt-p2v-wan.pl SETTINGS PORT PORT-FILE PARENT-PID
+#
+# It listens on an ephemeral port on localhost, writes the port number
+# to PORT-FILE, and forwards each connection to localhost:PORT through
+# an emulated link.  It exits when PARENT-PID exits.
+#
+# SETTINGS is a comma-separated list of:
+#
+#   rtt=TIME          round trip time (eg. 100ms), half in each direction
+#   jitter=TIME       random extra delay of up to TIME in each direction
+#   bandwidth=RATE    link speed in each direction (eg. 20Mbit, 5MB)
+#   loss=PERCENT      percentage of packets lost
+#   outage=AT+TIME    the link is down for TIME, starting at AT
+#                     seconds after $P2V_WAN_EPOCH (a time from
+#                     'date +%s.%N'), or after this program started
+#
+# Because the connections are TCP, data is never really lost.  A lost
+# packet is delivered after a retransmission timeout instead, and
+# holds up the data behind it, which is what the application sees.
+
+use strict;
+use warnings;
+
+use IO::Select;
+use IO::Socket::INET;
+use Errno qw(EAGAIN EWOULDBLOCK EINTR);
+use Time::HiRes qw(time);
+
+die "usage: $0 SETTINGS PORT PORT-FILE PARENT-PID\n" unless @ARGV == 4;
+my ($settings, $target_port, $port_file, $parent) = @ARGV;
+
+# Packets are emulated as reads of up to this many bytes.
+my $packet_size = 64 * 1024;
+
+# Stop reading from a sender when this much is queued on the link.
+my $max_queued = 4 * 1024 * 1024;
+
+sub parse_time
+{
+    my $s = shift;
+    $s =~ /^([\d.]+)(ms|s)?$/ or die "$0: cannot parse time: $s\n";
+    return defined $2 && $2 eq "ms" ? $1 / 1000 : $1;
+}
+
+sub parse_rate
+{
+    my $s = shift;
+    $s =~ /^([\d.]+)([kKMG]?)(bit|B)?$/ or die "$0: cannot parse rate: $s\n";
+    my $r = $1 * { "" => 1, k => 1e3, K => 1e3, M => 1e6, G => 1e9 }->{$2};
+    $r /= 8 unless defined $3 && $3 eq "B";
+    return $r;                  # bytes/second
+}
+
+my ($delay, $jitter, $rate, $loss, $outage_at, $outage_len) = (0, 0, 0, 0);
+foreach (split /,/, $settings) {
+    my ($k, $v) = split /=/, $_, 2;
+    die "$0: cannot parse setting: $_\n" unless defined $v;
+    if ($k eq "rtt") { $delay = parse_time ($v) / 2 }
+    elsif ($k eq "jitter") { $jitter = parse_time ($v) }
+    elsif ($k eq "bandwidth") { $rate = parse_rate ($v) }
+    elsif ($k eq "loss") { ($loss = $v) =~ s/%$//; $loss /= 100 }
+    elsif ($k eq "outage") {
+        $v =~ /^(.*)\+(.*)$/ or die "$0: cannot parse outage: $v\n";
+        ($outage_at, $outage_len) = (parse_time ($1), parse_time ($2));
+    }
+    else { die "$0: unknown setting: $k\n" }
+}
+
+# Same as the minimum TCP retransmission timeout on Linux.
+my $rto = 0.2 + 2 * $delay;
+
+my $listener = IO::Socket::INET->new (LocalAddr => "127.0.0.1",
+                                      LocalPort => 0,
+                                      Listen => 16,
+                                      ReuseAddr => 1)
+    or die "$0: listen: $!\n";
+$listener->blocking (0);
+open my $fh, ">", "$port_file.tmp" or die "$0: $port_file: $!\n";
+print $fh $listener->sockport, "\n";
+close $fh;
+rename "$port_file.tmp", $port_file or die "$0: $port_file: $!\n";
+
+# Each direction of each connection is a "pipe", which reads from
+# one socket and writes to the other.
+my @pipes;
+my $start = $ENV{P2V_WAN_EPOCH} // time ();
+
+sub new_pipe
+{
+    my ($from, $to) = @_;
+    return { from => $from, to => $to, queue => [], queued => 0,
+             wbuf => "", link_free => 0, last_delivery => 0,
+             eof => 0, done => 0 };
+}
+
+# When will data read now be delivered at the other end?
+sub schedule
+{
+    my ($p, $len, $now) = @_;
+    my $t = $now > $p->{link_free} ? $now : $p->{link_free};
+
+    $t += $len / $rate if $rate > 0;
+    $p->{link_free} = $t;
+    $t += $delay + rand ($jitter);
+    $t += $rto if $loss > 0 && rand () < $loss;
+    if (defined $outage_at) {
+        my $down = $start + $outage_at;
+        $t = $down + $outage_len + $delay
+            if $t >= $down && $t < $down + $outage_len;
+    }
+    # TCP delivers data in order.
+    $t = $p->{last_delivery} if $t < $p->{last_delivery};
+    $p->{last_delivery} = $t;
+    return $t;
+}
+
+my $last_parent_check = 0;
+
+for (;;) {
+    my $now = time ();
+
+    if ($now - $last_parent_check >= 1) {
+        exit 0 unless kill 0, $parent;
+        $last_parent_check = $now;
+    }
+
+    # Move data which has arrived to the write buffers.
+    my $timeout = 1;
+    foreach my $p (@pipes) {
+        while (@{$p->{queue}} && $p->{queue}[0][0] <= $now) {
+            my $item = shift @{$p->{queue}};
+            if (defined $item->[1]) {
+                $p->{wbuf} .= $item->[1];
+                $p->{queued} -= length $item->[1];
+            }
+            else {
+                $p->{eof} = 1;
+            }
+        }
+        if (@{$p->{queue}}) {
+            my $t = $p->{queue}[0][0] - $now;
+            $timeout = $t if $t < $timeout;
+        }
+        if ($p->{eof} && $p->{wbuf} eq "" && !$p->{done}) {
+            shutdown ($p->{to}, 1);
+            $p->{done} = 1;
+        }
+    }
+
+    # Close connections which are finished in both directions.
+    for (my $i = 0; $i < @pipes; $i += 2) {
+        if ($pipes[$i]{done} && $pipes[$i+1]{done}) {
+            close $pipes[$i]{from};
+            close $pipes[$i]{to};
+            splice @pipes, $i, 2;
+            $i -= 2;
+        }
+    }
+
+    my $rsel = IO::Select->new ($listener);
+    my $wsel = IO::Select->new ();
+    foreach my $p (@pipes) {
+        $rsel->add ($p->{from})
+            if !$p->{read_eof} && $p->{queued} < $max_queued;
+        $wsel->add ($p->{to}) if $p->{wbuf} ne "";
+    }
+
+    my ($readable, $writable) =
+        IO::Select->select ($rsel, $wsel, undef, $timeout);
+    $now = time ();
+
+    foreach my $fh (@{$readable // []}) {
+        if ($fh == $listener) {
+            my $client = $listener->accept or next;
+            my $server = IO::Socket::INET->new (PeerAddr => "127.0.0.1",
+                                                PeerPort => $target_port,
+                                                Proto => "tcp");
+            unless ($server) {
+                close $client;
+                next;
+            }
+            $_->blocking (0) foreach $client, $server;
+            push @pipes, new_pipe ($client, $server),
+                         new_pipe ($server, $client);
+            next;
+        }
+        foreach my $p (grep { $_->{from} == $fh } @pipes) {
+            my $buf;
+            my $r = sysread ($fh, $buf, $packet_size);
+            next if !defined $r && ($! == EAGAIN || $! == EWOULDBLOCK ||
+                                    $! == EINTR);
+            if (!$r) {
+                $p->{read_eof} = 1;
+                push @{$p->{queue}}, [ schedule ($p, 0, $now), undef ];
+            }
+            else {
+                push @{$p->{queue}}, [ schedule ($p, $r, $now), $buf ];
+                $p->{queued} += $r;
+            }
+        }
+    }
+
+    foreach my $fh (@{$writable // []}) {
+        foreach my $p (grep { $_->{to} == $fh } @pipes) {
+            my $r = syswrite ($fh, $p->{wbuf});
+            if (defined $r) {
+                substr ($p->{wbuf}, 0, $r) = "";
+            }
+            elsif ($! != EAGAIN && $! != EWOULDBLOCK && $! != EINTR) {
+                # The receiver went away.  Throw the data away.
+                $p->{wbuf} = "";
+                $p->{queue} = [ [ 0, undef ] ];
+                $p->{queued} = 0;
+                $p->{read_eof} = 1;
+            }
+        }
+    }
+}
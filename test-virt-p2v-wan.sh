@@ -0,0 +1,92 @@
+#!/bin/bash -
+# libguestfs virt-p2v test script
+# Copyright (C) 2014-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Test virt-p2v in non-GUI mode over an emulated WAN link.
+#
+# This is the same as test-virt-p2v-nbdkit.sh, except that the data
+# connections go through test-virt-p2v-wan.pl, which adds latency,
+# jitter, bandwidth limits, packet loss and outages.  Each scenario
+# must still convert successfully, and the time taken is printed.
+# Other scenarios can be tried by setting $P2V_WAN (see
+# test-virt-p2v-wan.pl for the settings).
+
+set -e
+
+$TEST_FUNCTIONS
+slow_test
+skip_if_skipped
+skip_if_backend uml
+skip_unless nbdkit file --version
+skip_unless perl -MTime::HiRes -MIO::Socket::INET -e 1
+skip_unless test -f fedora.img
+skip_unless test -f blank-part.img
+
+f1="$abs_builddir/fedora.img"
+f2="$abs_builddir/blank-part.img"
+
+d=test-virt-p2v-wan.d
+rm -rf $d
+mkdir $d
+
+pushd $d
+ln -sf "$abs_srcdir/test-virt-p2v-ssh.sh" ssh
+ln -sf "$abs_srcdir/test-virt-p2v-scp.sh" scp
+popd
+export PATH=$d:$PATH
+
+if [ -n "$P2V_WAN" ]; then
+    scenarios=("$P2V_WAN")
+else
+    scenarios=(
+        # A good connection between data centres.
+        "rtt=20ms,jitter=2ms,bandwidth=1Gbit"
+        # A long distance link.
+        "rtt=150ms,jitter=20ms,bandwidth=50Mbit,loss=0.5%"
+        # A poor link with a short outage, which is well within the
+        # ssh keepalive timeout and so should not be noticed.
+        "rtt=300ms,jitter=50ms,bandwidth=10Mbit,loss=2%,outage=10+5"
+    )
+fi
+
+cmdline="p2v.server=localhost p2v.name=fedora p2v.disks=$f1,$f2 p2v.o=local p2v.os=$(pwd)/$d p2v.network=em1:wired,other p2v.post="
+
+for wan in "${scenarios[@]}"; do
+    rm -f $d/fedora.xml $d/fedora-sd*
+    # Keep the virt-v2v capability cache out of the real home directory,
+    # and start each scenario without it.
+    rm -rf $d/cache
+    export XDG_CACHE_HOME="$(pwd)/$d/cache"
+
+    export P2V_WAN="$wan"
+    export P2V_WAN_EPOCH="$(date +%s.%N)"
+    start=$(date +%s.%N)
+    $VG virt-p2v --cmdline="$cmdline" > $d/virt-p2v.log 2>&1 || {
+        cat $d/virt-p2v.log
+        echo "$0: conversion failed with P2V_WAN=$wan"
+        exit 1
+    }
+    end=$(date +%s.%N)
+
+    test -f $d/fedora.xml
+    test -f $d/fedora-sda
+    test -f $d/fedora-sdb
+
+    awk -v wan="$wan" -v start=$start -v end=$end -v prog="$(basename $0)" \
+        'BEGIN { printf "%s: %s: %.1f seconds\n", prog, wan, end - start }'
+done
+
+rm -r $d
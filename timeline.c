@@ -0,0 +1,221 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * A timeline is a list of named steps, each with a start and end time
+ * taken from the monotonic clock.  Steps may overlap and may be
+ * recorded from any thread.
+ *
+ * The startup timeline (C<startup_timeline>) records how long each
+ * step between program start and virt-p2v being ready to use took.
+ * It is printed by S<C<virt-p2v --startup-timeline>>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+
+#include <pthread.h>
+
+#include "p2v.h"
+
+struct timeline_step {
+  char *name;
+  struct timespec start;
+  struct timespec end;          /* tv_sec == -1 if still running */
+};
+
+struct timeline {
+  pthread_mutex_t lock;         /* Protects all fields. */
+  struct timespec origin;       /* Time zero. */
+  struct timeline_step *steps;
+  size_t nr_steps, alloc_steps;
+};
+
+struct timeline *startup_timeline;
+int print_startup_timeline;
+
+static double
+seconds_between (const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/**
+ * Create a new timeline.  Time zero is the moment this is called.
+ */
+struct timeline *
+new_timeline (void)
+{
+  struct timeline *tl;
+
+  tl = calloc (1, sizeof *tl);
+  if (tl == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  pthread_mutex_init (&tl->lock, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &tl->origin);
+  return tl;
+}
+
+void
+free_timeline (struct timeline *tl)
+{
+  size_t i;
+
+  if (tl == NULL)
+    return;
+
+  for (i = 0; i < tl->nr_steps; ++i)
+    free (tl->steps[i].name);
+  free (tl->steps);
+  pthread_mutex_destroy (&tl->lock);
+  free (tl);
+}
+
+/**
+ * Record the start of a step.  Returns a step number which must be
+ * passed to C<timeline_end> when the step finishes.
+ *
+ * It is safe to call this with C<tl == NULL>, which does nothing.
+ */
+size_t
+timeline_begin (struct timeline *tl, const char *fs, ...)
+{
+  va_list args;
+  struct timeline_step *step;
+  size_t i;
+  int r;
+
+  if (tl == NULL)
+    return 0;
+
+  pthread_mutex_lock (&tl->lock);
+  if (tl->nr_steps >= tl->alloc_steps) {
+    tl->alloc_steps = tl->alloc_steps ? tl->alloc_steps * 2 : 16;
+    tl->steps = realloc (tl->steps, tl->alloc_steps * sizeof *tl->steps);
+    if (tl->steps == NULL)
+      error (EXIT_FAILURE, errno, "realloc");
+  }
+  i = tl->nr_steps++;
+  step = &tl->steps[i];
+  va_start (args, fs);
+  r = vasprintf (&step->name, fs, args);
+  va_end (args);
+  if (r == -1)
+    error (EXIT_FAILURE, errno, "vasprintf");
+  clock_gettime (CLOCK_MONOTONIC, &step->start);
+  step->end.tv_sec = -1;
+  pthread_mutex_unlock (&tl->lock);
+
+  return i;
+}
+
+/**
+ * Record the end of a step started by C<timeline_begin>.
+ */
+void
+timeline_end (struct timeline *tl, size_t i)
+{
+  if (tl == NULL)
+    return;
+
+  pthread_mutex_lock (&tl->lock);
+  if (i < tl->nr_steps)
+    clock_gettime (CLOCK_MONOTONIC, &tl->steps[i].end);
+  pthread_mutex_unlock (&tl->lock);
+}
+
+/**
+ * Record an instantaneous event.
+ */
+void
+timeline_mark (struct timeline *tl, const char *name)
+{
+  timeline_end (tl, timeline_begin (tl, "%s", name));
+}
+
+/**
+ * Print the timeline on C<fp>, one step per line, in the order the
+ * steps were started.  Steps which have not finished yet are shown
+ * without an end time.
+ */
+void
+timeline_print (struct timeline *tl, FILE *fp)
+{
+  struct timespec boot;
+  size_t i;
+
+  pthread_mutex_lock (&tl->lock);
+
+  /* CLOCK_BOOTTIME and CLOCK_MONOTONIC share the same origin except
+   * for time spent suspended, which is close enough for this.
+   */
+  if (clock_gettime (CLOCK_BOOTTIME, &boot) == 0) {
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    fprintf (fp, "%s: time zero is %.3fs after boot\n",
+             g_get_prgname (),
+             boot.tv_sec + boot.tv_nsec / 1e9 -
+             seconds_between (&tl->origin, &now));
+  }
+
+  fprintf (fp, "%10s %10s %10s  %s\n", "start", "end", "duration", "step");
+  for (i = 0; i < tl->nr_steps; ++i) {
+    const struct timeline_step *step = &tl->steps[i];
+    const double start = seconds_between (&tl->origin, &step->start);
+
+    if (step->end.tv_sec == -1)
+      fprintf (fp, "%9.3fs %10s %10s  %s\n", start, "-", "-", step->name);
+    else
+      fprintf (fp, "%9.3fs %9.3fs %9.3fs  %s\n",
+               start,
+               seconds_between (&tl->origin, &step->end),
+               seconds_between (&step->start, &step->end),
+               step->name);
+  }
+
+  pthread_mutex_unlock (&tl->lock);
+}
+
+/**
+ * Called when virt-p2v is ready for the user (in GUI mode) or ready
+ * to start the conversion (in kernel mode).  Marks the end of startup
+ * and prints the startup timeline if S<C<--startup-timeline>> was
+ * used.  Only the first call does anything.
+ */
+void
+startup_ready (void)
+{
+  static int done = 0;
+
+  if (done || startup_timeline == NULL)
+    return;
+  done = 1;
+
+  timeline_mark (startup_timeline, "ready");
+  if (print_startup_timeline) {
+    timeline_print (startup_timeline, stderr);
+    fflush (stderr);
+  }
+}
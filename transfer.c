@@ -0,0 +1,808 @@
+/* virt-p2v
+ * Copyright (C) 2009-2019 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Two-phase (staged) and resumable transfers.
+ *
+ * Normally virt-v2v reads the disks directly over the NBD data
+ * connections while it converts the guest, at whatever pace its copy
+ * loop sets.  In staged mode (S<C<p2v.transfer.mode=staged>>), the
+ * disks are first copied ("staged") into files on the conversion
+ * server, over several data connections per disk in parallel, and
+ * virt-v2v then converts the staged copies at local disk speed.
+ *
+ * Each disk is divided into chunks of C<TRANSFER_CHUNK_SIZE> bytes.
+ * virt-p2v writes a list of the chunks of each disk which is copied
+ * to the conversion server, and a shell function in the wrapper script
+ * (see C<generate_stage_function>) copies each chunk over one of the
+ * data connections.
+ *
+ * With S<C<p2v.transfer.resume>>, virt-p2v first reads the whole of
+ * each disk locally and puts the SHA-256 checksum of each chunk in
+ * the list.  The chunks are then checked after they are copied, and
+ * each chunk is added to the manifest in the staging directory as
+ * soon as it has been written.  The staging directory survives a
+ * failed conversion, and the chunks which are in the manifest with
+ * the same checksum are not copied again, so a conversion which was
+ * interrupted at 90% only has to copy the last 10% next time.  Chunks
+ * which only contain zeroes are never copied.
+ *
+ * The staging directory is named after the serial number and size of
+ * the disk, so it is found again when virt-p2v is run on the same
+ * machine, even if the disk names have changed.  It is deleted after
+ * a successful conversion.
+ *
+ * In pre-copy mode (S<C<p2v.transfer.mode=precopy>>), virt-p2v runs
+ * on the physical machine while it is still in use, and only stages
+ * the disks.  Since the disks are being written to, a chunk may change
+ * between computing its checksum and copying it, so the list of chunks
+ * is marked C<live> and the manifest records the checksum of the data
+ * which was actually copied.  When the machine is later booted from
+ * the virt-p2v ISO and converted with S<C<p2v.transfer.resume>>, the
+ * checksums are computed again and only the chunks which changed since
+ * the pre-copy are copied.
+ *
+ * With S<C<p2v.transfer.base_dir>>, the conversion server has a
+ * directory of base images (the images that the physical machines were
+ * installed from).  The wrapper script indexes the checksums of the
+ * chunks of each base image, and any chunk of a disk with the same
+ * checksum as a chunk of a base image is copied from the base image
+ * instead of over the network.  The list of checksums which virt-p2v
+ * sends is all that is needed to find these chunks.
+ *
+ * With S<C<p2v.transfer.dedup>>, the checksums of the chunks of all
+ * the disks are compared before the transfer, and a chunk which is the
+ * same as a chunk that comes before it (on the same disk, or on an
+ * earlier disk) is only copied once.  The wrapper script copies the
+ * other copies from the staged disks on the conversion server.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/types.h>
+
+#include <pthread.h>
+
+#include "p2v.h"
+
+/* Default directory on the conversion server for staged disks. */
+#define DEFAULT_STAGE_DIR "/var/tmp/virt-p2v-stage"
+
+/* Size of the blocks read from the disk while computing checksums. */
+#define READ_SIZE (1024 * 1024)
+
+/* Maximum number of threads computing the checksums of one disk. */
+#define MAX_CHECKSUM_THREADS 8
+
+/* Above this memory pressure (the percentage of time stalled, see
+ * C<get_memory_pressure>), only one thread per disk keeps reading.
+ */
+#define MEMORY_PRESSURE_LIMIT 10.0
+
+/* The most data connections for each disk when their number is
+ * chosen by the stream controller.
+ */
+#define MAX_ADAPTIVE_STREAMS 8
+
+/**
+ * Are the disks staged on the conversion server before conversion?
+ * Resumable transfers and pre-copies are always staged.
+ */
+bool
+is_staged_transfer (const struct config *config)
+{
+  return config->transfer.mode == TRANSFER_MODE_STAGED ||
+    is_checksummed_transfer (config);
+}
+
+/**
+ * Are the checksums of the chunks computed before the transfer?  This
+ * is needed to resume transfers, to find chunks in base images, to
+ * find duplicate chunks and to verify the staged disks.
+ */
+bool
+is_checksummed_transfer (const struct config *config)
+{
+  return is_resumable_transfer (config) ||
+    config->transfer.base_dir != NULL || config->transfer.dedup ||
+    config->transfer.verify;
+}
+
+/**
+ * Are the staged disks kept, and checksums computed, so that a later
+ * conversion only copies the chunks which changed?
+ */
+bool
+is_resumable_transfer (const struct config *config)
+{
+  return config->transfer.resume ||
+    config->transfer.mode == TRANSFER_MODE_PRECOPY;
+}
+
+/**
+ * Return the directory on the conversion server where disk C<i> is
+ * staged.  The caller must free the returned string.
+ *
+ * The staging directory is shared by all conversions to the server,
+ * so the name must identify the disk uniquely.  It is the serial
+ * number of the disk, or if the disk has no serial number (or is
+ * given as a path), the identifier of this machine (see
+ * C<get_machine_id>) followed by the name of the disk.  In both cases
+ * the size of the disk is added.  If neither is available this
+ * returns C<NULL>, since resuming from (or deleting) the staged disk
+ * of another machine would be much worse than not staging at all.
+ */
+char *
+get_disk_stage_dir (struct config *config, size_t i)
+{
+  const char *disk = config->disks[i];
+  CLEANUP_FREE char *serial = NULL;
+  CLEANUP_FREE char *device = NULL;
+  CLEANUP_FREE char *machine_id = NULL;
+  CLEANUP_FREE char *id = NULL;
+  const char *name;
+  char *ret, *p;
+  int fd;
+  off_t size = 0;
+
+  if (disk[0] == '/') {
+    device = strdup (disk);
+    p = strrchr (disk, '/');
+    name = p + 1;
+  }
+  else {
+    if (asprintf (&device, "/dev/%s", disk) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+    serial = get_blockdev_serial (disk);
+    name = disk;
+  }
+  if (device == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+
+  if (serial && STRNEQ (serial, ""))
+    id = strdup (serial);
+  else {
+    machine_id = get_machine_id ();
+    if (machine_id == NULL)
+      return NULL;
+    if (asprintf (&id, "%s-%s", machine_id, name) == -1)
+      error (EXIT_FAILURE, errno, "asprintf");
+  }
+  if (id == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+
+  fd = open (device, O_RDONLY|O_CLOEXEC);
+  if (fd >= 0) {
+    size = lseek (fd, 0, SEEK_END);
+    close (fd);
+  }
+
+  if (asprintf (&ret, "%s/%s-%" PRIi64,
+                config->transfer.stage_dir ?
+                config->transfer.stage_dir : DEFAULT_STAGE_DIR,
+                id, (int64_t) size) == -1)
+    error (EXIT_FAILURE, errno, "asprintf");
+
+  /* The name must not need shell quoting. */
+  for (p = strrchr (ret, '/') + 1; *p; ++p) {
+    if (!isalnum ((unsigned char) *p) && *p != '-' && *p != '_' && *p != '.')
+      *p = '_';
+  }
+
+  return ret;
+}
+
+static int
+is_zero (const char *buf, size_t len)
+{
+  return len == 0 || (buf[0] == 0 && memcmp (buf, buf + 1, len - 1) == 0);
+}
+
+/* The list of chunks of one disk. */
+struct chunk_list {
+  uint64_t size;
+  uint64_t nr_chunks;
+  char (*sums)[65];             /* checksum (or "zero") of each chunk */
+  struct chunk_ref *refs;       /* earlier copy of each chunk, if any */
+};
+
+struct chunk_ref {
+  bool dup;                     /* set if the chunk is a duplicate */
+  size_t disk;                  /* disk and chunk of its first copy */
+  uint64_t chunk;
+};
+
+/* The state shared by the threads computing the checksums of one
+ * disk.  Each thread takes the next chunk which has not been done.
+ * After a thread fails, the others stop at their next chunk.
+ */
+struct chunk_hasher {
+  int fd;
+  bool direct;                  /* fd is opened with O_DIRECT */
+  struct chunk_list *l;
+  bool checksums;               /* compute checksums, or only find zeroes */
+  unsigned nr_threads;
+  int (*cancelled) (void);
+  pthread_mutex_t lock;
+  uint64_t next_chunk;          /* protected by lock */
+  bool failed;                  /* protected by lock */
+};
+
+struct chunk_hasher_thread {
+  pthread_t thread;
+  struct chunk_hasher *h;
+  unsigned k;
+  int err;                      /* errno, if this thread failed */
+};
+
+static bool
+has_failed (struct chunk_hasher *h)
+{
+  bool r;
+
+  pthread_mutex_lock (&h->lock);
+  r = h->failed;
+  pthread_mutex_unlock (&h->lock);
+  return r;
+}
+
+/* Stop all the threads, because thread C<t> failed with C<err>. */
+static void
+set_failed (struct chunk_hasher_thread *t, int err)
+{
+  t->err = err;
+  pthread_mutex_lock (&t->h->lock);
+  t->h->failed = true;
+  pthread_mutex_unlock (&t->h->lock);
+}
+
+/* Return the next chunk to do, or C<UINT64_MAX> if there are none
+ * left or another thread failed.  Under memory pressure, all the
+ * threads except the first wait, so that fewer reads are in flight.
+ */
+static uint64_t
+get_next_chunk (struct chunk_hasher_thread *t)
+{
+  struct chunk_hasher *h = t->h;
+  uint64_t chunk;
+
+  while (t->k > 0 && get_memory_pressure () > MEMORY_PRESSURE_LIMIT) {
+    if ((h->cancelled && h->cancelled ()) || has_failed (h))
+      break;
+    sleep (1);
+  }
+
+  pthread_mutex_lock (&h->lock);
+  if (h->failed || h->next_chunk >= h->l->nr_chunks)
+    chunk = UINT64_MAX;
+  else
+    chunk = h->next_chunk++;
+  pthread_mutex_unlock (&h->lock);
+  return chunk;
+}
+
+static void *
+hash_chunks (void *tv)
+{
+  struct chunk_hasher_thread *t = tv;
+  struct chunk_hasher *h = t->h;
+  void *buf;
+  GChecksum *checksum;
+  uint64_t chunk;
+  int err;
+
+  /* Aligned, for O_DIRECT. */
+  err = posix_memalign (&buf, 4096, READ_SIZE);
+  if (err != 0)
+    error (EXIT_FAILURE, err, "posix_memalign");
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  while ((chunk = get_next_chunk (t)) != UINT64_MAX) {
+    uint64_t offset = chunk * TRANSFER_CHUNK_SIZE;
+    const uint64_t end = MIN (offset + TRANSFER_CHUNK_SIZE, h->l->size);
+    int zero = 1;
+    ssize_t r;
+
+    if (h->cancelled && h->cancelled ()) {
+      set_failed (t, ECANCELED);
+      break;
+    }
+
+    g_checksum_reset (checksum);
+    while (offset < end) {
+      uint64_t n = MIN (READ_SIZE, end - offset);
+
+      /* With O_DIRECT the size must be aligned too.  Only the last
+       * chunk of a file can end on an unaligned offset, and reading
+       * past the end just returns less.
+       */
+      if (h->direct)
+        n = (n + 4095) & ~UINT64_C(4095);
+      r = pread (h->fd, buf, n, offset);
+      if (r == -1 && errno == EINTR)
+        continue;
+      if (r <= 0) {
+        set_failed (t, r == -1 ? errno : EIO); /* EIO: the device got smaller. */
+        goto out;
+      }
+      if ((uint64_t) r > end - offset)
+        r = end - offset;
+      if (zero && !is_zero (buf, r))
+        zero = 0;
+      offset += r;
+      if (h->checksums)
+        g_checksum_update (checksum, (const guchar *) buf, r);
+      else if (!zero)
+        break;          /* Only whether the chunk is all zeroes is needed. */
+    }
+
+    /* Do not let the page cache fill up with the disk. */
+    if (!h->direct)
+      posix_fadvise (h->fd, chunk * TRANSFER_CHUNK_SIZE,
+                     offset - chunk * TRANSFER_CHUNK_SIZE,
+                     POSIX_FADV_DONTNEED);
+
+    if (zero)
+      strcpy (h->l->sums[chunk], "zero");
+    else if (h->checksums)
+      strcpy (h->l->sums[chunk], g_checksum_get_string (checksum));
+    else
+      strcpy (h->l->sums[chunk], "-");
+  }
+
+ out:
+  g_checksum_free (checksum);
+  free (buf);
+  return NULL;
+}
+
+/* Open C<device> for reading its chunks.  The page cache is bypassed
+ * with O_DIRECT if the device supports it, which is found out with an
+ * aligned read of the first block, since some devices (and regular
+ * files on some filesystems) accept O_DIRECT in open(2) and then fail
+ * every read with C<EINVAL>.  Otherwise the device is opened again for
+ * buffered reads.  Sets C<*direct> to tell which.
+ */
+static int
+open_for_chunks (const char *device, bool *direct)
+{
+  void *buf;
+  ssize_t r;
+  int fd, err;
+
+  fd = open (device, O_RDONLY|O_CLOEXEC|O_DIRECT);
+  if (fd >= 0) {
+    err = posix_memalign (&buf, 4096, 4096);
+    if (err != 0)
+      error (EXIT_FAILURE, err, "posix_memalign");
+    do
+      r = pread (fd, buf, 4096, 0);
+    while (r == -1 && errno == EINTR);
+    err = errno;
+    free (buf);
+    /* Other errors are reported when the chunks are read. */
+    if (r >= 0 || err != EINVAL) {
+      *direct = true;
+      return fd;
+    }
+    close (fd);
+    errno = EINVAL;
+  }
+  if (fd == -1 && errno != EINVAL)
+    return -1;
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: %s: O_DIRECT is not supported, "
+           "reading through the page cache\n",
+           g_get_prgname (), device);
+#endif
+  *direct = false;
+  return open (device, O_RDONLY|O_CLOEXEC);
+}
+
+/* Read the list of chunks of C<device> into C<l>, using C<nr_threads>
+ * threads.
+ *
+ * If C<checksums> is true, the whole of the device is read, and the
+ * SHA-256 checksum of each chunk is stored, or C<zero> for chunks
+ * which only contain zeroes.  Otherwise each chunk is only read up to
+ * its first block which is not all zeroes, and C<zero> or C<-> is
+ * stored, which means that the chunk is always copied.
+ *
+ * Returns C<0> on success or C<-1> on error (with C<errno> set).
+ */
+static int
+read_chunk_list (const char *device, struct chunk_list *l,
+                 bool checksums, unsigned nr_threads,
+                 int (*cancelled) (void))
+{
+  CLEANUP_FREE struct chunk_hasher_thread *threads = NULL;
+  struct chunk_hasher h = { .l = l, .checksums = checksums,
+                            .cancelled = cancelled };
+  unsigned k;
+  int err = 0;
+
+  /* Read around the page cache, which on the virt-p2v ISO competes
+   * for the little RAM there is with the NBD servers and ssh.
+   */
+  h.fd = open_for_chunks (device, &h.direct);
+  if (h.fd == -1)
+    return -1;
+  l->size = lseek (h.fd, 0, SEEK_END);
+  l->nr_chunks = (l->size + TRANSFER_CHUNK_SIZE - 1) / TRANSFER_CHUNK_SIZE;
+  posix_fadvise (h.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  pthread_mutex_init (&h.lock, NULL);
+
+  l->sums = calloc (l->nr_chunks ? l->nr_chunks : 1, sizeof *l->sums);
+  l->refs = calloc (l->nr_chunks ? l->nr_chunks : 1, sizeof *l->refs);
+  if (l->sums == NULL || l->refs == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+
+  h.nr_threads = MAX (1, MIN (nr_threads, l->nr_chunks));
+  threads = calloc (h.nr_threads, sizeof *threads);
+  if (threads == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  for (k = 0; k < h.nr_threads; ++k) {
+    threads[k].h = &h;
+    threads[k].k = k;
+    err = pthread_create (&threads[k].thread, NULL, hash_chunks,
+                          &threads[k]);
+    if (err != 0)
+      error (EXIT_FAILURE, err, "pthread_create");
+  }
+  err = 0;
+  for (k = 0; k < h.nr_threads; ++k) {
+    pthread_join (threads[k].thread, NULL);
+    if (threads[k].err != 0 && err == 0)
+      err = threads[k].err;
+  }
+
+  pthread_mutex_destroy (&h.lock);
+  close (h.fd);
+  errno = err;
+  return err == 0 ? 0 : -1;
+}
+
+/* Find the chunks which appear more than once in the lists of all
+ * the disks.  Every copy after the first one is marked with a
+ * reference to the first copy, which may be on another disk.  The
+ * index only holds pointers to the checksums in the lists, so it
+ * takes a few tens of bytes per 64 MB chunk.
+ */
+static void
+dedup_chunk_lists (struct chunk_list *lists, size_t nr_disks)
+{
+  GHashTable *index;
+  uint64_t chunk, nr_chunks = 0, nr_dups = 0;
+  size_t i;
+
+  index = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (i = 0; i < nr_disks; ++i) {
+    nr_chunks += lists[i].nr_chunks;
+    for (chunk = 0; chunk < lists[i].nr_chunks; ++chunk) {
+      const char *sum = lists[i].sums[chunk];
+      const struct chunk_ref *first;
+
+      if (STREQ (sum, "zero") || STREQ (sum, "-"))
+        continue;
+      first = g_hash_table_lookup (index, sum);
+      if (first) {
+        lists[i].refs[chunk] = *first;
+        lists[i].refs[chunk].dup = true;
+        nr_dups++;
+      }
+      else {
+        lists[i].refs[chunk].disk = i;
+        lists[i].refs[chunk].chunk = chunk;
+        g_hash_table_insert (index, (gpointer) sum, &lists[i].refs[chunk]);
+      }
+    }
+  }
+
+  g_hash_table_destroy (index);
+
+#if DEBUG_STDERR
+  fprintf (stderr, "%s: %" PRIu64 " of %" PRIu64 " chunks are duplicates\n",
+           g_get_prgname (), nr_dups, nr_chunks);
+#endif
+}
+
+/* Write the list of chunks of C<device> to C<filename>.
+ *
+ * If C<live> is true, the device is in use by the running machine
+ * (pre-copy mode), and the list is marked so that chunks which changed
+ * since their checksum was computed are not treated as errors.
+ *
+ * Duplicate chunks are written as S<C<N SUM DISK CHUNK>>, where
+ * C<DISK> and C<CHUNK> are the index of the disk and the chunk where
+ * the same data was first seen.
+ *
+ * Returns C<0> on success or C<-1> on error (with C<errno> set).
+ */
+static int
+write_chunk_list (const char *device, const struct chunk_list *l,
+                  const char *filename, bool live)
+{
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  uint64_t chunk;
+
+  fp = fopen (filename, "w");
+  if (fp == NULL)
+    return -1;
+  fprintf (fp, "# chunks of %s written by virt-p2v\n", device);
+  fprintf (fp, "size %" PRIu64 "\n", l->size);
+  fprintf (fp, "chunk %d\n", TRANSFER_CHUNK_SIZE);
+  if (live)
+    fprintf (fp, "live\n");
+  for (chunk = 0; chunk < l->nr_chunks; ++chunk) {
+    fprintf (fp, "%" PRIu64 " %s", chunk, l->sums[chunk]);
+    if (l->refs[chunk].dup)
+      fprintf (fp, " %zu %" PRIu64,
+               l->refs[chunk].disk, l->refs[chunk].chunk);
+    fprintf (fp, "\n");
+  }
+
+  if (fflush (fp) == EOF)
+    return -1;
+  return 0;
+}
+
+/* One thread reads the disks of one group (see C<get_disk_groups>),
+ * one after another.
+ */
+struct checksum_thread {
+  pthread_t thread;
+  size_t group;
+  size_t nr_disks;
+  const size_t *groups;         /* group of each disk */
+  const bool *rotational;       /* rotational flag of each disk */
+  char **devices;
+  struct chunk_list *lists;
+  bool checksums;
+  unsigned nr_threads;
+  int (*cancelled) (void);
+  int r, err;
+};
+
+static void *
+checksum_thread_start (void *ctv)
+{
+  struct checksum_thread *ct = ctv;
+  size_t i;
+
+  for (i = 0; i < ct->nr_disks; ++i) {
+    if (ct->groups[i] != ct->group)
+      continue;
+    /* The threads reading the disk inherit this. */
+    set_disk_thread_affinity (ct->devices[i]);
+    /* Several readers would make a rotational disk seek. */
+    ct->r = read_chunk_list (ct->devices[i], &ct->lists[i], ct->checksums,
+                             ct->rotational[i] ? 1 : ct->nr_threads,
+                             ct->cancelled);
+    ct->err = errno;
+    if (ct->r == -1)
+      break;
+  }
+  return NULL;
+}
+
+/**
+ * Write the lists of chunks of all the disks into files called
+ * F<checksums-I<N>> in C<dir>.  The checksums are only computed if
+ * C<is_checksummed_transfer>, otherwise only the chunks which are all
+ * zeroes are found, so that they are not copied.
+ *
+ * The disks are divided into groups which share a physical device or
+ * the controller of rotational disks (see C<get_disk_groups>).  The
+ * groups are read in parallel and the online CPUs are shared between
+ * them, while the disks of a group are read one after another, and
+ * rotational disks are read sequentially by a single thread.
+ *
+ * With S<C<p2v.transfer.dedup>>, chunks which are the same as an
+ * earlier chunk of any of the disks are marked as duplicates, and the
+ * wrapper script copies them from the earlier chunk on the conversion
+ * server instead of over the network.  This is not done in pre-copy
+ * mode, since the chunks may change before they are copied.
+ *
+ * Returns C<0> on success or C<-1> on error (with C<errno> set).
+ */
+int
+write_all_disk_checksums (struct config *config, const char *dir,
+                          int (*cancelled) (void))
+{
+  const size_t nr_disks = guestfs_int_count_strings (config->disks);
+  const long nr_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  const bool live = config->transfer.mode == TRANSFER_MODE_PRECOPY;
+  CLEANUP_FREE struct checksum_thread *threads = NULL;
+  CLEANUP_FREE struct chunk_list *lists = NULL;
+  CLEANUP_FREE size_t *groups = NULL;
+  CLEANUP_FREE bool *rotational = NULL;
+  CLEANUP_FREE_STRING_LIST char **devices = NULL;
+  size_t i, nr_groups;
+  int ret = 0, err = 0;
+
+  lists = calloc (nr_disks, sizeof *lists);
+  groups = calloc (nr_disks + 1, sizeof *groups);
+  rotational = calloc (nr_disks + 1, sizeof *rotational);
+  devices = calloc (nr_disks + 1, sizeof (char *));
+  if (lists == NULL || groups == NULL || rotational == NULL ||
+      devices == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+
+  for (i = 0; i < nr_disks; ++i) {
+    if (config->disks[i][0] == '/')
+      devices[i] = strdup (config->disks[i]);
+    else if (asprintf (&devices[i], "/dev/%s", config->disks[i]) == -1)
+      devices[i] = NULL;
+    if (devices[i] == NULL)
+      error (EXIT_FAILURE, errno, "strdup");
+  }
+
+  nr_groups = get_disk_groups (config->disks, groups, rotational);
+  threads = calloc (MAX (nr_groups, 1), sizeof *threads);
+  if (threads == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+
+  for (i = 0; i < nr_groups; ++i) {
+    threads[i].group = i;
+    threads[i].nr_disks = nr_disks;
+    threads[i].groups = groups;
+    threads[i].rotational = rotational;
+    threads[i].devices = devices;
+    threads[i].lists = lists;
+    threads[i].checksums = is_checksummed_transfer (config);
+    threads[i].nr_threads =
+      MIN (MAX_CHECKSUM_THREADS, MAX (1, nr_cpus / (long) nr_groups));
+    threads[i].cancelled = cancelled;
+    err = pthread_create (&threads[i].thread, NULL,
+                          checksum_thread_start, &threads[i]);
+    if (err != 0)
+      error (EXIT_FAILURE, err, "pthread_create");
+  }
+
+  err = 0;
+  for (i = 0; i < nr_groups; ++i) {
+    pthread_join (threads[i].thread, NULL);
+    if (threads[i].r == -1 && ret == 0) {
+      ret = -1;
+      err = threads[i].err;
+    }
+  }
+
+  if (ret == 0 && config->transfer.dedup && !live)
+    dedup_chunk_lists (lists, nr_disks);
+
+  for (i = 0; i < nr_disks; ++i) {
+    CLEANUP_FREE char *filename = NULL;
+
+    if (ret == 0) {
+      if (asprintf (&filename, "%s/checksums-%zu", dir, i) == -1)
+        error (EXIT_FAILURE, errno, "asprintf");
+      if (write_chunk_list (devices[i], &lists[i], filename, live) == -1) {
+        ret = -1;
+        err = errno;
+      }
+    }
+    free (lists[i].sums);
+    free (lists[i].refs);
+  }
+
+  errno = err;
+  return ret;
+}
+
+/**
+ * Return the number of data connections used to copy each disk in
+ * staged mode.  If it is not set in the configuration, use the
+ * number of streams which gave the best throughput in the network
+ * benchmark.
+ */
+unsigned
+get_transfer_streams (const struct config *config)
+{
+  if (config->transfer.streams > 0)
+    return config->transfer.streams;
+
+  if (network_benchmark.valid) {
+    if (network_benchmark.nr_streams > 1 &&
+        network_benchmark.multi_stream > network_benchmark.single_stream * 1.2)
+      return network_benchmark.nr_streams;
+    return 1;
+  }
+
+  return 4;
+}
+
+/**
+ * Does the stream controller (see F<supervisor.c>) change the number
+ * of data connections in use while the disks are copied?  It does in
+ * staged mode, unless the number of streams is set in the
+ * configuration.  C<get_transfer_streams> is then only the number it
+ * starts with.
+ */
+bool
+is_adaptive_transfer (const struct config *config)
+{
+  return is_staged_transfer (config) && config->transfer.streams == 0;
+}
+
+/**
+ * Return the most data connections that each disk may use in staged
+ * mode.  In adaptive mode, only C<get_transfer_streams> of them are
+ * opened at the start, and the stream controller opens the others
+ * when it first uses them.
+ */
+unsigned
+get_max_transfer_streams (const struct config *config)
+{
+  if (is_adaptive_transfer (config))
+    return MAX (get_transfer_streams (config), MAX_ADAPTIVE_STREAMS);
+  return get_transfer_streams (config);
+}
+
+/**
+ * Write the shell functions of staged transfers to the wrapper script.
+ *
+ * The functions are in F<virt-p2v-stage.sh>, which is compiled into
+ * virt-p2v as C<stage_script> (see F<generate-p2v-stage.pl>), and is
+ * tested on its own by F<test-virt-p2v-stage.sh>.
+ *
+ * S<C<stage NAME DIR CHUNKS PORT [PORT ...]>> copies the disk served
+ * by NBD on each C<PORT> into F<DIR/disk.raw>, using one process per
+ * port, and skipping the chunks listed in F<DIR/manifest> with the
+ * same checksums as in the file C<CHUNKS>.  Chunks which cannot be
+ * copied are retried for a while, in case the data connection was
+ * lost and is being reconnected (see F<supervisor.c>).  Progress is
+ * printed in the same form as virt-v2v's progress bars.
+ *
+ * The processes take the next chunk to copy from a counter in
+ * F<DIR/next>.  If there is a file called F<streams> in the current
+ * directory, only that many of them (the number on its first line)
+ * copy chunks, and the others wait.  The stream controller in
+ * virt-p2v rewrites this file, with the reason on its second line,
+ * which is printed to the log.
+ *
+ * S<C<load_base_index DIR CHUNK>> indexes the base images (the
+ * F<.img> files in C<DIR>), and the C<stage> function then copies
+ * chunks which are found in a base image from there.
+ *
+ * Chunks which are marked as duplicates in C<CHUNKS> are copied from
+ * their first copy in the staged disks, which are listed in the
+ * C<stage_dirs> array of the wrapper script, after the other chunks.
+ * S<C<dedup_summary CHUNKS ...>> prints how many chunks were
+ * duplicates.
+ *
+ * S<C<verify NAME DIR CHUNKS>> reads the whole of F<DIR/disk.raw>
+ * again, using one process per CPU on the conversion server, and
+ * compares every chunk with its checksum in C<CHUNKS>.
+ */
+void
+generate_stage_function (FILE *fp)
+{
+  fputs (stage_script, fp);
+}
@@ -28,7 +28,7 @@
 #include <locale.h>
 #include <libintl.h>
 
-#include "ignore-value.h"
+#include <pthread.h>
 
 #include "p2v.h"
 
@@ -136,6 +136,51 @@ get_blockdev_serial (const char *dev)
   return serial;
 }
 
+/**
+ * Read a counter (eg. C<rchar>) for process C<pid> from
+ * F</proc/I<pid>/io>.  Returns C<-1> if it cannot be read, which is
+ * normal if the process has exited.
+ */
+int
+get_process_io_counter (pid_t pid, const char *field, uint64_t *ret)
+{
+  char path[64], name[32];
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  uint64_t v;
+
+  snprintf (path, sizeof path, "/proc/%d/io", (int) pid);
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return -1;
+  while (fscanf (fp, "%31[^:]: %" SCNu64 " ", name, &v) == 2) {
+    if (STREQ (name, field)) {
+      *ret = v;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Return the share of the last 10 seconds (as a percentage) in which
+ * some tasks were stalled waiting for memory, from
+ * F</proc/pressure/memory>.  Returns C<-1> if the kernel does not
+ * report pressure stall information.
+ */
+double
+get_memory_pressure (void)
+{
+  CLEANUP_FCLOSE FILE *fp = NULL;
+  double avg10;
+
+  fp = fopen ("/proc/pressure/memory", "r");
+  if (fp == NULL)
+    return -1;
+  if (fscanf (fp, "some avg10=%lf", &avg10) != 1)
+    return -1;
+  return avg10;
+}
+
 /**
  * Return contents of F</sys/class/net/I<if_name>/address> (if found).
  */
@@ -234,24 +279,174 @@ get_if_vendor (const char *if_name, int truncate)
   return NULL;
 }
 
+/**
+ * Return an identifier for this machine: its DMI UUID from
+ * F</sys/class/dmi/id/product_uuid>, or if it has none, its
+ * F</etc/machine-id>.  Placeholder DMI UUIDs (all zeroes or all
+ * ones), which many machines would share, are ignored.
+ *
+ * Note that on live media F</etc/machine-id> is usually generated
+ * at boot, so it only identifies the machine until it is rebooted.
+ *
+ * Returns C<NULL> if there is no identifier.  The caller must free
+ * the returned string.
+ */
+char *
+get_machine_id (void)
+{
+  static const char *files[] = {
+    "/sys/class/dmi/id/product_uuid", "/etc/machine-id", NULL
+  };
+  size_t i;
+
+  for (i = 0; files[i] != NULL; ++i) {
+    CLEANUP_FCLOSE FILE *fp = NULL;
+    char *id = NULL;
+    size_t len = 0;
+    ssize_t n;
+
+    fp = fopen (files[i], "r");
+    if (fp == NULL)
+      continue;
+    if ((n = getline (&id, &len, fp)) == -1) {
+      free (id);
+      continue;
+    }
+    CHOMP (id, n);
+    if (STREQ (id, "") ||
+        strspn (id, "0-") == strlen (id) ||
+        strspn (id, "fF-") == strlen (id)) {
+      free (id);
+      continue;
+    }
+    return id;
+  }
+
+  return NULL;
+}
+
+/**
+ * A shell command running in a background thread.
+ */
+struct background_command {
+  pthread_t thread;
+  char *command;
+  size_t step;                  /* Step in the startup timeline. */
+  int status;                   /* Exit status, as from system(3). */
+};
+
+static void *
+run_background_command (void *bcv)
+{
+  struct background_command *bc = bcv;
+
+  bc->status = system (bc->command);
+  timeline_end (startup_timeline, bc->step);
+  return NULL;
+}
+
+/**
+ * Run C<command> using L<system(3)> in a background thread, recording
+ * it in the startup timeline as C<description>.  Call
+ * C<wait_background_command> to wait for it and get the exit status.
+ */
+struct background_command *
+start_background_command (const char *description, const char *command)
+{
+  struct background_command *bc;
+  int err;
+
+  bc = malloc (sizeof *bc);
+  if (bc == NULL)
+    error (EXIT_FAILURE, errno, "malloc");
+  bc->command = strdup (command);
+  if (bc->command == NULL)
+    error (EXIT_FAILURE, errno, "strdup");
+  bc->step = timeline_begin (startup_timeline, "%s", description);
+
+  err = pthread_create (&bc->thread, NULL, run_background_command, bc);
+  if (err != 0)
+    error (EXIT_FAILURE, err, "pthread_create");
+
+  return bc;
+}
+
+/**
+ * Wait for a command started by C<start_background_command> and free
+ * the handle.  Returns the exit status in the same form as
+ * L<system(3)>.
+ */
+int
+wait_background_command (struct background_command *bc)
+{
+  int status;
+
+  pthread_join (bc->thread, NULL);
+  status = bc->status;
+  free (bc->command);
+  free (bc);
+  return status;
+}
+
 /* XXX We could make this configurable. */
 #define NETWORK_ONLINE_COMMAND "nm-online -t 30"
 
+static pthread_mutex_t network_online_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct background_command *network_online_cmd;
+static int network_online_done;
+
+/* Must be called with network_online_lock held. */
+static void
+start_network_online_locked (void)
+{
+  if (!network_online_done && network_online_cmd == NULL) {
+#ifdef DEBUG_STDERR
+    fprintf (stderr, "waiting for the network to come online ...\n");
+    fprintf (stderr, "%s\n", NETWORK_ONLINE_COMMAND);
+    fflush (stderr);
+#endif
+    network_online_cmd =
+      start_background_command ("network online", NETWORK_ONLINE_COMMAND);
+  }
+}
+
+/**
+ * Start waiting for the network to come online in the background.
+ * C<wait_network_online> must still be called before the network is
+ * used.
+ */
+void
+start_network_online (void)
+{
+  pthread_mutex_lock (&network_online_lock);
+  start_network_online_locked ();
+  pthread_mutex_unlock (&network_online_lock);
+}
+
 /**
  * Wait for the network to come online, but don't error out if that
  * fails.  The caller will call C<test_connection> immediately after
  * this which will fail if the network didn't come online.
+ *
+ * If C<start_network_online> was called earlier, this only waits for
+ * the remainder of that.  Once the network has come online, later
+ * calls return at once.  It is safe to call this from several
+ * threads.
  */
 void
 wait_network_online (const struct config *config)
 {
-#ifdef DEBUG_STDERR
-  fprintf (stderr, "waiting for the network to come online ...\n");
-  fprintf (stderr, "%s\n", NETWORK_ONLINE_COMMAND);
-  fflush (stderr);
-#endif
-
-  ignore_value (system (NETWORK_ONLINE_COMMAND));
+  pthread_mutex_lock (&network_online_lock);
+  if (!network_online_done) {
+    start_network_online_locked ();
+    /* If the network did not come online (in time), wait again the
+     * next time, for example when the user tests the connection again.
+     */
+    if (wait_background_command (network_online_cmd) == 0)
+      network_online_done = 1;
+    network_online_cmd = NULL;
+  }
+  pthread_mutex_unlock (&network_online_lock);
 }
 
 int
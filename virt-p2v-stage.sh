@@ -0,0 +1,443 @@
+# shellcheck shell=bash
+# libguestfs virt-p2v
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Staged transfers: the shell functions which copy the disks to the
+# conversion server and check the copies (see transfer.c).
+#
+# This file is not run on its own.  It is built into virt-p2v, which
+# adds it to the wrapper script that runs on the conversion server, in
+# the remote directory.  The wrapper script sets the "stage_dirs"
+# array to the staging directory of each disk, in order.  It is tested
+# directly by test-virt-p2v-stage.sh.
+#
+# The checksums file of a disk (CHUNKS below) is written by virt-p2v.
+# It has the lines "size BYTES", "chunk BYTES", "live" if the disk is
+# being pre-copied while the machine is running, and then one line per
+# chunk: "I SUM" where SUM is the SHA-256 checksum, "zero" for an
+# empty chunk or "-" if it was not computed, followed by "DISK J" if
+# the chunk is the same as chunk J of the DISK'th disk.
+#
+# The manifest of a staged disk (DIR/manifest) has one line "I SUM"
+# for each chunk which is on the conversion server.
+
+# How many times a chunk is fetched before giving up, and the number
+# of seconds between the tries.  While a data connection is down,
+# virt-p2v keeps reconnecting it for 10 minutes (see supervisor.c).
+: "${STAGE_RETRIES:=60}"
+: "${STAGE_RETRY_DELAY:=10}"
+
+# Base image chunks, by checksum: "CHUNK IMAGE".
+declare -A base=()
+
+# Print an error message.
+stage_error ()
+{
+    echo "$*" >&2
+}
+
+# Load the checksums of the chunks of the base images in a directory,
+# writing an index next to each image if it is missing or out of
+# date.
+#
+# load_base_index DIR CHUNK
+load_base_index ()
+{
+    local dir="$1" chunk="$2" img idx size i sum
+
+    for img in "$dir"/*.img; do
+        [ -f "$img" ] || continue
+        idx="$img.index"
+        if [ ! -f "$idx" ] || [ "$img" -nt "$idx" ] ||
+           [ "$(head -1 "$idx")" != "chunk $chunk" ]; then
+            echo "Indexing base image $img ..."
+            size=$(stat -c %s "$img") || continue
+            if ! (
+                echo "chunk $chunk"
+                for ((i = 0; i * chunk < size; i++)); do
+                    sum=$(dd if="$img" bs="$chunk" skip="$i" count=1 \
+                             status=none | sha256sum) || exit 1
+                    echo "$i ${sum%% *}"
+                done
+            ) > "$idx.tmp" || ! mv "$idx.tmp" "$idx"; then
+                stage_error "$img: could not index the base image, skipping it"
+                rm -f "$idx.tmp"
+                continue
+            fi
+        fi
+        while read -r i sum; do
+            case "$i" in [0-9]*) base[$sum]="$i $img" ;; esac
+        done < "$idx"
+    done
+    echo "${#base[@]} chunks in base images"
+}
+
+# Punch out the old data of part of a staged disk before it is written
+# again with conv=sparse, which skips the blocks of zeroes in the new
+# data.  Prints the dd conversions to use.
+#
+# punch FILE OFFSET LENGTH
+punch ()
+{
+    if fallocate -p -o "$2" -l "$3" "$1" 2>/dev/null; then
+        echo notrunc,sparse
+    else
+        echo notrunc
+    fi
+}
+
+# Read a line of the form "KEY VALUE" from a checksums file.
+#
+# sums_value FILE KEY
+sums_value ()
+{
+    awk -v key="$2" '$1 == key { print $2 }' "$1"
+}
+
+# Take the next chunk from the counter in DIR/next, which is shared by
+# the copy workers and locked with fd 9.  Prints the index into the
+# list of chunks to copy.
+#
+# next_chunk DIR
+next_chunk ()
+{
+    local j
+
+    flock 9 || return 1
+    if ! j=$(< "$1/next") || [[ ! "$j" =~ ^[0-9]+$ ]] ||
+       ! echo $((j + 1)) > "$1/next"; then
+        flock -u 9
+        stage_error "$1/next: could not update the chunk counter"
+        return 1
+    fi
+    flock -u 9
+    echo "$j"
+}
+
+# Record that chunk I with checksum SUM is in the staged disk.  An
+# append of one short line is atomic, so the copy workers can do this
+# at the same time.
+#
+# add_to_manifest DIR I SUM
+add_to_manifest ()
+{
+    if ! echo "$2 $3" >> "$1/manifest"; then
+        stage_error "$1/manifest: could not add chunk $2"
+        return 1
+    fi
+}
+
+# Copy chunk I of length LEN at offset OFF over the NBD data connection
+# which was on PORT when the conversion started, into the file DATA.
+# If the data connection is lost, virt-p2v reconnects it, possibly on
+# a new port, which it writes to the file port-PORT.  A chunk which
+# comes back short is fetched again.
+#
+# fetch_chunk NAME I OFF LEN PORT DATA
+fetch_chunk ()
+{
+    local name="$1" i="$2" off="$3" len="$4" port="$5" data="$6"
+    local tries=0 p size
+
+    while :; do
+        p=$port
+        [ ! -f "port-$port" ] || p=$(< "port-$port")
+        rm -f "$data"
+        if qemu-img convert -O raw \
+               'json:{"driver":"raw","offset":'"$off"',"size":'"$len"',"file":{"driver":"nbd","host":"localhost","port":'"$p"'}}' \
+               "$data" &&
+           size=$(stat -c %s "$data") && [ "$size" -eq "$len" ]; then
+            return 0
+        fi
+        tries=$((tries + 1))
+        if [ "$tries" -ge "$STAGE_RETRIES" ]; then
+            stage_error "$name: chunk $i: giving up after $tries tries"
+            return 1
+        fi
+        stage_error "$name: chunk $i: retrying"
+        sleep "$STAGE_RETRY_DELAY"
+    done
+}
+
+# One copy worker.  It takes chunks from the list in the array "todo"
+# of the caller until there are none left.  If there is a file called
+# "streams", only that many of the workers (the number on its first
+# line) copy chunks, and the others wait.
+#
+# stage_worker NAME DIR K PORT SIZE CHUNK LIVE
+stage_worker ()
+{
+    local name="$1" dir="$2" k="$3" port="$4" size="$5" chunk="$6" live="$7"
+    local j i want sum off len ref conv data="$dir/data.$k"
+
+    exec 9> "$dir/next.lock" || return 1
+    while :; do
+        # virt-p2v may pause all but the first connection.
+        while [ "$k" -gt 0 ] && [ -s streams ] &&
+              [ "$k" -ge "$(head -1 streams)" ]; do
+            sleep 1
+        done
+        j=$(next_chunk "$dir") || return 1
+        [ "$j" -lt "${#todo[@]}" ] || break
+        read -r i want <<< "${todo[j]}"
+        sum=$want
+        off=$((i * chunk))
+        len=$((size - off < chunk ? size - off : chunk))
+        if [ "$want" = "zero" ]; then
+            if ! fallocate -p -o "$off" -l "$len" "$dir/disk.raw" 2>/dev/null &&
+               ! dd if=/dev/zero of="$dir/disk.raw" bs="$len" count=1 \
+                    seek="$off" oflag=seek_bytes conv=notrunc status=none; then
+                stage_error "$name: chunk $i: could not write the staged disk"
+                return 1
+            fi
+        elif [ -n "${base[$want]}" ]; then
+            # The same chunk is in a base image.
+            ref=${base[$want]}
+            conv=$(punch "$dir/disk.raw" "$off" "$len")
+            if ! dd if="${ref#* }" of="$dir/disk.raw" bs="$chunk" \
+                    skip="${ref%% *}" seek="$i" count=1 conv="$conv" \
+                    status=none; then
+                stage_error "$name: chunk $i: could not copy it from ${ref#* }"
+                return 1
+            fi
+            echo >> "$dir/based" || return 1
+        else
+            fetch_chunk "$name" "$i" "$off" "$len" "$port" "$data" || return 1
+            if [ "$want" != "-" ]; then
+                sum=$(sha256sum < "$data") || return 1
+                sum=${sum%% *}
+            fi
+            # If the machine is running (pre-copy), the chunk may have
+            # changed since its checksum was computed.  The manifest
+            # records what was actually copied.
+            if [ "$sum" != "$want" ] && [ -z "$live" ]; then
+                stage_error "$name: chunk $i is different from the source"
+                return 1
+            fi
+            conv=$(punch "$dir/disk.raw" "$off" "$len")
+            if ! dd if="$data" of="$dir/disk.raw" bs="$chunk" seek="$i" \
+                    conv="$conv" status=none; then
+                stage_error "$name: chunk $i: could not write the staged disk"
+                return 1
+            fi
+        fi
+        add_to_manifest "$dir" "$i" "$sum" || return 1
+        echo >> "$dir/copied" || return 1
+    done
+    rm -f "$data"
+}
+
+# Copy a disk to the staging directory DIR over one or more NBD data
+# connections (one copy worker per PORT), skipping the chunks which
+# are already there.  Duplicate chunks are copied from their first
+# copy in the staged disks after the other chunks.  Progress is
+# printed in the same form as virt-v2v's progress bars.
+#
+# stage NAME DIR CHUNKS PORT [PORT ...]
+stage ()
+{
+    local name="$1" dir="$2" sums="$3"
+    shift 3
+    local ports=("$@")
+    local size chunk nr live i sum disk j k p b s last off len conv
+    local failed=0 pids=() todo=() dups=()
+    local -A have=()
+
+    size=$(sums_value "$sums" size)
+    chunk=$(sums_value "$sums" chunk)
+    nr=$(grep -c '^[0-9]' "$sums")
+    live=$(awk '$1 == "live" { print 1 }' "$sums")
+    if [[ ! "$size" =~ ^[0-9]+$ ]] || [[ ! "$chunk" =~ ^[1-9][0-9]*$ ]]; then
+        stage_error "$sums: missing size or chunk size"
+        return 1
+    fi
+
+    mkdir -p "$dir" || return 1
+    if [ "$(cat "$dir/chunk" 2>/dev/null)" != "$chunk" ] ||
+       [ ! -f "$dir/disk.raw" ]; then
+        rm -f "$dir/manifest"
+        truncate -s "$size" "$dir/disk.raw" || return 1
+        echo "$chunk" > "$dir/chunk" || return 1
+    fi
+    if [ -f "$dir/manifest" ]; then
+        while read -r i sum; do have[$i]=$sum; done < "$dir/manifest"
+    fi
+    while read -r i sum disk j; do
+        case "$i" in [0-9]*) ;; *) continue ;; esac
+        if [ "$sum" = "-" ] || [ "${have[$i]}" != "$sum" ]; then
+            if [ -n "$disk" ]; then
+                dups+=("$i $sum $disk $j")
+            else
+                todo+=("$i $sum")
+            fi
+        fi
+    done < "$sums"
+
+    echo "Copying disk $name to $dir over ${#ports[@]} connection(s) ..."
+    if ! : > "$dir/copied" || ! : > "$dir/based" ||
+       ! echo 0 > "$dir/next"; then
+        stage_error "$dir: could not start copying"
+        return 1
+    fi
+    for ((k = 0; k < ${#ports[@]}; k++)); do
+        stage_worker "$name" "$dir" "$k" "${ports[k]}" \
+                     "$size" "$chunk" "$live" &
+        pids+=($!)
+    done
+
+    last=
+    [ ! -f streams ] || last=$(tail -n +2 streams)
+    while :; do
+        s=
+        [ ! -f streams ] || s=$(tail -n +2 streams)
+        if [ -n "$s" ] && [ "$s" != "$last" ]; then
+            printf '\n%s\n' "$s"
+            last=$s
+        fi
+        p=$(wc -l < "$dir/copied")
+        p=$((nr - ${#todo[@]} - ${#dups[@]} + p))
+        p=$((nr ? p * 10000 / nr : 10000))
+        printf '\r    (%d.%02d/100%%)' $((p / 100)) $((p % 100))
+        [ -n "$(jobs -rp)" ] || break
+        sleep 1
+    done
+    echo
+    for p in "${pids[@]}"; do wait "$p" || failed=1; done
+    b=$(wc -l < "$dir/based")
+    rm -f "$dir/copied" "$dir/based" "$dir/next" "$dir/next.lock"
+    [ "$failed" -eq 0 ] || return 1
+
+    # Duplicate chunks are copied from the first copy, which is either
+    # on this disk or on a disk which was staged before.
+    for s in "${dups[@]}"; do
+        read -r i sum disk j <<< "$s"
+        off=$((i * chunk))
+        len=$((size - off < chunk ? size - off : chunk))
+        conv=$(punch "$dir/disk.raw" "$off" "$len")
+        # shellcheck disable=SC2154 # set by the wrapper script
+        if ! dd if="${stage_dirs[disk]}/disk.raw" of="$dir/disk.raw" \
+                bs="$chunk" skip="$j" seek="$i" count=1 conv="$conv" \
+                status=none; then
+            stage_error "$name: chunk $i: could not copy it from disk $disk"
+            return 1
+        fi
+        add_to_manifest "$dir" "$i" "$sum" || return 1
+    done
+
+    p=$((${#todo[@]} + ${#dups[@]}))
+    echo "$name: $p of $nr chunks copied ($b from base images," \
+         "${#dups[@]} duplicates), $((nr - p)) already on the conversion server"
+}
+
+# Print how many of the chunks in the checksums files were duplicates.
+#
+# dedup_summary CHUNKS [CHUNKS ...]
+dedup_summary ()
+{
+    awk '$1 !~ /^[0-9]/ { next }
+         $2 != "zero" { n++ }
+         NF == 4 { d++ }
+         END { printf "%d of %d chunks were duplicates (deduplication ratio %.2f)\n",
+                      d, n, (n > d ? n / (n - d) : 1) }' "$@"
+}
+
+# Check all the chunks of the staged disk in DIR against the checksums
+# of the source disk, using one process per CPU.  Chunks which are
+# different are removed from the manifest, so that they are copied
+# again.
+#
+# verify NAME DIR CHUNKS
+verify ()
+{
+    local name="$1" dir="$2" sums="$3"
+    local size chunk nr threads i j sum expect k p zero zlast failed=0
+    local pids=() list=()
+
+    size=$(sums_value "$sums" size)
+    chunk=$(sums_value "$sums" chunk)
+    if [[ ! "$size" =~ ^[0-9]+$ ]] || [[ ! "$chunk" =~ ^[1-9][0-9]*$ ]]; then
+        stage_error "$sums: missing size or chunk size"
+        return 1
+    fi
+    while read -r i sum _; do
+        case "$i" in [0-9]*) ;; *) continue ;; esac
+        [ "$sum" = "-" ] || list+=("$i $sum")
+    done < "$sums"
+    nr=${#list[@]}
+    threads=$(nproc 2>/dev/null || echo 1)
+    [ "$threads" -le "$nr" ] || threads=$((nr > 0 ? nr : 1))
+    zero=$(head -c "$chunk" /dev/zero | sha256sum)
+    zero=${zero%% *}
+    zlast=$(head -c $((size % chunk)) /dev/zero | sha256sum)
+    zlast=${zlast%% *}
+
+    echo "Verifying disk $name using $threads thread(s) ..."
+    if ! : > "$dir/verified" || ! : > "$dir/bad"; then
+        stage_error "$dir: could not start verifying"
+        return 1
+    fi
+    for ((k = 0; k < threads; k++)); do
+        (
+            for ((j = k; j < nr; j += threads)); do
+                read -r i expect <<< "${list[j]}"
+                if [ "$expect" = "zero" ]; then
+                    expect=$zero
+                    [ $((size - i * chunk)) -ge "$chunk" ] || expect=$zlast
+                fi
+                sum=$(dd if="$dir/disk.raw" bs="$chunk" skip="$i" count=1 \
+                         status=none | sha256sum) || exit 1
+                if [ "${sum%% *}" != "$expect" ]; then
+                    echo "$i" >> "$dir/bad" || exit 1
+                fi
+                echo >> "$dir/verified" || exit 1
+            done
+        ) &
+        pids+=($!)
+    done
+
+    while :; do
+        p=$(wc -l < "$dir/verified")
+        p=$((nr ? p * 10000 / nr : 10000))
+        printf '\r    (%d.%02d/100%%)' $((p / 100)) $((p % 100))
+        [ -n "$(jobs -rp)" ] || break
+        sleep 1
+    done
+    echo
+    for p in "${pids[@]}"; do wait "$p" || failed=1; done
+    rm -f "$dir/verified"
+    if [ "$failed" -ne 0 ]; then
+        # Which chunks were checked is not known, so all of them are
+        # copied again.
+        rm -f "$dir/bad" "$dir/manifest"
+        echo "$name: verification FAILED: could not read the staged disk"
+        return 1
+    fi
+    if [ -s "$dir/bad" ]; then
+        if ! awk 'NR == FNR { bad[$1] = 1; next } !($1 in bad)' \
+                 "$dir/bad" "$dir/manifest" > "$dir/manifest.tmp" ||
+           ! mv "$dir/manifest.tmp" "$dir/manifest"; then
+            # The bad chunks must not stay in the manifest.
+            rm -f "$dir/manifest.tmp" "$dir/manifest"
+        fi
+        echo "$name: verification FAILED:" \
+             "$(wc -l < "$dir/bad") chunk(s) are different from the source:" \
+             "$(sort -n "$dir/bad" | paste -sd ' ')"
+        rm -f "$dir/bad"
+        return 1
+    fi
+    rm -f "$dir/bad"
+    echo "$name: verified, all $nr chunks are the same as the source"
+}